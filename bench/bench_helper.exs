@@ -0,0 +1,154 @@
+defmodule Tundra.Bench.Packet do
+  @moduledoc false
+  import Bitwise
+
+  # IPv6 (40 bytes) plus UDP (8 bytes)
+  @headers 48
+
+  def headers, do: @headers
+
+  @doc """
+  Build an IPv6/UDP packet of `size` bytes in total, with a zeroed payload.
+  """
+  def udp6(src, dst, sport, dport, size) when size >= @headers + 10 do
+    payload = :binary.copy(<<0>>, size - @headers)
+    len = 8 + byte_size(payload)
+    src = ip6(src)
+    dst = ip6(dst)
+
+    pseudo = [src, dst, <<len::32, 0::24, 17>>]
+
+    csum =
+      case checksum([pseudo, <<sport::16, dport::16, len::16, 0::16>>, payload]) do
+        0 -> 0xFFFF
+        csum -> csum
+      end
+
+    <<6::4, 0::8, 0::20, len::16, 17, 64, src::binary, dst::binary, sport::16, dport::16,
+      len::16, csum::16, payload::binary>>
+  end
+
+  @doc """
+  Write the current monotonic time (in nanoseconds) into the first 8 bytes of
+  the payload of a packet built by `udp6/5`. The next 2 bytes are set so that
+  the words sum to zero, leaving the UDP checksum valid without recomputing it.
+  """
+  def stamp(<<header::binary-size(@headers), 0::80, rest::binary>>) do
+    ts = System.monotonic_time(:nanosecond)
+    <<a::16, b::16, c::16, d::16>> = <<ts::64>>
+    <<header::binary, ts::64, fold(a + b + c + d)::16, rest::binary>>
+  end
+
+  @doc """
+  Return the UDP destination port and payload of an IPv6/UDP packet, or `nil`.
+  """
+  def udp6_payload(
+        <<6::4, _::28, _len::16, 17, _hop, _src::binary-size(16), _dst::binary-size(16),
+          _sport::16, dport::16, _ulen::16, _csum::16, payload::binary>>
+      ),
+      do: {dport, payload}
+
+  def udp6_payload(_), do: nil
+
+  defp ip6(addr) when is_binary(addr) do
+    {:ok, addr} = :inet.parse_ipv6_address(to_charlist(addr))
+    ip6(addr)
+  end
+
+  defp ip6({a, b, c, d, e, f, g, h}) do
+    <<a::16, b::16, c::16, d::16, e::16, f::16, g::16, h::16>>
+  end
+
+  defp checksum(iodata) do
+    bin = IO.iodata_to_binary(iodata)
+    bin = if rem(byte_size(bin), 2) == 1, do: bin <> <<0>>, else: bin
+
+    sum =
+      for <<word::16 <- bin>>, reduce: 0 do
+        acc -> acc + word
+      end
+
+    fold(sum)
+  end
+
+  defp fold(sum) when sum > 0xFFFF, do: fold((sum &&& 0xFFFF) + (sum >>> 16))
+  defp fold(sum), do: bxor(sum, 0xFFFF)
+end
+
+defmodule Tundra.Bench.Report do
+  @moduledoc false
+
+  @doc """
+  Summarise a list of latencies (in nanoseconds) as percentiles.
+  """
+  def latency([]), do: nil
+
+  def latency(samples) do
+    sorted = samples |> Enum.sort() |> List.to_tuple()
+    n = tuple_size(sorted)
+    at = fn p -> elem(sorted, min(max(ceil(p * n / 100) - 1, 0), n - 1)) end
+
+    %{
+      "p50" => at.(50),
+      "p90" => at.(90),
+      "p99" => at.(99),
+      "p999" => at.(99.9),
+      "max" => elem(sorted, n - 1)
+    }
+  end
+
+  @doc """
+  Write results as JSON.
+  """
+  def write!(path, results) do
+    File.mkdir_p!(Path.dirname(path))
+    File.write!(path, JSON.encode!(results))
+  end
+
+  def read!(path), do: path |> File.read!() |> JSON.decode!()
+
+  @doc """
+  Compare results against a baseline. A case regresses if its packet rate
+  drops, or its p99 latency rises, by more than `tolerance` (a fraction).
+  Returns the names of the regressed cases.
+  """
+  def compare(%{"results" => results}, %{"results" => baseline}, tolerance) do
+    base = Map.new(baseline, &{&1["name"], &1})
+
+    IO.puts("\n#{pad("case", 40)} #{pad("pps", 22)} #{pad("p99 ns", 22)}")
+
+    regressed =
+      for result <- results, Map.has_key?(base, result["name"]) do
+        old = base[result["name"]]
+        pps = change(old["pps"], result["pps"])
+        p99 = change(p99(old), p99(result))
+        bad? = pps < -tolerance or p99 > tolerance
+        mark = if bad?, do: "  REGRESSION", else: ""
+
+        IO.puts(
+          "#{pad(result["name"], 40)} #{pad(delta(old["pps"], result["pps"], pps), 22)} " <>
+            "#{pad(delta(p99(old), p99(result), p99), 22)}#{mark}"
+        )
+
+        if bad?, do: result["name"]
+      end
+
+    Enum.reject(regressed, &is_nil/1)
+  end
+
+  defp p99(%{"latency_ns" => %{"p99" => p99}}), do: p99
+  defp p99(_), do: nil
+
+  defp change(old, new) when is_number(old) and is_number(new) and old > 0, do: (new - old) / old
+  defp change(_, _), do: 0.0
+
+  defp delta(old, new, change) do
+    sign = if change >= 0, do: "+", else: ""
+    "#{round_num(old)} -> #{round_num(new)} (#{sign}#{Float.round(change * 100, 1)}%)"
+  end
+
+  defp round_num(n) when is_float(n), do: round(n)
+  defp round_num(n), do: n
+
+  defp pad(str, n), do: String.pad_trailing(to_string(str), n)
+end
@@ -0,0 +1,728 @@
+# Control plane churn benchmark and soak test for Tundra.
+#
+# Run with `mix bench.churn`. See bench/README.md for the cycle, options and
+# output.
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+defmodule Tundra.Bench.Churn do
+  @moduledoc false
+  import Bitwise
+
+  @prefix "fd11:b7b7:4362"
+  @teardown_timeout 5_000
+  @settle_timeout 2_000
+  @ops ["connect", "create", "handoff", "reattach", "teardown"]
+  @phases ["fork", "open", "tunsetiff", "netlink", "fd_pass"]
+
+  @switches [
+    modes: :string,
+    concurrency: :integer,
+    cycles: :integer,
+    duration: :integer,
+    interval: :integer,
+    reconnect: :integer,
+    trace: :boolean,
+    server_bin: :string,
+    output: :string,
+    tolerance: :float,
+    check: :boolean
+  ]
+
+  def main(argv) do
+    {opts, _args, invalid} = OptionParser.parse(argv, strict: @switches)
+    if invalid != [], do: Mix.raise("Invalid options: #{inspect(invalid)}")
+
+    modes = list(opts[:modes], ["direct", "server"])
+    output = Keyword.get(opts, :output, "bench/results/churn.json")
+    tolerance = Keyword.get(opts, :tolerance, 0.25)
+    duration = opts[:duration]
+
+    config = %{
+      concurrency: Keyword.get(opts, :concurrency, 8),
+      # A soak runs for --duration seconds however many cycles that takes
+      cycles: if(duration, do: nil, else: Keyword.get(opts, :cycles, 2_000)),
+      duration: duration,
+      interval: Keyword.get(opts, :interval, if(duration, do: 60, else: 5)) * 1_000,
+      reconnect: opts[:reconnect],
+      server_bin: Keyword.get(opts, :server_bin, "/usr/local/bin/tundra_server")
+    }
+
+    tracer = if opts[:trace], do: start_tracer(config.server_bin)
+    results = modes |> Enum.map(&run_mode(&1, config, tracer)) |> Enum.reject(&is_nil/1)
+    if tracer, do: stop_tracer(tracer)
+
+    report = %{"meta" => meta(config, tracer), "results" => results}
+    Tundra.Bench.Report.write!(output, report)
+    IO.puts("Wrote #{output}")
+
+    failed = for result <- results, problems(result, tolerance) != [], do: result["name"]
+    IO.puts("\n#{length(failed)} mode(s) leaked or grew beyond #{tolerance * 100}%")
+    if opts[:check] and failed != [], do: System.halt(1)
+  end
+
+  defp list(nil, default), do: default
+  defp list(str, _default), do: String.split(str, ",", trim: true)
+
+  defp meta(config, tracer) do
+    %{
+      "date" => DateTime.utc_now() |> DateTime.to_iso8601(),
+      "elixir" => System.version(),
+      "otp" => System.otp_release(),
+      "os" => inspect(:os.type()),
+      "schedulers" => System.schedulers_online(),
+      "tundra" => to_string(Application.spec(:tundra, :vsn)),
+      "concurrency" => config.concurrency,
+      "cycles" => config.cycles,
+      "duration" => config.duration,
+      "reconnect" => config.reconnect,
+      "trace" => tracer != nil
+    }
+  end
+
+  ## Modes
+
+  # direct and server force the creation mode; oneshot creates through the
+  # server on a connection of its own per device, as before connections were
+  # pooled; loopback churns loopback pairs, which needs no privileges but has
+  # no interface, persistence or server
+  defp run_mode(mode, config, tracer) do
+    previous = Application.fetch_env(:tundra, :mode)
+    if mode in ["direct", "server"], do: Application.put_env(:tundra, :mode, mode_atom(mode))
+    before = resources(config.server_bin)
+
+    try do
+      case probe(mode) do
+        :ok ->
+          churn(mode, config, tracer, before)
+
+        {:error, reason} ->
+          IO.puts("Skipping #{mode}: #{inspect(reason)}")
+          nil
+      end
+    after
+      stop_pool()
+
+      case previous do
+        {:ok, value} -> Application.put_env(:tundra, :mode, value)
+        :error -> Application.delete_env(:tundra, :mode)
+      end
+    end
+  end
+
+  defp mode_atom("direct"), do: :direct
+  defp mode_atom("server"), do: :server
+
+  # One create and close before anything is measured, so that a mode that
+  # cannot work here is skipped rather than counted as errors
+  defp probe(mode) do
+    case create(mode, 0, 1, false) do
+      {:ok, {dev, name, peer}} ->
+        Enum.each([dev, peer], &(&1 && Tundra.close(&1)))
+        if name, do: wait_gone(name, System.monotonic_time(:nanosecond), @teardown_timeout)
+        :ok
+
+      error ->
+        error
+    end
+  end
+
+  defp churn(mode, config, tracer, before) do
+    # The probe's connection is replaced by the timed pool
+    stop_pool()
+    if tracer, do: take_phases(tracer)
+
+    ctx = %{
+      mode: mode,
+      cycles: config.cycles,
+      deadline: config.duration && now_ms() + config.duration * 1_000,
+      ticket: :atomics.new(1, []),
+      done: :counters.new(2, [:write_concurrency])
+    }
+
+    start = System.monotonic_time(:nanosecond)
+    connect = if mode == "server", do: start_pool(), else: %{}
+    reconnector = config.reconnect && mode == "server" && start_reconnector(config.reconnect)
+
+    workers =
+      for w <- 1..config.concurrency, into: %{} do
+        {_pid, ref} = spawn_monitor(fn -> exit({:done, loop(ctx, w, %{}, %{})}) end)
+        {ref, true}
+      end
+
+    {hists, errors, samples} = collect(workers, ctx, config, start, [])
+
+    connect = merge_hists(connect, stop_reconnector(reconnector))
+    hists = merge_hists(hists, connect)
+    seconds = (System.monotonic_time(:nanosecond) - start) / 1.0e9
+    cycles = :counters.get(ctx.done, 1)
+
+    stop_pool()
+    leaks = leaks(before, settle(before, config.server_bin))
+    phases = if tracer, do: take_phases(tracer), else: %{}
+
+    result = %{
+      "name" => "churn/#{mode}",
+      "mode" => mode,
+      "concurrency" => config.concurrency,
+      "cycles" => cycles,
+      "errors" => errors,
+      "seconds" => seconds,
+      "creations_per_sec" => created(hists) / seconds,
+      "latency_ns" => Map.new(hists, fn {op, hist} -> {op, summary(hist)} end),
+      "phases_ns" => Map.new(phases, fn {phase, hist} -> {phase, summary(hist)} end),
+      "leaks" => leaks,
+      "samples" => Enum.reverse(samples)
+    }
+
+    print(result)
+    result
+  end
+
+  # Gather the workers' results, sampling the rate and resources every
+  # interval until they are all done
+  defp collect(workers, ctx, config, start, samples, acc \\ {%{}, %{}})
+
+  defp collect(workers, _ctx, _config, _start, samples, {hists, errors})
+       when map_size(workers) == 0,
+       do: {hists, errors, samples}
+
+  defp collect(workers, ctx, config, start, samples, {hists, errors} = acc) do
+    receive do
+      {:DOWN, ref, :process, _, {:done, {h, e}}} when is_map_key(workers, ref) ->
+        acc = {merge_hists(hists, h), Map.merge(errors, e, fn _, a, b -> a + b end)}
+        collect(Map.delete(workers, ref), ctx, config, start, samples, acc)
+
+      {:DOWN, ref, :process, _, reason} when is_map_key(workers, ref) ->
+        IO.puts("Worker crashed: #{inspect(reason)}")
+        collect(Map.delete(workers, ref), ctx, config, start, samples, acc)
+    after
+      config.interval ->
+        sample = sample(ctx, config, start, List.first(samples))
+        IO.puts(format_sample(ctx.mode, sample))
+        collect(workers, ctx, config, start, [sample | samples], acc)
+    end
+  end
+
+  defp sample(ctx, config, start, previous) do
+    t = (System.monotonic_time(:nanosecond) - start) / 1.0e9
+    cycles = :counters.get(ctx.done, 1)
+    {t0, c0} = if previous, do: {previous["t"], previous["cycles"]}, else: {0.0, 0}
+
+    Map.merge(resources(config.server_bin), %{
+      "t" => t,
+      "cycles" => cycles,
+      "errors" => :counters.get(ctx.done, 2),
+      "cycles_per_sec" => (cycles - c0) / max(t - t0, 1.0e-3)
+    })
+  end
+
+  defp format_sample(mode, s) do
+    "#{mode} #{round(s["t"])}s: #{s["cycles"]} cycles (#{round(s["cycles_per_sec"])}/s), " <>
+      "#{s["errors"]} errors, rss #{div(s["rss"] || 0, 1024)} KiB, " <>
+      "vm fds #{s["fds"]}, interfaces #{s["interfaces"]}, servers #{s["server_processes"]}"
+  end
+
+  ## Cycles
+
+  defp loop(ctx, w, hists, errors) do
+    i = :atomics.add_get(ctx.ticket, 1, 1)
+
+    if (ctx.cycles && i > ctx.cycles) || (ctx.deadline && now_ms() >= ctx.deadline) do
+      {hists, errors}
+    else
+      {hists, errors} = cycle(ctx, w, i, {hists, errors})
+      :counters.add(ctx.done, 1, 1)
+      loop(ctx, w, hists, errors)
+    end
+  end
+
+  # Create a device, hand it to another process and let that process exit.
+  # Every other cycle the device is persistent, so it outlives its owner and
+  # is re-opened with reattach/1 before being removed.
+  defp cycle(ctx, w, i, acc) do
+    persist = ctx.mode in ["direct", "server"] and rem(i, 2) == 0
+
+    case measure(ctx, acc, "create", fn -> create(ctx.mode, w, i, persist) end) do
+      {{:ok, {dev, name, peer}}, acc} -> handoff(ctx, dev, name, peer, persist, acc)
+      {_error, acc} -> acc
+    end
+  end
+
+  defp create("loopback", _w, _i, _persist) do
+    with {:ok, {dev, peer}} <- Tundra.create_loopback(), do: {:ok, {dev, nil, peer}}
+  end
+
+  # The connection is started, used for one request and stopped in the
+  # worker, which is what each server creation cost before
+  defp create("oneshot", w, i, _persist) do
+    params = Tundra.convert_opts(addr: address(w, i))
+
+    with {:ok, conn} <- :gen_statem.start(Tundra.Client, [], []) do
+      result =
+        try do
+          :gen_statem.call(conn, {:create_tun_device, params})
+        after
+          :gen_statem.stop(conn)
+        end
+
+      with {:ok, {ref, name}} <- result, do: {:ok, {{:"$tundra", ref}, name, nil}}
+    end
+  end
+
+  defp create(_mode, w, i, persist) do
+    with {:ok, {dev, name}} <- Tundra.create(address(w, i), persist: persist) do
+      {:ok, {dev, name, nil}}
+    end
+  end
+
+  defp address(w, i) do
+    host = Integer.to_string(rem(i, 0xFFFF) + 1, 16)
+    "#{@prefix}:#{Integer.to_string(w, 16)}::#{host}"
+  end
+
+  defp handoff(ctx, dev, name, peer, persist, acc) do
+    {heir, ref} = spawn_monitor(fn -> receive(do: (:exit -> :ok)) end)
+    {result, acc} = measure(ctx, acc, "handoff", fn -> Tundra.controlling_process(dev, heir) end)
+    if result != :ok, do: discard(dev, persist)
+    if peer, do: Tundra.controlling_process(peer, heir)
+
+    send(heir, :exit)
+    receive(do: ({:DOWN, ^ref, :process, _, _} -> :ok))
+    start = System.monotonic_time(:nanosecond)
+
+    cond do
+      name == nil -> acc
+      persist and result == :ok -> reattach(ctx, name, acc)
+      true -> teardown(ctx, name, start, acc)
+    end
+  end
+
+  # The owner's exit is seen here before the NIF has closed the device, so
+  # reattach/1 is retried while the device is still busy
+  defp reattach(ctx, name, acc, attempts \\ 1_000) do
+    start = System.monotonic_time(:nanosecond)
+    result = Tundra.reattach(name)
+    elapsed = System.monotonic_time(:nanosecond) - start
+
+    case result do
+      {:error, :ebusy} when attempts > 0 ->
+        Process.sleep(1)
+        reattach(ctx, name, acc, attempts - 1)
+
+      {:ok, {dev, _}} ->
+        {hists, errors} = acc
+        closed = System.monotonic_time(:nanosecond)
+        discard(dev, true)
+        teardown(ctx, name, closed, {record(hists, "reattach", elapsed), errors})
+
+      # Left persistent, to be reported as a leaked interface
+      _error ->
+        fail(ctx, acc, "reattach")
+    end
+  end
+
+  defp discard({:"$tundra", ref} = dev, true) do
+    _ = Tundra.Client.unpersist(ref)
+    Tundra.close(dev)
+  end
+
+  defp discard(dev, false), do: Tundra.close(dev)
+
+  # From the owner's exit (or close) until the interface is gone
+  defp teardown(ctx, name, start, {hists, errors}) do
+    case wait_gone(name, start, @teardown_timeout) do
+      :ok -> {record(hists, "teardown", System.monotonic_time(:nanosecond) - start), errors}
+      :timeout -> fail(ctx, {hists, errors}, "teardown")
+    end
+  end
+
+  defp wait_gone(name, start, timeout) do
+    cond do
+      not File.exists?("/sys/class/net/#{name}") ->
+        :ok
+
+      System.monotonic_time(:nanosecond) - start > timeout * 1_000_000 ->
+        :timeout
+
+      true ->
+        Process.sleep(1)
+        wait_gone(name, start, timeout)
+    end
+  end
+
+  defp measure(ctx, {hists, errors} = acc, op, fun) do
+    start = System.monotonic_time(:nanosecond)
+    result = fun.()
+    elapsed = System.monotonic_time(:nanosecond) - start
+
+    case result do
+      :ok -> {result, {record(hists, op, elapsed), errors}}
+      {:ok, _} -> {result, {record(hists, op, elapsed), errors}}
+      _ -> {result, fail(ctx, acc, op)}
+    end
+  end
+
+  defp fail(ctx, {hists, errors}, op) do
+    :counters.add(ctx.done, 2, 1)
+    {hists, Map.update(errors, op, 1, &(&1 + 1))}
+  end
+
+  ## Server connections
+
+  # Connecting is timed by starting the pool's connections ahead of the
+  # workers; with --reconnect the pool is torn down and started again every
+  # so many seconds, so that the server's accept and fork stay in the mix
+  defp start_pool do
+    n = Tundra.Client.max_connections()
+
+    Enum.reduce(1..n, %{}, fn _, hists ->
+      start = System.monotonic_time(:nanosecond)
+      {:ok, _} = DynamicSupervisor.start_child(Tundra.DynamicSupervisor, Tundra.Client)
+      record(hists, "connect", System.monotonic_time(:nanosecond) - start)
+    end)
+  end
+
+  defp stop_pool do
+    for {pid, _} <- Registry.lookup(Tundra.Registry, Tundra.Client) do
+      DynamicSupervisor.terminate_child(Tundra.DynamicSupervisor, pid)
+    end
+
+    :ok
+  end
+
+  defp start_reconnector(seconds) do
+    spawn(fn -> reconnect(seconds * 1_000, %{}) end)
+  end
+
+  defp reconnect(ms, hists) do
+    receive do
+      {:stop, from} -> send(from, {:reconnected, hists})
+    after
+      ms ->
+        stop_pool()
+        reconnect(ms, merge_hists(hists, start_pool()))
+    end
+  end
+
+  defp stop_reconnector(nil), do: %{}
+  defp stop_reconnector(false), do: %{}
+
+  defp stop_reconnector(pid) do
+    send(pid, {:stop, self()})
+    receive(do: ({:reconnected, hists} -> hists))
+  end
+
+  ## Resources
+
+  # What a leak would show up in: the VM's descriptors and memory, TUN
+  # interfaces, and server processes and their descriptors (readable as root)
+  defp resources(server_bin) do
+    servers = server_pids(Path.basename(server_bin))
+
+    %{
+      "memory" => :erlang.memory(:total),
+      "rss" => rss(),
+      "fds" => count_dir("/proc/self/fd"),
+      "interfaces" => length(tun_interfaces()),
+      "server_processes" => length(servers),
+      "server_fds" => sum_counts(Enum.map(servers, &count_dir("/proc/#{&1}/fd")))
+    }
+  end
+
+  defp rss do
+    with {:ok, status} <- File.read("/proc/self/status"),
+         [_, kb] <- Regex.run(~r/VmRSS:\s+(\d+) kB/, status) do
+      String.to_integer(kb) * 1024
+    else
+      _ -> nil
+    end
+  end
+
+  defp count_dir(path) do
+    case File.ls(path) do
+      {:ok, entries} -> length(entries)
+      {:error, _} -> nil
+    end
+  end
+
+  defp sum_counts(counts) do
+    if Enum.any?(counts, &is_nil/1), do: nil, else: Enum.sum(counts)
+  end
+
+  defp tun_interfaces do
+    case File.ls("/sys/class/net") do
+      {:ok, names} -> Enum.filter(names, &File.exists?("/sys/class/net/#{&1}/tun_flags"))
+      {:error, _} -> []
+    end
+  end
+
+  # Server processes are recognised by their command name, which the kernel
+  # truncates to 15 characters
+  defp server_pids(bin) do
+    comm = String.slice(bin, 0, 15) <> "\n"
+
+    case File.ls("/proc") do
+      {:ok, entries} ->
+        Enum.filter(entries, &(&1 =~ ~r/^\d+$/ and File.read("/proc/#{&1}/comm") == {:ok, comm}))
+
+      {:error, _} ->
+        []
+    end
+  end
+
+  # Wait for interfaces and server children from the last cycles to go
+  defp settle(before, server_bin, deadline \\ nil) do
+    deadline = deadline || now_ms() + @settle_timeout
+    later = resources(server_bin)
+
+    settled =
+      later["interfaces"] <= before["interfaces"] and
+        later["server_processes"] <= before["server_processes"]
+
+    if settled or now_ms() > deadline do
+      later
+    else
+      Process.sleep(10)
+      settle(before, server_bin, deadline)
+    end
+  end
+
+  defp leaks(before, later) do
+    for key <- ["fds", "interfaces", "server_processes", "server_fds"], into: %{} do
+      {key, diff(before[key], later[key])}
+    end
+    |> Map.put("rss_growth", growth(before["rss"], later["rss"]))
+  end
+
+  defp diff(a, b) when is_integer(a) and is_integer(b), do: b - a
+  defp diff(_, _), do: nil
+
+  defp growth(a, b) when is_integer(a) and is_integer(b) and a > 0, do: (b - a) / a
+  defp growth(_, _), do: nil
+
+  # Leaked descriptors, interfaces or server processes, or RSS that grew by
+  # more than `tolerance` between the first and last samples of a soak
+  defp problems(%{"leaks" => leaks, "samples" => samples}, tolerance) do
+    leaked = for {key, n} <- leaks, key != "rss_growth", is_integer(n) and n > 0, do: key
+
+    grown =
+      with %{"rss" => a} <- List.first(samples),
+           %{"rss" => b} <- List.last(samples),
+           growth when is_float(growth) <- growth(a, b),
+           true <- growth > tolerance do
+        ["rss"]
+      else
+        _ -> []
+      end
+
+    leaked ++ grown
+  end
+
+  ## Phase tracing
+
+  # With --trace, bpftrace times the native phases of each creation from the
+  # USDT probes in the NIF and the server, printing one line per phase
+  defp start_tracer(server_bin) do
+    nif = Path.join(:code.priv_dir(:tundra), "tundra_nif.so")
+    script = trace_script(nif, server_bin)
+    path = Path.join(System.tmp_dir!(), "tundra_churn_#{System.pid()}.bt")
+    File.write!(path, script)
+    owner = self()
+    pid = spawn_link(fn -> trace(owner, path) end)
+
+    receive do
+      {:tracing, ^pid} -> pid
+      {:trace_failed, ^pid, reason} -> Mix.raise("bpftrace failed: #{reason}")
+    after
+      30_000 -> Mix.raise("bpftrace did not attach")
+    end
+  end
+
+  defp trace_script(nif, server_bin) do
+    server = File.exists?(server_bin)
+    configure = if server, do: ",\nusdt:#{server_bin}:tundra:configure_entry", else: ""
+
+    """
+    usdt:#{nif}:tundra:create_entry
+    { @phase[tid] = nsecs; }
+    #{if server, do: server_probes(server_bin)}
+    #{phase_probe(nif, server && server_bin, "create_open", "open")}
+    #{phase_probe(nif, server && server_bin, "create_setiff", "tunsetiff")}
+    usdt:#{nif}:tundra:configure_entry#{configure}
+    /@phase[tid]/
+    { @phase[tid] = nsecs; }
+    #{phase_probe(nif, server && server_bin, "configure_commit", "netlink")}
+    usdt:#{nif}:tundra:create_return
+    { delete(@phase[tid]); }
+    """
+  end
+
+  defp server_probes(bin) do
+    """
+    usdt:#{bin}:tundra:server_accept
+    { @accepted[pid, arg0] = nsecs; }
+    usdt:#{bin}:tundra:server_fork
+    /arg1 > 0 && @accepted[pid, arg0]/
+    {
+      printf("phase fork %d\\n", nsecs - @accepted[pid, arg0]);
+      delete(@accepted[pid, arg0]);
+    }
+    usdt:#{bin}:tundra:server_request
+    { @phase[tid] = nsecs; }
+    usdt:#{bin}:tundra:server_sendfd
+    /@phase[tid]/
+    {
+      printf("phase fd_pass %d\\n", nsecs - @phase[tid]);
+      delete(@phase[tid]);
+    }
+    """
+  end
+
+  defp phase_probe(nif, server_bin, probe, phase) do
+    server = if server_bin, do: ",\nusdt:#{server_bin}:tundra:#{probe}", else: ""
+
+    """
+    usdt:#{nif}:tundra:#{probe}#{server}
+    /@phase[tid]/
+    {
+      printf("phase #{phase} %d\\n", nsecs - @phase[tid]);
+      @phase[tid] = nsecs;
+    }
+    """
+  end
+
+  defp trace(owner, path) do
+    case System.find_executable("bpftrace") do
+      nil ->
+        send(owner, {:trace_failed, self(), "bpftrace not found"})
+
+      exe ->
+        port =
+          Port.open({:spawn_executable, exe}, [
+            :binary,
+            :exit_status,
+            :stderr_to_stdout,
+            {:line, 1024},
+            args: ["-B", "line", path]
+          ])
+
+        {:os_pid, os_pid} = Port.info(port, :os_pid)
+        trace_loop(owner, port, os_pid, %{}, false)
+    end
+  end
+
+  defp trace_loop(owner, port, os_pid, hists, attached) do
+    receive do
+      {^port, {:data, {:eol, "phase " <> rest}}} ->
+        [phase, ns] = String.split(rest)
+        trace_loop(owner, port, os_pid, record(hists, phase, String.to_integer(ns)), attached)
+
+      {^port, {:data, {:eol, "Attaching" <> _}}} when not attached ->
+        send(owner, {:tracing, self()})
+        trace_loop(owner, port, os_pid, hists, true)
+
+      {^port, {:data, {:eol, line}}} when not attached ->
+        IO.puts("bpftrace: #{line}")
+        trace_loop(owner, port, os_pid, hists, attached)
+
+      {^port, {:data, _}} ->
+        trace_loop(owner, port, os_pid, hists, attached)
+
+      {^port, {:exit_status, status}} when not attached ->
+        send(owner, {:trace_failed, self(), "exit status #{status}"})
+
+      # Keep the phases seen so far
+      {^port, {:exit_status, status}} ->
+        IO.puts("bpftrace exited with status #{status}")
+        trace_loop(owner, nil, nil, hists, attached)
+
+      {:take, from} ->
+        send(from, {:phases, hists})
+        trace_loop(owner, port, os_pid, %{}, attached)
+
+      :stop ->
+        if os_pid, do: System.cmd("kill", [to_string(os_pid)])
+    end
+  end
+
+  defp take_phases(tracer) do
+    send(tracer, {:take, self()})
+    receive(do: ({:phases, hists} -> hists))
+  end
+
+  defp stop_tracer(tracer), do: send(tracer, :stop)
+
+  ## Histograms
+
+  # Latencies are counted in Tundra.Histogram buckets, as the NIF counts them
+  # (see c_src/hist.h), so that a soak of any length takes constant memory
+  defp record(hists, op, value) do
+    hist = Map.get(hists, op, %Tundra.Histogram{})
+
+    Map.put(hists, op, %{
+      hist
+      | count: hist.count + 1,
+        sum: hist.sum + value,
+        min: if(hist.count == 0, do: value, else: min(hist.min, value)),
+        max: max(hist.max, value),
+        buckets: Map.update(hist.buckets, upper(value), 1, &(&1 + 1))
+    })
+  end
+
+  # The highest value in the value's bucket: values below 64 are exact, and
+  # each power of two above is split into 32 buckets
+  defp upper(value) when value < 64, do: max(value, 0)
+
+  defp upper(value) do
+    shift = bit_length(value) - 6
+    (((value >>> shift) + 1) <<< shift) - 1
+  end
+
+  defp bit_length(value), do: length(Integer.digits(value, 2))
+
+  defp merge_hists(a, b), do: Map.merge(a, b, fn _, x, y -> Tundra.Histogram.merge(x, y) end)
+
+  defp summary(hist) do
+    ps = Tundra.Histogram.percentiles(hist, [50, 90, 99, 99.9])
+
+    %{
+      "count" => hist.count,
+      "p50" => ps[50],
+      "p90" => ps[90],
+      "p99" => ps[99],
+      "p999" => ps[99.9],
+      "max" => hist.max
+    }
+  end
+
+  defp created(hists) do
+    Enum.reduce(["create", "reattach"], 0, fn op, n -> n + (hists[op] || %{count: 0}).count end)
+  end
+
+  defp print(result) do
+    seconds = Float.round(result["seconds"], 1)
+
+    IO.puts(
+      "\n#{result["name"]}: #{result["cycles"]} cycles in #{seconds}s, " <>
+        "#{round(result["creations_per_sec"])} creations/s, errors #{inspect(result["errors"])}"
+    )
+
+    for {group, names} <- [{"latency_ns", @ops}, {"phases_ns", @phases}],
+        name <- names,
+        Map.has_key?(result[group], name) do
+      s = result[group][name]
+
+      IO.puts(
+        "  #{String.pad_trailing(name, 10)} n=#{s["count"]} p50 #{s["p50"]} p90 #{s["p90"]} " <>
+          "p99 #{s["p99"]} p999 #{s["p999"]} max #{s["max"]} ns"
+      )
+    end
+
+    IO.puts("  leaks #{inspect(result["leaks"])}")
+  end
+
+  defp now_ms, do: System.monotonic_time(:millisecond)
+end
+
+Tundra.Bench.Churn.main(System.argv())
@@ -0,0 +1,844 @@
+# Data path benchmarks for Tundra.
+#
+# Run with `mix bench`. See bench/README.md for the cases, options and output.
+
+Code.require_file("bench_helper.exs", __DIR__)
+
+defmodule Tundra.Bench do
+  @moduledoc false
+  alias Tundra.Bench.{Packet, Report}
+
+  @prefix "fd11:b7b7:4361"
+  @netmask "ffff:ffff:ffff:ffff::"
+  @host_port 40_000
+  @peer_port 40_001
+  @timeout 2_000
+  @ack_timeout 100
+  @sockopts [:binary, :inet6, active: false, recbuf: 4_194_304, sndbuf: 4_194_304]
+
+  @switches [
+    packets: :integer,
+    cases: :string,
+    sizes: :string,
+    mtus: :string,
+    batches: :string,
+    output: :string,
+    baseline: :string,
+    save_baseline: :boolean,
+    tolerance: :float,
+    check: :boolean,
+    capture: :string,
+    flows: :boolean,
+    rates: :string,
+    busy_polls: :string
+  ]
+
+  def main(argv) do
+    {opts, _args, invalid} = OptionParser.parse(argv, strict: @switches)
+    if invalid != [], do: Mix.raise("Invalid options: #{inspect(invalid)}")
+
+    n = Keyword.get(opts, :packets, 20_000)
+    cases = list(opts[:cases], ["recv", "send", "reflect"], & &1)
+    sizes = list(opts[:sizes], [64, 512, 1400, 8000], &String.to_integer/1)
+    mtus = list(opts[:mtus], [1500, 9000], &String.to_integer/1)
+    batches = list(opts[:batches], [1, 16, 64], &String.to_integer/1)
+
+    sweep = %{
+      rates: list(opts[:rates], [1_000, 10_000, 50_000], &String.to_integer/1),
+      spins: list(opts[:busy_polls], [0, 20, 100], &String.to_integer/1)
+    }
+
+    output = Keyword.get(opts, :output, "bench/results/latest.json")
+    baseline = Keyword.get(opts, :baseline, "bench/baseline.json")
+    instruments = %{capture: opts[:capture], flows: Keyword.get(opts, :flows, false)}
+    if instruments.capture, do: File.mkdir_p!(instruments.capture)
+
+    results =
+      for {mtu, index} <- Enum.with_index(mtus, 1),
+          result <- run_mtu(mtu, index, cases, sizes, batches, sweep, n, instruments),
+          do: result
+
+    report = %{"meta" => meta(n, instruments), "results" => results}
+    Report.write!(output, report)
+    IO.puts("Wrote #{output}")
+
+    cond do
+      opts[:save_baseline] ->
+        Report.write!(baseline, report)
+        IO.puts("Saved baseline to #{baseline}")
+
+      File.exists?(baseline) ->
+        tolerance = Keyword.get(opts, :tolerance, 0.10)
+        regressed = Report.compare(report, Report.read!(baseline), tolerance)
+        IO.puts("\n#{length(regressed)} regression(s) against #{baseline}")
+        if opts[:check] and regressed != [], do: System.halt(1)
+
+      opts[:check] ->
+        IO.puts("No baseline at #{baseline} to check against; run with --save-baseline first")
+        System.halt(1)
+
+      true ->
+        IO.puts("No baseline at #{baseline}; run with --save-baseline to create one")
+    end
+  end
+
+  defp list(nil, default, _fun), do: default
+  defp list(str, _default, fun), do: str |> String.split(",", trim: true) |> Enum.map(fun)
+
+  defp meta(n, instruments) do
+    %{
+      "date" => DateTime.utc_now() |> DateTime.to_iso8601(),
+      "elixir" => System.version(),
+      "otp" => System.otp_release(),
+      "os" => inspect(:os.type()),
+      "schedulers" => System.schedulers_online(),
+      "tundra" => to_string(Application.spec(:tundra, :vsn)),
+      "packets" => n,
+      "capture" => instruments.capture != nil,
+      "flows" => instruments.flows
+    }
+  end
+
+  @loopback_cases [
+    "loopback",
+    "stage",
+    "tunnel",
+    "tunnel_elixir",
+    "busy_poll",
+    "encap",
+    "encap_headroom"
+  ]
+
+  # One device per MTU, shared by all cases at that MTU
+  defp run_mtu(mtu, index, cases, sizes, batches, sweep, n, instruments) do
+    local = "#{@prefix}:#{index}::2"
+    peer = "#{@prefix}:#{index}::1"
+
+    # The loopback cases alone need no TUN device (or privileges)
+    dev =
+      if Enum.all?(cases, &(&1 in @loopback_cases)) do
+        nil
+      else
+        {:ok, {dev, _name}} = Tundra.create(local, dstaddr: peer, netmask: @netmask, mtu: mtu)
+        instrument(dev, instruments, "mtu#{mtu}")
+        dev
+      end
+
+    ctx =
+      Map.merge(instruments, %{
+        dev: dev,
+        mtu: mtu,
+        local: ip(local),
+        peer: ip(peer),
+        local_str: local,
+        peer_str: peer
+      })
+
+    try do
+      for kind <- cases,
+          size <- sizes,
+          size <= mtu,
+          batch <- batches,
+          variant <- variants(kind, sweep) do
+        run_case(kind, Map.merge(ctx, variant), size, batch, packets(variant, n))
+      end
+    after
+      if dev do
+        uninstrument(dev, instruments)
+        Tundra.close(dev)
+      end
+    end
+  end
+
+  # With --capture, each device captures every packet it reads or writes, and
+  # with --flows accounts them to flows, so that the results can be compared
+  # with a run without to measure the cost
+  defp instrument(dev, instruments, name) do
+    if instruments.capture do
+      path = Path.join(instruments.capture, "#{name}.pcapng")
+      :ok = Tundra.capture(dev, path, file_size: 100_000_000)
+    end
+
+    if instruments.flows, do: :ok = Tundra.flow_accounting(dev, [])
+    :ok
+  end
+
+  defp uninstrument(dev, instruments) do
+    if instruments.capture do
+      {:ok, %{packets: packets, drops: drops}} = Tundra.stop_capture(dev)
+      IO.puts("Captured #{packets} packets, dropped #{drops}")
+    end
+
+    if instruments.flows do
+      {:ok, %{packets: packets, created: created}} = Tundra.flow_stats(dev)
+      IO.puts("Accounted #{packets} packets to #{created} flows")
+    end
+
+    :ok
+  end
+
+  defp ip(str) do
+    {:ok, addr} = :inet.parse_ipv6_address(to_charlist(str))
+    addr
+  end
+
+  # The busy_poll case runs once per rate and busy poll time
+  defp variants("busy_poll", %{rates: rates, spins: spins}) do
+    for rate <- rates, spin <- spins, do: %{rate: rate, spin: spin}
+  end
+
+  # The tracking cases run with latency tracking off and then on
+  defp variants(kind, _sweep) when kind in ["recv_track", "send_track"] do
+    [%{track: false}, %{track: true}]
+  end
+
+  defp variants(_kind, _sweep), do: [%{}]
+
+  # At most a second of paced traffic
+  defp packets(%{rate: rate}, n), do: min(n, rate)
+  defp packets(_variant, n), do: n
+
+  defp run_case(kind, ctx, size, batch, n) do
+    name = "#{kind}/mtu#{ctx.mtu}/size#{size}/batch#{batch}#{variant_name(ctx)}"
+    {cpu_start, _} = :erlang.statistics(:runtime)
+    start = System.monotonic_time(:nanosecond)
+    {received, latencies} = run(kind, ctx, size, batch, n)
+    seconds = (System.monotonic_time(:nanosecond) - start) / 1.0e9
+    {cpu_end, _} = :erlang.statistics(:runtime)
+    flush()
+    latency = Report.latency(latencies)
+
+    IO.puts(
+      "#{String.pad_trailing(name, 36)} #{round(received / seconds)} pps, " <>
+        "p99 #{latency && latency["p99"]} ns, lost #{n - received}, cpu #{cpu_end - cpu_start} ms"
+    )
+
+    Map.merge(variant_fields(ctx), %{
+      "name" => name,
+      "case" => kind,
+      "mtu" => ctx.mtu,
+      "size" => size,
+      "batch" => batch,
+      "packets" => n,
+      "received" => received,
+      "seconds" => seconds,
+      "pps" => received / seconds,
+      "bytes_per_sec" => received * size / seconds,
+      "cpu_seconds" => (cpu_end - cpu_start) / 1000,
+      "latency_ns" => latency
+    })
+  end
+
+  defp variant_name(%{rate: rate, spin: spin}), do: "/rate#{rate}/spin#{spin}"
+  defp variant_name(%{track: true}), do: "/track_on"
+  defp variant_name(%{track: false}), do: "/track_off"
+  defp variant_name(_ctx), do: ""
+
+  defp variant_fields(%{rate: rate, spin: spin}), do: %{"rate" => rate, "busy_poll_usec" => spin}
+  defp variant_fields(%{track: track}), do: %{"track_latency" => track}
+  defp variant_fields(_ctx), do: %{}
+
+  # Drop acknowledgements and select messages left over from the last case
+  defp flush do
+    receive do
+      _ -> flush()
+    after
+      0 -> :ok
+    end
+  end
+
+  # recv: a kernel UDP socket sends bursts of `batch` packets towards the peer
+  # address, which the kernel routes into the device; Tundra.recv/3 reads
+  # them. Latency is from the socket send to the return of recv/3.
+  defp run("recv", ctx, size, batch, n) do
+    {:ok, sock} = :gen_udp.open(@host_port, [ip: ctx.local] ++ @sockopts)
+    pad = :binary.copy(<<0>>, size - Packet.headers() - 8)
+
+    sender =
+      spawn_link(fn -> udp_sender(sock, ctx.peer, pad, batch, n, 0) end)
+
+    try do
+      recv_loop(ctx, sender, batch, n, 0, [])
+    after
+      Process.unlink(sender)
+      Process.exit(sender, :kill)
+      :gen_udp.close(sock)
+    end
+  end
+
+  # send: Tundra.send/3 writes bursts of `batch` packets addressed to a kernel
+  # UDP socket. Latency is from the send/3 call to the socket receive.
+  defp run("send", ctx, size, batch, n) do
+    {:ok, sock} = :gen_udp.open(@host_port, [ip: ctx.local] ++ @sockopts)
+    owner = self()
+
+    receiver =
+      spawn_link(fn ->
+        send(owner, {:received, udp_receiver(sock, owner, batch, n, 0, [])})
+      end)
+
+    template = Packet.udp6(ctx.peer_str, ctx.local_str, @peer_port, @host_port, size)
+
+    try do
+      tun_sender(ctx, template, batch, n, 0)
+
+      receive do
+        {:received, result} -> result
+      end
+    after
+      Process.unlink(receiver)
+      Process.exit(receiver, :kill)
+      :gen_udp.close(sock)
+    end
+  end
+
+  # reflect: the Reflector example from the Tundra docs. A kernel socket sends
+  # bursts of `batch` packets to the peer; the device owner swaps source and
+  # destination addresses and writes them back; a second socket receives them.
+  # Latency is the round trip.
+  defp run("reflect", ctx, size, batch, n) do
+    {:ok, out} = :gen_udp.open(@host_port, [ip: ctx.local] ++ @sockopts)
+    {:ok, back} = :gen_udp.open(@peer_port, [ip: ctx.local] ++ @sockopts)
+    owner = self()
+    pad = :binary.copy(<<0>>, size - Packet.headers() - 8)
+
+    pinger =
+      spawn_link(fn ->
+        send(owner, {:received, pinger(out, back, ctx.peer, pad, batch, n, 0, 0, [])})
+      end)
+
+    try do
+      reflect_loop(ctx)
+    after
+      Process.unlink(pinger)
+      Process.exit(pinger, :kill)
+      :gen_udp.close(out)
+      :gen_udp.close(back)
+    end
+  end
+
+  # loopback: as recv, but over a loopback device whose peer is driven by
+  # another process, so no privileges are needed. Latency is from the peer's
+  # send/3 to the return of recv/3.
+  defp run("loopback", ctx, size, batch, n) do
+    {:ok, {dev, peer}} = Tundra.create_loopback(buffer: 4_194_304)
+    instrument(dev, ctx, "loopback-mtu#{ctx.mtu}-size#{size}-batch#{batch}")
+    template = Packet.udp6(ctx.local_str, ctx.peer_str, @host_port, @peer_port, size)
+
+    sender = loopback_sender(peer, template, batch, n)
+
+    try do
+      recv_loop(%{ctx | dev: dev}, sender, batch, n, 0, [])
+    after
+      Process.unlink(sender)
+      Process.exit(sender, :kill)
+      uninstrument(dev, ctx)
+      Tundra.close(dev)
+    end
+  end
+
+  # stage: as loopback, but the device is read by a Tundra.Producer and the
+  # packets consumed through GenStage.stream/1 in another process, to compare
+  # with the hand-written loop. Latency is from the peer's send/3 to the
+  # consumer.
+  defp run("stage", ctx, size, batch, n) do
+    {:ok, {dev, peer}} = Tundra.create_loopback(buffer: 4_194_304)
+    template = Packet.udp6(ctx.local_str, ctx.peer_str, @host_port, @peer_port, size)
+
+    sender =
+      spawn_link(fn ->
+        receive do
+          :go -> tun_sender(%{dev: peer}, template, batch, n, 0)
+        end
+      end)
+
+    :ok = Tundra.controlling_process(peer, sender)
+    {:ok, producer} = Tundra.Producer.start_link(device: dev, length: ctx.mtu)
+    consumer = Task.async(fn -> stage_consumer(producer, sender, batch, n) end)
+    send(sender, :go)
+
+    try do
+      case Task.yield(consumer, 60_000) || Task.shutdown(consumer, :brutal_kill) do
+        {:ok, result} -> result
+        nil -> {0, []}
+      end
+    after
+      Process.unlink(sender)
+      Process.exit(sender, :kill)
+      GenStage.stop(producer)
+    end
+  end
+
+  # tunnel: as loopback, but through two loopback devices in tunnel mode, so
+  # that each packet is sealed, sent over UDP on ::1 and opened in native code
+  # between the peer of the first device and the peer of the second. Latency
+  # is from the first peer's send/3 to the second's recv/3.
+  defp run("tunnel", ctx, size, batch, n) do
+    {:ok, {a, a_peer}} = Tundra.create_loopback(buffer: 4_194_304)
+    {:ok, {b, b_peer}} = Tundra.create_loopback(buffer: 4_194_304)
+    key = :crypto.strong_rand_bytes(32)
+    {:ok, _} = Tundra.tunnel(a, ip: "::1", buffer: 4_194_304)
+    {:ok, port} = Tundra.tunnel(b, ip: "::1", buffer: 4_194_304)
+    peer = [remote_index: 1, tx_key: key, rx_key: key]
+
+    to_b = [endpoint: {"::1", port}, allowed_ips: [{ctx.peer_str, 128}]]
+    :ok = Tundra.tunnel_peer(a, 1, to_b ++ peer)
+    :ok = Tundra.tunnel_peer(b, 1, [allowed_ips: [{ctx.local_str, 128}]] ++ peer)
+    template = Packet.udp6(ctx.local_str, ctx.peer_str, @host_port, @peer_port, size)
+    sender = loopback_sender(a_peer, template, batch, n)
+
+    try do
+      recv_loop(%{ctx | dev: b_peer}, sender, batch, n, 0, [])
+    after
+      Process.unlink(sender)
+      Process.exit(sender, :kill)
+      Enum.each([a, a_peer, b, b_peer], &Tundra.close/1)
+    end
+  end
+
+  # tunnel_elixir: the traffic of tunnel, sealed and opened in Elixir as before
+  # tunnel mode. One process reads the first device and sends each packet,
+  # framed as tunnel mode frames it and sealed with :crypto, from a gen_udp
+  # socket; another opens what arrives on a second socket and writes it to the
+  # second device. There is no replay window, so this flatters Elixir a little.
+  defp run("tunnel_elixir", ctx, size, batch, n) do
+    {:ok, {a, a_peer}} = Tundra.create_loopback(buffer: 4_194_304)
+    {:ok, {b, b_peer}} = Tundra.create_loopback(buffer: 4_194_304)
+    key = :crypto.strong_rand_bytes(32)
+    opts = [:binary, :inet6, ip: {0, 0, 0, 0, 0, 0, 0, 1}, recbuf: 4_194_304, sndbuf: 4_194_304]
+    {:ok, out} = :gen_udp.open(0, opts)
+    {:ok, into} = :gen_udp.open(0, opts)
+    {:ok, port} = :inet.port(into)
+
+    sealer = spawn_link(fn -> receive(do: (:go -> seal_loop(a, out, port, key, 0))) end)
+    opener = spawn_link(fn -> receive(do: (:go -> open_loop(into, b, key))) end)
+    :ok = Tundra.controlling_process(a, sealer)
+    :ok = :gen_udp.controlling_process(out, sealer)
+    :ok = Tundra.controlling_process(b, opener)
+    :ok = :gen_udp.controlling_process(into, opener)
+    Enum.each([sealer, opener], &send(&1, :go))
+
+    template = Packet.udp6(ctx.local_str, ctx.peer_str, @host_port, @peer_port, size)
+    sender = loopback_sender(a_peer, template, batch, n)
+
+    try do
+      recv_loop(%{ctx | dev: b_peer}, sender, batch, n, 0, [])
+    after
+      # The devices and sockets the relay owns close with it
+      for pid <- [sender, sealer, opener] do
+        Process.unlink(pid)
+        Process.exit(pid, :kill)
+      end
+
+      Tundra.close(a_peer)
+      Tundra.close(b_peer)
+    end
+  end
+
+  defp seal_loop(dev, sock, port, key, counter) do
+    case Tundra.recv(dev, 65_535, :nowait) do
+      {:ok, packet} ->
+        header = <<4, 0, 0, 0, 1::32-little, counter::64-little>>
+        nonce = <<0::32, counter::64-little>>
+
+        {sealed, tag} =
+          :crypto.crypto_one_time_aead(:chacha20_poly1305, key, nonce, packet, header, true)
+
+        _ = :gen_udp.send(sock, {0, 0, 0, 0, 0, 0, 0, 1}, port, [header, sealed, tag])
+        seal_loop(dev, sock, port, key, counter + 1)
+
+      {:select, _} ->
+        receive do
+          {:"$socket", ^dev, :select, _} -> seal_loop(dev, sock, port, key, counter)
+        end
+    end
+  end
+
+  defp open_loop(sock, dev, key) do
+    receive do
+      {:udp, ^sock, _addr, _port, <<header::binary-16, rest::binary>>}
+      when byte_size(rest) >= 16 ->
+        <<4, 0, 0, 0, _index::32, counter::64-little>> = header
+        len = byte_size(rest) - 16
+        <<sealed::binary-size(len), tag::binary>> = rest
+        nonce = <<0::32, counter::64-little>>
+        aead = :chacha20_poly1305
+
+        case :crypto.crypto_one_time_aead(aead, key, nonce, sealed, header, tag, false) do
+          :error -> :ok
+          packet -> Tundra.send(dev, packet, :nowait)
+        end
+
+        open_loop(sock, dev, key)
+    end
+  end
+
+  @encap_header <<4, 0, 0, 0, 1::32-little, 0::64>>
+
+  # encap and encap_headroom: as loopback, but the reader forwards each packet
+  # behind a 16-byte header over UDP on ::1, as a tunnel without encryption
+  # would, to a socket in another process. encap sends the header and packet
+  # as iodata, which the socket copies into one buffer; encap_headroom reads
+  # with headroom and fills the header in with Tundra.fill_headroom/3, so that
+  # the datagram is already one binary. Latency is from the peer's send/3 to
+  # the socket receive.
+  defp run(kind, ctx, size, batch, n) when kind in ["encap", "encap_headroom"] do
+    {:ok, {dev, peer}} = Tundra.create_loopback(buffer: 4_194_304)
+    {:ok, out} = :socket.open(:inet6, :dgram, :udp)
+    :ok = :socket.setopt(out, {:socket, :sndbuf}, 4_194_304)
+    owner = self()
+    receiver = spawn_link(fn -> encap_receiver(owner, batch, n) end)
+    to = receive(do: ({:encap_to, ^receiver, to} -> to))
+    template = Packet.udp6(ctx.local_str, ctx.peer_str, @host_port, @peer_port, size)
+    sender = loopback_sender(peer, template, batch, n)
+    send(receiver, {:sender, sender})
+    room = if kind == "encap_headroom", do: [headroom: byte_size(@encap_header)], else: []
+
+    try do
+      encap_loop(dev, out, to, ctx.mtu, room)
+    after
+      for pid <- [sender, receiver] do
+        Process.unlink(pid)
+        Process.exit(pid, :kill)
+      end
+
+      :socket.close(out)
+      Tundra.close(dev)
+    end
+  end
+
+  defp encap_loop(dev, sock, to, mtu, room) do
+    case Tundra.recv(dev, mtu, :nowait, room) do
+      {:ok, packet} ->
+        _ = :socket.sendto(sock, encapsulate(packet, room), to)
+        encap_loop(dev, sock, to, mtu, room)
+
+      {:select, _} ->
+        receive do
+          {:"$socket", ^dev, :select, _} -> encap_loop(dev, sock, to, mtu, room)
+          {:received, result} -> result
+        end
+    end
+  end
+
+  defp encapsulate(packet, []), do: [@encap_header, packet]
+
+  defp encapsulate(packet, _room) do
+    {:ok, datagram} = Tundra.fill_headroom(packet, @encap_header)
+    datagram
+  end
+
+  defp encap_receiver(owner, batch, n) do
+    {:ok, sock} = :socket.open(:inet6, :dgram, :udp)
+    :ok = :socket.setopt(sock, {:socket, :rcvbuf}, 4_194_304)
+    :ok = :socket.bind(sock, %{family: :inet6, addr: :loopback, port: 0})
+    {:ok, to} = :socket.sockname(sock)
+    send(owner, {:encap_to, self(), to})
+    sender = receive(do: ({:sender, sender} -> sender))
+    send(owner, {:received, encap_receive(sock, sender, batch, n, 0, [])})
+  end
+
+  defp encap_receive(_sock, _sender, _batch, n, n, latencies), do: {n, latencies}
+
+  defp encap_receive(sock, sender, batch, n, received, latencies) do
+    case :socket.recv(sock, 65_535, @timeout) do
+      {:ok, <<_header::binary-16, packet::binary>>} ->
+        case Packet.udp6_payload(packet) do
+          {@peer_port, <<ts::signed-64, _::binary>>} ->
+            latencies = [System.monotonic_time(:nanosecond) - ts | latencies]
+            received = received + 1
+            if rem(received, batch) == 0, do: send(sender, {:ack, received})
+            encap_receive(sock, sender, batch, n, received, latencies)
+
+          _ ->
+            encap_receive(sock, sender, batch, n, received, latencies)
+        end
+
+      {:ok, _short} ->
+        encap_receive(sock, sender, batch, n, received, latencies)
+
+      {:error, :timeout} ->
+        {received, latencies}
+    end
+  end
+
+  # recv_track, send_track: recv and send, run with Tundra.track_latency/2 off
+  # and on, so that the two give the cost of tracking. When on, the NIF's own
+  # view of the calls is printed.
+  defp run(kind, ctx, size, batch, n) when kind in ["recv_track", "send_track"] do
+    traffic = String.replace_suffix(kind, "_track", "")
+    :ok = Tundra.track_latency(ctx.dev, ctx.track)
+
+    try do
+      result = run(traffic, ctx, size, batch, n)
+
+      if ctx.track do
+        {:ok, hists} = Tundra.latency(ctx.dev)
+        p = Tundra.Histogram.percentiles(Map.fetch!(hists, String.to_atom(traffic)))
+        IO.puts("Tracked #{traffic}/3 calls: p50 #{p[50]} ns, p99 #{p[99]} ns")
+      end
+
+      result
+    after
+      Tundra.track_latency(ctx.dev, false)
+    end
+  end
+
+  # busy_poll: as loopback, but the peer sends bursts of `batch` at a fixed
+  # rate whether or not the reader keeps up, and the reader busy polls for up
+  # to the given time (see Tundra.busy_poll/2). Latency is from the peer's
+  # send/3 to the return of recv/3. Run once per --rates and --busy-polls.
+  defp run("busy_poll", ctx, size, batch, n) do
+    {:ok, {dev, peer}} = Tundra.create_loopback(buffer: 4_194_304)
+    :ok = Tundra.busy_poll(dev, ctx.spin)
+    template = Packet.udp6(ctx.local_str, ctx.peer_str, @host_port, @peer_port, size)
+    sender = paced_sender(peer, template, batch, ctx.rate, n)
+
+    try do
+      result = recv_loop(%{ctx | dev: dev}, sender, batch, n, 0, [])
+      {:ok, stats} = Tundra.stats(dev)
+
+      IO.puts(
+        "Busy polled #{stats.busy_polls} times, #{stats.busy_poll_hits} hits, " <>
+          "#{div(stats.busy_poll_time, 1_000_000)} ms"
+      )
+
+      result
+    after
+      Process.unlink(sender)
+      Process.exit(sender, :kill)
+      Tundra.close(dev)
+    end
+  end
+
+  # Drive the peer of a loopback device from another process, as tun_sender
+  defp loopback_sender(peer, template, batch, n) do
+    sender =
+      spawn_link(fn ->
+        receive do
+          :go -> tun_sender(%{dev: peer}, template, batch, n, 0)
+        end
+      end)
+
+    :ok = Tundra.controlling_process(peer, sender)
+    send(sender, :go)
+    sender
+  end
+
+  # Drive the peer of a loopback device from another process at `rate`
+  # packets a second. Bursts closer together than a few milliseconds are
+  # timed by spinning, so the sender keeps a scheduler busy at higher rates.
+  defp paced_sender(peer, template, batch, rate, n) do
+    interval = div(batch * 1_000_000_000, rate)
+
+    sender =
+      spawn_link(fn ->
+        receive do
+          :go ->
+            due = System.monotonic_time(:nanosecond)
+            paced_send(peer, template, batch, interval, n, 0, due)
+        end
+      end)
+
+    :ok = Tundra.controlling_process(peer, sender)
+    send(sender, :go)
+    sender
+  end
+
+  defp paced_send(_peer, _template, _batch, _interval, n, n, _due), do: :ok
+
+  defp paced_send(peer, template, batch, interval, n, sent, due) do
+    wait_until(due)
+    burst = min(batch, n - sent)
+    for _ <- 1..burst, do: tun_send(peer, Packet.stamp(template))
+    # The reader's acknowledgements pace nothing here
+    flush()
+    paced_send(peer, template, batch, interval, n, sent + burst, due + interval)
+  end
+
+  defp wait_until(due) do
+    left = due - System.monotonic_time(:nanosecond)
+
+    cond do
+      left > 3_000_000 ->
+        Process.sleep(div(left, 1_000_000) - 2)
+        wait_until(due)
+
+      left > 0 ->
+        wait_until(due)
+
+      true ->
+        :ok
+    end
+  end
+
+  defp stage_consumer(producer, sender, batch, n) do
+    [producer]
+    |> GenStage.stream()
+    |> Enum.reduce_while({0, []}, fn packet, {received, latencies} = acc ->
+      case Packet.udp6_payload(packet) do
+        {@peer_port, <<ts::signed-64, _::binary>>} ->
+          latencies = [System.monotonic_time(:nanosecond) - ts | latencies]
+          received = received + 1
+          if rem(received, batch) == 0, do: send(sender, {:ack, received})
+          if received == n, do: {:halt, {n, latencies}}, else: {:cont, {received, latencies}}
+
+        _ ->
+          {:cont, acc}
+      end
+    end)
+  end
+
+  # Kernel-side sender for the recv case: send a burst, then wait for the
+  # reader to acknowledge it (or assume loss after a short timeout).
+  defp udp_sender(_sock, _peer, _pad, _batch, n, n), do: :ok
+
+  defp udp_sender(sock, peer, pad, batch, n, sent) do
+    burst = min(batch, n - sent)
+
+    for _ <- 1..burst do
+      ts = System.monotonic_time(:nanosecond)
+      :ok = :gen_udp.send(sock, peer, @peer_port, [<<ts::64>>, pad])
+    end
+
+    sent = sent + burst
+
+    receive do
+      {:ack, ^sent} -> :ok
+    after
+      @ack_timeout -> :ok
+    end
+
+    udp_sender(sock, peer, pad, batch, n, sent)
+  end
+
+  defp recv_loop(_ctx, _sender, _batch, n, n, latencies), do: {n, latencies}
+
+  defp recv_loop(ctx, sender, batch, n, received, latencies) do
+    case Tundra.recv(ctx.dev, ctx.mtu, :nowait) do
+      {:ok, packet} ->
+        case Packet.udp6_payload(packet) do
+          {@peer_port, <<ts::signed-64, _::binary>>} ->
+            latencies = [System.monotonic_time(:nanosecond) - ts | latencies]
+            received = received + 1
+            if rem(received, batch) == 0, do: send(sender, {:ack, received})
+            recv_loop(ctx, sender, batch, n, received, latencies)
+
+          _ ->
+            # Router solicitations and other kernel traffic
+            recv_loop(ctx, sender, batch, n, received, latencies)
+        end
+
+      {:select, _} ->
+        # Acknowledge a partial burst so that the sender is not held up by loss
+        send(sender, {:ack, received})
+        dev = ctx.dev
+
+        receive do
+          {:"$socket", ^dev, :select, _} ->
+            recv_loop(ctx, sender, batch, n, received, latencies)
+        after
+          @timeout -> {received, latencies}
+        end
+    end
+  end
+
+  # Device-side sender for the send case
+  defp tun_sender(_ctx, _template, _batch, n, n), do: :ok
+
+  defp tun_sender(ctx, template, batch, n, sent) do
+    burst = min(batch, n - sent)
+    for _ <- 1..burst, do: tun_send(ctx.dev, Packet.stamp(template))
+    sent = sent + burst
+
+    receive do
+      {:ack, ^sent} -> :ok
+    after
+      @ack_timeout -> :ok
+    end
+
+    tun_sender(ctx, template, batch, n, sent)
+  end
+
+  defp tun_send(dev, packet) do
+    case Tundra.send(dev, packet, :nowait) do
+      :ok ->
+        :ok
+
+      {:select, _} ->
+        receive do
+          {:"$socket", ^dev, :select, _} -> tun_send(dev, packet)
+        after
+          @timeout -> :timeout
+        end
+    end
+  end
+
+  defp udp_receiver(_sock, _owner, _batch, n, n, latencies), do: {n, latencies}
+
+  defp udp_receiver(sock, owner, batch, n, received, latencies) do
+    case :gen_udp.recv(sock, 0, @timeout) do
+      {:ok, {_addr, _port, <<ts::signed-64, _::binary>>}} ->
+        latencies = [System.monotonic_time(:nanosecond) - ts | latencies]
+        received = received + 1
+        if rem(received, batch) == 0, do: send(owner, {:ack, received})
+        udp_receiver(sock, owner, batch, n, received, latencies)
+
+      {:error, :timeout} ->
+        {received, latencies}
+    end
+  end
+
+  # Kernel-side pinger for the reflect case: send a burst on one socket and
+  # collect the reflected packets on the other.
+  defp pinger(_out, _back, _peer, _pad, _batch, n, n, received, latencies),
+    do: {received, latencies}
+
+  defp pinger(out, back, peer, pad, batch, n, sent, received, latencies) do
+    burst = min(batch, n - sent)
+
+    for _ <- 1..burst do
+      ts = System.monotonic_time(:nanosecond)
+      :ok = :gen_udp.send(out, peer, @peer_port, [<<ts::64>>, pad])
+    end
+
+    {got, latencies} = collect(back, burst, latencies)
+    pinger(out, back, peer, pad, batch, n, sent + burst, received + got, latencies)
+  end
+
+  defp collect(sock, count, latencies, got \\ 0)
+  defp collect(_sock, count, latencies, count), do: {count, latencies}
+
+  defp collect(sock, count, latencies, got) do
+    case :gen_udp.recv(sock, 0, @ack_timeout) do
+      {:ok, {_addr, _port, <<ts::signed-64, _::binary>>}} ->
+        latency = System.monotonic_time(:nanosecond) - ts
+        collect(sock, count, [latency | latencies], got + 1)
+
+      {:error, :timeout} ->
+        {got, latencies}
+    end
+  end
+
+  defp reflect_loop(ctx) do
+    dev = ctx.dev
+
+    case Tundra.recv(dev, ctx.mtu, :nowait) do
+      {:ok, <<pre::binary-size(8), src::binary-size(16), dst::binary-size(16), rest::bits>>} ->
+        # Drop the packet if the device is full, as the Reflector example does
+        _ = Tundra.send(dev, [pre, dst, src, rest], :nowait)
+        reflect_loop(ctx)
+
+      {:ok, _short} ->
+        reflect_loop(ctx)
+
+      {:select, _} ->
+        receive do
+          {:"$socket", ^dev, :select, _} -> reflect_loop(ctx)
+          {:received, result} -> result
+        end
+    end
+  end
+end
+
+Tundra.Bench.main(System.argv())
@@ -0,0 +1,791 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#define HAVE_SYS_UIO_H 1
+#include <unistd.h>
+#include "capture.h"
+
+// pcapng (draft-ietf-opsawg-pcapng), written in host byte order
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_EPB_FLAGS 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define LINKTYPE_RAW 101
+
+#define SHB_SIZE 28
+#define IDB_SIZE 32
+#define HEADERS_SIZE (SHB_SIZE + IDB_SIZE)
+
+// An EPB without its packet data: the block header, an epb_flags option, the
+// end of options and the trailing length
+#define EPB_OVERHEAD (28 + 8 + 4 + 4)
+
+// Classic BPF (see linux/filter.h or net/bpf.h)
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_SIZE(code) ((code) & 0x18)
+#define BPF_MODE(code) ((code) & 0xe0)
+#define BPF_OP(code) ((code) & 0xf0)
+#define BPF_SRC(code) ((code) & 0x08)
+#define BPF_RVAL(code) ((code) & 0x18)
+#define BPF_MISCOP(code) ((code) & 0xf8)
+
+#define BPF_LD 0x00
+#define BPF_LDX 0x01
+#define BPF_ST 0x02
+#define BPF_STX 0x03
+#define BPF_ALU 0x04
+#define BPF_JMP 0x05
+#define BPF_RET 0x06
+#define BPF_MISC 0x07
+
+#define BPF_W 0x00
+#define BPF_H 0x08
+#define BPF_B 0x10
+
+#define BPF_IMM 0x00
+#define BPF_ABS 0x20
+#define BPF_IND 0x40
+#define BPF_MEM 0x60
+#define BPF_LEN 0x80
+#define BPF_MSH 0xa0
+
+#define BPF_ADD 0x00
+#define BPF_SUB 0x10
+#define BPF_MUL 0x20
+#define BPF_DIV 0x30
+#define BPF_OR 0x40
+#define BPF_AND 0x50
+#define BPF_LSH 0x60
+#define BPF_RSH 0x70
+#define BPF_NEG 0x80
+#define BPF_MOD 0x90
+#define BPF_XOR 0xa0
+
+#define BPF_JA 0x00
+#define BPF_JEQ 0x10
+#define BPF_JGT 0x20
+#define BPF_JGE 0x30
+#define BPF_JSET 0x40
+
+#define BPF_K 0x00
+#define BPF_X 0x08
+#define BPF_A 0x10
+
+#define BPF_TAX 0x00
+#define BPF_TXA 0x80
+
+#define BPF_MEMWORDS 16
+
+// All fields other than the writer's are protected by `lock`, except the
+// configuration and `seen`, which only change while the writer is stopped and
+// are otherwise read-only (configuration) or touched only by the device's
+// owner (seen).
+struct capture_t
+{
+    ErlNifMutex *lock;
+    ErlNifCond *cond;
+    ErlNifTid tid;
+    bool running;  // accepting packets
+    bool stopping; // the writer is flushing and about to exit
+    struct capture_config_t config;
+    unsigned char *buf[2];
+    size_t fill[2];
+    unsigned active; // the buffer being filled; the writer owns the other
+    uint64_t seen;   // matching packets, for sampling
+    struct capture_stats_t stats;
+    // Writer only
+    int fd;
+    uint64_t file_bytes;
+};
+
+// A packet within an iovec
+struct packet_t
+{
+    const struct iovec *iov;
+    int iovcnt;
+    size_t offset;
+    size_t len;
+};
+
+static void packet_copy(const struct packet_t *pkt, size_t off, unsigned char *out, size_t n)
+{
+    off += pkt->offset;
+    for (int i = 0; i < pkt->iovcnt && n > 0; ++i)
+    {
+        size_t len = pkt->iov[i].iov_len;
+        if (off >= len)
+        {
+            off -= len;
+            continue;
+        }
+        size_t take = len - off < n ? len - off : n;
+        memcpy(out, (const unsigned char *)pkt->iov[i].iov_base + off, take);
+        out += take;
+        n -= take;
+        off = 0;
+    }
+}
+
+// Load a big-endian value of `size` bytes, failing if it is out of bounds
+static bool packet_load(const struct packet_t *pkt, uint64_t off, unsigned size, uint32_t *value)
+{
+    if (off > pkt->len || size > pkt->len - off)
+    {
+        return false;
+    }
+    unsigned char b[4];
+    packet_copy(pkt, off, b, size);
+    switch (size)
+    {
+    case 4:
+        *value = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3];
+        break;
+    case 2:
+        *value = (uint32_t)b[0] << 8 | b[1];
+        break;
+    default:
+        *value = b[0];
+        break;
+    }
+    return true;
+}
+
+static unsigned load_size(uint16_t code)
+{
+    return BPF_SIZE(code) == BPF_W ? 4 : BPF_SIZE(code) == BPF_H ? 2 : 1;
+}
+
+bool capture_filter_valid(const struct capture_insn_t *insns, unsigned n)
+{
+    if (n == 0 || n > CAPTURE_MAX_INSNS)
+    {
+        return false;
+    }
+    for (unsigned pc = 0; pc < n; ++pc)
+    {
+        const struct capture_insn_t *in = &insns[pc];
+        switch (in->code)
+        {
+        case BPF_LD | BPF_W | BPF_ABS:
+        case BPF_LD | BPF_H | BPF_ABS:
+        case BPF_LD | BPF_B | BPF_ABS:
+        case BPF_LD | BPF_W | BPF_IND:
+        case BPF_LD | BPF_H | BPF_IND:
+        case BPF_LD | BPF_B | BPF_IND:
+        case BPF_LD | BPF_W | BPF_IMM:
+        case BPF_LD | BPF_W | BPF_LEN:
+        case BPF_LDX | BPF_W | BPF_IMM:
+        case BPF_LDX | BPF_W | BPF_LEN:
+        case BPF_LDX | BPF_B | BPF_MSH:
+        case BPF_RET | BPF_K:
+        case BPF_RET | BPF_A:
+        case BPF_MISC | BPF_TAX:
+        case BPF_MISC | BPF_TXA:
+        case BPF_ALU | BPF_NEG:
+            break;
+        case BPF_LD | BPF_W | BPF_MEM:
+        case BPF_LDX | BPF_W | BPF_MEM:
+        case BPF_ST:
+        case BPF_STX:
+            if (in->k >= BPF_MEMWORDS)
+            {
+                return false;
+            }
+            break;
+        case BPF_ALU | BPF_DIV | BPF_K:
+        case BPF_ALU | BPF_MOD | BPF_K:
+            if (in->k == 0)
+            {
+                return false;
+            }
+            break;
+        case BPF_ALU | BPF_ADD | BPF_K:
+        case BPF_ALU | BPF_SUB | BPF_K:
+        case BPF_ALU | BPF_MUL | BPF_K:
+        case BPF_ALU | BPF_OR | BPF_K:
+        case BPF_ALU | BPF_AND | BPF_K:
+        case BPF_ALU | BPF_LSH | BPF_K:
+        case BPF_ALU | BPF_RSH | BPF_K:
+        case BPF_ALU | BPF_XOR | BPF_K:
+        case BPF_ALU | BPF_ADD | BPF_X:
+        case BPF_ALU | BPF_SUB | BPF_X:
+        case BPF_ALU | BPF_MUL | BPF_X:
+        case BPF_ALU | BPF_DIV | BPF_X:
+        case BPF_ALU | BPF_OR | BPF_X:
+        case BPF_ALU | BPF_AND | BPF_X:
+        case BPF_ALU | BPF_LSH | BPF_X:
+        case BPF_ALU | BPF_RSH | BPF_X:
+        case BPF_ALU | BPF_MOD | BPF_X:
+        case BPF_ALU | BPF_XOR | BPF_X:
+            break;
+        case BPF_JMP | BPF_JA:
+            if ((uint64_t)pc + 1 + in->k >= n)
+            {
+                return false;
+            }
+            break;
+        case BPF_JMP | BPF_JEQ | BPF_K:
+        case BPF_JMP | BPF_JGT | BPF_K:
+        case BPF_JMP | BPF_JGE | BPF_K:
+        case BPF_JMP | BPF_JSET | BPF_K:
+        case BPF_JMP | BPF_JEQ | BPF_X:
+        case BPF_JMP | BPF_JGT | BPF_X:
+        case BPF_JMP | BPF_JGE | BPF_X:
+        case BPF_JMP | BPF_JSET | BPF_X:
+            if (pc + 1 + in->jt >= n || pc + 1 + in->jf >= n)
+            {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+    return BPF_CLASS(insns[n - 1].code) == BPF_RET;
+}
+
+// Run a valid filter, returning the number of bytes to capture (0 to skip the
+// packet). A load out of bounds skips the packet, as in the kernel.
+static uint32_t run_filter(const struct capture_insn_t *insns, const struct packet_t *pkt)
+{
+    uint32_t a = 0;
+    uint32_t x = 0;
+    uint32_t mem[BPF_MEMWORDS] = {0};
+
+    for (unsigned pc = 0;; ++pc)
+    {
+        const struct capture_insn_t *in = &insns[pc];
+        uint32_t k = in->k;
+        uint32_t s = BPF_SRC(in->code) == BPF_X ? x : k;
+        switch (BPF_CLASS(in->code))
+        {
+        case BPF_LD:
+            switch (BPF_MODE(in->code))
+            {
+            case BPF_ABS:
+                if (!packet_load(pkt, k, load_size(in->code), &a))
+                {
+                    return 0;
+                }
+                break;
+            case BPF_IND:
+                if (!packet_load(pkt, (uint64_t)x + k, load_size(in->code), &a))
+                {
+                    return 0;
+                }
+                break;
+            case BPF_LEN:
+                a = (uint32_t)pkt->len;
+                break;
+            case BPF_MEM:
+                a = mem[k];
+                break;
+            default:
+                a = k;
+                break;
+            }
+            break;
+        case BPF_LDX:
+            switch (BPF_MODE(in->code))
+            {
+            case BPF_MSH:
+                if (!packet_load(pkt, k, 1, &x))
+                {
+                    return 0;
+                }
+                x = (x & 0xf) << 2;
+                break;
+            case BPF_LEN:
+                x = (uint32_t)pkt->len;
+                break;
+            case BPF_MEM:
+                x = mem[k];
+                break;
+            default:
+                x = k;
+                break;
+            }
+            break;
+        case BPF_ST:
+            mem[k] = a;
+            break;
+        case BPF_STX:
+            mem[k] = x;
+            break;
+        case BPF_ALU:
+            switch (BPF_OP(in->code))
+            {
+            case BPF_ADD:
+                a += s;
+                break;
+            case BPF_SUB:
+                a -= s;
+                break;
+            case BPF_MUL:
+                a *= s;
+                break;
+            case BPF_DIV:
+                if (s == 0)
+                {
+                    return 0;
+                }
+                a /= s;
+                break;
+            case BPF_MOD:
+                if (s == 0)
+                {
+                    return 0;
+                }
+                a %= s;
+                break;
+            case BPF_OR:
+                a |= s;
+                break;
+            case BPF_AND:
+                a &= s;
+                break;
+            case BPF_XOR:
+                a ^= s;
+                break;
+            case BPF_LSH:
+                a = s < 32 ? a << s : 0;
+                break;
+            case BPF_RSH:
+                a = s < 32 ? a >> s : 0;
+                break;
+            default:
+                a = -a;
+                break;
+            }
+            break;
+        case BPF_JMP:
+            switch (BPF_OP(in->code))
+            {
+            case BPF_JA:
+                pc += k;
+                break;
+            case BPF_JEQ:
+                pc += a == s ? in->jt : in->jf;
+                break;
+            case BPF_JGT:
+                pc += a > s ? in->jt : in->jf;
+                break;
+            case BPF_JGE:
+                pc += a >= s ? in->jt : in->jf;
+                break;
+            default:
+                pc += (a & s) ? in->jt : in->jf;
+                break;
+            }
+            break;
+        case BPF_RET:
+            return BPF_RVAL(in->code) == BPF_A ? a : k;
+        default:
+            if (BPF_MISCOP(in->code) == BPF_TXA)
+            {
+                a = x;
+            }
+            else
+            {
+                x = a;
+            }
+            break;
+        }
+    }
+}
+
+static inline unsigned char *put16(unsigned char *p, uint16_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static inline unsigned char *put32(unsigned char *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static inline uint32_t get32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int write_all(int fd, const unsigned char *p, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -errno;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Create (or truncate) the newest capture file and write its section header
+// and its one interface description, with nanosecond timestamps
+static int open_file(struct capture_t *c)
+{
+    unsigned char hdr[HEADERS_SIZE];
+    unsigned char *p = hdr;
+    int64_t section_length = -1; // unknown
+
+    p = put32(p, PCAPNG_SHB);
+    p = put32(p, SHB_SIZE);
+    p = put32(p, PCAPNG_BYTE_ORDER);
+    p = put16(p, 1);
+    p = put16(p, 0);
+    memcpy(p, &section_length, sizeof(section_length));
+    p += sizeof(section_length);
+    p = put32(p, SHB_SIZE);
+
+    p = put32(p, PCAPNG_IDB);
+    p = put32(p, IDB_SIZE);
+    p = put16(p, LINKTYPE_RAW);
+    p = put16(p, 0);
+    p = put32(p, c->config.snaplen);
+    p = put16(p, PCAPNG_OPT_IF_TSRESOL);
+    p = put16(p, 1);
+    *p++ = 9; // 10^-9 seconds, padded to 4 bytes
+    memset(p, 0, 3);
+    p += 3;
+    p = put32(p, PCAPNG_OPT_END);
+    put32(p, IDB_SIZE);
+
+    c->fd = open(c->config.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (c->fd < 0)
+    {
+        return -errno;
+    }
+    int err = write_all(c->fd, hdr, sizeof(hdr));
+    if (err != 0)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return err;
+    }
+    c->file_bytes = sizeof(hdr);
+    return 0;
+}
+
+// Shift the ring of files along by one and start a new file. A failure leaves
+// the capture without a file, and the next rotation tries again.
+static void rotate(struct capture_t *c)
+{
+    if (c->fd != -1)
+    {
+        close(c->fd);
+        c->fd = -1;
+    }
+    size_t size = strlen(c->config.path) + 12;
+    char *from = enif_alloc(size);
+    char *to = enif_alloc(size);
+    if (from != NULL && to != NULL)
+    {
+        for (unsigned i = c->config.files - 1; i >= 1 && i < c->config.files; --i)
+        {
+            if (i == 1)
+            {
+                snprintf(from, size, "%s", c->config.path);
+            }
+            else
+            {
+                snprintf(from, size, "%s.%u", c->config.path, i - 1);
+            }
+            snprintf(to, size, "%s.%u", c->config.path, i);
+            rename(from, to);
+        }
+    }
+    enif_free(from);
+    enif_free(to);
+    open_file(c);
+}
+
+// Write a run of whole records, counting them as written or dropped
+static void write_span(struct capture_t *c, const unsigned char *p, size_t len, uint64_t packets, uint64_t bytes,
+                       struct capture_stats_t *done)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    if (c->fd != -1 && write_all(c->fd, p, len) == 0)
+    {
+        c->file_bytes += len;
+        done->packets += packets;
+        done->bytes += bytes;
+    }
+    else
+    {
+        done->drops += packets;
+    }
+}
+
+// Write a buffer of EPBs, rotating between records once a file is full
+static void write_records(struct capture_t *c, const unsigned char *p, size_t len, struct capture_stats_t *done)
+{
+    size_t start = 0;
+    size_t off = 0;
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+
+    while (off < len)
+    {
+        uint32_t size = get32(p + off + 4);
+        uint64_t used = c->file_bytes + (off - start);
+        if (c->config.file_size != 0 && used + size > c->config.file_size && used > HEADERS_SIZE)
+        {
+            write_span(c, p + start, off - start, packets, bytes, done);
+            rotate(c);
+            start = off;
+            packets = bytes = 0;
+        }
+        packets++;
+        bytes += get32(p + off + 20);
+        off += size;
+    }
+    write_span(c, p + start, off - start, packets, bytes, done);
+}
+
+static void *capture_thread(void *arg)
+{
+    struct capture_t *c = arg;
+
+    enif_mutex_lock(c->lock);
+    for (;;)
+    {
+        while (!c->stopping && c->fill[c->active] == 0)
+        {
+            enif_cond_wait(c->cond, c->lock);
+        }
+        // Once stopping is set nothing more is appended, so this is the last swap
+        bool stop = c->stopping;
+        unsigned idx = c->active;
+        size_t len = c->fill[idx];
+        c->active ^= 1;
+        enif_mutex_unlock(c->lock);
+
+        struct capture_stats_t done = {0, 0, 0};
+        write_records(c, c->buf[idx], len, &done);
+
+        enif_mutex_lock(c->lock);
+        c->fill[idx] = 0;
+        c->stats.packets += done.packets;
+        c->stats.bytes += done.bytes;
+        c->stats.drops += done.drops;
+        if (stop)
+        {
+            break;
+        }
+    }
+    enif_mutex_unlock(c->lock);
+
+    if (c->fd != -1)
+    {
+        close(c->fd);
+        c->fd = -1;
+    }
+    return NULL;
+}
+
+struct capture_t *capture_create(void)
+{
+    struct capture_t *c = enif_alloc(sizeof(*c));
+    if (c == NULL)
+    {
+        return NULL;
+    }
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    c->lock = enif_mutex_create("tundra_capture");
+    c->cond = enif_cond_create("tundra_capture");
+    if (c->lock == NULL || c->cond == NULL)
+    {
+        if (c->lock != NULL)
+        {
+            enif_mutex_destroy(c->lock);
+        }
+        if (c->cond != NULL)
+        {
+            enif_cond_destroy(c->cond);
+        }
+        enif_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+static void free_config(struct capture_config_t *config)
+{
+    enif_free(config->path);
+    enif_free(config->filter);
+    config->path = NULL;
+    config->filter = NULL;
+}
+
+void capture_destroy(struct capture_t *c)
+{
+    if (c != NULL)
+    {
+        capture_stop(c, NULL);
+        free_config(&c->config);
+        enif_free(c->buf[0]);
+        enif_free(c->buf[1]);
+        enif_cond_destroy(c->cond);
+        enif_mutex_destroy(c->lock);
+        enif_free(c);
+    }
+}
+
+int capture_start(struct capture_t *c, struct capture_config_t *config)
+{
+    enif_mutex_lock(c->lock);
+    bool busy = c->running || c->stopping;
+    enif_mutex_unlock(c->lock);
+    if (busy)
+    {
+        free_config(config);
+        return -EBUSY;
+    }
+
+    // The writer has exited, so nothing else touches the buffers or config
+    if (config->buffer != c->config.buffer || c->buf[0] == NULL || c->buf[1] == NULL)
+    {
+        enif_free(c->buf[0]);
+        enif_free(c->buf[1]);
+        c->buf[0] = enif_alloc(config->buffer);
+        c->buf[1] = enif_alloc(config->buffer);
+    }
+    free_config(&c->config);
+    c->config = *config;
+    config->path = NULL;
+    config->filter = NULL;
+    if (c->buf[0] == NULL || c->buf[1] == NULL)
+    {
+        return -ENOMEM;
+    }
+    c->fill[0] = c->fill[1] = 0;
+    c->active = 0;
+    c->seen = 0;
+    memset(&c->stats, 0, sizeof(c->stats));
+
+    int err = open_file(c);
+    if (err != 0)
+    {
+        return err;
+    }
+    c->running = true;
+    if ((err = enif_thread_create("tundra_capture", &c->tid, capture_thread, c, NULL)) != 0)
+    {
+        c->running = false;
+        close(c->fd);
+        c->fd = -1;
+        return -err;
+    }
+    return 0;
+}
+
+bool capture_stop(struct capture_t *c, struct capture_stats_t *stats)
+{
+    enif_mutex_lock(c->lock);
+    bool running = c->running;
+    if (running)
+    {
+        c->running = false;
+        c->stopping = true;
+        enif_cond_signal(c->cond);
+    }
+    enif_mutex_unlock(c->lock);
+
+    if (running)
+    {
+        enif_thread_join(c->tid, NULL);
+        enif_mutex_lock(c->lock);
+        c->stopping = false;
+        enif_mutex_unlock(c->lock);
+    }
+    if (stats != NULL)
+    {
+        enif_mutex_lock(c->lock);
+        *stats = c->stats;
+        enif_mutex_unlock(c->lock);
+    }
+    return running;
+}
+
+void capture_packet(struct capture_t *c, const struct iovec *iov, int iovcnt, size_t offset, size_t len,
+                    int direction)
+{
+    struct packet_t pkt = {iov, iovcnt, offset, len};
+    uint32_t snaplen = c->config.snaplen;
+
+    if (c->config.filter != NULL)
+    {
+        uint32_t keep = run_filter(c->config.filter, &pkt);
+        if (keep == 0)
+        {
+            return;
+        }
+        snaplen = keep < snaplen ? keep : snaplen;
+    }
+    if (c->config.sample > 1 && c->seen++ % c->config.sample != 0)
+    {
+        return;
+    }
+
+    uint32_t caplen = len < snaplen ? (uint32_t)len : snaplen;
+    uint32_t padded = (caplen + 3) & ~3u;
+    uint32_t size = EPB_OVERHEAD + padded;
+    uint64_t ts = (uint64_t)(enif_monotonic_time(ERL_NIF_NSEC) + enif_time_offset(ERL_NIF_NSEC));
+
+    enif_mutex_lock(c->lock);
+    if (!c->running)
+    {
+        enif_mutex_unlock(c->lock);
+        return;
+    }
+    size_t fill = c->fill[c->active];
+    if (size > c->config.buffer - fill)
+    {
+        c->stats.drops++;
+        enif_mutex_unlock(c->lock);
+        return;
+    }
+    unsigned char *p = c->buf[c->active] + fill;
+    p = put32(p, PCAPNG_EPB);
+    p = put32(p, size);
+    p = put32(p, 0); // interface
+    p = put32(p, (uint32_t)(ts >> 32));
+    p = put32(p, (uint32_t)ts);
+    p = put32(p, caplen);
+    p = put32(p, (uint32_t)len);
+    packet_copy(&pkt, 0, p, caplen);
+    memset(p + caplen, 0, padded - caplen);
+    p += padded;
+    p = put16(p, PCAPNG_OPT_EPB_FLAGS);
+    p = put16(p, 4);
+    p = put32(p, (uint32_t)direction);
+    p = put32(p, PCAPNG_OPT_END);
+    put32(p, size);
+    c->fill[c->active] = fill + size;
+    if (fill == 0)
+    {
+        enif_cond_signal(c->cond);
+    }
+    enif_mutex_unlock(c->lock);
+}
@@ -0,0 +1,86 @@
+#ifndef TUNDRA_CAPTURE_H
+#define TUNDRA_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <erl_nif.h>
+
+// Packet capture.
+//
+// A capture taps a device's data path and writes copies of its packets to a
+// pcapng file, optionally filtered by a classic BPF program, sampled 1 in N
+// and truncated to a snap length. The data path only appends a record to an
+// in-memory buffer; a writer thread swaps buffers and writes them out, so a
+// packet is never held up by the file. A packet that does not fit in the
+// buffer is counted as dropped.
+//
+// When a size limit is set the capture rotates through a ring of files, in the
+// manner of logrotate: `path` is the newest, `path.1` the one before it, and
+// so on. Packets are raw IP (LINKTYPE_RAW) with nanosecond timestamps, marked
+// inbound (read from the device) or outbound (written to it).
+
+#define CAPTURE_INBOUND 1
+#define CAPTURE_OUTBOUND 2
+
+#define CAPTURE_MAX_INSNS 4096
+
+// A classic BPF instruction, as printed by `tcpdump -dd`
+struct capture_insn_t
+{
+    uint16_t code;
+    uint8_t jt;
+    uint8_t jf;
+    uint32_t k;
+};
+
+struct capture_config_t
+{
+    char *path; // owned by the capture once started
+    uint32_t snaplen;
+    uint32_t sample;     // capture 1 in `sample` matching packets
+    uint64_t file_size;  // bytes per file, 0 for no limit
+    unsigned files;      // files in the ring when file_size is set
+    size_t buffer;       // bytes per buffer (there are two)
+    struct capture_insn_t *filter; // NULL to capture everything; owned once started
+    unsigned nfilter;
+};
+
+struct capture_stats_t
+{
+    uint64_t packets; // captured
+    uint64_t bytes;   // captured, after truncation
+    uint64_t drops;   // matched and sampled, but the buffer was full
+};
+
+struct capture_t;
+
+// Check that a filter is well formed: known instructions, jumps and scratch
+// memory in range, and a return at the end. Jumps only go forward, so a valid
+// filter always terminates.
+bool capture_filter_valid(const struct capture_insn_t *insns, unsigned n);
+
+// Allocate a stopped capture. Returns NULL on failure.
+struct capture_t *capture_create(void);
+
+// Free a capture, stopping it first if needed.
+void capture_destroy(struct capture_t *c);
+
+// Open the capture file, write its headers and start the writer thread. Takes
+// ownership of the path and filter in `config`, even on failure. Returns 0 or
+// -errno; -EBUSY if the capture is already running.
+int capture_start(struct capture_t *c, struct capture_config_t *config);
+
+// Stop the writer thread once it has written everything buffered, and close
+// the file. Safe to call more than once, and from any thread. Returns false if
+// the capture was not running; either way `stats` (if not NULL) is set to the
+// counts of the last run.
+bool capture_stop(struct capture_t *c, struct capture_stats_t *stats);
+
+// Capture a packet that starts `offset` bytes into an iovec and is `len` bytes
+// long. Called by the device's owner only.
+void capture_packet(struct capture_t *c, const struct iovec *iov, int iovcnt, size_t offset, size_t len,
+                    int direction);
+
+#endif
@@ -0,0 +1,954 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "flow.h"
+
+#define HEADER_MAX 128     // bytes of a packet looked at
+#define EXT_HEADERS_MAX 8  // IPv6 extension headers skipped
+#define EVICT_CANDIDATES 8 // flows considered for eviction
+#define SCAN_SLOTS 4096    // slots expired per hold of the lock
+#define EXPORT_BATCH 64    // records taken per hold of the lock
+#define WAKE_MS 1000
+
+#define IPFIX_VERSION 10
+#define IPFIX_HEADER 16
+#define IPFIX_SET_HEADER 4
+#define IPFIX_TEMPLATE_SET 2
+#define IPFIX_MESSAGE_MAX 1400 // to stay within a typical path MTU
+#define TEMPLATE_V4 256
+#define TEMPLATE_V6 257
+
+struct flow_entry_t
+{
+    struct flow_key_t key;
+    uint32_t hash; // 0 for an empty slot
+    uint8_t tcp_flags;
+    uint64_t packets;
+    uint64_t bytes;
+    int64_t first;
+    int64_t last;
+};
+
+struct flow_slot_t
+{
+    uint32_t hash; // 0 for an empty slot
+    uint32_t pos;  // of the counter in the heap
+};
+
+_Static_assert(sizeof(struct flow_key_t) == 40, "flow keys are hashed as five words");
+
+// The flows of all devices with accounting on, serviced by the thread
+static ErlNifMutex *s_lock;
+static struct flow_t *s_flows;
+static ErlNifTid s_tid;
+static bool s_running;
+static bool s_stopping;
+static int s_wake[2] = {-1, -1};
+
+struct flow_t *flow_create(void)
+{
+    struct flow_t *f = enif_alloc(sizeof(*f));
+    if (f == NULL)
+    {
+        return NULL;
+    }
+    memset(f, 0, sizeof(*f));
+    if ((f->lock = enif_mutex_create("tundra_flow")) == NULL)
+    {
+        enif_free(f);
+        return NULL;
+    }
+    f->sock = -1;
+    return f;
+}
+
+void flow_destroy(struct flow_t *f)
+{
+    if (f != NULL)
+    {
+        flow_disable(f);
+        enif_mutex_destroy(f->lock);
+        enif_free(f);
+    }
+}
+
+static uint64_t hash_key(uint64_t seed, const struct flow_key_t *key)
+{
+    uint64_t w[5];
+    memcpy(w, key, sizeof(w));
+    uint64_t h = seed;
+    for (int i = 0; i < 5; ++i)
+    {
+        h ^= w[i];
+        h *= UINT64_C(0x9E3779B97F4A7C15);
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// Copy the first bytes of a packet out of an iovec
+static size_t gather(const struct iovec *iov, int iovcnt, size_t offset, size_t len, uint8_t *out)
+{
+    size_t want = len < HEADER_MAX ? len : HEADER_MAX;
+    size_t n = 0;
+    for (int i = 0; i < iovcnt && n < want; ++i)
+    {
+        if (offset >= iov[i].iov_len)
+        {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        size_t take = iov[i].iov_len - offset;
+        take = take < want - n ? take : want - n;
+        memcpy(out + n, (const uint8_t *)iov[i].iov_base + offset, take);
+        n += take;
+        offset = 0;
+    }
+    return n;
+}
+
+// Fill in a key from the first `n` bytes of a packet. Returns false for
+// anything but IPv4 and IPv6. Fragments after the first have no ports.
+static bool parse(const uint8_t *p, size_t n, struct flow_key_t *key, uint8_t *flags)
+{
+    memset(key, 0, sizeof(*key));
+    *flags = 0;
+    size_t off;
+    bool first = true;
+    if (n >= 20 && p[0] >> 4 == 4)
+    {
+        off = (size_t)(p[0] & 0xf) * 4;
+        if (off < 20)
+        {
+            return false;
+        }
+        key->version = 4;
+        key->protocol = p[9];
+        memcpy(key->src, p + 12, 4);
+        memcpy(key->dst, p + 16, 4);
+        first = ((p[6] & 0x1f) << 8 | p[7]) == 0;
+    }
+    else if (n >= 40 && p[0] >> 4 == 6)
+    {
+        key->version = 6;
+        memcpy(key->src, p + 8, 16);
+        memcpy(key->dst, p + 24, 16);
+        uint8_t next = p[6];
+        off = 40;
+        for (int i = 0; i < EXT_HEADERS_MAX && off + 8 <= n; ++i)
+        {
+            if (next == IPPROTO_HOPOPTS || next == IPPROTO_ROUTING || next == IPPROTO_DSTOPTS)
+            {
+                next = p[off];
+                off += ((size_t)p[off + 1] + 1) * 8;
+            }
+            else if (next == IPPROTO_FRAGMENT)
+            {
+                next = p[off];
+                first = ((p[off + 2] << 8 | p[off + 3]) & 0xfff8) == 0;
+                off += 8;
+            }
+            else if (next == IPPROTO_AH)
+            {
+                next = p[off];
+                off += ((size_t)p[off + 1] + 2) * 4;
+            }
+            else
+            {
+                break;
+            }
+        }
+        key->protocol = next;
+    }
+    else
+    {
+        return false;
+    }
+
+    if (!first)
+    {
+        return true;
+    }
+    switch (key->protocol)
+    {
+    case IPPROTO_TCP:
+        if (off + 14 <= n)
+        {
+            *flags = p[off + 13];
+        }
+        // fall through
+    case IPPROTO_UDP:
+    case 132: // SCTP
+    case 136: // UDP-Lite
+        if (off + 4 <= n)
+        {
+            key->sport = (uint16_t)(p[off] << 8 | p[off + 1]);
+            key->dport = (uint16_t)(p[off + 2] << 8 | p[off + 3]);
+        }
+        break;
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+        if (off + 2 <= n)
+        {
+            key->dport = (uint16_t)(p[off] << 8 | p[off + 1]);
+        }
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+// Called with the lock held.
+static void enqueue(struct flow_t *f, const struct flow_entry_t *e, uint8_t reason)
+{
+    if (f->held == f->config.queue)
+    {
+        f->stats.dropped++;
+        return;
+    }
+    struct flow_record_t *r = &f->queue[(f->head + f->held) % f->config.queue];
+    r->key = e->key;
+    r->packets = e->packets;
+    r->bytes = e->bytes;
+    r->first = e->first;
+    r->last = e->last;
+    r->tcp_flags = e->tcp_flags;
+    r->reason = reason;
+    f->held++;
+}
+
+// Remove the flow in slot i, moving later flows of the same run back so that
+// every flow stays reachable from its home slot. Called with the lock held.
+static void remove_at(struct flow_t *f, uint32_t i)
+{
+    uint32_t j = i;
+    for (;;)
+    {
+        j = (j + 1) & f->mask;
+        struct flow_entry_t *e = &f->table[j];
+        if (e->hash == 0)
+        {
+            break;
+        }
+        uint32_t home = e->hash & f->mask;
+        if (((j - home) & f->mask) >= ((j - i) & f->mask))
+        {
+            f->table[i] = *e;
+            i = j;
+        }
+    }
+    f->table[i].hash = 0;
+    f->count--;
+}
+
+// Expire the least recently seen of the flows nearest `home` to make room.
+// Called with the lock held, when the table is not empty.
+static void evict(struct flow_t *f, uint32_t home)
+{
+    uint32_t victim = 0;
+    unsigned seen = 0;
+    for (uint32_t i = home; seen < EVICT_CANDIDATES && seen < f->count; i = (i + 1) & f->mask)
+    {
+        if (f->table[i].hash != 0 && (seen++ == 0 || f->table[i].last < f->table[victim].last))
+        {
+            victim = i;
+        }
+    }
+    enqueue(f, &f->table[victim], FLOW_EVICTED);
+    remove_at(f, victim);
+    f->stats.evicted++;
+}
+
+// Called with the lock held.
+static void count_flow(struct flow_t *f, const struct flow_key_t *key, uint32_t hash, size_t len, uint8_t flags,
+                       int64_t now)
+{
+    uint32_t i = hash & f->mask;
+    for (; f->table[i].hash != 0; i = (i + 1) & f->mask)
+    {
+        struct flow_entry_t *e = &f->table[i];
+        if (e->hash == hash && memcmp(&e->key, key, sizeof(*key)) == 0)
+        {
+            e->packets++;
+            e->bytes += len;
+            e->last = now;
+            e->tcp_flags |= flags;
+            return;
+        }
+    }
+    if (f->count >= f->limit)
+    {
+        evict(f, hash & f->mask);
+        // Flows may have moved into the empty slot
+        for (i = hash & f->mask; f->table[i].hash != 0; i = (i + 1) & f->mask)
+        {
+        }
+    }
+    f->table[i] = (struct flow_entry_t){
+        .key = *key, .hash = hash, .tcp_flags = flags, .packets = 1, .bytes = len, .first = now, .last = now};
+    f->count++;
+    f->stats.created++;
+}
+
+static void top_swap(struct flow_t *f, uint32_t a, uint32_t b)
+{
+    struct flow_top_t t = f->top[a];
+    f->top[a] = f->top[b];
+    f->top[b] = t;
+    uint32_t s = f->top_slot[a];
+    f->top_slot[a] = f->top_slot[b];
+    f->top_slot[b] = s;
+    f->top_index[f->top_slot[a]].pos = a;
+    f->top_index[f->top_slot[b]].pos = b;
+}
+
+static void top_sift_down(struct flow_t *f, uint32_t i)
+{
+    for (;;)
+    {
+        uint32_t least = i;
+        uint32_t l = 2 * i + 1;
+        uint32_t r = l + 1;
+        if (l < f->ntop && f->top[l].bytes < f->top[least].bytes)
+        {
+            least = l;
+        }
+        if (r < f->ntop && f->top[r].bytes < f->top[least].bytes)
+        {
+            least = r;
+        }
+        if (least == i)
+        {
+            return;
+        }
+        top_swap(f, i, least);
+        i = least;
+    }
+}
+
+static void top_sift_up(struct flow_t *f, uint32_t i)
+{
+    while (i > 0 && f->top[(i - 1) / 2].bytes > f->top[i].bytes)
+    {
+        top_swap(f, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void top_index_insert(struct flow_t *f, uint32_t hash, uint32_t pos)
+{
+    uint32_t k = hash & f->top_mask;
+    while (f->top_index[k].hash != 0)
+    {
+        k = (k + 1) & f->top_mask;
+    }
+    f->top_index[k] = (struct flow_slot_t){hash, pos};
+    f->top_slot[pos] = k;
+}
+
+// As remove_at, for the index
+static void top_index_remove(struct flow_t *f, uint32_t i)
+{
+    uint32_t j = i;
+    for (;;)
+    {
+        j = (j + 1) & f->top_mask;
+        struct flow_slot_t *s = &f->top_index[j];
+        if (s->hash == 0)
+        {
+            break;
+        }
+        uint32_t home = s->hash & f->top_mask;
+        if (((j - home) & f->top_mask) >= ((j - i) & f->top_mask))
+        {
+            f->top_index[i] = *s;
+            f->top_slot[s->pos] = i;
+            i = j;
+        }
+    }
+    f->top_index[i].hash = 0;
+}
+
+// Space-saving: a flow with a counter adds to it, and a flow without one
+// takes the smallest, inheriting its count as the error. Called with the lock
+// held.
+static void count_top(struct flow_t *f, const struct flow_key_t *key, uint32_t hash, size_t len)
+{
+    for (uint32_t k = hash & f->top_mask; f->top_index[k].hash != 0; k = (k + 1) & f->top_mask)
+    {
+        struct flow_top_t *t = &f->top[f->top_index[k].pos];
+        if (f->top_index[k].hash == hash && memcmp(&t->key, key, sizeof(*key)) == 0)
+        {
+            t->packets++;
+            t->bytes += len;
+            top_sift_down(f, f->top_index[k].pos);
+            return;
+        }
+    }
+    if (f->ntop < f->config.top)
+    {
+        uint32_t pos = f->ntop++;
+        f->top[pos] = (struct flow_top_t){.key = *key, .packets = 1, .bytes = len, .error = 0};
+        top_index_insert(f, hash, pos);
+        top_sift_up(f, pos);
+        return;
+    }
+    uint64_t least = f->top[0].bytes;
+    top_index_remove(f, f->top_slot[0]);
+    f->top[0] = (struct flow_top_t){.key = *key, .packets = 1, .bytes = least + len, .error = least};
+    top_index_insert(f, hash, 0);
+    top_sift_down(f, 0);
+}
+
+void flow_packet(struct flow_t *f, const struct iovec *iov, int iovcnt, size_t offset, size_t len, int direction,
+                 int64_t now)
+{
+    uint8_t head[HEADER_MAX];
+    size_t n = gather(iov, iovcnt, offset, len, head);
+    struct flow_key_t key;
+    uint8_t flags;
+    if (!parse(head, n, &key, &flags))
+    {
+        return;
+    }
+    key.direction = (uint8_t)direction;
+
+    enif_mutex_lock(f->lock);
+    if (f->enabled)
+    {
+        // The top bit keeps the hash from being 0, and is above any mask
+        uint32_t hash = (uint32_t)hash_key(f->seed, &key) | UINT32_C(0x80000000);
+        f->stats.packets++;
+        count_flow(f, &key, hash, len, flags, now);
+        if (f->config.top > 0)
+        {
+            count_top(f, &key, hash, len);
+        }
+    }
+    enif_mutex_unlock(f->lock);
+}
+
+static inline uint8_t *put8(uint8_t *p, uint8_t v)
+{
+    *p = v;
+    return p + 1;
+}
+
+static inline uint8_t *put16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+    return p + 2;
+}
+
+static inline uint8_t *put32(uint8_t *p, uint32_t v)
+{
+    return put16(put16(p, (uint16_t)(v >> 16)), (uint16_t)v);
+}
+
+static inline uint8_t *put64(uint8_t *p, uint64_t v)
+{
+    return put32(put32(p, (uint32_t)(v >> 32)), (uint32_t)v);
+}
+
+struct ipfix_field_t
+{
+    uint16_t id;
+    uint16_t length;
+};
+
+// The information elements of a record, after the addresses. ICMP type and
+// code go in the destination port.
+static const struct ipfix_field_t s_fields[] = {
+    {7, 2},   // sourceTransportPort
+    {11, 2},  // destinationTransportPort
+    {4, 1},   // protocolIdentifier
+    {6, 1},   // tcpControlBits, in reduced-size encoding
+    {61, 1},  // flowDirection
+    {136, 1}, // flowEndReason
+    {1, 8},   // octetDeltaCount
+    {2, 8},   // packetDeltaCount
+    {152, 8}, // flowStartMilliseconds
+    {153, 8}, // flowEndMilliseconds
+};
+
+#define NFIELDS (sizeof(s_fields) / sizeof(s_fields[0]) + 2)
+#define FIELDS_SIZE 40
+
+static size_t record_size(int version)
+{
+    return (version == 4 ? 8 : 32) + FIELDS_SIZE;
+}
+
+static uint8_t *put_header(uint8_t *p, size_t length, int64_t now_ms, uint32_t sequence, uint32_t domain)
+{
+    p = put16(p, IPFIX_VERSION);
+    p = put16(p, (uint16_t)length);
+    p = put32(p, (uint32_t)(now_ms / 1000));
+    p = put32(p, sequence);
+    return put32(p, domain);
+}
+
+static uint8_t *put_template(uint8_t *p, uint16_t id, int version)
+{
+    p = put16(p, id);
+    p = put16(p, NFIELDS);
+    p = put16(p, version == 4 ? 8 : 27);  // sourceIPv4Address, sourceIPv6Address
+    p = put16(p, version == 4 ? 4 : 16);
+    p = put16(p, version == 4 ? 12 : 28); // destinationIPv4Address, destinationIPv6Address
+    p = put16(p, version == 4 ? 4 : 16);
+    for (size_t i = 0; i < sizeof(s_fields) / sizeof(s_fields[0]); ++i)
+    {
+        p = put16(p, s_fields[i].id);
+        p = put16(p, s_fields[i].length);
+    }
+    return p;
+}
+
+static uint8_t *put_record(uint8_t *p, const struct flow_record_t *r, int64_t offset_ms)
+{
+    size_t alen = r->key.version == 4 ? 4 : 16;
+    memcpy(p, r->key.src, alen);
+    memcpy(p + alen, r->key.dst, alen);
+    p += 2 * alen;
+    p = put16(p, r->key.sport);
+    p = put16(p, r->key.dport);
+    p = put8(p, r->key.protocol);
+    p = put8(p, r->tcp_flags);
+    p = put8(p, r->key.direction);
+    p = put8(p, r->reason);
+    p = put64(p, r->bytes);
+    p = put64(p, r->packets);
+    p = put64(p, (uint64_t)(r->first / 1000000 + offset_ms));
+    return put64(p, (uint64_t)(r->last / 1000000 + offset_ms));
+}
+
+static void send_message(struct flow_t *f, const uint8_t *msg, size_t len)
+{
+    if (send(f->sock, msg, len, 0) != (ssize_t)len)
+    {
+        f->stats.export_errors++;
+    }
+}
+
+// Send the records to the collector, preceded by the templates when they are
+// due. Called with the lock held, or by the thread while the flows are
+// registered, which keeps them from being disabled.
+static void export_records(struct flow_t *f, const struct flow_record_t *records, unsigned n, int64_t now)
+{
+    uint8_t msg[IPFIX_MESSAGE_MAX];
+    int64_t offset_ms = enif_time_offset(ERL_NIF_NSEC) / 1000000;
+    int64_t now_ms = now / 1000000 + offset_ms;
+
+    if (f->templates_at == 0 || now - f->templates_at >= (int64_t)FLOW_TEMPLATE_REFRESH * 1000000000)
+    {
+        uint8_t *p = msg + IPFIX_HEADER + IPFIX_SET_HEADER;
+        p = put_template(p, TEMPLATE_V4, 4);
+        p = put_template(p, TEMPLATE_V6, 6);
+        size_t len = (size_t)(p - msg);
+        put16(msg + IPFIX_HEADER, IPFIX_TEMPLATE_SET);
+        put16(msg + IPFIX_HEADER + 2, (uint16_t)(len - IPFIX_HEADER));
+        put_header(msg, len, now_ms, f->sequence, f->config.domain);
+        send_message(f, msg, len);
+        f->templates_at = now;
+    }
+
+    unsigned i = 0;
+    while (i < n)
+    {
+        // Fill a message with data sets, one per run of records of a version
+        uint8_t *p = msg + IPFIX_HEADER;
+        unsigned start = i;
+        while (i < n)
+        {
+            int version = records[i].key.version;
+            if ((size_t)(p - msg) + IPFIX_SET_HEADER + record_size(version) > sizeof(msg))
+            {
+                break;
+            }
+            uint8_t *set = p;
+            p += IPFIX_SET_HEADER;
+            while (i < n && records[i].key.version == version &&
+                   (size_t)(p - msg) + record_size(version) <= sizeof(msg))
+            {
+                p = put_record(p, &records[i++], offset_ms);
+            }
+            put16(set, version == 4 ? TEMPLATE_V4 : TEMPLATE_V6);
+            put16(set + 2, (uint16_t)(p - set));
+        }
+        size_t len = (size_t)(p - msg);
+        put_header(msg, len, now_ms, f->sequence, f->config.domain);
+        f->sequence += i - start;
+        if (send(f->sock, msg, len, 0) == (ssize_t)len)
+        {
+            f->stats.exported += i - start;
+        }
+        else
+        {
+            f->stats.export_errors++;
+        }
+    }
+}
+
+// Called with the lock held.
+static unsigned take(struct flow_t *f, struct flow_record_t *records, unsigned max)
+{
+    unsigned n = f->held < max ? f->held : max;
+    for (unsigned i = 0; i < n; ++i)
+    {
+        records[i] = f->queue[(f->head + i) % f->config.queue];
+    }
+    f->head = (f->head + n) % f->config.queue;
+    f->held -= n;
+    return n;
+}
+
+int flow_take(struct flow_t *f, struct flow_record_t *records, unsigned max)
+{
+    enif_mutex_lock(f->lock);
+    int n = f->enabled ? (int)take(f, records, max) : -EBADF;
+    enif_mutex_unlock(f->lock);
+    return n;
+}
+
+// Expire the flows that have timed out, a few thousand slots at a time so
+// that the data path is not held up for long. Called by the thread.
+static void expire(struct flow_t *f, int64_t now)
+{
+    uint32_t i = 0;
+    for (;;)
+    {
+        enif_mutex_lock(f->lock);
+        if (!f->enabled || i > f->mask)
+        {
+            enif_mutex_unlock(f->lock);
+            return;
+        }
+        uint32_t end = f->mask - i < SCAN_SLOTS ? f->mask + 1 : i + SCAN_SLOTS;
+        while (i < end)
+        {
+            struct flow_entry_t *e = &f->table[i];
+            bool idle = now - e->last >= f->config.idle_timeout;
+            if (e->hash != 0 && (idle || now - e->first >= f->config.active_timeout))
+            {
+                enqueue(f, e, idle ? FLOW_IDLE : FLOW_ACTIVE);
+                f->stats.expired++;
+                // A later flow may have moved into the slot
+                remove_at(f, i);
+            }
+            else
+            {
+                i++;
+            }
+        }
+        enif_mutex_unlock(f->lock);
+    }
+}
+
+// Send what is queued to the collector. Called by the thread.
+static void export_queued(struct flow_t *f, int64_t now)
+{
+    struct flow_record_t records[EXPORT_BATCH];
+    for (;;)
+    {
+        enif_mutex_lock(f->lock);
+        unsigned n = f->enabled && f->sock != -1 ? take(f, records, EXPORT_BATCH) : 0;
+        if (n > 0)
+        {
+            export_records(f, records, n, now);
+        }
+        enif_mutex_unlock(f->lock);
+        if (n == 0)
+        {
+            return;
+        }
+    }
+}
+
+static void *flow_thread(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        enif_mutex_lock(s_lock);
+        if (s_stopping)
+        {
+            enif_mutex_unlock(s_lock);
+            break;
+        }
+        int64_t now = enif_monotonic_time(ERL_NIF_NSEC);
+        for (struct flow_t *f = s_flows; f != NULL; f = f->next)
+        {
+            expire(f, now);
+            export_queued(f, now);
+        }
+        bool idle = s_flows == NULL;
+        enif_mutex_unlock(s_lock);
+
+        struct pollfd pfd = {.fd = s_wake[0], .events = POLLIN};
+        if (poll(&pfd, 1, idle ? -1 : WAKE_MS) > 0)
+        {
+            char buf[64];
+            ssize_t n = read(s_wake[0], buf, sizeof(buf));
+            (void)n;
+        }
+    }
+    return NULL;
+}
+
+int flow_init(void)
+{
+    s_lock = enif_mutex_create("tundra_flow_thread");
+    return s_lock ? 0 : -1;
+}
+
+// Called with the lock held.
+static int start_thread(void)
+{
+    if (pipe(s_wake) == -1)
+    {
+        return -errno;
+    }
+    if (enif_thread_create("tundra_flow", &s_tid, flow_thread, NULL, NULL) != 0)
+    {
+        close(s_wake[0]);
+        close(s_wake[1]);
+        s_wake[0] = s_wake[1] = -1;
+        return -EAGAIN;
+    }
+    s_running = true;
+    return 0;
+}
+
+static uint32_t pow2_at_least(uint64_t n)
+{
+    uint32_t size = 16;
+    while (size < n)
+    {
+        size <<= 1;
+    }
+    return size;
+}
+
+static void free_tables(struct flow_t *f)
+{
+    enif_free(f->table);
+    enif_free(f->queue);
+    enif_free(f->top);
+    enif_free(f->top_slot);
+    enif_free(f->top_index);
+    f->table = NULL;
+    f->queue = NULL;
+    f->top = NULL;
+    f->top_slot = NULL;
+    f->top_index = NULL;
+}
+
+static int open_socket(const struct sockaddr_storage *to)
+{
+    int s = socket(to->ss_family, SOCK_DGRAM, 0);
+    if (s == -1)
+    {
+        return -errno;
+    }
+    socklen_t len = to->ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+    if (fcntl(s, F_SETFD, FD_CLOEXEC) == -1 || fcntl(s, F_SETFL, O_NONBLOCK) == -1 ||
+        connect(s, (const struct sockaddr *)to, len) == -1)
+    {
+        int err = errno;
+        close(s);
+        return -err;
+    }
+    return s;
+}
+
+int flow_enable(struct flow_t *f, const struct flow_config_t *config)
+{
+    enif_mutex_lock(f->lock);
+    bool busy = f->enabled;
+    enif_mutex_unlock(f->lock);
+    if (busy)
+    {
+        return -EBUSY;
+    }
+
+    // Enabling and disabling are left to the owner, so the state is not
+    // touched by anyone else until it is enabled
+    uint32_t slots = pow2_at_least((uint64_t)config->max_flows * 4 / 3 + 1);
+    uint32_t index = config->top > 0 ? pow2_at_least((uint64_t)config->top * 2) : 0;
+    f->table = enif_alloc(slots * sizeof(*f->table));
+    f->queue = enif_alloc(config->queue * sizeof(*f->queue));
+    if (config->top > 0)
+    {
+        f->top = enif_alloc(config->top * sizeof(*f->top));
+        f->top_slot = enif_alloc(config->top * sizeof(*f->top_slot));
+        f->top_index = enif_alloc(index * sizeof(*f->top_index));
+    }
+    if (f->table == NULL || f->queue == NULL || (config->top > 0 && (f->top == NULL || f->top_slot == NULL ||
+                                                                      f->top_index == NULL)))
+    {
+        free_tables(f);
+        return -ENOMEM;
+    }
+    memset(f->table, 0, slots * sizeof(*f->table));
+    if (index > 0)
+    {
+        memset(f->top_index, 0, index * sizeof(*f->top_index));
+    }
+    int sock = -1;
+    if (config->collector.ss_family != AF_UNSPEC && (sock = open_socket(&config->collector)) < 0)
+    {
+        free_tables(f);
+        return sock;
+    }
+
+    enif_mutex_lock(f->lock);
+    f->config = *config;
+    // Seeded so that the flows that collide cannot be chosen by a sender
+    f->seed = (uint64_t)enif_monotonic_time(ERL_NIF_NSEC) * UINT64_C(0x9E3779B97F4A7C15) ^ (uint64_t)(uintptr_t)f;
+    f->mask = slots - 1;
+    f->count = 0;
+    f->limit = config->max_flows;
+    f->head = f->held = 0;
+    f->ntop = 0;
+    f->top_mask = index > 0 ? index - 1 : 0;
+    f->sock = sock;
+    f->sequence = 0;
+    f->templates_at = 0;
+    memset(&f->stats, 0, sizeof(f->stats));
+    f->stats.memory = slots * sizeof(*f->table) + config->queue * sizeof(*f->queue) +
+                      config->top * (sizeof(*f->top) + sizeof(*f->top_slot)) + index * sizeof(*f->top_index);
+    f->enabled = true;
+    enif_mutex_unlock(f->lock);
+
+    enif_mutex_lock(s_lock);
+    int result = s_running ? 0 : start_thread();
+    if (result == 0)
+    {
+        f->next = s_flows;
+        s_flows = f;
+    }
+    enif_mutex_unlock(s_lock);
+    if (result < 0)
+    {
+        flow_disable(f);
+        return result;
+    }
+    ssize_t n = write(s_wake[1], "x", 1);
+    (void)n;
+    return 0;
+}
+
+void flow_disable(struct flow_t *f)
+{
+    enif_mutex_lock(s_lock);
+    for (struct flow_t **link = &s_flows; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == f)
+        {
+            *link = f->next;
+            break;
+        }
+    }
+    enif_mutex_unlock(s_lock);
+
+    enif_mutex_lock(f->lock);
+    if (!f->enabled)
+    {
+        enif_mutex_unlock(f->lock);
+        return;
+    }
+    f->enabled = false;
+    if (f->sock != -1)
+    {
+        int64_t now = enif_monotonic_time(ERL_NIF_NSEC);
+        struct flow_record_t records[EXPORT_BATCH];
+        unsigned n;
+        for (uint32_t i = 0; i <= f->mask; ++i)
+        {
+            if (f->table[i].hash == 0)
+            {
+                continue;
+            }
+            if (f->held == f->config.queue)
+            {
+                n = take(f, records, EXPORT_BATCH);
+                export_records(f, records, n, now);
+            }
+            enqueue(f, &f->table[i], FLOW_FORCED);
+        }
+        while ((n = take(f, records, EXPORT_BATCH)) > 0)
+        {
+            export_records(f, records, n, now);
+        }
+        close(f->sock);
+        f->sock = -1;
+    }
+    free_tables(f);
+    enif_mutex_unlock(f->lock);
+}
+
+static int compare_top(const void *a, const void *b)
+{
+    uint64_t x = ((const struct flow_top_t *)a)->bytes;
+    uint64_t y = ((const struct flow_top_t *)b)->bytes;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int flow_get_top(struct flow_t *f, struct flow_top_t *top, bool reset)
+{
+    enif_mutex_lock(f->lock);
+    if (!f->enabled)
+    {
+        enif_mutex_unlock(f->lock);
+        return -EBADF;
+    }
+    unsigned n = f->ntop;
+    memcpy(top, f->top, n * sizeof(*top));
+    if (reset && f->config.top > 0)
+    {
+        f->ntop = 0;
+        memset(f->top_index, 0, (f->top_mask + 1) * sizeof(*f->top_index));
+    }
+    enif_mutex_unlock(f->lock);
+    qsort(top, n, sizeof(*top), compare_top);
+    return (int)n;
+}
+
+int flow_get_stats(struct flow_t *f, struct flow_stats_t *stats)
+{
+    enif_mutex_lock(f->lock);
+    if (!f->enabled)
+    {
+        enif_mutex_unlock(f->lock);
+        return -EBADF;
+    }
+    *stats = f->stats;
+    stats->flows = f->count;
+    stats->queued = f->held;
+    enif_mutex_unlock(f->lock);
+    return 0;
+}
+
+void flow_shutdown(void)
+{
+    if (s_running)
+    {
+        enif_mutex_lock(s_lock);
+        s_stopping = true;
+        enif_mutex_unlock(s_lock);
+        ssize_t n = write(s_wake[1], "x", 1);
+        (void)n;
+        enif_thread_join(s_tid, NULL);
+        close(s_wake[0]);
+        close(s_wake[1]);
+        s_wake[0] = s_wake[1] = -1;
+        s_running = false;
+        s_stopping = false;
+    }
+}
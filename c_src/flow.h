@@ -0,0 +1,178 @@
+#ifndef TUNDRA_FLOW_H
+#define TUNDRA_FLOW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <erl_nif.h>
+
+// Flow accounting.
+//
+// While accounting is on, every packet a device reads or writes through the
+// NIF is counted against its flow: the direction, IP version, addresses,
+// protocol and ports (for ICMP, the type and code in the destination port, as
+// IPFIX exporters commonly do). Flows live in a fixed-size open addressing
+// table, so memory is bounded by `max_flows`. A flow is expired once it has
+// been idle for the idle timeout or active for the active timeout, and when
+// the table is full the least recently seen of the new flow's neighbours is
+// expired early to make room.
+//
+// Expired flows are queued as records, up to `queue` of them; a record that
+// does not fit is counted as dropped. With a collector, one native thread for
+// all devices expires flows once a second and sends the queued records to it
+// as IPFIX (RFC 7011) over UDP, repeating the templates every
+// FLOW_TEMPLATE_REFRESH seconds. Without one, the thread only expires flows
+// and the records wait to be taken with flow_take.
+//
+// Alongside the table, the heaviest flows by bytes are tracked with a
+// space-saving summary of `top` counters (Metwally et al.), which never
+// misses a flow that has had more than 1/top of the bytes since it was last
+// reset, however many flows there are. A counter overestimates its flow by at
+// most its `error`.
+//
+// A device's flow state is allocated when accounting is first enabled and
+// freed with the device. Everything is protected by `lock`.
+
+#define FLOW_MAX_FLOWS (1 << 20)
+#define FLOW_MAX_TOP 1024
+#define FLOW_MAX_QUEUE (1 << 20)
+#define FLOW_TEMPLATE_REFRESH 60
+
+#define FLOW_INBOUND 0  // read from the device (IPFIX ingress)
+#define FLOW_OUTBOUND 1 // written to it (egress)
+
+// flowEndReason values
+enum flow_reason_t
+{
+    FLOW_IDLE = 1,
+    FLOW_ACTIVE = 2,
+    FLOW_FORCED = 4,  // accounting was disabled
+    FLOW_EVICTED = 5, // lack of resources
+};
+
+struct flow_config_t
+{
+    unsigned max_flows;
+    unsigned top;   // counters in the summary, 0 for none
+    unsigned queue; // records held for export
+    int64_t active_timeout; // nanoseconds
+    int64_t idle_timeout;   // nanoseconds
+    struct sockaddr_storage collector; // family AF_UNSPEC for none
+    uint32_t domain;                   // IPFIX observation domain
+};
+
+struct flow_key_t
+{
+    uint8_t src[16]; // IPv4 addresses in the first 4 bytes
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t protocol;
+    uint8_t version; // 4 or 6
+    uint8_t direction;
+    uint8_t pad;
+};
+
+struct flow_record_t
+{
+    struct flow_key_t key;
+    uint64_t packets;
+    uint64_t bytes;
+    int64_t first; // monotonic nanoseconds
+    int64_t last;
+    uint8_t tcp_flags; // of all the flow's packets
+    uint8_t reason;
+};
+
+struct flow_top_t
+{
+    struct flow_key_t key;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t error; // bytes counted before the flow took the counter
+};
+
+struct flow_stats_t
+{
+    uint64_t packets;  // packets counted
+    uint64_t flows;    // flows in the table
+    uint64_t created;
+    uint64_t expired;  // on either timeout
+    uint64_t evicted;  // to make room
+    uint64_t queued;   // records waiting
+    uint64_t dropped;  // records the queue had no room for
+    uint64_t exported; // records sent to the collector
+    uint64_t export_errors; // messages that could not be sent
+    uint64_t memory;   // bytes allocated
+};
+
+struct flow_entry_t;
+struct flow_slot_t;
+
+struct flow_t
+{
+    ErlNifMutex *lock;
+    bool enabled;
+    struct flow_config_t config;
+    uint64_t seed; // of the hash
+    struct flow_entry_t *table;
+    uint32_t mask; // table size - 1
+    uint32_t count;
+    uint32_t limit; // flows before the table counts as full
+    struct flow_record_t *queue;
+    uint32_t head; // next record to take
+    uint32_t held;
+    struct flow_top_t *top;        // min-heap on bytes
+    uint32_t *top_slot;            // each counter's slot in the index
+    struct flow_slot_t *top_index; // open addressing, by flow
+    uint32_t ntop;
+    uint32_t top_mask; // index size - 1
+    int sock;             // connected to the collector, or -1
+    uint32_t sequence;    // IPFIX data records sent
+    int64_t templates_at; // when the templates were last sent, 0 for never
+    struct flow_stats_t stats;
+    struct flow_t *next; // registered with the thread
+};
+
+// Create the thread's lock. Called from the NIF load callback.
+int flow_init(void);
+
+// Allocate a disabled flow state. Returns NULL on failure.
+struct flow_t *flow_create(void);
+
+// Free a flow state, disabling it first if needed.
+void flow_destroy(struct flow_t *f);
+
+// Start accounting with an empty table and summary, and reset the counters.
+// Returns 0 or -errno; -EBUSY if accounting is already on.
+int flow_enable(struct flow_t *f, const struct flow_config_t *config);
+
+// Stop accounting. Flows still in the table are expired and, with a
+// collector, sent to it along with any queued records; without one they are
+// discarded. Does nothing if already disabled.
+void flow_disable(struct flow_t *f);
+
+// Count a packet that starts `offset` bytes into an iovec and is `len` bytes
+// long, at monotonic time `now`. Packets that are not IPv4 or IPv6 are
+// ignored. Called by the device's owner only.
+void flow_packet(struct flow_t *f, const struct iovec *iov, int iovcnt, size_t offset, size_t len, int direction,
+                 int64_t now);
+
+// Take up to `max` of the oldest queued records. Returns the number taken, or
+// -EBADF if accounting is off.
+int flow_take(struct flow_t *f, struct flow_record_t *records, unsigned max);
+
+// Copy the summary's counters, heaviest first, to `top`, which has room for
+// FLOW_MAX_TOP, and clear it if `reset`. Returns the number copied, or -EBADF
+// if accounting is off.
+int flow_get_top(struct flow_t *f, struct flow_top_t *top, bool reset);
+
+// Read the counters. Returns 0, or -EBADF if accounting is off.
+int flow_get_stats(struct flow_t *f, struct flow_stats_t *stats);
+
+// Stop the thread. Called on unload.
+void flow_shutdown(void);
+
+#endif
@@ -0,0 +1,557 @@
+#ifdef __linux__
+#define _GNU_SOURCE // struct ucred, accept4, MSG_CMSG_CLOEXEC
+#endif
+
+#include <errno.h>
+#include <erl_nif.h>
+#include "handoff.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define HANDOFF_MAGIC 0x484e4454 // "TDNH"
+#define HANDOFF_VERSION 1
+#define HANDOFF_BATCH 64  // descriptors per message, well below SCM_MAX_FD
+#define HANDOFF_MSG 65536 // bytes per message
+
+// A message is a header, `count` entries and then their metadata, back to
+// back, with the entries' descriptors attached in the same order.
+struct handoff_hdr_t
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t last; // no more messages follow
+};
+
+struct handoff_entry_t
+{
+    char name[IF_NAMESIZE];
+    uint32_t flags;
+    uint32_t meta_len;
+};
+
+struct handoff_ack_t
+{
+    uint32_t magic;
+    uint32_t count; // devices received
+};
+
+union handoff_cmsg_t
+{
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+};
+
+// Wait for `events` on `fd` until `deadline` (in monotonic milliseconds, or
+// forever if negative). Returns 0 or -errno.
+static int wait_for(int fd, short events, int64_t deadline)
+{
+    for (;;)
+    {
+        int64_t left = -1;
+        if (deadline >= 0)
+        {
+            left = deadline - enif_monotonic_time(ERL_NIF_MSEC);
+            left = left < 0 ? 0 : left > INT32_MAX ? INT32_MAX : left;
+        }
+        struct pollfd pfd = {.fd = fd, .events = events};
+        int ready = poll(&pfd, 1, (int)left);
+        if (ready > 0)
+        {
+            return 0;
+        }
+        if (ready == 0)
+        {
+            return -ETIMEDOUT;
+        }
+        if (errno != EINTR)
+        {
+            return -errno;
+        }
+    }
+}
+
+// Only hand devices to, or take them from, the same user
+static int check_peer(int sock)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+    {
+        return -errno;
+    }
+    return cred.uid == geteuid() ? 0 : -EPERM;
+}
+
+static int make_addr(const char *path, struct sockaddr_un *addr)
+{
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr->sun_path))
+    {
+        return -ENAMETOOLONG;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+    return 0;
+}
+
+static size_t entry_size(const struct handoff_dev_t *dev)
+{
+    return sizeof(struct handoff_entry_t) + dev->meta_len;
+}
+
+// Send the devices from `first` that fit in one message. Returns the number
+// sent or -errno.
+static int send_batch(int sock, const struct handoff_dev_t *devs, size_t first, size_t n, unsigned char *buf,
+                      int64_t deadline)
+{
+    size_t count = 0, size = sizeof(struct handoff_hdr_t);
+    while (first + count < n && count < HANDOFF_BATCH && size + entry_size(&devs[first + count]) <= HANDOFF_MSG)
+    {
+        size += entry_size(&devs[first + count++]);
+    }
+
+    struct handoff_hdr_t hdr = {.magic = HANDOFF_MAGIC,
+                                .version = HANDOFF_VERSION,
+                                .count = (uint16_t)count,
+                                .last = first + count == n};
+    memcpy(buf, &hdr, sizeof(hdr));
+    unsigned char *entries = buf + sizeof(hdr);
+    unsigned char *meta = entries + count * sizeof(struct handoff_entry_t);
+    union handoff_cmsg_t control;
+    int fds[HANDOFF_BATCH];
+    for (size_t i = 0; i < count; ++i)
+    {
+        const struct handoff_dev_t *dev = &devs[first + i];
+        struct handoff_entry_t entry = {.flags = dev->flags, .meta_len = (uint32_t)dev->meta_len};
+        memcpy(entry.name, dev->name, sizeof(entry.name));
+        memcpy(entries + i * sizeof(entry), &entry, sizeof(entry));
+        if (dev->meta_len > 0)
+        {
+            memcpy(meta, dev->meta, dev->meta_len);
+            meta += dev->meta_len;
+        }
+        fds[i] = dev->fd;
+    }
+
+    struct iovec iov = {.iov_base = buf, .iov_len = size};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (count > 0)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    }
+
+    for (;;)
+    {
+        if (sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != -1)
+        {
+            return (int)count;
+        }
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            return -errno;
+        }
+        int result = wait_for(sock, POLLOUT, deadline);
+        if (result < 0)
+        {
+            return result;
+        }
+    }
+}
+
+int handoff_export(const char *path, struct handoff_dev_t *devs, size_t n, int timeout)
+{
+    struct sockaddr_un addr;
+    int result = make_addr(path, &addr);
+    if (result < 0)
+    {
+        return result;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        struct ifreq ifr = {0};
+        if (ioctl(devs[i].fd, TUNGETIFF, &ifr) == -1)
+        {
+            return -errno;
+        }
+        memcpy(devs[i].name, ifr.ifr_name, sizeof(devs[i].name));
+        devs[i].name[sizeof(devs[i].name) - 1] = '\0';
+        devs[i].flags = (unsigned short)ifr.ifr_flags;
+        if (sizeof(struct handoff_hdr_t) + entry_size(&devs[i]) > HANDOFF_MSG)
+        {
+            return -EMSGSIZE;
+        }
+    }
+
+    unsigned char *buf = enif_alloc(HANDOFF_MSG);
+    if (buf == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    int64_t deadline = timeout < 0 ? -1 : enif_monotonic_time(ERL_NIF_MSEC) + timeout;
+    bool bound = false;
+    int conn = -1;
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listener == -1)
+    {
+        result = -errno;
+        goto cleanup;
+    }
+
+    // A socket left behind by an earlier export is replaced, anything else
+    // at the path is not
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, 1) == -1)
+    {
+        result = -errno;
+        goto cleanup;
+    }
+    bound = true;
+
+    while (conn == -1)
+    {
+        if ((result = wait_for(listener, POLLIN, deadline)) < 0)
+        {
+            goto cleanup;
+        }
+        conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1 && errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+        {
+            result = -errno;
+            goto cleanup;
+        }
+    }
+    if ((result = check_peer(conn)) < 0)
+    {
+        goto cleanup;
+    }
+
+    size_t sent = 0;
+    do
+    {
+        int count = send_batch(conn, devs, sent, n, buf, deadline);
+        if (count < 0)
+        {
+            result = count;
+            goto cleanup;
+        }
+        sent += (size_t)count;
+    } while (sent < n);
+
+    struct handoff_ack_t ack;
+    for (;;)
+    {
+        if ((result = wait_for(conn, POLLIN, deadline)) < 0)
+        {
+            goto cleanup;
+        }
+        ssize_t received = recv(conn, &ack, sizeof(ack), MSG_DONTWAIT);
+        if (received == -1 && (errno == EAGAIN || errno == EINTR))
+        {
+            continue;
+        }
+        if (received == -1)
+        {
+            result = -errno;
+        }
+        else if (received == 0)
+        {
+            result = -ECONNRESET;
+        }
+        else
+        {
+            result = received == sizeof(ack) && ack.magic == HANDOFF_MAGIC && ack.count == n ? 0 : -EPROTO;
+        }
+        break;
+    }
+
+cleanup:
+    if (conn != -1)
+    {
+        close(conn);
+    }
+    if (listener != -1)
+    {
+        close(listener);
+    }
+    if (bound)
+    {
+        unlink(path);
+    }
+    enif_free(buf);
+    return result;
+}
+
+// Check a received descriptor against its entry and take it on
+static int adopt(struct handoff_dev_t *dev, const struct handoff_entry_t *entry, const unsigned char *meta)
+{
+    struct ifreq ifr = {0};
+    if (ioctl(dev->fd, TUNGETIFF, &ifr) == -1)
+    {
+        return -errno;
+    }
+    memcpy(dev->name, entry->name, sizeof(dev->name));
+    dev->name[sizeof(dev->name) - 1] = '\0';
+    dev->flags = entry->flags;
+    if (strncmp(ifr.ifr_name, dev->name, sizeof(dev->name)) != 0 || (unsigned short)ifr.ifr_flags != dev->flags)
+    {
+        return -EPROTO;
+    }
+    if (fcntl(dev->fd, F_SETFL, fcntl(dev->fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        return -errno;
+    }
+    if (entry->meta_len > 0)
+    {
+        if ((dev->meta = enif_alloc(entry->meta_len)) == NULL)
+        {
+            return -ENOMEM;
+        }
+        memcpy(dev->meta, meta, entry->meta_len);
+        dev->meta_len = entry->meta_len;
+    }
+    return 0;
+}
+
+// Receive one message, appending its devices to `*devs`. Returns 1 if it was
+// the last, 0 if more follow, or -errno.
+static int recv_batch(int sock, unsigned char *buf, struct handoff_dev_t **devs, size_t *n, int64_t deadline)
+{
+    union handoff_cmsg_t control;
+    struct iovec iov = {.iov_base = buf, .iov_len = HANDOFF_MSG};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+    ssize_t received;
+    for (;;)
+    {
+        int result = wait_for(sock, POLLIN, deadline);
+        if (result < 0)
+        {
+            return result;
+        }
+        received = recvmsg(sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (received != -1 || (errno != EAGAIN && errno != EINTR))
+        {
+            break;
+        }
+    }
+    if (received == -1)
+    {
+        return -errno;
+    }
+
+    // Take every descriptor first, so that none leaks whatever is wrong
+    int fds[HANDOFF_BATCH];
+    size_t nfds = 0;
+    int result = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++i)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+            if (nfds < HANDOFF_BATCH)
+            {
+                fds[nfds++] = fd;
+            }
+            else
+            {
+                close(fd);
+                result = -EPROTO;
+            }
+        }
+    }
+
+    struct handoff_hdr_t hdr;
+    if (received == 0)
+    {
+        result = -ECONNRESET;
+    }
+    else if (result == 0 && ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0 || (size_t)received < sizeof(hdr)))
+    {
+        result = -EPROTO;
+    }
+    if (result == 0)
+    {
+        memcpy(&hdr, buf, sizeof(hdr));
+        size_t entries_end = sizeof(hdr) + hdr.count * sizeof(struct handoff_entry_t);
+        if (hdr.magic != HANDOFF_MAGIC || hdr.version != HANDOFF_VERSION || hdr.count != nfds ||
+            entries_end > (size_t)received)
+        {
+            result = -EPROTO;
+        }
+    }
+
+    size_t taken = 0;
+    if (result == 0 && nfds > 0)
+    {
+        struct handoff_dev_t *grown = enif_realloc(*devs, (*n + nfds) * sizeof(**devs));
+        if (grown == NULL)
+        {
+            result = -ENOMEM;
+        }
+        else
+        {
+            *devs = grown;
+            size_t offset = sizeof(hdr) + nfds * sizeof(struct handoff_entry_t);
+            for (; taken < nfds; ++taken)
+            {
+                struct handoff_entry_t entry;
+                memcpy(&entry, buf + sizeof(hdr) + taken * sizeof(entry), sizeof(entry));
+                struct handoff_dev_t *dev = &(*devs)[(*n)++];
+                *dev = (struct handoff_dev_t){.fd = fds[taken], .meta = NULL, .meta_len = 0};
+                if (entry.meta_len > (size_t)received - offset)
+                {
+                    result = -EPROTO;
+                }
+                else
+                {
+                    result = adopt(dev, &entry, buf + offset);
+                    offset += entry.meta_len;
+                }
+                if (result < 0)
+                {
+                    taken++;
+                    break;
+                }
+            }
+        }
+    }
+    for (size_t i = taken; i < nfds; ++i)
+    {
+        close(fds[i]);
+    }
+    return result < 0 ? result : hdr.last != 0;
+}
+
+int handoff_import(const char *path, int timeout, struct handoff_dev_t **devs, size_t *n)
+{
+    struct sockaddr_un addr;
+    int result = make_addr(path, &addr);
+    if (result < 0)
+    {
+        return result;
+    }
+
+    *devs = NULL;
+    *n = 0;
+    unsigned char *buf = enif_alloc(HANDOFF_MSG);
+    if (buf == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    int64_t deadline = timeout < 0 ? -1 : enif_monotonic_time(ERL_NIF_MSEC) + timeout;
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        result = -errno;
+        goto cleanup;
+    }
+    if ((result = check_peer(sock)) < 0)
+    {
+        goto cleanup;
+    }
+
+    while ((result = recv_batch(sock, buf, devs, n, deadline)) == 0)
+    {
+    }
+    if (result < 0)
+    {
+        goto cleanup;
+    }
+
+    // The exporter lets go of the devices once they are acknowledged
+    struct handoff_ack_t ack = {.magic = HANDOFF_MAGIC, .count = (uint32_t)*n};
+    result = send(sock, &ack, sizeof(ack), MSG_NOSIGNAL) == sizeof(ack) ? 0 : -errno;
+
+cleanup:
+    if (sock != -1)
+    {
+        close(sock);
+    }
+    enif_free(buf);
+    if (result < 0)
+    {
+        handoff_free(*devs, *n);
+        *devs = NULL;
+        *n = 0;
+    }
+    return result;
+}
+
+void handoff_free(struct handoff_dev_t *devs, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (devs[i].fd != -1)
+        {
+            close(devs[i].fd);
+        }
+        if (devs[i].meta != NULL)
+        {
+            enif_free(devs[i].meta);
+        }
+    }
+    if (devs != NULL)
+    {
+        enif_free(devs);
+    }
+}
+
+#else
+
+int handoff_export(const char *path, struct handoff_dev_t *devs, size_t n, int timeout)
+{
+    (void)path;
+    (void)devs;
+    (void)n;
+    (void)timeout;
+    return -ENOTSUP;
+}
+
+int handoff_import(const char *path, int timeout, struct handoff_dev_t **devs, size_t *n)
+{
+    (void)path;
+    (void)timeout;
+    *devs = NULL;
+    *n = 0;
+    return -ENOTSUP;
+}
+
+void handoff_free(struct handoff_dev_t *devs, size_t n)
+{
+    (void)devs;
+    (void)n;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef TUNDRA_HANDOFF_H
+#define TUNDRA_HANDOFF_H
+
+#include <stddef.h>
+#include <net/if.h>
+
+// Handing live TUN devices from one VM to another.
+//
+// The exporting side listens on a Unix socket and the importing side connects
+// to it. The devices' descriptors are passed in batches of SCM_RIGHTS messages
+// over a SOCK_SEQPACKET connection, each with the device's name, its TUN flags
+// and an opaque metadata blob, and the importer acknowledges once it holds
+// them all. Both sides share the open file description of each device, so
+// nothing queued in the kernel is lost, and the importer can read before the
+// exporter lets go.
+//
+// Only a peer with the exporter's effective uid is accepted.
+
+struct handoff_dev_t
+{
+    int fd;
+    char name[IF_NAMESIZE]; // filled in by handoff_export from the device
+    unsigned flags;         // likewise: the TUNGETIFF flags (IFF_TUN, IFF_NO_PI...)
+    size_t meta_len;
+    unsigned char *meta;
+};
+
+// Offer `n` devices on `path`, waiting up to `timeout` milliseconds for an
+// importer to connect and acknowledge them. The descriptors stay open on this
+// side. Returns 0 or -errno: -ETIMEDOUT if no importer completed in time,
+// -EMSGSIZE if a device's metadata cannot fit in a message.
+int handoff_export(const char *path, struct handoff_dev_t *devs, size_t n, int timeout);
+
+// Take the devices offered on `path`, waiting up to `timeout` milliseconds.
+// On success `*devs` is an array of `*n` devices allocated with enif_alloc, to
+// be released with handoff_free; each descriptor has been checked to be the
+// TUN device named, and is non-blocking. Returns 0 or -errno.
+int handoff_import(const char *path, int timeout, struct handoff_dev_t **devs, size_t *n);
+
+// Free an array returned by handoff_import, closing any descriptor not set to
+// -1 by the caller.
+void handoff_free(struct handoff_dev_t *devs, size_t n);
+
+#endif
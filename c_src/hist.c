@@ -0,0 +1,59 @@
+#include "hist.h"
+
+void hist_reset(struct hist_t *h)
+{
+    for (unsigned i = 0; i < HIST_BUCKETS; ++i)
+    {
+        atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->min, UINT64_MAX, memory_order_relaxed);
+    atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+}
+
+uint64_t hist_bucket_upper(unsigned index)
+{
+    if (index < HIST_SUB_COUNT)
+    {
+        return index;
+    }
+    unsigned shift = (index - HIST_SUB_COUNT) / HIST_HALF_COUNT + 1;
+    uint64_t sub = (index - HIST_SUB_COUNT) % HIST_HALF_COUNT + HIST_HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+ERL_NIF_TERM hist_to_term(ErlNifEnv *env, const struct hist_t *h)
+{
+    // Walk downwards so the list is built in ascending order
+    ERL_NIF_TERM buckets = enif_make_list(env, 0);
+    for (unsigned i = HIST_BUCKETS; i-- > 0;)
+    {
+        uint64_t n = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (n != 0)
+        {
+            ERL_NIF_TERM pair = enif_make_tuple2(env, enif_make_uint64(env, hist_bucket_upper(i)), enif_make_uint64(env, n));
+            buckets = enif_make_list_cell(env, pair, buckets);
+        }
+    }
+
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    uint64_t min = atomic_load_explicit(&h->min, memory_order_relaxed);
+
+    ERL_NIF_TERM keys[] = {
+        enif_make_atom(env, "count"),
+        enif_make_atom(env, "sum"),
+        enif_make_atom(env, "min"),
+        enif_make_atom(env, "max"),
+        enif_make_atom(env, "buckets")};
+    ERL_NIF_TERM values[] = {
+        enif_make_uint64(env, count),
+        enif_make_uint64(env, atomic_load_explicit(&h->sum, memory_order_relaxed)),
+        enif_make_uint64(env, count == 0 ? 0 : min),
+        enif_make_uint64(env, atomic_load_explicit(&h->max, memory_order_relaxed)),
+        buckets};
+
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(keys[0]), &map);
+    return map;
+}
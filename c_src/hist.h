@@ -0,0 +1,78 @@
+#ifndef TUNDRA_HIST_H
+#define TUNDRA_HIST_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <erl_nif.h>
+
+// Log-linear (HDR-style) histogram of nanosecond durations.
+//
+// Values below 2^HIST_SUB_BITS are counted exactly. Above that, each power of
+// two is split into 2^(HIST_SUB_BITS - 1) equal buckets, which bounds the
+// relative error at about 3%. Values of 2^HIST_MAX_BITS ns (about 18 minutes)
+// or more are counted in the last bucket.
+#define HIST_SUB_BITS 6
+#define HIST_MAX_BITS 40
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS (HIST_SUB_COUNT + (HIST_MAX_BITS - HIST_SUB_BITS) * HIST_HALF_COUNT)
+
+// As with the receive counters, a histogram has a single writer and any number
+// of readers, so updates are relaxed loads and stores.
+struct hist_t
+{
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t min;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline unsigned hist_index(uint64_t value)
+{
+    if (value < HIST_SUB_COUNT)
+    {
+        return (unsigned)value;
+    }
+    if (value >> HIST_MAX_BITS)
+    {
+        return HIST_BUCKETS - 1;
+    }
+    unsigned msb = 63 - (unsigned)__builtin_clzll(value);
+    unsigned shift = msb - (HIST_SUB_BITS - 1);
+    unsigned sub = (unsigned)(value >> shift) - HIST_HALF_COUNT;
+    return HIST_SUB_COUNT + (shift - 1) * HIST_HALF_COUNT + sub;
+}
+
+static inline void hist_bump(_Atomic uint64_t *counter, uint64_t n)
+{
+    uint64_t cur = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, cur + n, memory_order_relaxed);
+}
+
+static inline void hist_record(struct hist_t *h, uint64_t value)
+{
+    hist_bump(&h->buckets[hist_index(value)], 1);
+    hist_bump(&h->count, 1);
+    hist_bump(&h->sum, value);
+    if (value < atomic_load_explicit(&h->min, memory_order_relaxed))
+    {
+        atomic_store_explicit(&h->min, value, memory_order_relaxed);
+    }
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed))
+    {
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+    }
+}
+
+// Clear all recorded values.
+void hist_reset(struct hist_t *h);
+
+// The highest value counted in bucket `index`.
+uint64_t hist_bucket_upper(unsigned index);
+
+// Export as a map of count, sum, min, max and a list of {upper, count} pairs
+// for the non-empty buckets, in ascending order.
+ERL_NIF_TERM hist_to_term(ErlNifEnv *env, const struct hist_t *h);
+
+#endif
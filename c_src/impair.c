@@ -0,0 +1,368 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include "impair.h"
+
+#define NSEC 1000000000LL
+#define TICK 1000000LL // 1ms
+#define WHEEL_SLOTS 1024
+
+struct impair_t *impair_create(void)
+{
+    struct impair_t *imp = enif_alloc(sizeof(*imp));
+    if (imp == NULL)
+    {
+        return NULL;
+    }
+    memset(imp, 0, sizeof(*imp));
+    if ((imp->lock = enif_mutex_create("tundra_impair")) == NULL)
+    {
+        enif_free(imp);
+        return NULL;
+    }
+    return imp;
+}
+
+void impair_destroy(struct impair_t *imp)
+{
+    if (imp != NULL)
+    {
+        struct impair_pkt_t *pkt = imp->ready;
+        while (pkt != NULL)
+        {
+            struct impair_pkt_t *next = pkt->next;
+            enif_free(pkt);
+            pkt = next;
+        }
+        if (imp->wait_env != NULL)
+        {
+            enif_free_env(imp->wait_env);
+        }
+        enif_mutex_destroy(imp->lock);
+        enif_free(imp);
+    }
+}
+
+// splitmix64
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+// Draws only when the outcome is in doubt, so that disabled features do not
+// shift the sequence seen by the others
+static bool chance(struct impair_stage_t *stage, uint64_t p)
+{
+    if (p == 0 || p >= IMPAIR_ALWAYS)
+    {
+        return p != 0;
+    }
+    return (next_random(&stage->rng) >> 32) < p;
+}
+
+void impair_configure(struct impair_stage_t *stage, const struct impair_config_t *config, int64_t now)
+{
+    stage->enabled = true;
+    stage->config = *config;
+    stage->rng = config->seed;
+    stage->bad = false;
+    stage->tokens = (double)config->burst;
+    stage->filled = now;
+    memset(&stage->stats, 0, sizeof(stage->stats));
+}
+
+// Take `size` bytes from the token bucket and return the earliest time the
+// packet may leave
+static int64_t rate_limit(struct impair_stage_t *stage, int64_t now, size_t size)
+{
+    const struct impair_config_t *c = &stage->config;
+    if (now > stage->filled)
+    {
+        stage->tokens += (double)(now - stage->filled) * (double)c->rate / NSEC;
+        if (stage->tokens > (double)c->burst)
+        {
+            stage->tokens = (double)c->burst;
+        }
+        stage->filled = now;
+    }
+    stage->tokens -= (double)size;
+    return stage->tokens >= 0 ? now : now + (int64_t)(-stage->tokens * NSEC / (double)c->rate);
+}
+
+int impair_decide(struct impair_stage_t *stage, int64_t now, size_t size, int64_t due[2])
+{
+    const struct impair_config_t *c = &stage->config;
+    stage->stats.packets++;
+
+    stage->bad = stage->bad ? !chance(stage, c->r) : chance(stage, c->p);
+    if (chance(stage, stage->bad ? c->loss_bad : c->loss_good))
+    {
+        stage->stats.lost++;
+        return 0;
+    }
+
+    int copies = chance(stage, c->duplicate) ? 2 : 1;
+    int n = 0;
+    stage->stats.duplicated += copies - 1;
+    for (int i = 0; i < copies; ++i)
+    {
+        int64_t delay = c->delay;
+        if (c->jitter > 0)
+        {
+            delay += (int64_t)(next_random(&stage->rng) % (uint64_t)(2 * c->jitter + 1)) - c->jitter;
+        }
+        if (chance(stage, c->reorder))
+        {
+            stage->stats.reordered++;
+            delay = 0;
+        }
+        int64_t at = now + (delay > 0 ? delay : 0);
+        if (c->rate != 0)
+        {
+            int64_t allowed = rate_limit(stage, now, size);
+            at = allowed > at ? allowed : at;
+        }
+        if (at > now)
+        {
+            if (stage->held >= c->limit)
+            {
+                stage->stats.overlimit++;
+                continue;
+            }
+            stage->held++;
+            stage->stats.delayed++;
+        }
+        due[n++] = at;
+    }
+    return n;
+}
+
+struct impair_pkt_t *impair_pkt_alloc(const void *data, size_t size, int dir, int64_t due)
+{
+    struct impair_pkt_t *pkt = enif_alloc(sizeof(*pkt) + size);
+    if (pkt != NULL)
+    {
+        pkt->next = NULL;
+        pkt->due = due;
+        pkt->resource = NULL;
+        pkt->dir = dir;
+        pkt->size = size;
+        if (data != NULL)
+        {
+            memcpy(pkt->data, data, size);
+        }
+    }
+    return pkt;
+}
+
+// The wheel. Slot i holds the packets due in ticks congruent to i, in the
+// order they were scheduled; a packet more than a turn away stays in its slot
+// until the turn it is due.
+struct slot_t
+{
+    struct impair_pkt_t *head;
+    struct impair_pkt_t *tail;
+};
+
+static ErlNifMutex *s_lock;
+static impair_fire_fn s_fire;
+static ErlNifTid s_tid;
+static bool s_running;
+static bool s_stopping;
+static int s_wake[2] = {-1, -1};
+static struct slot_t s_slots[WHEEL_SLOTS];
+static int64_t s_tick;  // the last tick serviced
+static unsigned s_held; // packets in the wheel
+static bool s_idle;     // the thread is waiting with no timeout
+
+// Monotonic time may be negative, so these round explicitly
+static int64_t tick_floor(int64_t t)
+{
+    return t / TICK - (t % TICK < 0);
+}
+
+static int64_t due_tick(int64_t due)
+{
+    return -tick_floor(-due);
+}
+
+static struct slot_t *slot_at(int64_t tick)
+{
+    return &s_slots[(uint64_t)tick % WHEEL_SLOTS];
+}
+
+// Called with the lock held. Appends the packets of one slot that are due by
+// `tick` to a list.
+static void take_due(struct slot_t *slot, int64_t tick, struct impair_pkt_t ***tail)
+{
+    struct impair_pkt_t **link = &slot->head;
+    slot->tail = NULL;
+    while (*link != NULL)
+    {
+        struct impair_pkt_t *pkt = *link;
+        if (due_tick(pkt->due) <= tick)
+        {
+            *link = pkt->next;
+            pkt->next = NULL;
+            **tail = pkt;
+            *tail = &pkt->next;
+            s_held--;
+        }
+        else
+        {
+            slot->tail = pkt;
+            link = &pkt->next;
+        }
+    }
+}
+
+static void *impair_thread(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        struct impair_pkt_t *due = NULL;
+        struct impair_pkt_t **tail = &due;
+
+        enif_mutex_lock(s_lock);
+        if (s_stopping)
+        {
+            enif_mutex_unlock(s_lock);
+            break;
+        }
+        int64_t now = tick_floor(enif_monotonic_time(ERL_NIF_NSEC));
+        int64_t from = now - s_tick > WHEEL_SLOTS ? now - WHEEL_SLOTS : s_tick;
+        for (int64_t t = from + 1; t <= now && s_held > 0; ++t)
+        {
+            take_due(slot_at(t), now, &tail);
+        }
+        s_tick = now;
+        bool idle = s_idle = s_held == 0;
+        enif_mutex_unlock(s_lock);
+
+        while (due != NULL)
+        {
+            struct impair_pkt_t *pkt = due;
+            void *resource = pkt->resource;
+            due = pkt->next;
+            pkt->next = NULL;
+            s_fire(resource, pkt);
+            enif_release_resource(resource);
+        }
+
+        // Sleep until the next tick, or until woken by a schedule or shutdown
+        struct pollfd pfd = {.fd = s_wake[0], .events = POLLIN};
+        if (poll(&pfd, 1, idle ? -1 : 1) > 0)
+        {
+            char buf[64];
+            ssize_t n = read(s_wake[0], buf, sizeof(buf));
+            (void)n;
+        }
+    }
+    return NULL;
+}
+
+int impair_init(impair_fire_fn fire)
+{
+    s_fire = fire;
+    s_lock = enif_mutex_create("tundra_impair_wheel");
+    return s_lock ? 0 : -1;
+}
+
+// Called with the lock held.
+static int start_thread(void)
+{
+    if (pipe(s_wake) == -1)
+    {
+        return -errno;
+    }
+    s_tick = tick_floor(enif_monotonic_time(ERL_NIF_NSEC));
+    s_idle = false;
+    if (enif_thread_create("tundra_impair", &s_tid, impair_thread, NULL, NULL) != 0)
+    {
+        close(s_wake[0]);
+        close(s_wake[1]);
+        s_wake[0] = s_wake[1] = -1;
+        return -EAGAIN;
+    }
+    s_running = true;
+    return 0;
+}
+
+int impair_schedule(struct impair_pkt_t *pkt, void *resource)
+{
+    int result = 0;
+    enif_mutex_lock(s_lock);
+    if (!s_running && (result = start_thread()) < 0)
+    {
+        enif_mutex_unlock(s_lock);
+        return result;
+    }
+
+    // A packet due in a tick already serviced goes in the next one
+    int64_t tick = due_tick(pkt->due);
+    struct slot_t *slot = slot_at(tick > s_tick ? tick : s_tick + 1);
+    pkt->next = NULL;
+    pkt->resource = resource;
+    enif_keep_resource(resource);
+    if (slot->tail != NULL)
+    {
+        slot->tail->next = pkt;
+    }
+    else
+    {
+        slot->head = pkt;
+    }
+    slot->tail = pkt;
+    s_held++;
+    bool wake = s_idle;
+    s_idle = false;
+    enif_mutex_unlock(s_lock);
+
+    if (wake)
+    {
+        ssize_t n = write(s_wake[1], "x", 1);
+        (void)n;
+    }
+    return 0;
+}
+
+void impair_shutdown(void)
+{
+    if (s_running)
+    {
+        enif_mutex_lock(s_lock);
+        s_stopping = true;
+        enif_mutex_unlock(s_lock);
+        ssize_t n = write(s_wake[1], "x", 1);
+        (void)n;
+        enif_thread_join(s_tid, NULL);
+        close(s_wake[0]);
+        close(s_wake[1]);
+        s_wake[0] = s_wake[1] = -1;
+        s_running = false;
+        s_stopping = false;
+    }
+    for (unsigned i = 0; i < WHEEL_SLOTS; ++i)
+    {
+        struct impair_pkt_t *pkt = s_slots[i].head;
+        while (pkt != NULL)
+        {
+            struct impair_pkt_t *next = pkt->next;
+            enif_release_resource(pkt->resource);
+            enif_free(pkt);
+            pkt = next;
+        }
+        s_slots[i].head = s_slots[i].tail = NULL;
+    }
+    s_held = 0;
+    if (s_lock != NULL)
+    {
+        enif_mutex_destroy(s_lock);
+        s_lock = NULL;
+    }
+}
@@ -0,0 +1,132 @@
+#ifndef TUNDRA_IMPAIR_H
+#define TUNDRA_IMPAIR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <erl_nif.h>
+
+// Network impairment emulation.
+//
+// An impairment stage sits in one direction of a device's data path and
+// decides, for each packet, whether to lose it, whether to duplicate it, and
+// when to deliver it: after a fixed delay with optional jitter, at once if it
+// is picked for reordering, and no earlier than a token bucket allows. Loss
+// follows a Gilbert-Elliott model, of which Bernoulli loss is the special case
+// of never leaving the good state.
+//
+// Every random choice is drawn from a per-stage generator seeded by the
+// caller, so a stage makes the same choices for the same sequence of packets.
+// Only the rate limit, which depends on when packets arrive, is not
+// reproducible.
+//
+// Packets that are not delivered at once wait in a timer wheel with 1ms slots,
+// serviced by one native thread for all devices, which hands each packet to a
+// callback when it is due. A packet is never delivered early.
+
+#define IMPAIR_SEND 0
+#define IMPAIR_RECV 1
+
+// Probabilities are fractions of 2^32, so IMPAIR_ALWAYS is certain
+#define IMPAIR_ALWAYS (UINT64_C(1) << 32)
+
+struct impair_config_t
+{
+    int64_t delay;  // nanoseconds
+    int64_t jitter; // nanoseconds; the delay is uniform within +/- jitter
+    uint64_t p;     // chance of moving from the good state to the bad
+    uint64_t r;     // chance of moving from the bad state to the good
+    uint64_t loss_bad;
+    uint64_t loss_good;
+    uint64_t duplicate;
+    uint64_t reorder; // chance of skipping the delay
+    uint64_t rate;    // bytes per second, 0 for no limit
+    uint64_t burst;   // bytes
+    unsigned limit;   // packets held at once, beyond which packets are lost
+    uint64_t seed;
+};
+
+struct impair_stats_t
+{
+    uint64_t packets;
+    uint64_t lost;
+    uint64_t duplicated;
+    uint64_t delayed;
+    uint64_t reordered;
+    uint64_t overlimit; // lost because `limit` packets were already held
+    uint64_t dropped;   // lost on delivery, e.g. to a full device
+};
+
+struct impair_stage_t
+{
+    bool enabled;
+    struct impair_config_t config;
+    uint64_t rng;
+    bool bad;        // Gilbert-Elliott state
+    double tokens;   // bytes; negative while packets wait for the rate limit
+    int64_t filled;  // when the bucket was last refilled
+    unsigned held;   // packets waiting in the wheel (or, for recv, to be read)
+    struct impair_stats_t stats;
+};
+
+struct impair_pkt_t
+{
+    struct impair_pkt_t *next;
+    int64_t due; // monotonic nanoseconds
+    void *resource;
+    int dir;
+    size_t size;
+    unsigned char data[]; // including the 4-byte TUN header
+};
+
+// Per-device state. Everything is protected by `lock`.
+struct impair_t
+{
+    ErlNifMutex *lock;
+    struct impair_stage_t stages[2];
+    struct impair_pkt_t *ready;      // recv packets that are due, oldest first
+    struct impair_pkt_t *ready_tail;
+    bool closed;         // the device is being closed; packets due are dropped
+    bool waiting;        // the owner is waiting for a select message
+    ErlNifPid waiter;
+    ErlNifEnv *wait_env; // holds the select reference
+    ERL_NIF_TERM wait_ref;
+};
+
+// Called by the wheel thread, without its lock, with a packet that is due.
+// The callback owns the packet, whose resource is kept for the duration of
+// the call.
+typedef void (*impair_fire_fn)(void *resource, struct impair_pkt_t *pkt);
+
+// Create the wheel's lock. Called from the NIF load callback.
+int impair_init(impair_fire_fn fire);
+
+// Allocate a device's state with both stages disabled. Returns NULL on failure.
+struct impair_t *impair_create(void);
+
+// Free a device's state and any packets waiting to be read.
+void impair_destroy(struct impair_t *imp);
+
+// Enable a stage with a new configuration, resetting its generator, state and
+// counters (but not packets already held). Called with the lock held.
+void impair_configure(struct impair_stage_t *stage, const struct impair_config_t *config, int64_t now);
+
+// Decide the fate of a packet of `size` bytes arriving at `now`. Returns the
+// number of copies to deliver (0, 1 or 2) and sets their due times; a copy due
+// at or before `now` is to be delivered at once, and the others must be passed
+// to impair_schedule. Called with the lock held.
+int impair_decide(struct impair_stage_t *stage, int64_t now, size_t size, int64_t due[2]);
+
+// Allocate a packet for the wheel, copying `size` bytes of data unless `data`
+// is NULL. Returns NULL on failure.
+struct impair_pkt_t *impair_pkt_alloc(const void *data, size_t size, int dir, int64_t due);
+
+// Hand a packet to the wheel, starting its thread if needed. The wheel keeps
+// `resource` until the packet has been passed to the callback. Returns 0 or
+// -errno, in which case the caller still owns the packet.
+int impair_schedule(struct impair_pkt_t *pkt, void *resource);
+
+// Stop the wheel thread, freeing any packets still in it. Called on unload.
+void impair_shutdown(void);
+
+#endif
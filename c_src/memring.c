@@ -0,0 +1,482 @@
+#ifdef __linux__
+#define _GNU_SOURCE // memfd_create, struct ucred
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "memring.h"
+#include "watch.h"
+
+struct memring_t *memring_create(void)
+{
+    struct memring_t *r = enif_alloc(sizeof(*r));
+    if (r == NULL)
+    {
+        return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    if ((r->lock = enif_mutex_create("tundra_memring")) == NULL)
+    {
+        enif_free(r);
+        return NULL;
+    }
+    r->closed = true;
+    r->fd = r->memfd = r->efd_peer = r->efd_self = -1;
+    r->watch = -1;
+    return r;
+}
+
+void memring_destroy(struct memring_t *r)
+{
+    if (r == NULL)
+    {
+        return;
+    }
+    // The registration holds the device, so a ring is disabled before it can
+    // be freed
+    memring_disable(r);
+    enif_mutex_destroy(r->lock);
+    enif_free(r);
+}
+
+void memring_get_stats(struct memring_t *r, struct memring_stats_t *stats)
+{
+    stats->rx_packets = atomic_load_explicit(&r->rx_packets, memory_order_relaxed);
+    stats->rx_bytes = atomic_load_explicit(&r->rx_bytes, memory_order_relaxed);
+    stats->rx_full = atomic_load_explicit(&r->rx_full, memory_order_relaxed);
+    stats->tx_packets = atomic_load_explicit(&r->tx_packets, memory_order_relaxed);
+    stats->tx_bytes = atomic_load_explicit(&r->tx_bytes, memory_order_relaxed);
+    stats->tx_errors = atomic_load_explicit(&r->tx_errors, memory_order_relaxed);
+    stats->wakeups = atomic_load_explicit(&r->wakeups, memory_order_relaxed);
+}
+
+static inline void count(_Atomic uint64_t *counter, uint64_t n)
+{
+    uint64_t cur = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, cur + n, memory_order_relaxed);
+}
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define BATCH 64 // packets between publishing to the other process
+#define ROUNDS 4 // batches each way per wakeup, so that busy rings take turns
+
+static void ring_bell(struct memring_t *r)
+{
+    uint64_t one = 1;
+    ssize_t n = write(r->efd_peer, &one, sizeof(one));
+    (void)n; // a full counter means the other process has yet to look
+    count(&r->wakeups, 1);
+}
+
+// Read up to ROUNDS batches of packets from the device into the RX ring,
+// stopping early if the device has no more or the ring is full. Returns false
+// in the latter case, having asked the other process to ring when it frees a
+// slot. A device with more to read is still readable, so epoll reports it
+// again.
+static bool fill_rx(struct memring_t *r, bool *wake)
+{
+    struct tundra_ring_shm *shm = r->shm;
+    struct tundra_ring_dir *dir = &shm->rx;
+    size_t cap = tundra_ring_capacity(shm);
+    uint32_t start = r->rx_tail;
+    uint32_t published = r->rx_tail;
+    bool room = true;
+    while (!r->rx_eof && r->rx_tail - start < ROUNDS * BATCH)
+    {
+        if (tundra_ring_free(shm, dir, r->rx_tail) == 0)
+        {
+            if (r->rx_tail != published)
+            {
+                *wake |= tundra_ring_publish(dir, r->rx_tail);
+                published = r->rx_tail;
+            }
+            if (tundra_ring_producer_idle(shm, dir, r->rx_tail))
+            {
+                count(&r->rx_full, 1);
+                room = false;
+                break;
+            }
+            continue;
+        }
+
+        struct tundra_ring_slot *slot = tundra_ring_slot_at(shm, dir, r->rx_tail);
+        ssize_t n = read(r->fd, slot->data, cap);
+        if (n > 0)
+        {
+            slot->len = (uint32_t)n;
+            slot->reserved = 0;
+            r->rx_tail++;
+            count(&r->rx_packets, 1);
+            count(&r->rx_bytes, (uint64_t)n);
+            if (r->rx_tail - published >= BATCH)
+            {
+                *wake |= tundra_ring_publish(dir, r->rx_tail);
+                published = r->rx_tail;
+            }
+        }
+        else if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            // EOF, from a loopback device whose peer has closed, or an error
+            // the device would keep reporting: stop reading it
+            r->rx_eof = n == 0 || errno != EAGAIN;
+            break;
+        }
+    }
+    if (r->rx_tail != published)
+    {
+        *wake |= tundra_ring_publish(dir, r->rx_tail);
+    }
+    return room;
+}
+
+// Write up to ROUNDS batches of packets from the TX ring to the device,
+// stopping early if the ring is empty, when the other process is asked to ring
+// when it adds more, or the device will not take one. Returns true in the
+// latter case, and sets *more if packets were left in the ring.
+static bool drain_tx(struct memring_t *r, bool *wake, bool *more)
+{
+    struct tundra_ring_shm *shm = r->shm;
+    struct tundra_ring_dir *dir = &shm->tx;
+    size_t cap = tundra_ring_capacity(shm);
+    uint32_t start = r->tx_head;
+    uint32_t released = r->tx_head;
+    bool blocked = false;
+    for (;;)
+    {
+        if (r->tx_head - start >= ROUNDS * BATCH)
+        {
+            *more = true;
+            break;
+        }
+        if (tundra_ring_ready(dir, r->tx_head) == 0)
+        {
+            if (tundra_ring_consumer_idle(dir, r->tx_head))
+            {
+                break;
+            }
+            continue;
+        }
+
+        struct tundra_ring_slot *slot = tundra_ring_slot_at(shm, dir, r->tx_head);
+        uint32_t len = slot->len; // written by the other process, so not trusted
+        if (len <= TUNDRA_RING_TUN_HEADER || len > cap)
+        {
+            count(&r->tx_errors, 1);
+        }
+        else
+        {
+            ssize_t n = write(r->fd, slot->data, len);
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n == -1 && errno == EAGAIN)
+            {
+                blocked = true;
+                break;
+            }
+            if (n == -1)
+            {
+                count(&r->tx_errors, 1);
+            }
+            else
+            {
+                count(&r->tx_packets, 1);
+                count(&r->tx_bytes, (uint64_t)n);
+            }
+        }
+        r->tx_head++;
+        if (r->tx_head - released >= BATCH)
+        {
+            *wake |= tundra_ring_release(dir, r->tx_head);
+            released = r->tx_head;
+        }
+    }
+    if (r->tx_head != released)
+    {
+        *wake |= tundra_ring_release(dir, r->tx_head);
+    }
+    return blocked;
+}
+
+static void service(void *resource, void *arg, int64_t now)
+{
+    (void)resource;
+    (void)now;
+    struct memring_t *r = arg;
+    enif_mutex_lock(r->lock);
+    if (r->closed)
+    {
+        enif_mutex_unlock(r->lock);
+        return;
+    }
+
+    uint64_t rung;
+    ssize_t n = read(r->efd_self, &rung, sizeof(rung));
+    (void)n;
+
+    bool wake = false;
+    bool more = false;
+    bool room = fill_rx(r, &wake);
+    bool blocked = drain_tx(r, &wake, &more);
+    if (wake)
+    {
+        ring_bell(r);
+    }
+    if (more)
+    {
+        // Ring our own bell, having taken the other process's, to come back
+        // to the rest once the other rings have had their turn
+        uint64_t one = 1;
+        n = write(r->efd_self, &one, sizeof(one));
+        (void)n;
+    }
+
+    // Stop watching the device for input while the RX ring is full, as the
+    // other process rings once it frees a slot. A device that can no longer be
+    // read is dropped altogether, since epoll reports a hangup regardless.
+    uint32_t events = (room ? WATCH_READ : 0) | (blocked ? WATCH_WRITE : 0);
+    if (r->rx_eof && r->events != 0)
+    {
+        watch_delete(r->fd);
+        r->events = 0;
+    }
+    else if (!r->rx_eof && events != r->events && watch_add(r->fd, events, NULL, NULL, NULL, &r->watch) == 0)
+    {
+        r->events = events;
+    }
+    enif_mutex_unlock(r->lock);
+}
+
+// Watch the device and the eventfd of a ring. Called with the ring's lock
+// held.
+static int watch(struct memring_t *r, void *resource)
+{
+    int result = watch_add(r->fd, r->events, resource, service, r, &r->watch);
+    if (result == 0 && (result = watch_add(r->efd_self, WATCH_READ, NULL, NULL, NULL, &r->watch)) < 0)
+    {
+        // The caller holds a reference too, so this cannot run the destructor
+        enif_release_resource(watch_remove(&r->watch, &r->fd, 1));
+    }
+    return result;
+}
+
+// Stop watching a ring, returning the resource reference the watch held, to
+// be released once the ring's lock is released. Called with that lock held.
+static void *unwatch(struct memring_t *r)
+{
+    int fds[] = {r->fd, r->efd_self};
+    return watch_remove(&r->watch, fds, 2);
+}
+
+// Release the region and descriptors of a ring. Called with its lock held.
+static void release_region(struct memring_t *r)
+{
+    if (r->shm != NULL)
+    {
+        munmap(r->shm, r->size);
+        r->shm = NULL;
+    }
+    int *fds[] = {&r->memfd, &r->efd_peer, &r->efd_self};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i)
+    {
+        if (*fds[i] != -1)
+        {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+    r->fd = -1;
+}
+
+int memring_enable(struct memring_t *r, int fd, uint32_t slots, uint32_t slot_size, void *resource)
+{
+    if (slots < 2 || (slots & (slots - 1)) != 0 || slot_size % 8 != 0 ||
+        slot_size <= sizeof(struct tundra_ring_slot) + TUNDRA_RING_TUN_HEADER)
+    {
+        return -EINVAL;
+    }
+
+    int result = 0;
+    enif_mutex_lock(r->lock);
+    if (!r->closed)
+    {
+        result = -EBUSY;
+        goto done;
+    }
+
+    r->size = tundra_ring_region_size(slots, slot_size);
+    r->memfd = memfd_create("tundra_ring", MFD_CLOEXEC);
+    if (r->memfd == -1 || ftruncate(r->memfd, (off_t)r->size) == -1)
+    {
+        goto fail;
+    }
+    void *shm = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, r->memfd, 0);
+    if (shm == MAP_FAILED)
+    {
+        goto fail;
+    }
+    r->shm = shm;
+    r->efd_peer = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    r->efd_self = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (r->efd_peer == -1 || r->efd_self == -1)
+    {
+        goto fail;
+    }
+
+    // The region is zeroed by ftruncate, so both rings start empty
+    r->shm->magic = TUNDRA_RING_MAGIC;
+    r->shm->version = TUNDRA_RING_VERSION;
+    r->shm->slots = slots;
+    r->shm->slot_size = slot_size;
+    r->shm->rx.offset = sizeof(struct tundra_ring_shm);
+    r->shm->tx.offset = r->shm->rx.offset + (uint64_t)slots * slot_size;
+
+    r->fd = fd;
+    r->rx_tail = 0;
+    r->tx_head = 0;
+    r->events = WATCH_READ;
+    r->rx_eof = false;
+    _Atomic uint64_t *counters[] = {&r->rx_packets, &r->rx_bytes, &r->rx_full, &r->tx_packets,
+                                    &r->tx_bytes,   &r->tx_errors, &r->wakeups};
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+    {
+        atomic_store(counters[i], 0);
+    }
+    if ((result = watch(r, resource)) < 0)
+    {
+        release_region(r);
+        goto done;
+    }
+    r->closed = false;
+    goto done;
+
+fail:
+    result = -errno;
+    release_region(r);
+done:
+    enif_mutex_unlock(r->lock);
+    return result;
+}
+
+void memring_disable(struct memring_t *r)
+{
+    void *resource = NULL;
+    enif_mutex_lock(r->lock);
+    if (!r->closed)
+    {
+        r->closed = true;
+        atomic_store(&r->shm->closed, 1);
+        ring_bell(r);
+        resource = unwatch(r);
+        release_region(r);
+    }
+    enif_mutex_unlock(r->lock);
+
+    // Released outside the lock as this may run the resource destructor
+    if (resource != NULL)
+    {
+        enif_release_resource(resource);
+    }
+}
+
+int memring_share(struct memring_t *r, const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path))
+    {
+        return -ENAMETOOLONG;
+    }
+    memcpy(addr.sun_path, path, len);
+
+    int result = 0;
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        result = -errno;
+        goto cleanup;
+    }
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1)
+    {
+        result = -errno;
+        goto cleanup;
+    }
+    if (cred.uid != geteuid())
+    {
+        result = -EPERM;
+        goto cleanup;
+    }
+
+    enif_mutex_lock(r->lock);
+    if (r->closed)
+    {
+        enif_mutex_unlock(r->lock);
+        result = -EBADF;
+        goto cleanup;
+    }
+    struct tundra_ring_hello hello = {.magic = TUNDRA_RING_MAGIC, .version = TUNDRA_RING_VERSION, .size = r->size};
+    int fds[3] = {r->memfd, r->efd_peer, r->efd_self};
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    result = sent == -1 ? -errno : 0;
+    enif_mutex_unlock(r->lock);
+
+cleanup:
+    if (sock != -1)
+    {
+        close(sock);
+    }
+    return result;
+}
+
+#else
+
+int memring_enable(struct memring_t *r, int fd, uint32_t slots, uint32_t slot_size, void *resource)
+{
+    (void)r;
+    (void)fd;
+    (void)slots;
+    (void)slot_size;
+    (void)resource;
+    return -ENOTSUP;
+}
+
+void memring_disable(struct memring_t *r)
+{
+    (void)r;
+}
+
+int memring_share(struct memring_t *r, const char *path)
+{
+    (void)r;
+    (void)path;
+    return -ENOTSUP;
+}
+
+#endif
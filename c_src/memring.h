@@ -0,0 +1,89 @@
+#ifndef TUNDRA_MEMRING_H
+#define TUNDRA_MEMRING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <erl_nif.h>
+#include "ring/tundra_ring.h"
+
+// Ring mode: a device's packets moved through shared memory (Linux).
+//
+// While a device is in ring mode, the descriptor watcher's thread (see watch.h)
+// reads its packets straight into the RX ring of a memfd region and writes the
+// packets another process puts in the TX ring straight to the device (see
+// ring/tundra_ring.h for the layout and the wakeup protocol). The thread
+// watches the device, and an eventfd the other process rings; it rings the
+// other process's eventfd at most once per batch, and only when that process
+// has said it is waiting.
+//
+// A device's ring is allocated when ring mode is first enabled and freed with
+// the device, so the thread may keep using it, under its lock, after ring mode
+// is disabled; `closed` tells it to stop. Disabling releases the region and
+// the descriptors at once.
+//
+// Fields other than the counters are protected by `lock`.
+
+struct memring_stats_t
+{
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_full;     // times the device was left unread because the RX ring was full
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_errors;   // packets in the TX ring the device refused, or that were malformed
+    uint64_t wakeups;     // times the other process was woken
+};
+
+struct memring_t
+{
+    ErlNifMutex *lock;
+    bool closed;
+    int fd; // the device
+    int memfd;
+    int efd_peer; // rung by this side
+    int efd_self; // rung by the other process
+    struct tundra_ring_shm *shm;
+    size_t size;
+    uint32_t rx_tail;
+    uint32_t tx_head;
+    uint32_t events; // watch interest in the device
+    bool rx_eof;     // the device can no longer be read, e.g. a loopback peer closed
+    int watch;       // watcher slot
+    _Atomic uint64_t rx_packets;
+    _Atomic uint64_t rx_bytes;
+    _Atomic uint64_t rx_full;
+    _Atomic uint64_t tx_packets;
+    _Atomic uint64_t tx_bytes;
+    _Atomic uint64_t tx_errors;
+    _Atomic uint64_t wakeups;
+};
+
+// Allocate a closed ring. Returns NULL on failure.
+struct memring_t *memring_create(void);
+
+// Free a ring, disabling it first if needed.
+void memring_destroy(struct memring_t *r);
+
+// Put device `fd` in ring mode with a new region of `slots` slots of
+// `slot_size` bytes in each direction, resetting the counters, and start
+// servicing it. The registration holds a reference to `resource` until
+// memring_disable. Returns 0 or -errno; -EBUSY if the ring is already
+// enabled, -ENOTSUP where this is not implemented.
+int memring_enable(struct memring_t *r, int fd, uint32_t slots, uint32_t slot_size, void *resource);
+
+// Leave ring mode: tell the other process, stop servicing the device and
+// release the region and its descriptors. Does nothing if already disabled.
+void memring_disable(struct memring_t *r);
+
+// Read the counters. May be called at any time.
+void memring_get_stats(struct memring_t *r, struct memring_stats_t *stats);
+
+// Send the region's descriptors (the memfd, the eventfd this side rings and
+// the one it waits on) over a connection to a Unix socket at `path`, as
+// tundra_ring_accept expects. Only a peer with this process's effective uid is
+// accepted. Returns 0 or -errno; -EBADF if the ring is disabled.
+int memring_share(struct memring_t *r, const char *path);
+
+#endif
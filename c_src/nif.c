@@ -2,8 +2,10 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -13,12 +15,25 @@
 #include <unistd.h>
 #include <erl_nif.h>
 #include <erl_driver.h>
+#include "capture.h"
+#include "flow.h"
+#include "handoff.h"
+#include "hist.h"
+#include "impair.h"
+#include "memring.h"
+#include "ready.h"
+#include "rxbuf.h"
+#include "sendq.h"
+#include "tunnel.h"
+#include "watch.h"
 #include "server/src/protocol.h"
 #include "server/src/server.h"
+#include "server/src/usdt.h"
 
 // Platform-specific includes
 #ifdef __linux__
 #include <arpa/inet.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
@@ -51,36 +66,378 @@ static ERL_NIF_TERM s_addr;
 static ERL_NIF_TERM s_dstaddr;
 static ERL_NIF_TERM s_netmask;
 static ERL_NIF_TERM s_mtu;
+static ERL_NIF_TERM s_txqueuelen;
 static ERL_NIF_TERM s_recv;
 static ERL_NIF_TERM s_send;
 static ERL_NIF_TERM s_select;
 static ERL_NIF_TERM s_select_info;
 static ERL_NIF_TERM s_socket;
 static ERL_NIF_TERM s_tundra;
+static ERL_NIF_TERM s_tundra_poll;
+static ERL_NIF_TERM s_true;
+static ERL_NIF_TERM s_closed;
+static ERL_NIF_TERM s_rx_packets;
+static ERL_NIF_TERM s_rx_bytes;
+static ERL_NIF_TERM s_tx_packets;
+static ERL_NIF_TERM s_tx_bytes;
+static ERL_NIF_TERM s_eagain_count;
+static ERL_NIF_TERM s_selects;
+static ERL_NIF_TERM s_enobufs;
+static ERL_NIF_TERM s_emsgsize;
+static ERL_NIF_TERM s_max_packet;
+static ERL_NIF_TERM s_disabled;
+static ERL_NIF_TERM s_ready;
+static ERL_NIF_TERM s_queue_full;
+static ERL_NIF_TERM s_tundra_send_queue;
+static ERL_NIF_TERM s_high;
+static ERL_NIF_TERM s_low;
+static ERL_NIF_TERM s_send_queue_packets;
+static ERL_NIF_TERM s_send_queue_bytes;
+static ERL_NIF_TERM s_send_queue_drops;
+static ERL_NIF_TERM s_class;
+static ERL_NIF_TERM s_weight;
+static ERL_NIF_TERM s_priority;
+static ERL_NIF_TERM s_packets;
+static ERL_NIF_TERM s_bytes;
+static ERL_NIF_TERM s_drops;
+static ERL_NIF_TERM s_sent;
+static ERL_NIF_TERM s_delay;
+static ERL_NIF_TERM s_lost;
+static ERL_NIF_TERM s_duplicated;
+static ERL_NIF_TERM s_delayed;
+static ERL_NIF_TERM s_reordered;
+static ERL_NIF_TERM s_overlimit;
+static ERL_NIF_TERM s_dropped;
+static ERL_NIF_TERM s_held;
+static ERL_NIF_TERM s_rx_full;
+static ERL_NIF_TERM s_tx_errors;
+static ERL_NIF_TERM s_wakeups;
+static ERL_NIF_TERM s_up;
+static ERL_NIF_TERM s_add_address;
+static ERL_NIF_TERM s_remove_address;
+static ERL_NIF_TERM s_add_route;
+static ERL_NIF_TERM s_remove_route;
+static ERL_NIF_TERM s_configured;
+static ERL_NIF_TERM s_refused;
+static ERL_NIF_TERM s_netns;
+static ERL_NIF_TERM s_tundra_tunnel;
+static ERL_NIF_TERM s_chacha20_poly1305;
+static ERL_NIF_TERM s_aes_256_gcm;
+static ERL_NIF_TERM s_no_route;
+static ERL_NIF_TERM s_unknown_peer;
+static ERL_NIF_TERM s_auth_failures;
+static ERL_NIF_TERM s_replays;
+static ERL_NIF_TERM s_control;
+static ERL_NIF_TERM s_peers;
+static ERL_NIF_TERM s_index;
+static ERL_NIF_TERM s_counter;
+static ERL_NIF_TERM s_busy_polls;
+static ERL_NIF_TERM s_busy_poll_hits;
+static ERL_NIF_TERM s_busy_poll_time;
+static ERL_NIF_TERM s_src;
+static ERL_NIF_TERM s_dst;
+static ERL_NIF_TERM s_sport;
+static ERL_NIF_TERM s_dport;
+static ERL_NIF_TERM s_protocol;
+static ERL_NIF_TERM s_direction;
+static ERL_NIF_TERM s_inbound;
+static ERL_NIF_TERM s_outbound;
+static ERL_NIF_TERM s_start;
+static ERL_NIF_TERM s_end;
+static ERL_NIF_TERM s_tcp_flags;
+static ERL_NIF_TERM s_reason;
+static ERL_NIF_TERM s_idle;
+static ERL_NIF_TERM s_active;
+static ERL_NIF_TERM s_forced;
+static ERL_NIF_TERM s_evicted;
+static ERL_NIF_TERM s_flows;
+static ERL_NIF_TERM s_created;
+static ERL_NIF_TERM s_expired;
+static ERL_NIF_TERM s_queued;
+static ERL_NIF_TERM s_exported;
+static ERL_NIF_TERM s_export_errors;
+static ERL_NIF_TERM s_memory;
+
+// Per-device I/O counters.
+//
+// The receive path is only entered by the owning process, so its counters have
+// a single writer and are updated with a relaxed load and store (stat_add)
+// rather than a locked read-modify-write. The send counters and max_packet
+// are also written by the send queue's drainer and the impairment wheel, and
+// are only ever updated atomically (stat_add_shared, stat_max). Any process
+// may read them; a reader sees each counter individually up to date but not a
+// consistent snapshot across counters. Byte counts exclude the 4-byte TUN
+// header.
+struct fd_stats_t
+{
+    _Atomic uint64_t rx_packets;
+    _Atomic uint64_t rx_bytes;
+    _Atomic uint64_t tx_packets;
+    _Atomic uint64_t tx_bytes;
+    _Atomic uint64_t eagain;
+    _Atomic uint64_t selects;
+    _Atomic uint64_t enobufs;
+    _Atomic uint64_t emsgsize;
+    _Atomic uint64_t max_packet;
+    _Atomic uint64_t busy_polls;     // spins on an empty device
+    _Atomic uint64_t busy_poll_hits; // spins that ended with the device readable
+    _Atomic uint64_t busy_poll_ns;   // time spent spinning
+};
+
+// Busy polling (see busy_poll). The spin budget adapts to arrivals: a spin
+// that sees a packet moves it towards twice the wait, one that does not
+// halves it, down to nothing. While it is nothing, every BUSY_POLL_PROBE'th
+// empty read spins for the longest time anyway, so that the budget can grow
+// again when traffic picks up. Owner only.
+struct busy_poll_t
+{
+    int64_t max;    // longest spin in ns, 0 when off
+    int64_t budget; // current spin in ns
+    unsigned idle;  // empty reads since the budget fell to nothing
+};
+
+// Optional latency histograms, allocated when tracking is first enabled and
+// kept until the resource is destroyed so that readers never race a free.
+struct fd_latency_t
+{
+    struct hist_t recv;       // recv_data call durations
+    struct hist_t send;       // send_data call durations
+    struct hist_t ready;      // readiness to the next successful read
+    _Atomic int64_t ready_at; // set by the readiness watcher, 0 when unset
+    int watch;                // readiness watch slot (see ready.h)
+};
+
+struct poll_members_t;
 
 struct fd_object_t
 {
     int fd;
     ErlNifPid cp;
     ErlNifMonitor mon;
+    struct fd_stats_t stats;
+    struct fd_latency_t *track; // latency when tracking is on, else NULL; owner only
+    struct busy_poll_t busy;    // owner only
+    _Atomic(struct fd_latency_t *) latency;
+    struct sendq_t *queue; // send queue when enabled, else NULL; owner only
+    _Atomic(struct sendq_t *) sendq;
+    struct capture_t *tap; // capture when running, else NULL; owner only
+    _Atomic(struct capture_t *) capture;
+    struct impair_t *impair; // impairment when either stage is on, else NULL; owner only
+    _Atomic(struct impair_t *) impairment;
+    struct memring_t *ring; // ring when in ring mode, else NULL; owner only
+    _Atomic(struct memring_t *) memring;
+    struct tunnel_t *tun; // tunnel when in tunnel mode, else NULL; owner only
+    _Atomic(struct tunnel_t *) tunnel;
+    struct flow_t *acct; // flow accounting when on, else NULL; owner only
+    _Atomic(struct flow_t *) flow;
+    struct poll_members_t *members;              // poll sets only (see below)
+    _Atomic(struct fd_object_t *) poll_set;      // the set a device is registered with; not kept
+    int poll_slot;                               // its slot there, under the set's lock
 };
 
-static void fdrt_dtor(ErlNifEnv *env, void *obj)
+// Poll sets (Linux).
+//
+// A poll set is an fd object whose descriptor is an epoll instance. While a
+// device is registered, the set keeps the device, and the device points back at
+// the set without keeping it, so that a set nobody refers to can be destroyed.
+// Either can be closed first. The back pointers are only written under
+// s_poll_lock, which also keeps the set alive for whoever holds it: closing or
+// destroying a set clears the pointers of its devices under it. Whoever clears
+// a device's pointer (removal, closing either side, or a poll that finds the
+// device has changed owner) removes its slot and drops the set's reference.
+struct poll_slot_t
+{
+    struct fd_object_t *dev;
+    uint32_t gen;
+};
+
+struct poll_members_t
+{
+    ErlNifMutex *lock;
+    struct poll_slot_t *slots;
+    unsigned nslots;
+};
+
+static ErlNifMutex *s_poll_lock; // taken before a set's lock
+
+static inline void stat_add(_Atomic uint64_t *counter, uint64_t n)
+{
+    uint64_t cur = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, cur + n, memory_order_relaxed);
+}
+
+// For counters written by more than one thread
+static inline void stat_add_shared(_Atomic uint64_t *counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static inline void stat_max(_Atomic uint64_t *counter, uint64_t n)
+{
+    uint64_t cur = atomic_load_explicit(counter, memory_order_relaxed);
+    while (n > cur && !atomic_compare_exchange_weak_explicit(counter, &cur, n, memory_order_relaxed,
+                                                              memory_order_relaxed))
+    {
+    }
+}
+
+static void fdrt_close(struct fd_object_t *fd_obj)
 {
-    (void)env;
-    struct fd_object_t *fd_obj = obj;
     int s = fd_obj->fd;
     if (s != -1 && atomic_compare_exchange_strong((atomic_int *)&fd_obj->fd, &s, -1))
     {
+        TUNDRA_PROBE1(close, s);
         close(s);
     }
 }
 
+static void poll_close(struct fd_object_t *set);
+
+static void fdrt_dtor(ErlNifEnv *env, void *obj)
+{
+    (void)env;
+    struct fd_object_t *fd_obj = obj;
+    fdrt_close(fd_obj);
+    enif_free(atomic_load(&fd_obj->latency));
+    sendq_destroy(atomic_load(&fd_obj->sendq));
+    capture_destroy(atomic_load(&fd_obj->capture));
+    impair_destroy(atomic_load(&fd_obj->impairment));
+    memring_destroy(atomic_load(&fd_obj->memring));
+    tunnel_destroy(atomic_load(&fd_obj->tunnel));
+    flow_destroy(atomic_load(&fd_obj->flow));
+    if (fd_obj->members != NULL)
+    {
+        // The devices still registered do not keep the set
+        poll_close(fd_obj);
+        enif_mutex_destroy(fd_obj->members->lock);
+        enif_free(fd_obj->members->slots);
+        enif_free(fd_obj->members);
+    }
+}
+
+// Clear a device's slot in its poll set. Called with the set's lock held.
+static void poll_clear_slot(struct fd_object_t *set, struct fd_object_t *dev)
+{
+    struct poll_slot_t *slot = &set->members->slots[dev->poll_slot];
+#ifdef __linux__
+    if (set->fd != -1 && dev->fd != -1)
+    {
+        epoll_ctl(set->fd, EPOLL_CTL_DEL, dev->fd, NULL);
+    }
+#endif
+    slot->dev = NULL;
+    slot->gen++;
+    dev->poll_slot = -1;
+}
+
+// Remove a device from the poll set it is registered with, if any, and drop the
+// set's reference to it. Returns false if the device is not registered with
+// `set`, or with any set if `set` is NULL.
+static bool poll_leave(struct fd_object_t *set, struct fd_object_t *dev)
+{
+    enif_mutex_lock(s_poll_lock);
+    struct fd_object_t *cur = atomic_load(&dev->poll_set);
+    bool member = cur != NULL && (set == NULL || cur == set);
+    if (member)
+    {
+        enif_mutex_lock(cur->members->lock);
+        poll_clear_slot(cur, dev);
+        enif_mutex_unlock(cur->members->lock);
+        atomic_store(&dev->poll_set, NULL);
+    }
+    enif_mutex_unlock(s_poll_lock);
+
+    // Released outside the lock as this may run the resource destructor
+    if (member)
+    {
+        enif_release_resource(dev);
+    }
+    return member;
+}
+
+// Close a poll set, dropping every device still registered with it. The
+// devices' references are released under the locks, which is safe as a
+// device's destructor takes neither.
+static void poll_close(struct fd_object_t *set)
+{
+    struct poll_members_t *m = set->members;
+    enif_mutex_lock(s_poll_lock);
+    enif_mutex_lock(m->lock);
+    for (unsigned i = 0; i < m->nslots; ++i)
+    {
+        struct fd_object_t *dev = m->slots[i].dev;
+        if (dev != NULL)
+        {
+            poll_clear_slot(set, dev);
+            atomic_store(&dev->poll_set, NULL);
+            enif_release_resource(dev);
+        }
+    }
+    fdrt_close(set);
+    enif_mutex_unlock(m->lock);
+    enif_mutex_unlock(s_poll_lock);
+}
+
 static void fdrt_stop(ErlNifEnv *env, void *obj, ErlNifEvent event, int is_direct_call)
 {
-    (void)event;
+    (void)env;
     (void)is_direct_call;
-    fdrt_dtor(env, obj);
+    struct fd_object_t *fd_obj = obj;
+    struct fd_latency_t *lat = atomic_load(&fd_obj->latency);
+    if (lat != NULL)
+    {
+        ready_unwatch(event, &lat->watch);
+    }
+    if (fd_obj->members != NULL)
+    {
+        poll_close(fd_obj);
+        return;
+    }
+    struct sendq_t *q = atomic_load(&fd_obj->sendq);
+    if (q != NULL)
+    {
+        // Stop the drainer writing before the descriptor is closed
+        enif_mutex_lock(q->lock);
+        q->closed = true;
+        sendq_clear(q);
+        enif_mutex_unlock(q->lock);
+        sendq_unwatch(event, &q->watch);
+    }
+    struct impair_t *imp = atomic_load(&fd_obj->impairment);
+    if (imp != NULL)
+    {
+        // Stop the wheel writing before the descriptor is closed, since the
+        // number could be reused by then
+        enif_mutex_lock(imp->lock);
+        imp->closed = true;
+        enif_mutex_unlock(imp->lock);
+    }
+    struct capture_t *c = atomic_load(&fd_obj->capture);
+    if (c != NULL)
+    {
+        // Flush and close the capture file; the capture is freed with the resource
+        capture_stop(c, NULL);
+    }
+    struct memring_t *r = atomic_load(&fd_obj->memring);
+    if (r != NULL)
+    {
+        // Stop the ring thread using the descriptor and tell the other process
+        memring_disable(r);
+    }
+    struct tunnel_t *t = atomic_load(&fd_obj->tunnel);
+    if (t != NULL)
+    {
+        // Stop the tunnel thread using the descriptor and close the socket
+        tunnel_disable(t);
+    }
+    struct flow_t *f = atomic_load(&fd_obj->flow);
+    if (f != NULL)
+    {
+        // Send the flows still in the table to the collector, if there is one
+        flow_disable(f);
+    }
+    poll_leave(NULL, fd_obj);
+    fdrt_close(fd_obj);
 }
 
 static void fdrt_down(ErlNifEnv *env, void *obj, ErlNifPid *pid, ErlNifMonitor *mon)
@@ -106,6 +463,25 @@ static struct fd_object_t *alloc_fd_object(ErlNifEnv *env)
     if (fd_obj != NULL)
     {
         fd_obj->fd = -1;
+        memset(&fd_obj->stats, 0, sizeof(fd_obj->stats));
+        fd_obj->track = NULL;
+        atomic_init(&fd_obj->latency, NULL);
+        fd_obj->busy = (struct busy_poll_t){0};
+        fd_obj->queue = NULL;
+        atomic_init(&fd_obj->sendq, NULL);
+        fd_obj->tap = NULL;
+        atomic_init(&fd_obj->capture, NULL);
+        fd_obj->impair = NULL;
+        atomic_init(&fd_obj->impairment, NULL);
+        fd_obj->ring = NULL;
+        atomic_init(&fd_obj->memring, NULL);
+        fd_obj->tun = NULL;
+        atomic_init(&fd_obj->tunnel, NULL);
+        fd_obj->acct = NULL;
+        atomic_init(&fd_obj->flow, NULL);
+        fd_obj->members = NULL;
+        atomic_init(&fd_obj->poll_set, NULL);
+        fd_obj->poll_slot = -1;
         if (NULL == enif_self(env, &fd_obj->cp) || enif_monitor_process(env, fd_obj, &fd_obj->cp, &fd_obj->mon) != 0)
         {
             enif_release_resource(fd_obj);
@@ -120,294 +496,3497 @@ static ERL_NIF_TERM make_error(ErlNifEnv *env, int err)
     return enif_make_tuple2(env, s_error, enif_make_atom(env, erl_errno_id(err)));
 }
 
-static int load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
+// Send {tundra_send_queue, {'$tundra', Dev}, high | low} to the owner of a
+// device. `env` is the caller's environment, or NULL off a scheduler thread.
+static void notify_send_queue(ErlNifEnv *env, ErlNifPid *pid, struct fd_object_t *fd_obj, ERL_NIF_TERM level)
 {
-    (void)priv_data;
-    (void)load_info;
-    s_ok = enif_make_atom(env, "ok");
-    s_error = enif_make_atom(env, "error");
-    s_eagain = enif_make_atom(env, "eagain");
-    s_not_owner = enif_make_atom(env, "not_owner");
-    s_addr = enif_make_atom(env, "addr");
-    s_dstaddr = enif_make_atom(env, "dstaddr");
-    s_netmask = enif_make_atom(env, "netmask");
-    s_mtu = enif_make_atom(env, "mtu");
-    s_recv = enif_make_atom(env, "recv");
-    s_send = enif_make_atom(env, "send");
-    s_select = enif_make_atom(env, "select");
-    s_select_info = enif_make_atom(env, "select_info");
-    s_socket = enif_make_atom(env, "$socket");
-    s_tundra = enif_make_atom(env, "$tundra");
-    s_fdrt = enif_init_resource_type(env, "fdrt", &s_fdrt_init, ERL_NIF_RT_CREATE, NULL);
-    return s_fdrt ? 0 : -1;
+    ErlNifEnv *msg_env = enif_alloc_env();
+    if (msg_env != NULL)
+    {
+        ERL_NIF_TERM dev = enif_make_tuple2(msg_env, s_tundra, enif_make_resource(msg_env, fd_obj));
+        enif_send(env, pid, msg_env, enif_make_tuple3(msg_env, s_tundra_send_queue, dev, level));
+        enif_free_env(msg_env);
+    }
 }
 
-static ERL_NIF_TERM recv_response(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Write out as much of a device's send queue as the device will take, in the
+// order chosen by its scheduler. Called by the drainer thread when the device
+// becomes writable (see sendq.h). Packets that fail with anything but EAGAIN
+// are dropped, since there is no caller left to report the error to.
+static void drain_send_queue(void *obj)
 {
-    void *obj;
-    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_is_ref(env, argv[1]))
-    {
-        return enif_make_badarg(env);
-    }
     struct fd_object_t *fd_obj = obj;
-    ErlNifPid self;
-    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
-    {
-        return enif_make_tuple2(env, s_error, s_not_owner);
-    }
-    int s = fd_obj->fd;
-
-    struct response_t resp = {0};
-    char cmsgbuf[CMSG_SPACE(sizeof(int))];
-    struct iovec iov = {
-        .iov_base = &resp,
-        .iov_len = sizeof(resp)};
-    struct msghdr msg = {
-        .msg_iov = &iov,
-        .msg_iovlen = 1,
-        .msg_control = cmsgbuf,
-        .msg_controllen = sizeof cmsgbuf,
-    };
+    struct sendq_t *q = atomic_load(&fd_obj->sendq);
+    int written = 0;
+    bool low = false;
+    ErlNifPid owner;
 
-    int ret = recvmsg(s, &msg, 0);
-    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    struct sendq_pkt_t *pkt;
+    unsigned cls;
+    enif_mutex_lock(q->lock);
+    while (!q->closed && (pkt = sendq_next(q, &cls)) != NULL)
     {
-        if (enif_select(env, s, ERL_NIF_SELECT_READ, obj, NULL, argv[1]) < 0)
+        ssize_t n = write(fd_obj->fd, pkt->data, pkt->size);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
         {
-            return enif_make_badarg(env);
+            break;
         }
-        return enif_make_tuple2(env, s_error, s_eagain);
+        if (n == (ssize_t)pkt->size)
+        {
+            stat_add_shared(&fd_obj->stats.tx_packets, 1);
+            stat_add_shared(&fd_obj->stats.tx_bytes, n - 4);
+            ++written;
+        }
+        else if (n >= 0)
+        {
+            stat_add_shared(&fd_obj->stats.enobufs, 1);
+        }
+        sendq_pop(q, cls, n == (ssize_t)pkt->size);
     }
-
-    if (ret == -1)
+    if (!q->closed && atomic_load_explicit(&q->packets, memory_order_relaxed) != 0 && sendq_watch(fd_obj->fd, fd_obj, &q->watch) < 0)
     {
-        return make_error(env, errno);
+        // Nothing would ever drain what is left
+        sendq_clear(q);
+    }
+    uint64_t depth = atomic_load_explicit(&q->bytes, memory_order_relaxed);
+    if (q->above && depth <= q->low)
+    {
+        q->above = false;
+        low = !q->closed;
+        owner = q->owner;
     }
+    enif_mutex_unlock(q->lock);
 
-    // Read the aux data and check for the file descriptor
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+    TUNDRA_PROBE3(send_queue_drain, fd_obj->fd, written, depth);
+    if (low)
     {
-        return make_error(env, EINVAL);
+        notify_send_queue(NULL, &owner, fd_obj, s_low);
     }
-    // Extract the file descriptor
-    int fd;
-    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+}
 
-    ERL_NIF_TERM result;
+// Deliver a packet from the impairment wheel (see impair.h). A sent packet is
+// written to the device, and lost if the device will not take it. A received
+// one joins the queue read by recv_impaired, and if the owner is waiting it is
+// sent the select message it is waiting for. Packets due after the device
+// was closed are dropped.
+static void deliver_impaired(void *obj, struct impair_pkt_t *pkt)
+{
+    struct fd_object_t *fd_obj = obj;
+    struct impair_t *imp = atomic_load(&fd_obj->impairment);
+    struct impair_stage_t *stage = &imp->stages[pkt->dir];
 
-    // Allocate a resource for the file descriptor so that it becomes owned by the calling process
-    struct fd_object_t *res_fd = alloc_fd_object(env);
-    if (res_fd)
+    enif_mutex_lock(imp->lock);
+    if (imp->closed || pkt->dir == IMPAIR_SEND || !stage->enabled)
     {
-        res_fd->fd = fd;
-        // Allocate a binary to hold the name of the tun device
-        ErlNifBinary name_bin;
-        if (enif_alloc_binary(strlen(resp.msg.create_tun.name), &name_bin))
+        ssize_t n = pkt->dir == IMPAIR_SEND && !imp->closed ? write(fd_obj->fd, pkt->data, pkt->size) : -1;
+        if (n == (ssize_t)pkt->size && n > 4)
         {
-            strcpy((char *)name_bin.data, resp.msg.create_tun.name);
-
-            ERL_NIF_TERM info = enif_make_tuple2(env, enif_make_resource(env, res_fd), enif_make_binary(env, &name_bin));
-            enif_release_binary(&name_bin);
-
-            fd = -1; // Ownership has moved
-            result = enif_make_tuple2(env, s_ok, info);
+            stat_add_shared(&fd_obj->stats.tx_packets, 1);
+            stat_add_shared(&fd_obj->stats.tx_bytes, n - 4);
+            stat_max(&fd_obj->stats.max_packet, n - 4);
         }
-        else
+        else if (n != (ssize_t)pkt->size)
         {
-            result = make_error(env, ENOMEM);
+            stage->stats.dropped++;
         }
-
-        enif_release_resource(res_fd);
+        stage->held--;
+        enif_free(pkt);
     }
     else
     {
-        result = make_error(env, ENOMEM);
+        if (imp->ready_tail != NULL)
+        {
+            imp->ready_tail->next = pkt;
+        }
+        else
+        {
+            imp->ready = pkt;
+        }
+        imp->ready_tail = pkt;
+        ErlNifEnv *msg_env = imp->waiting ? enif_alloc_env() : NULL;
+        if (msg_env != NULL)
+        {
+            ERL_NIF_TERM dev = enif_make_tuple2(msg_env, s_tundra, enif_make_resource(msg_env, fd_obj));
+            ERL_NIF_TERM ref = enif_make_copy(msg_env, imp->wait_ref);
+            enif_send(NULL, &imp->waiter, msg_env, enif_make_tuple4(msg_env, s_socket, dev, s_select, ref));
+            enif_free_env(msg_env);
+            imp->waiting = false;
+        }
     }
+    enif_mutex_unlock(imp->lock);
+}
 
-    if (fd >= 0)
+// An address as a tuple of 4 bytes or 8 16-bit groups, as inet does
+static ERL_NIF_TERM make_ip(ErlNifEnv *env, const unsigned char *addr, bool v4)
+{
+    ERL_NIF_TERM parts[8];
+    for (int i = 0; i < (v4 ? 4 : 8); ++i)
     {
-        close(fd);
+        parts[i] = enif_make_int(env, v4 ? addr[i] : addr[2 * i] << 8 | addr[2 * i + 1]);
     }
+    return enif_make_tuple_from_array(env, parts, v4 ? 4 : 8);
+}
 
-    return result;
+// An address and port as {Ip, Port}, with IPv4-mapped addresses given as IPv4
+static ERL_NIF_TERM make_endpoint(ErlNifEnv *env, const struct sockaddr_storage *ss)
+{
+    const unsigned char *addr;
+    int port;
+    bool v4;
+    if (ss->ss_family == AF_INET)
+    {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+        addr = (const unsigned char *)&sin->sin_addr;
+        port = ntohs(sin->sin_port);
+        v4 = true;
+    }
+    else
+    {
+        static const unsigned char mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+        addr = sin6->sin6_addr.s6_addr;
+        port = ntohs(sin6->sin6_port);
+        v4 = memcmp(addr, mapped, sizeof(mapped)) == 0;
+        addr += v4 ? sizeof(mapped) : 0;
+    }
+    return enif_make_tuple2(env, make_ip(env, addr, v4), enif_make_int(env, port));
 }
 
-static ERL_NIF_TERM send_request(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Read {IpBin, Port}, where IpBin is a 4 or 16-byte address
+static bool get_endpoint(ErlNifEnv *env, ERL_NIF_TERM term, struct sockaddr_storage *ss)
 {
-    void *obj;
-    if (argc != 3 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_is_ref(env, argv[1]) || !enif_is_map(env, argv[2]))
+    const ERL_NIF_TERM *tuple;
+    int arity;
+    ErlNifBinary addr;
+    unsigned port;
+    if (!enif_get_tuple(env, term, &arity, &tuple) || arity != 2 || !enif_inspect_binary(env, tuple[0], &addr) ||
+        (addr.size != 4 && addr.size != 16) || !enif_get_uint(env, tuple[1], &port) || port > 0xffff)
     {
-        return enif_make_badarg(env);
+        return false;
     }
-    struct fd_object_t *fd_obj = obj;
-    ErlNifPid self;
-    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    memset(ss, 0, sizeof(*ss));
+    if (addr.size == 4)
     {
-        return enif_make_tuple2(env, s_error, s_not_owner);
+        struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons((uint16_t)port);
+        memcpy(&sin->sin_addr, addr.data, 4);
     }
-    int s = fd_obj->fd;
+    else
+    {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons((uint16_t)port);
+        memcpy(&sin6->sin6_addr, addr.data, 16);
+    }
+    return true;
+}
 
-    struct request_t req = {
-        .type = REQUEST_TYPE_CREATE_TUN,
-        .msg.create_tun = {
-            .size = sizeof(struct create_tun_request_t)}};
+// Pass a datagram that arrived on a device's tunnel socket but is not a data
+// message to the device's owner, as {tundra_tunnel, {'$tundra', Dev}, {Ip,
+// Port}, Data}. Called by the tunnel thread (see tunnel.h).
+static void deliver_tunnel_control(void *obj, ErlNifPid *owner, const struct sockaddr_storage *from,
+                                   const unsigned char *data, size_t len)
+{
+    ErlNifEnv *msg_env = enif_alloc_env();
+    if (msg_env == NULL)
+    {
+        return;
+    }
+    ERL_NIF_TERM bin;
+    unsigned char *p = enif_make_new_binary(msg_env, len, &bin);
+    if (p != NULL)
+    {
+        memcpy(p, data, len);
+        ERL_NIF_TERM dev = enif_make_tuple2(msg_env, s_tundra, enif_make_resource(msg_env, obj));
+        ERL_NIF_TERM msg = enif_make_tuple4(msg_env, s_tundra_tunnel, dev, make_endpoint(msg_env, from), bin);
+        enif_send(NULL, owner, msg_env, msg);
+    }
+    enif_free_env(msg_env);
+}
 
+// Fill a create_tun_request_t from a parameters map. Keys that are absent
+// leave the corresponding field zeroed; unknown keys are ignored.
+static bool get_create_tun_request(ErlNifEnv *env, ERL_NIF_TERM map, struct create_tun_request_t *req)
+{
     ErlNifMapIterator iter;
-    if (!enif_map_iterator_create(env, argv[2], &iter, ERL_NIF_MAP_ITERATOR_FIRST))
+    if (!enif_map_iterator_create(env, map, &iter, ERL_NIF_MAP_ITERATOR_FIRST))
     {
-        return enif_make_badarg(env);
+        return false;
     }
+
     ERL_NIF_TERM key, value;
     bool ok = true;
     while (ok && enif_map_iterator_get_pair(env, &iter, &key, &value))
     {
         if (0 == enif_compare(key, s_addr))
         {
-            ok = !!enif_get_string(env, value, req.msg.create_tun.addr, sizeof(req.msg.create_tun.addr), ERL_NIF_UTF8);
+            ok = !!enif_get_string(env, value, req->addr, sizeof(req->addr), ERL_NIF_UTF8);
         }
         else if (0 == enif_compare(key, s_dstaddr))
         {
-            ok = !!enif_get_string(env, value, req.msg.create_tun.dstaddr, sizeof(req.msg.create_tun.dstaddr), ERL_NIF_UTF8);
+            ok = !!enif_get_string(env, value, req->dstaddr, sizeof(req->dstaddr), ERL_NIF_UTF8);
         }
         else if (0 == enif_compare(key, s_netmask))
         {
-            ok = !!enif_get_string(env, value, req.msg.create_tun.netmask, sizeof(req.msg.create_tun.netmask), ERL_NIF_UTF8);
+            ok = !!enif_get_string(env, value, req->netmask, sizeof(req->netmask), ERL_NIF_UTF8);
         }
         else if (0 == enif_compare(key, s_mtu))
         {
-            ok = !!enif_get_int(env, value, &req.msg.create_tun.mtu);
+            ok = !!enif_get_int(env, value, &req->mtu);
+        }
+        else if (0 == enif_compare(key, s_txqueuelen))
+        {
+            ok = !!enif_get_int(env, value, &req->txqueuelen);
         }
 
         enif_map_iterator_next(env, &iter);
     }
     enif_map_iterator_destroy(env, &iter);
-    if (!ok)
-    {
-        return enif_make_badarg(env);
-    }
-
-    int rc = send(s, &req, sizeof(req), TUNDRA_MSG_NOSIGNAL);
-    if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-    {
-        if (enif_select(env, s, ERL_NIF_SELECT_WRITE, obj, NULL, argv[1]) < 0)
-        {
-            return enif_make_badarg(env);
-        }
-        return enif_make_tuple2(env, s_error, s_eagain);
-    }
-    if (rc == -1)
-    {
-        return make_error(env, errno);
-    }
 
-    return s_ok;
+    return ok;
 }
 
-static ERL_NIF_TERM try_connect(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Fill a configure_tun_request_t from a list of changes: {mtu, Mtu}, {up,
+// Boolean}, and {Op, {Address, PrefixLen}} for the address and route
+// operations, with the address as a 4 or 16-byte binary.
+static bool get_configure_tun_request(ErlNifEnv *env, ERL_NIF_TERM list, struct configure_tun_request_t *req)
 {
-    void *obj;
-    if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    ERL_NIF_TERM head;
+    while (enif_get_list_cell(env, list, &head, &list))
     {
-        return enif_make_badarg(env);
-    }
-    struct fd_object_t *fd_obj = obj;
-    int s = fd_obj->fd;
+        const ERL_NIF_TERM *change;
+        int arity;
+        if (req->count == TUN_MAX_CHANGES || !enif_get_tuple(env, head, &arity, &change) || arity != 2)
+        {
+            return false;
+        }
 
-    struct sockaddr_un addr = {0};
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SVR_PATH, sizeof(addr.sun_path) - 1);
+        struct tun_change_t *c = &req->changes[req->count++];
+        if (enif_compare(change[0], s_mtu) == 0)
+        {
+            c->op = TUN_CHANGE_MTU;
+            if (!enif_get_int(env, change[1], &c->value) || c->value <= 0)
+            {
+                return false;
+            }
+            continue;
+        }
+        if (enif_compare(change[0], s_up) == 0)
+        {
+            c->op = TUN_CHANGE_LINK;
+            c->value = enif_compare(change[1], s_true) == 0;
+            continue;
+        }
 
-    int ret = connect(s, (struct sockaddr *)&addr, sizeof(addr));
-    if (ret == 0)
-    {
-        return enif_make_tuple2(env, s_ok, argv[0]);
-    }
+        if (enif_compare(change[0], s_add_address) == 0)
+        {
+            c->op = TUN_CHANGE_ADD_ADDRESS;
+        }
+        else if (enif_compare(change[0], s_remove_address) == 0)
+        {
+            c->op = TUN_CHANGE_REMOVE_ADDRESS;
+        }
+        else if (enif_compare(change[0], s_add_route) == 0)
+        {
+            c->op = TUN_CHANGE_ADD_ROUTE;
+        }
+        else if (enif_compare(change[0], s_remove_route) == 0)
+        {
+            c->op = TUN_CHANGE_REMOVE_ROUTE;
+        }
+        else
+        {
+            return false;
+        }
+
+        const ERL_NIF_TERM *prefix;
+        ErlNifBinary addr;
+        unsigned prefixlen;
+        if (!enif_get_tuple(env, change[1], &arity, &prefix) || arity != 2 ||
+            !enif_inspect_binary(env, prefix[0], &addr) || (addr.size != 4 && addr.size != 16) ||
+            !enif_get_uint(env, prefix[1], &prefixlen) || prefixlen > addr.size * 8)
+        {
+            return false;
+        }
+        c->family = addr.size == 4 ? AF_INET : AF_INET6;
+        c->prefixlen = (unsigned char)prefixlen;
+        memcpy(c->addr, addr.data, addr.size);
+    }
+    return enif_is_empty_list(env, list);
+}
+
+#ifdef __linux__
+// Devices created directly in a namespace share its netlink context, which
+// the lock serialises
+static ErlNifMutex *s_netns_lock;
+static struct tun_netns_cache_t s_netns_cache;
+
+// setns(2) moves only the calling thread, and a scheduler left in another
+// namespace (if returning failed) would open every later socket there. Work
+// that may switch namespaces therefore runs on a thread made for the call,
+// which is joined before it returns and takes any namespace with it.
+struct netns_call_t
+{
+    int (*fn)(void *arg);
+    void *arg;
+    int result;
+};
+
+static void *netns_call_main(void *p)
+{
+    struct netns_call_t *call = p;
+    call->result = call->fn(call->arg);
+    return NULL;
+}
+
+// Returns: fn's result, or -EAGAIN if the thread could not be created
+static int netns_call(int (*fn)(void *arg), void *arg)
+{
+    struct netns_call_t call = {.fn = fn, .arg = arg, .result = 0};
+    ErlNifTid tid;
+    if (enif_thread_create("tundra_netns", &tid, netns_call_main, &call, NULL) != 0)
+    {
+        return -EAGAIN;
+    }
+    enif_thread_join(tid, NULL);
+    return call.result;
+}
+
+struct netns_create_t
+{
+    int nsfd; // -1 once the cache has taken it
+    const char *name; // to configure, or NULL to create
+    const struct create_tun_request_t *req;
+    struct create_tun_response_t *resp;
+};
+
+static int netns_create(void *arg)
+{
+    struct netns_create_t *c = arg;
+    struct tun_netns_t *ns;
+    enif_mutex_lock(s_netns_lock);
+    int result = tun_netns_get_safe(&s_netns_cache, c->nsfd, &ns);
+    c->nsfd = -1;
+    if (result >= 0)
+    {
+        result = c->name != NULL ? tun_configure_netns_safe(ns, c->name, c->req)
+                                 : tun_create_netns_safe(ns, c->req, c->resp);
+    }
+    enif_mutex_unlock(s_netns_lock);
+    return result;
+}
+
+// Create (or configure) a device inside a namespace; takes nsfd
+static int netns_create_safe(int nsfd, const char *name, const struct create_tun_request_t *req,
+                             struct create_tun_response_t *resp)
+{
+    struct netns_create_t c = {.nsfd = nsfd, .name = name, .req = req, .resp = resp};
+    int result = netns_call(netns_create, &c);
+    if (c.nsfd != -1)
+    {
+        close(c.nsfd);
+    }
+    return result;
+}
+
+struct netns_reconfigure_t
+{
+    int fd;
+    const struct configure_tun_request_t *req;
+};
+
+static int netns_reconfigure(void *arg)
+{
+    struct netns_reconfigure_t *r = arg;
+    return tun_reconfigure_safe(r->fd, r->req);
+}
+#endif
+
+// Open the namespace named by the netns key of a creation parameters map,
+// either a path (charlist) or a descriptor.
+// Returns: 0 with *nsfd -1 if there is no such key, 0 with *nsfd open, or
+// -errno (-EINVAL if the value is neither)
+static int get_netns(ErlNifEnv *env, ERL_NIF_TERM map, int *nsfd)
+{
+    ERL_NIF_TERM value;
+    *nsfd = -1;
+    if (!enif_get_map_value(env, map, s_netns, &value))
+    {
+        return 0;
+    }
+#ifdef __linux__
+    char path[4096];
+    int fd;
+    int result;
+    if (enif_get_string(env, value, path, sizeof(path), ERL_NIF_UTF8) > 1)
+    {
+        result = netns_open(path, -1);
+    }
+    else if (enif_get_int(env, value, &fd) && fd >= 0)
+    {
+        result = netns_open(NULL, fd);
+    }
+    else
+    {
+        return -EINVAL;
+    }
+    if (result < 0)
+    {
+        return result;
+    }
+    *nsfd = result;
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+static int load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
+{
+    (void)priv_data;
+    (void)load_info;
+    s_ok = enif_make_atom(env, "ok");
+    s_error = enif_make_atom(env, "error");
+    s_eagain = enif_make_atom(env, "eagain");
+    s_not_owner = enif_make_atom(env, "not_owner");
+    s_addr = enif_make_atom(env, "addr");
+    s_dstaddr = enif_make_atom(env, "dstaddr");
+    s_netmask = enif_make_atom(env, "netmask");
+    s_mtu = enif_make_atom(env, "mtu");
+    s_txqueuelen = enif_make_atom(env, "txqueuelen");
+    s_recv = enif_make_atom(env, "recv");
+    s_send = enif_make_atom(env, "send");
+    s_select = enif_make_atom(env, "select");
+    s_select_info = enif_make_atom(env, "select_info");
+    s_socket = enif_make_atom(env, "$socket");
+    s_tundra = enif_make_atom(env, "$tundra");
+    s_tundra_poll = enif_make_atom(env, "$tundra_poll");
+    s_true = enif_make_atom(env, "true");
+    s_closed = enif_make_atom(env, "closed");
+    s_rx_packets = enif_make_atom(env, "rx_packets");
+    s_rx_bytes = enif_make_atom(env, "rx_bytes");
+    s_tx_packets = enif_make_atom(env, "tx_packets");
+    s_tx_bytes = enif_make_atom(env, "tx_bytes");
+    s_eagain_count = enif_make_atom(env, "eagain");
+    s_selects = enif_make_atom(env, "selects");
+    s_enobufs = enif_make_atom(env, "enobufs");
+    s_emsgsize = enif_make_atom(env, "emsgsize");
+    s_max_packet = enif_make_atom(env, "max_packet");
+    s_disabled = enif_make_atom(env, "disabled");
+    s_ready = enif_make_atom(env, "ready");
+    s_queue_full = enif_make_atom(env, "queue_full");
+    s_tundra_send_queue = enif_make_atom(env, "tundra_send_queue");
+    s_high = enif_make_atom(env, "high");
+    s_low = enif_make_atom(env, "low");
+    s_send_queue_packets = enif_make_atom(env, "send_queue_packets");
+    s_send_queue_bytes = enif_make_atom(env, "send_queue_bytes");
+    s_send_queue_drops = enif_make_atom(env, "send_queue_drops");
+    s_class = enif_make_atom(env, "class");
+    s_weight = enif_make_atom(env, "weight");
+    s_priority = enif_make_atom(env, "priority");
+    s_packets = enif_make_atom(env, "packets");
+    s_bytes = enif_make_atom(env, "bytes");
+    s_drops = enif_make_atom(env, "drops");
+    s_sent = enif_make_atom(env, "sent");
+    s_delay = enif_make_atom(env, "delay");
+    s_lost = enif_make_atom(env, "lost");
+    s_duplicated = enif_make_atom(env, "duplicated");
+    s_delayed = enif_make_atom(env, "delayed");
+    s_reordered = enif_make_atom(env, "reordered");
+    s_overlimit = enif_make_atom(env, "overlimit");
+    s_dropped = enif_make_atom(env, "dropped");
+    s_held = enif_make_atom(env, "held");
+    s_rx_full = enif_make_atom(env, "rx_full");
+    s_tx_errors = enif_make_atom(env, "tx_errors");
+    s_wakeups = enif_make_atom(env, "wakeups");
+    s_up = enif_make_atom(env, "up");
+    s_add_address = enif_make_atom(env, "add_address");
+    s_remove_address = enif_make_atom(env, "remove_address");
+    s_add_route = enif_make_atom(env, "add_route");
+    s_remove_route = enif_make_atom(env, "remove_route");
+    s_configured = enif_make_atom(env, "configured");
+    s_refused = enif_make_atom(env, "refused");
+    s_netns = enif_make_atom(env, "netns");
+    s_tundra_tunnel = enif_make_atom(env, "tundra_tunnel");
+    s_chacha20_poly1305 = enif_make_atom(env, "chacha20_poly1305");
+    s_aes_256_gcm = enif_make_atom(env, "aes_256_gcm");
+    s_no_route = enif_make_atom(env, "no_route");
+    s_unknown_peer = enif_make_atom(env, "unknown_peer");
+    s_auth_failures = enif_make_atom(env, "auth_failures");
+    s_replays = enif_make_atom(env, "replays");
+    s_control = enif_make_atom(env, "control");
+    s_peers = enif_make_atom(env, "peers");
+    s_index = enif_make_atom(env, "index");
+    s_counter = enif_make_atom(env, "counter");
+    s_busy_polls = enif_make_atom(env, "busy_polls");
+    s_busy_poll_hits = enif_make_atom(env, "busy_poll_hits");
+    s_busy_poll_time = enif_make_atom(env, "busy_poll_time");
+    s_src = enif_make_atom(env, "src");
+    s_dst = enif_make_atom(env, "dst");
+    s_sport = enif_make_atom(env, "sport");
+    s_dport = enif_make_atom(env, "dport");
+    s_protocol = enif_make_atom(env, "protocol");
+    s_direction = enif_make_atom(env, "direction");
+    s_inbound = enif_make_atom(env, "inbound");
+    s_outbound = enif_make_atom(env, "outbound");
+    s_start = enif_make_atom(env, "start");
+    s_end = enif_make_atom(env, "end");
+    s_tcp_flags = enif_make_atom(env, "tcp_flags");
+    s_reason = enif_make_atom(env, "reason");
+    s_idle = enif_make_atom(env, "idle");
+    s_active = enif_make_atom(env, "active");
+    s_forced = enif_make_atom(env, "forced");
+    s_evicted = enif_make_atom(env, "evicted");
+    s_flows = enif_make_atom(env, "flows");
+    s_created = enif_make_atom(env, "created");
+    s_expired = enif_make_atom(env, "expired");
+    s_queued = enif_make_atom(env, "queued");
+    s_exported = enif_make_atom(env, "exported");
+    s_export_errors = enif_make_atom(env, "export_errors");
+    s_memory = enif_make_atom(env, "memory");
+    if (watch_init() != 0 || sendq_init(drain_send_queue) != 0 || impair_init(deliver_impaired) != 0 ||
+        tunnel_init(deliver_tunnel_control) != 0 || flow_init() != 0 || rxbuf_init(env) != 0)
+    {
+        return -1;
+    }
+    if ((s_poll_lock = enif_mutex_create("tundra_poll_sets")) == NULL)
+    {
+        return -1;
+    }
+#ifdef __linux__
+    if ((s_netns_lock = enif_mutex_create("tundra_netns")) == NULL)
+    {
+        return -1;
+    }
+    tun_netns_cache_init(&s_netns_cache);
+#endif
+    s_fdrt = enif_init_resource_type(env, "fdrt", &s_fdrt_init, ERL_NIF_RT_CREATE, NULL);
+    return s_fdrt ? 0 : -1;
+}
+
+static void unload(ErlNifEnv *env, void *priv_data)
+{
+    (void)env;
+    (void)priv_data;
+    watch_shutdown();
+    impair_shutdown();
+    tunnel_shutdown();
+    flow_shutdown();
+    enif_mutex_destroy(s_poll_lock);
+#ifdef __linux__
+    tun_netns_cache_clear(&s_netns_cache);
+    enif_mutex_destroy(s_netns_lock);
+#endif
+}
+
+static ERL_NIF_TERM recv_response(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_is_ref(env, argv[1]))
+    {
+        return enif_make_badarg(env);
+    }
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    int s = fd_obj->fd;
+
+    struct response_t resp = {0};
+    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {
+        .iov_base = &resp,
+        .iov_len = sizeof(resp)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cmsgbuf,
+        .msg_controllen = sizeof cmsgbuf,
+    };
+
+    int ret = recvmsg(s, &msg, 0);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        if (enif_select(env, s, ERL_NIF_SELECT_READ, obj, NULL, argv[1]) < 0)
+        {
+            return enif_make_badarg(env);
+        }
+        return enif_make_tuple2(env, s_error, s_eagain);
+    }
+
+    if (ret == -1)
+    {
+        return make_error(env, errno);
+    }
+    if (ret == 0)
+    {
+        // The server closed the connection, as one older than the versioned
+        // protocol does on receiving a request it cannot read
+        return make_error(env, ECONNRESET);
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if ((size_t)ret < sizeof(resp.header) || resp.header.magic != TUNDRA_PROTOCOL_MAGIC ||
+        resp.header.version != TUNDRA_PROTOCOL_VERSION)
+    {
+        // A server of another version (which refuses the request with EPROTO
+        // in any case): the connection is of no further use
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+            close(fd);
+        }
+        return make_error(env, EPROTO);
+    }
+
+    // The outcome of a reconfiguration, which passes no descriptor back
+    if (resp.type == REQUEST_TYPE_CONFIGURE_TUN && cmsg == NULL)
+    {
+        int err = resp.error;
+        return enif_make_tuple2(env, s_configured, err == 0 ? s_ok : make_error(env, err));
+    }
+
+    // A create or attach request the server could not carry out
+    if (cmsg == NULL && resp.error != 0)
+    {
+        return enif_make_tuple2(env, s_refused, make_error(env, resp.error));
+    }
+
+    // Read the aux data and check for the file descriptor
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+    {
+        return make_error(env, EINVAL);
+    }
+    // Extract the file descriptor
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+    ERL_NIF_TERM result;
+
+    // Allocate a resource for the file descriptor so that it becomes owned by the calling process
+    struct fd_object_t *res_fd = alloc_fd_object(env);
+    if (res_fd)
+    {
+        res_fd->fd = fd;
+        // Allocate a binary to hold the name of the tun device
+        const char *name = resp.type == REQUEST_TYPE_ATTACH_TUN
+                               ? resp.msg.attach_tun.name
+                               : resp.msg.create_tun.name;
+        ErlNifBinary name_bin;
+        if (enif_alloc_binary(strlen(name), &name_bin))
+        {
+            memcpy(name_bin.data, name, name_bin.size);
+
+            ERL_NIF_TERM info = enif_make_tuple2(env, enif_make_resource(env, res_fd), enif_make_binary(env, &name_bin));
+            enif_release_binary(&name_bin);
+
+            fd = -1; // Ownership has moved
+            result = enif_make_tuple2(env, s_ok, info);
+        }
+        else
+        {
+            result = make_error(env, ENOMEM);
+        }
+
+        enif_release_resource(res_fd);
+    }
+    else
+    {
+        result = make_error(env, ENOMEM);
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    return result;
+}
+
+// Send a request to the server over the connection resource in argv[0],
+// arming a write select on EAGAIN with the ref in argv[1]. A device
+// descriptor is passed with the request if `dev_fd` is not -1.
+static ERL_NIF_TERM send_server_request(ErlNifEnv *env, const ERL_NIF_TERM argv[], struct fd_object_t *fd_obj, const struct request_t *req,
+                                        int dev_fd)
+{
+    int s = fd_obj->fd;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {
+        .iov_base = (void *)req,
+        .iov_len = sizeof(*req)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    if (dev_fd != -1)
+    {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &dev_fd, sizeof(dev_fd));
+    }
+
+    int rc = sendmsg(s, &msg, TUNDRA_MSG_NOSIGNAL);
+    if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        if (enif_select(env, s, ERL_NIF_SELECT_WRITE, fd_obj, NULL, argv[1]) < 0)
+        {
+            return enif_make_badarg(env);
+        }
+        return enif_make_tuple2(env, s_error, s_eagain);
+    }
+    if (rc == -1)
+    {
+        return make_error(env, errno);
+    }
+
+    return s_ok;
+}
+
+static ERL_NIF_TERM send_request(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 3 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_is_ref(env, argv[1]) || !enif_is_map(env, argv[2]))
+    {
+        return enif_make_badarg(env);
+    }
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+
+    struct request_t req = {
+        .header = TUNDRA_MESSAGE_HEADER,
+        .type = REQUEST_TYPE_CREATE_TUN,
+        .msg.create_tun = {
+            .size = sizeof(struct create_tun_request_t)}};
+
+    if (!get_create_tun_request(env, argv[2], &req.msg.create_tun))
+    {
+        return enif_make_badarg(env);
+    }
+
+    // The server creates the device in the namespace whose descriptor comes
+    // with the request
+    int nsfd;
+    int err = get_netns(env, argv[2], &nsfd);
+    if (err < 0)
+    {
+        return make_error(env, -err);
+    }
+    ERL_NIF_TERM result = send_server_request(env, argv, fd_obj, &req, nsfd);
+    if (nsfd != -1)
+    {
+        close(nsfd);
+    }
+    return result;
+}
+
+static ERL_NIF_TERM send_attach_request(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    struct request_t req = {
+        .header = TUNDRA_MESSAGE_HEADER,
+        .type = REQUEST_TYPE_ATTACH_TUN,
+        .msg.attach_tun = {
+            .size = sizeof(struct attach_tun_request_t)}};
+
+    if (argc != 3 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_is_ref(env, argv[1]) ||
+        !enif_get_string(env, argv[2], req.msg.attach_tun.name, sizeof(req.msg.attach_tun.name), ERL_NIF_UTF8))
+    {
+        return enif_make_badarg(env);
+    }
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+
+    return send_server_request(env, argv, fd_obj, &req, -1);
+}
+
+// Ask the server to change a device, passing it the device's descriptor.
+//
+// The connection belongs to the calling process, which is not the device's
+// owner: the owner waits on the call, so cannot close the device meanwhile.
+static ERL_NIF_TERM send_configure_request(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj, *dev;
+    struct request_t req = {
+        .header = TUNDRA_MESSAGE_HEADER,
+        .type = REQUEST_TYPE_CONFIGURE_TUN,
+        .msg.configure_tun = {
+            .size = sizeof(struct configure_tun_request_t)}};
+
+    if (argc != 4 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_is_ref(env, argv[1]) ||
+        !enif_get_resource(env, argv[2], s_fdrt, &dev) ||
+        !get_configure_tun_request(env, argv[3], &req.msg.configure_tun))
+    {
+        return enif_make_badarg(env);
+    }
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    struct fd_object_t *dev_obj = dev;
+    int dev_fd = atomic_load((atomic_int *)&dev_obj->fd);
+    if (dev_obj->members != NULL)
+    {
+        return enif_make_badarg(env);
+    }
+    if (dev_fd == -1)
+    {
+        return enif_make_tuple2(env, s_error, s_closed);
+    }
+
+    return send_server_request(env, argv, fd_obj, &req, dev_fd);
+}
+
+static ERL_NIF_TERM try_connect(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+    struct fd_object_t *fd_obj = obj;
+    int s = fd_obj->fd;
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, SVR_PATH, sizeof(addr.sun_path) - 1);
+
+    int ret = connect(s, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret == 0)
+    {
+        return enif_make_tuple2(env, s_ok, argv[0]);
+    }
     if (errno == EINPROGRESS)
     {
-        return enif_make_tuple2(env, s_ok, argv[0]);
+        return enif_make_tuple2(env, s_ok, argv[0]);
+    }
+    else if (errno == EINTR)
+    {
+        return enif_schedule_nif(env, "try_connect", 0, try_connect, argc, argv);
+    }
+    else
+    {
+        return make_error(env, errno);
+    }
+}
+
+static ERL_NIF_TERM connect_svr(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    struct fd_object_t *fd_obj = alloc_fd_object(env);
+    if (fd_obj == NULL)
+    {
+        return make_error(env, ENOMEM);
+    }
+
+    ERL_NIF_TERM ret;
+
+    fd_obj->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_obj->fd == -1)
+    {
+        goto error;
+    }
+    if (-1 == fcntl(fd_obj->fd, F_SETFL, fcntl(fd_obj->fd, F_GETFL) | O_NONBLOCK))
+    {
+        goto error;
+    }
+#ifdef __APPLE__
+    if (-1 == setsockopt(fd_obj->fd, SOL_SOCKET, SO_NOSIGPIPE, &(int){1}, sizeof(int)))
+    {
+        goto error;
+    }
+#endif
+
+    ERL_NIF_TERM res = enif_make_resource(env, fd_obj);
+    ret = enif_schedule_nif(env, "try_connect", 0, try_connect, 1, &res);
+    goto exit;
+
+error:
+    ret = make_error(env, errno);
+
+exit:
+    enif_release_resource(fd_obj);
+    return ret;
+}
+
+static ERL_NIF_TERM controlling_process(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    ErlNifPid pid;
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_get_local_pid(env, argv[1], &pid))
+    {
+        return enif_make_badarg(env);
+    }
+    struct fd_object_t *fd_obj = obj;
+
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+
+    if (enif_compare_pids(&fd_obj->cp, &pid) != 0)
+    {
+        fd_obj->cp = pid;
+        struct sendq_t *q = atomic_load(&fd_obj->sendq);
+        if (q != NULL)
+        {
+            enif_mutex_lock(q->lock);
+            q->owner = pid;
+            enif_mutex_unlock(q->lock);
+        }
+        struct tunnel_t *t = atomic_load(&fd_obj->tunnel);
+        if (t != NULL)
+        {
+            tunnel_set_owner(t, &pid);
+        }
+        enif_demonitor_process(env, fd_obj, &fd_obj->mon);
+        if (enif_monitor_process(env, fd_obj, &pid, &fd_obj->mon) != 0)
+        {
+            enif_select(env, fd_obj->fd, ERL_NIF_SELECT_STOP, fd_obj, NULL, enif_make_ref(env));
+        }
+    }
+
+    return s_ok;
+}
+
+static ERL_NIF_TERM close_fd(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+
+    int ret = enif_select(env, fd_obj->fd, ERL_NIF_SELECT_STOP, fd_obj, NULL, enif_make_ref(env));
+    if (ret < 0)
+    {
+        if (ret & ERL_NIF_SELECT_FAILED)
+        {
+            return make_error(env, errno);
+        }
+        else
+        {
+            return make_error(env, EINVAL);
+        }
+    }
+
+    return s_ok;
+}
+
+static ERL_NIF_TERM get_fd(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    return enif_make_int(env, fd_obj->fd);
+}
+
+#define BUSY_POLL_MAX_USEC 1000
+#define BUSY_POLL_MIN_NS 1000
+#define BUSY_POLL_PROBE 32
+
+// Spin on a device that a read has just found empty, for up to its busy poll
+// budget, in case a packet arrives sooner than the owner would be scheduled
+// after a select. Returns true if the device became readable. The time spent
+// is charged to the caller's timeslice (nominally 1ms), so a process that
+// spins is scheduled out as soon as one that runs as long would be.
+static bool busy_poll(ErlNifEnv *env, struct fd_object_t *fd_obj)
+{
+    struct busy_poll_t *bp = &fd_obj->busy;
+    int64_t budget = bp->budget;
+    if (budget == 0)
+    {
+        if (++bp->idle < BUSY_POLL_PROBE)
+        {
+            return false;
+        }
+        bp->idle = 0;
+        budget = bp->max;
+    }
+
+    struct pollfd pfd = {.fd = fd_obj->fd, .events = POLLIN};
+    int64_t start = enif_monotonic_time(ERL_NIF_NSEC);
+    int64_t now;
+    int ready;
+    do
+    {
+        ready = poll(&pfd, 1, 0);
+        now = enif_monotonic_time(ERL_NIF_NSEC);
+    } while (ready == 0 && now - start < budget);
+
+    int64_t spent = now - start;
+    int percent = (int)(spent / 10000);
+    enif_consume_timeslice(env, percent < 1 ? 1 : percent > 100 ? 100 : percent);
+    stat_add(&fd_obj->stats.busy_polls, 1);
+    stat_add(&fd_obj->stats.busy_poll_ns, (uint64_t)spent);
+    if (ready > 0)
+    {
+        stat_add(&fd_obj->stats.busy_poll_hits, 1);
+        int64_t target = 2 * spent < bp->max ? 2 * spent : bp->max;
+        bp->budget = bp->budget == 0 ? target : bp->budget + (target - bp->budget) / 4;
+        if (bp->budget < BUSY_POLL_MIN_NS)
+        {
+            bp->budget = BUSY_POLL_MIN_NS < bp->max ? BUSY_POLL_MIN_NS : bp->max;
+        }
+        return true;
+    }
+    bp->budget = bp->budget / 2 < BUSY_POLL_MIN_NS ? 0 : bp->budget / 2;
+    return false;
+}
+
+// Headroom and tailroom to read packets with (see rxbuf.h), both 0 for none
+struct room_t
+{
+    unsigned head;
+    unsigned tail;
+};
+
+static const struct room_t s_no_room = {0, 0};
+
+static bool get_room(ErlNifEnv *env, ERL_NIF_TERM head, ERL_NIF_TERM tail, struct room_t *room)
+{
+    return enif_get_uint(env, head, &room->head) && enif_get_uint(env, tail, &room->tail) &&
+           room->head <= RXBUF_MAX_ROOM && room->tail <= RXBUF_MAX_ROOM;
+}
+
+// Where a packet is read: a binary, or a buffer with room around the packet.
+// `data` and `size` are the space for the TUN header and the packet.
+struct read_buf_t
+{
+    ErlNifBinary bin;
+    struct rxbuf_t *rx;
+    unsigned char *data;
+    size_t size;
+};
+
+static bool read_buf_alloc(struct read_buf_t *buf, int length, const struct room_t *room)
+{
+    if (room->head == 0 && room->tail == 0)
+    {
+        buf->rx = NULL;
+        if (!enif_alloc_binary(length + 4, &buf->bin))
+        {
+            return false;
+        }
+        buf->data = buf->bin.data;
+        buf->size = buf->bin.size;
+        return true;
+    }
+    // The TUN header goes in the headroom, where there is enough
+    if ((buf->rx = rxbuf_alloc(room->head, length, room->tail, 4)) == NULL)
+    {
+        return false;
+    }
+    buf->data = buf->rx->data + buf->rx->front - 4;
+    buf->size = (size_t)length + 4;
+    return true;
+}
+
+static void read_buf_release(struct read_buf_t *buf)
+{
+    if (buf->rx != NULL)
+    {
+        rxbuf_release(buf->rx);
+    }
+    else
+    {
+        enif_release_binary(&buf->bin);
+    }
+}
+
+// Make the binary of the packet in the `n` bytes read into `buf`, skipping the
+// TUN header. Returns false if there is no memory to register it.
+static bool read_buf_packet(ErlNifEnv *env, struct read_buf_t *buf, size_t n, ERL_NIF_TERM *packet)
+{
+    if (buf->rx != NULL)
+    {
+        return rxbuf_publish(env, buf->rx, n - 4, packet) == 0;
+    }
+    *packet = enif_make_sub_binary(env, enif_make_binary(env, &buf->bin), 4, n - 4);
+    return true;
+}
+
+// Count, capture and return a packet of `n` bytes read into `buf`.
+static ERL_NIF_TERM recv_result(ErlNifEnv *env, struct fd_object_t *fd_obj, struct read_buf_t *buf, size_t n)
+{
+    stat_add(&fd_obj->stats.rx_packets, 1);
+    stat_add(&fd_obj->stats.rx_bytes, n - 4);
+    stat_max(&fd_obj->stats.max_packet, n - 4);
+#ifdef TUN_PKT_STRIP
+    // The kernel flags packets truncated to fit the buffer
+    uint16_t pi_flags;
+    memcpy(&pi_flags, buf->data, sizeof(pi_flags));
+    if (pi_flags & TUN_PKT_STRIP)
+    {
+        stat_add(&fd_obj->stats.emsgsize, 1);
+    }
+#endif
+    if (fd_obj->tap != NULL)
+    {
+        struct iovec iov = {buf->data, n};
+        capture_packet(fd_obj->tap, &iov, 1, 4, n - 4, CAPTURE_INBOUND);
+    }
+    if (fd_obj->acct != NULL)
+    {
+        struct iovec iov = {buf->data, n};
+        flow_packet(fd_obj->acct, &iov, 1, 4, n - 4, FLOW_INBOUND, enif_monotonic_time(ERL_NIF_NSEC));
+    }
+    // Skip 4-byte TUN header, return only the IP packet
+    ERL_NIF_TERM bin;
+    if (!read_buf_packet(env, buf, n, &bin))
+    {
+        return make_error(env, ENOMEM);
+    }
+    return enif_make_tuple2(env, s_ok, bin);
+}
+
+#define IMPAIR_READ_BUDGET 64
+
+// recv_data through an impairment stage (see impair.h). Packets that are due
+// wait in the `ready` queue and are returned first. Otherwise packets are read
+// from the device and passed through the stage until one is to be delivered at
+// once; those it delays are added to the queue by the wheel. If none is, the
+// device is selected as usual, and should a delayed packet become due first
+// the wheel sends the select message instead. Called with the lock held.
+static ERL_NIF_TERM recv_impaired(ErlNifEnv *env, ERL_NIF_TERM handle, struct fd_object_t *fd_obj,
+                                  struct impair_t *imp, struct read_buf_t *buf, ssize_t *received, int *error)
+{
+    struct impair_stage_t *stage = &imp->stages[IMPAIR_RECV];
+    imp->waiting = false;
+    *received = -1;
+    *error = EAGAIN;
+    for (int budget = IMPAIR_READ_BUDGET; budget > 0; --budget)
+    {
+        struct impair_pkt_t *pkt = imp->ready;
+        if (pkt != NULL)
+        {
+            if ((imp->ready = pkt->next) == NULL)
+            {
+                imp->ready_tail = NULL;
+            }
+            stage->held--;
+            size_t n = pkt->size < buf->size ? pkt->size : buf->size;
+            memcpy(buf->data, pkt->data, n);
+            enif_free(pkt);
+            *received = (ssize_t)n;
+            *error = 0;
+            return recv_result(env, fd_obj, buf, n);
+        }
+
+        ssize_t n = read(fd_obj->fd, buf->data, buf->size);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            stat_add(&fd_obj->stats.eagain, 1);
+            break;
+        }
+        if (n == -1)
+        {
+            *error = errno;
+            return make_error(env, *error);
+        }
+        if (n == 0)
+        {
+            *error = EPIPE;
+            return enif_make_tuple2(env, s_error, s_closed);
+        }
+        if (n < 4)
+        {
+            *error = EMSGSIZE;
+            stat_add(&fd_obj->stats.emsgsize, 1);
+            return make_error(env, EMSGSIZE);
+        }
+
+        int64_t now = enif_monotonic_time(ERL_NIF_NSEC);
+        int64_t due[2];
+        int copies = impair_decide(stage, now, n - 4, due);
+        bool deliver = false;
+        for (int i = 0; i < copies; ++i)
+        {
+            if (due[i] <= now && !deliver)
+            {
+                deliver = true;
+                continue;
+            }
+            struct impair_pkt_t *copy = impair_pkt_alloc(buf->data, n, IMPAIR_RECV, due[i]);
+            if (copy != NULL && due[i] <= now)
+            {
+                // A duplicate due at once waits for the next call
+                stage->held++;
+                if (imp->ready_tail != NULL)
+                {
+                    imp->ready_tail->next = copy;
+                }
+                else
+                {
+                    imp->ready = copy;
+                }
+                imp->ready_tail = copy;
+            }
+            else if (copy == NULL || impair_schedule(copy, fd_obj) != 0)
+            {
+                stage->held -= due[i] > now;
+                stage->stats.dropped++;
+                if (copy != NULL)
+                {
+                    enif_free(copy);
+                }
+            }
+        }
+        if (deliver)
+        {
+            *received = n;
+            *error = 0;
+            return recv_result(env, fd_obj, buf, n);
+        }
+    }
+
+    // Nothing to deliver (or the read budget is spent and the device is still
+    // readable, in which case the select message arrives at once)
+    ERL_NIF_TERM ref = enif_make_ref(env);
+    ERL_NIF_TERM msg = enif_make_tuple4(env, s_socket, enif_make_tuple2(env, s_tundra, handle), s_select, ref);
+    if (enif_select_read(env, fd_obj->fd, fd_obj, NULL, msg, NULL) < 0)
+    {
+        *error = errno;
+        return make_error(env, *error);
+    }
+    TUNDRA_PROBE2(select_arm, fd_obj->fd, ERL_NIF_SELECT_READ);
+    stat_add(&fd_obj->stats.selects, 1);
+    if (stage->held > 0)
+    {
+        if (imp->wait_env == NULL)
+        {
+            imp->wait_env = enif_alloc_env();
+        }
+        else
+        {
+            enif_clear_env(imp->wait_env);
+        }
+        if (imp->wait_env != NULL && enif_self(env, &imp->waiter) != NULL)
+        {
+            imp->wait_ref = enif_make_copy(imp->wait_env, ref);
+            imp->waiting = true;
+        }
+    }
+    return enif_make_tuple2(env, s_select, enif_make_tuple3(env, s_select_info, s_recv, ref));
+}
+
+static ERL_NIF_TERM recv_data(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 4 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+    struct fd_object_t *fd_obj = obj;
+
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    if (fd_obj->ring != NULL || fd_obj->tun != NULL)
+    {
+        // The ring or tunnel thread reads the device
+        return make_error(env, EBUSY);
+    }
+
+    int length;
+    struct room_t room;
+    if (!enif_get_int(env, argv[1], &length) || length <= 0 || !get_room(env, argv[2], argv[3], &room))
+    {
+        return enif_make_badarg(env);
+    }
+
+    TUNDRA_PROBE2(recv_entry, fd_obj->fd, length);
+    struct fd_latency_t *lat = fd_obj->track;
+    int64_t start = lat ? enif_monotonic_time(ERL_NIF_NSEC) : 0;
+
+    // Add 4 bytes for the TUN header that we strip from the result
+    struct read_buf_t buf;
+    if (!read_buf_alloc(&buf, length, &room))
+    {
+        return make_error(env, ENOMEM);
+    }
+
+    ssize_t n;
+    int err;
+    ERL_NIF_TERM ret;
+    struct impair_t *imp = fd_obj->impair;
+    if (imp != NULL && imp->stages[IMPAIR_RECV].enabled)
+    {
+        enif_mutex_lock(imp->lock);
+        ret = recv_impaired(env, argv[0], fd_obj, imp, &buf, &n, &err);
+        enif_mutex_unlock(imp->lock);
+        goto done;
+    }
+
+    n = read(fd_obj->fd, buf.data, buf.size);
+    err = n == -1 ? errno : 0;
+    if ((err == EAGAIN || err == EWOULDBLOCK) && fd_obj->busy.max > 0 && busy_poll(env, fd_obj))
+    {
+        stat_add(&fd_obj->stats.eagain, 1);
+        n = read(fd_obj->fd, buf.data, buf.size);
+        err = n == -1 ? errno : 0;
+    }
+
+    if (n == -1)
+    {
+        if (err == EAGAIN || err == EWOULDBLOCK)
+        {
+            stat_add(&fd_obj->stats.eagain, 1);
+            ERL_NIF_TERM ref = enif_make_ref(env);
+            ERL_NIF_TERM obj = enif_make_tuple2(env, s_tundra, argv[0]);
+            ERL_NIF_TERM msg = enif_make_tuple4(env, s_socket, obj, s_select, ref);
+            if (enif_select_read(env, fd_obj->fd, fd_obj, NULL, msg, NULL) >= 0)
+            {
+                TUNDRA_PROBE2(select_arm, fd_obj->fd, ERL_NIF_SELECT_READ);
+                stat_add(&fd_obj->stats.selects, 1);
+                if (lat)
+                {
+                    // Best effort; readiness delay is not measured where unsupported
+                    atomic_store_explicit(&lat->ready_at, 0, memory_order_relaxed);
+                    ready_watch(fd_obj->fd, fd_obj, &lat->ready_at, &lat->watch);
+                }
+                ret = enif_make_tuple2(env, s_select, enif_make_tuple3(env, s_select_info, s_recv, ref));
+            }
+            else
+            {
+                ret = make_error(env, errno);
+            }
+        }
+        else
+        {
+            ret = make_error(env, err);
+        }
+    }
+    else if (n == 0)
+    {
+        // End of file: only a loopback device whose peer has been closed
+        err = EPIPE;
+        ret = enif_make_tuple2(env, s_error, s_closed);
+    }
+    else if (n < 4)
+    {
+        // Received less than header size
+        err = EMSGSIZE;
+        stat_add(&fd_obj->stats.emsgsize, 1);
+        ret = make_error(env, err);
+    }
+    else
+    {
+        ret = recv_result(env, fd_obj, &buf, n);
+
+        if (lat)
+        {
+            int64_t ready_at = atomic_exchange_explicit(&lat->ready_at, 0, memory_order_relaxed);
+            if (ready_at != 0 && ready_at <= start)
+            {
+                hist_record(&lat->ready, start - ready_at);
+            }
+        }
+    }
+
+done:
+    read_buf_release(&buf);
+    if (lat)
+    {
+        hist_record(&lat->recv, enif_monotonic_time(ERL_NIF_NSEC) - start);
+    }
+    TUNDRA_PROBE3(recv_return, fd_obj->fd, err == 0 ? n - 4 : -1, err);
+    return ret;
+}
+
+// Read up to `batch` packets from a device for recv_batch and poll_wait.
+// Returns a list of packets, empty if the first read would block, or
+// {error, Reason} if it fails for any other reason. Updates the same counters
+// as recv_data.
+static ERL_NIF_TERM read_batch(ErlNifEnv *env, struct fd_object_t *dev, int length, const struct room_t *room,
+                               int batch, ERL_NIF_TERM *packets)
+{
+    int n = 0;
+    while (n < batch)
+    {
+        struct read_buf_t buf;
+        if (!read_buf_alloc(&buf, length, room))
+        {
+            return n ? enif_make_list_from_array(env, packets, n) : make_error(env, ENOMEM);
+        }
+
+        ssize_t len = read(dev->fd, buf.data, buf.size);
+        int err = len == -1 ? errno : len == 0 ? EPIPE : len < 4 ? EMSGSIZE : 0;
+        TUNDRA_PROBE3(recv_return, dev->fd, err == 0 ? len - 4 : -1, err);
+        if (err != 0)
+        {
+            read_buf_release(&buf);
+            if (err == EMSGSIZE)
+            {
+                stat_add(&dev->stats.emsgsize, 1);
+            }
+            if (n > 0 || err == EAGAIN || err == EWOULDBLOCK)
+            {
+                break;
+            }
+            return err == EPIPE ? enif_make_tuple2(env, s_error, s_closed) : make_error(env, err);
+        }
+
+        stat_add(&dev->stats.rx_packets, 1);
+        stat_add(&dev->stats.rx_bytes, len - 4);
+        stat_max(&dev->stats.max_packet, len - 4);
+        if (dev->tap != NULL)
+        {
+            struct iovec iov = {buf.data, (size_t)len};
+            capture_packet(dev->tap, &iov, 1, 4, len - 4, CAPTURE_INBOUND);
+        }
+        if (dev->acct != NULL)
+        {
+            struct iovec iov = {buf.data, (size_t)len};
+            flow_packet(dev->acct, &iov, 1, 4, len - 4, FLOW_INBOUND, enif_monotonic_time(ERL_NIF_NSEC));
+        }
+        bool made = read_buf_packet(env, &buf, len, &packets[n]);
+        read_buf_release(&buf);
+        if (!made)
+        {
+            return n ? enif_make_list_from_array(env, packets, n) : make_error(env, ENOMEM);
+        }
+        n++;
+    }
+    return enif_make_list_from_array(env, packets, n);
+}
+
+// Read up to `max` packets of at most `length` bytes from a device, with room
+// around each as for recv_data, returning {ok, Packets}. If none is waiting
+// the device is selected as for recv_data.
+// Packets read this way bypass the recv impairment stage.
+static ERL_NIF_TERM recv_batch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    int length, max;
+    struct room_t room;
+    if (argc != 5 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_get_int(env, argv[1], &length) ||
+        !enif_get_int(env, argv[2], &max) || length <= 0 || max <= 0 || !get_room(env, argv[3], argv[4], &room))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    if (fd_obj->members != NULL)
+    {
+        return enif_make_badarg(env);
+    }
+    if (fd_obj->ring != NULL || fd_obj->tun != NULL)
+    {
+        return make_error(env, EBUSY);
+    }
+    if (max > 1024)
+    {
+        max = 1024;
+    }
+    ERL_NIF_TERM *packets = enif_alloc(max * sizeof(*packets));
+    if (packets == NULL)
+    {
+        return make_error(env, ENOMEM);
+    }
+
+    TUNDRA_PROBE2(recv_entry, fd_obj->fd, length);
+    ERL_NIF_TERM ret = read_batch(env, fd_obj, length, &room, max, packets);
+    if (enif_is_empty_list(env, ret) && fd_obj->busy.max > 0 && busy_poll(env, fd_obj))
+    {
+        stat_add(&fd_obj->stats.eagain, 1);
+        ret = read_batch(env, fd_obj, length, &room, max, packets);
+    }
+    enif_free(packets);
+    if (!enif_is_list(env, ret))
+    {
+        return ret;
+    }
+    if (!enif_is_empty_list(env, ret))
+    {
+        return enif_make_tuple2(env, s_ok, ret);
+    }
+
+    stat_add(&fd_obj->stats.eagain, 1);
+    ERL_NIF_TERM ref = enif_make_ref(env);
+    ERL_NIF_TERM msg = enif_make_tuple4(env, s_socket, enif_make_tuple2(env, s_tundra, argv[0]), s_select, ref);
+    if (enif_select_read(env, fd_obj->fd, fd_obj, NULL, msg, NULL) < 0)
+    {
+        return make_error(env, errno);
+    }
+    TUNDRA_PROBE2(select_arm, fd_obj->fd, ERL_NIF_SELECT_READ);
+    stat_add(&fd_obj->stats.selects, 1);
+    return enif_make_tuple2(env, s_select, enif_make_tuple3(env, s_select_info, s_recv, ref));
+}
+
+// Write a header before and a trailer after a packet read with headroom and
+// tailroom, returning {ok, Datagram}: a binary over all three in the packet's
+// buffer (see rxbuf.h). The packet itself is left as it was.
+static ERL_NIF_TERM fill_room(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary packet, header, trailer;
+    if (argc != 3 || !enif_inspect_binary(env, argv[0], &packet) || !enif_inspect_iolist_as_binary(env, argv[1], &header) ||
+        !enif_inspect_iolist_as_binary(env, argv[2], &trailer))
+    {
+        return enif_make_badarg(env);
+    }
+
+    ERL_NIF_TERM datagram;
+    int err = rxbuf_fill(env, &packet, &header, &trailer, &datagram);
+    return err == 0 ? enif_make_tuple2(env, s_ok, datagram) : make_error(env, -err);
+}
+
+// Write a packet to a device whose send queue is enabled. While the queue is
+// empty packets are written directly; otherwise, or if the write would block,
+// the packet is queued in class `tag` (or by DSCP if negative) for the drainer
+// and the call succeeds all the same. Crossing the high watermark notifies the
+// caller (see notify_send_queue).
+static ERL_NIF_TERM send_queued(ErlNifEnv *env, struct fd_object_t *fd_obj, struct sendq_t *q, ErlNifIOVec *iovec,
+                                int tag, ssize_t *written, int *error)
+{
+    ERL_NIF_TERM ret = s_ok;
+    ssize_t n = (ssize_t)iovec->size;
+    int err = 0;
+    bool high = false;
+
+    enif_mutex_lock(q->lock);
+    if (tag >= (int)q->nclasses)
+    {
+        n = -1;
+        err = EINVAL;
+        ret = make_error(env, err);
+        goto done;
+    }
+    unsigned cls = tag < 0 ? sendq_classify(q, iovec) : (unsigned)tag;
+    bool empty = atomic_load_explicit(&q->packets, memory_order_relaxed) == 0;
+    if (empty)
+    {
+        n = writev(fd_obj->fd, iovec->iov, iovec->iovcnt);
+        err = n < 0 ? errno : 0;
+        if (n >= 0 || (err != EAGAIN && err != EWOULDBLOCK))
+        {
+            if ((size_t)n == iovec->size)
+            {
+                if (n > 4)
+                {
+                    stat_add_shared(&fd_obj->stats.tx_packets, 1);
+                    stat_add_shared(&fd_obj->stats.tx_bytes, n - 4);
+                    stat_max(&fd_obj->stats.max_packet, n - 4);
+                }
+            }
+            else if (n >= 0)
+            {
+                err = ENOBUFS;
+                stat_add_shared(&fd_obj->stats.enobufs, 1);
+                ret = make_error(env, err);
+            }
+            else
+            {
+                ret = make_error(env, err);
+            }
+            goto done;
+        }
+        stat_add(&fd_obj->stats.eagain, 1);
+        n = (ssize_t)iovec->size;
+        err = 0;
+    }
+
+    if (!sendq_push(q, cls, iovec))
+    {
+        n = -1;
+        err = ENOBUFS;
+        ret = enif_make_tuple2(env, s_error, s_queue_full);
+        goto done;
+    }
+    if (empty)
+    {
+        int result = sendq_watch(fd_obj->fd, fd_obj, &q->watch);
+        if (result < 0)
+        {
+            sendq_pop(q, cls, false);
+            n = -1;
+            err = -result;
+            ret = make_error(env, err);
+            goto done;
+        }
+        TUNDRA_PROBE2(select_arm, fd_obj->fd, ERL_NIF_SELECT_WRITE);
+        stat_add(&fd_obj->stats.selects, 1);
+    }
+    if (iovec->size > 4)
+    {
+        stat_max(&fd_obj->stats.max_packet, iovec->size - 4);
+    }
+    if (!q->above && atomic_load_explicit(&q->bytes, memory_order_relaxed) >= q->high)
+    {
+        q->above = high = true;
+    }
+
+done:
+    enif_mutex_unlock(q->lock);
+    if (high)
+    {
+        notify_send_queue(env, &fd_obj->cp, fd_obj, s_high);
+    }
+    *written = n;
+    *error = err;
+    return ret;
+}
+
+// Write a packet to a device, arming a select if the write would block.
+static ERL_NIF_TERM send_direct(ErlNifEnv *env, ERL_NIF_TERM handle, struct fd_object_t *fd_obj, ErlNifIOVec *iovec,
+                                ssize_t *written, int *error)
+{
+    ERL_NIF_TERM ret;
+    ssize_t n = writev(fd_obj->fd, iovec->iov, iovec->iovcnt);
+    int err = n < 0 ? errno : 0;
+    if (n < 0)
+    {
+        if (err == EAGAIN || err == EWOULDBLOCK)
+        {
+            // Use a notifaction msg similar to the one used by the erlang socket support
+            ERL_NIF_TERM ref = enif_make_ref(env);
+            ERL_NIF_TERM obj = enif_make_tuple2(env, s_tundra, handle);
+            ERL_NIF_TERM msg = enif_make_tuple4(env, s_socket, obj, s_select, ref);
+            stat_add(&fd_obj->stats.eagain, 1);
+            if (enif_select_write(env, fd_obj->fd, fd_obj, NULL, msg, NULL) >= 0)
+            {
+                TUNDRA_PROBE2(select_arm, fd_obj->fd, ERL_NIF_SELECT_WRITE);
+                stat_add(&fd_obj->stats.selects, 1);
+                ret = enif_make_tuple2(env, s_select, enif_make_tuple3(env, s_select_info, s_send, ref));
+            }
+            else
+            {
+                ret = make_error(env, errno);
+            }
+        }
+        else
+        {
+            ret = make_error(env, err);
+        }
+    }
+    else if ((size_t)n == iovec->size)
+    {
+        if (n > 4)
+        {
+            stat_add_shared(&fd_obj->stats.tx_packets, 1);
+            stat_add_shared(&fd_obj->stats.tx_bytes, n - 4);
+            stat_max(&fd_obj->stats.max_packet, n - 4);
+        }
+        ret = s_ok;
+    }
+    else
+    {
+        err = ENOBUFS;
+        stat_add_shared(&fd_obj->stats.enobufs, 1);
+        ret = make_error(env, err);
+    }
+
+    *written = n;
+    *error = err;
+    return ret;
+}
+
+// send_data through an impairment stage (see impair.h). Copies due at once are
+// written as usual, the first one deciding the result; the others are copied
+// into the wheel, which writes them when they are due. A lost packet succeeds
+// as if it had been written.
+static ERL_NIF_TERM send_impaired(ErlNifEnv *env, ERL_NIF_TERM handle, struct fd_object_t *fd_obj,
+                                  struct impair_t *imp, ErlNifIOVec *iovec, int tag, ssize_t *written, int *error)
+{
+    struct impair_stage_t *stage = &imp->stages[IMPAIR_SEND];
+    ERL_NIF_TERM ret = s_ok;
+    bool sent = false;
+    *written = (ssize_t)iovec->size;
+    *error = 0;
+
+    enif_mutex_lock(imp->lock);
+    int64_t now = enif_monotonic_time(ERL_NIF_NSEC);
+    int64_t due[2];
+    int copies = impair_decide(stage, now, iovec->size > 4 ? iovec->size - 4 : 0, due);
+    for (int i = 0; i < copies; ++i)
+    {
+        if (due[i] <= now)
+        {
+            ssize_t n;
+            int err;
+            ERL_NIF_TERM result = fd_obj->queue ? send_queued(env, fd_obj, fd_obj->queue, iovec, tag, &n, &err)
+                                                : send_direct(env, handle, fd_obj, iovec, &n, &err);
+            if (!sent)
+            {
+                // A duplicate's result is of no interest to the caller
+                sent = true;
+                ret = result;
+                *written = n;
+                *error = err;
+            }
+            continue;
+        }
+        struct impair_pkt_t *copy = impair_pkt_alloc(NULL, iovec->size, IMPAIR_SEND, due[i]);
+        if (copy != NULL)
+        {
+            size_t offset = 0;
+            for (int j = 0; j < iovec->iovcnt; ++j)
+            {
+                memcpy(copy->data + offset, iovec->iov[j].iov_base, iovec->iov[j].iov_len);
+                offset += iovec->iov[j].iov_len;
+            }
+        }
+        if (copy == NULL || impair_schedule(copy, fd_obj) != 0)
+        {
+            stage->held--;
+            stage->stats.dropped++;
+            if (copy != NULL)
+            {
+                enif_free(copy);
+            }
+        }
+    }
+    enif_mutex_unlock(imp->lock);
+    return ret;
+}
+
+// Write a packet to a device. argv[2] is the send queue class to use if the
+// write would block, or -1 to classify the packet by DSCP.
+static ERL_NIF_TERM send_data(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    int tag;
+    if (argc != 3 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_get_int(env, argv[2], &tag))
+    {
+        return enif_make_badarg(env);
+    }
+    struct fd_object_t *fd_obj = obj;
+
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+
+    unsigned max_elements;
+    if (!enif_get_list_length(env, argv[1], &max_elements) || max_elements == 0)
+    {
+        return enif_make_badarg(env);
+    }
+
+    ErlNifIOVec *iovec = NULL;
+    ERL_NIF_TERM tail;
+    if (!enif_inspect_iovec(env, max_elements, argv[1], &tail, &iovec))
+    {
+        return enif_make_badarg(env);
+    }
+
+    TUNDRA_PROBE2(send_entry, fd_obj->fd, iovec->size - 4);
+    struct fd_latency_t *lat = fd_obj->track;
+    int64_t start = lat ? enif_monotonic_time(ERL_NIF_NSEC) : 0;
+
+    ssize_t n;
+    int err;
+    ERL_NIF_TERM ret;
+    struct impair_t *imp = fd_obj->impair;
+    if (imp != NULL && imp->stages[IMPAIR_SEND].enabled)
+    {
+        ret = send_impaired(env, argv[0], fd_obj, imp, iovec, tag, &n, &err);
+    }
+    else if (fd_obj->queue != NULL)
+    {
+        ret = send_queued(env, fd_obj, fd_obj->queue, iovec, tag, &n, &err);
+    }
+    else
+    {
+        ret = send_direct(env, argv[0], fd_obj, iovec, &n, &err);
+    }
+
+    if (err == 0 && fd_obj->tap != NULL)
+    {
+        capture_packet(fd_obj->tap, iovec->iov, iovec->iovcnt, 4, iovec->size - 4, CAPTURE_OUTBOUND);
+    }
+    if (err == 0 && fd_obj->acct != NULL)
+    {
+        flow_packet(fd_obj->acct, iovec->iov, iovec->iovcnt, 4, iovec->size - 4, FLOW_OUTBOUND,
+                    enif_monotonic_time(ERL_NIF_NSEC));
+    }
+    if (lat)
+    {
+        hist_record(&lat->send, enif_monotonic_time(ERL_NIF_NSEC) - start);
+    }
+    TUNDRA_PROBE3(send_return, fd_obj->fd, err == 0 ? n - 4 : -1, err);
+    return ret;
+}
+
+// Return the I/O counters of a device.
+//
+// Deliberately skips the owner check so that any process (e.g. a telemetry
+// poller) can read them; counters are relaxed atomics and cost nothing to read.
+// Returns {error, closed} once the device has been closed.
+static ERL_NIF_TERM get_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+    struct fd_object_t *fd_obj = obj;
+    if (atomic_load((atomic_int *)&fd_obj->fd) == -1)
+    {
+        return enif_make_tuple2(env, s_error, s_closed);
+    }
+
+    struct fd_stats_t *st = &fd_obj->stats;
+    struct sendq_t *q = atomic_load(&fd_obj->sendq);
+    ERL_NIF_TERM keys[] = {s_rx_packets, s_rx_bytes, s_tx_packets, s_tx_bytes, s_eagain_count,
+                           s_selects, s_enobufs, s_emsgsize, s_max_packet, s_send_queue_packets,
+                           s_send_queue_bytes, s_send_queue_drops, s_busy_polls, s_busy_poll_hits,
+                           s_busy_poll_time};
+    ERL_NIF_TERM values[] = {
+        enif_make_uint64(env, atomic_load_explicit(&st->rx_packets, memory_order_relaxed)),
+        enif_make_uint64(env, atomic_load_explicit(&st->rx_bytes, memory_order_relaxed)),
+        enif_make_uint64(env, atomic_load_explicit(&st->tx_packets, memory_order_relaxed)),
+        enif_make_uint64(env, atomic_load_explicit(&st->tx_bytes, memory_order_relaxed)),
+        enif_make_uint64(env, atomic_load_explicit(&st->eagain, memory_order_relaxed)),
+        enif_make_uint64(env, atomic_load_explicit(&st->selects, memory_order_relaxed)),
+        enif_make_uint64(env, atomic_load_explicit(&st->enobufs, memory_order_relaxed)),
+        enif_make_uint64(env, atomic_load_explicit(&st->emsgsize, memory_order_relaxed)),
+        enif_make_uint64(env, atomic_load_explicit(&st->max_packet, memory_order_relaxed)),
+        enif_make_uint64(env, q ? atomic_load_explicit(&q->packets, memory_order_relaxed) : 0),
+        enif_make_uint64(env, q ? atomic_load_explicit(&q->bytes, memory_order_relaxed) : 0),
+        enif_make_uint64(env, q ? atomic_load_explicit(&q->drops, memory_order_relaxed) : 0),
+        enif_make_uint64(env, atomic_load_explicit(&st->busy_polls, memory_order_relaxed)),
+        enif_make_uint64(env, atomic_load_explicit(&st->busy_poll_hits, memory_order_relaxed)),
+        enif_make_uint64(env, atomic_load_explicit(&st->busy_poll_ns, memory_order_relaxed))};
+
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(keys[0]), &map);
+    return enif_make_tuple2(env, s_ok, map);
+}
+
+// Turn latency tracking on or off. Enabling tracking clears the histograms.
+static ERL_NIF_TERM set_latency_tracking(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_is_atom(env, argv[1]))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+
+    struct fd_latency_t *lat = atomic_load(&fd_obj->latency);
+    if (enif_compare(argv[1], s_true) == 0)
+    {
+        if (lat == NULL)
+        {
+            if ((lat = enif_alloc(sizeof(*lat))) == NULL)
+            {
+                return make_error(env, ENOMEM);
+            }
+            atomic_init(&lat->ready_at, 0);
+            lat->watch = -1;
+        }
+        hist_reset(&lat->recv);
+        hist_reset(&lat->send);
+        hist_reset(&lat->ready);
+        atomic_store(&fd_obj->latency, lat);
+        fd_obj->track = lat;
+    }
+    else if (lat != NULL)
+    {
+        fd_obj->track = NULL;
+        ready_unwatch(fd_obj->fd, &lat->watch);
+    }
+
+    return s_ok;
+}
+
+// Set the longest a read that finds a device empty spins before selecting, in
+// microseconds (at most BUSY_POLL_MAX_USEC), or turn busy polling off with 0.
+// Starts at the longest spin (see busy_poll).
+static ERL_NIF_TERM set_busy_poll(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    unsigned usec;
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_get_uint(env, argv[1], &usec) ||
+        usec > BUSY_POLL_MAX_USEC)
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    if (fd_obj->members != NULL)
+    {
+        return enif_make_badarg(env);
+    }
+
+    fd_obj->busy = (struct busy_poll_t){.max = (int64_t)usec * 1000, .budget = (int64_t)usec * 1000};
+    return s_ok;
+}
+
+// Parse a list of {Weight, MaxPackets, MaxBytes, Priority} send queue classes.
+static bool get_send_queue_classes(ErlNifEnv *env, ERL_NIF_TERM list, struct sendq_class_config_t *classes,
+                                   unsigned *nclasses)
+{
+    ERL_NIF_TERM head;
+    unsigned n = 0;
+    while (enif_get_list_cell(env, list, &head, &list))
+    {
+        const ERL_NIF_TERM *elems;
+        int arity;
+        unsigned weight, max_packets;
+        ErlNifUInt64 max_bytes;
+        if (n == SENDQ_MAX_CLASSES || !enif_get_tuple(env, head, &arity, &elems) || arity != 4 ||
+            !enif_get_uint(env, elems[0], &weight) || !enif_get_uint(env, elems[1], &max_packets) ||
+            !enif_get_uint64(env, elems[2], &max_bytes) || !enif_is_atom(env, elems[3]) || weight == 0)
+        {
+            return false;
+        }
+        classes[n++] = (struct sendq_class_config_t){
+            .weight = weight,
+            .max_packets = max_packets,
+            .max_bytes = max_bytes,
+            .priority = enif_compare(elems[3], s_true) == 0};
+    }
+    *nclasses = n;
+    return n > 0;
+}
+
+// Enable, resize or disable (max_packets of 0) the send queue of a device
+// (Linux). Limits and watermarks are in bytes, including the TUN header.
+// argv[5] is a list of classes (see get_send_queue_classes) and argv[6] a
+// 64-byte binary mapping each DSCP to a class. Disabling the queue, or
+// changing its number of classes, drops any packets still in it.
+static ERL_NIF_TERM set_send_queue(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    unsigned max_packets, nclasses;
+    ErlNifUInt64 max_bytes, low, high;
+    ErlNifBinary dscp;
+    struct sendq_class_config_t classes[SENDQ_MAX_CLASSES];
+    if (argc != 7 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_get_uint(env, argv[1], &max_packets) ||
+        !enif_get_uint64(env, argv[2], &max_bytes) || !enif_get_uint64(env, argv[3], &low) ||
+        !enif_get_uint64(env, argv[4], &high) || low > high || high > max_bytes ||
+        !get_send_queue_classes(env, argv[5], classes, &nclasses) || !enif_inspect_binary(env, argv[6], &dscp) ||
+        dscp.size != 64)
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    if (fd_obj->members != NULL)
+    {
+        return enif_make_badarg(env);
+    }
+#ifdef __linux__
+    struct sendq_t *q = atomic_load(&fd_obj->sendq);
+    if (q == NULL)
+    {
+        if (max_packets == 0)
+        {
+            return s_ok;
+        }
+        if ((q = sendq_create()) == NULL)
+        {
+            return make_error(env, ENOMEM);
+        }
+        atomic_store(&fd_obj->sendq, q);
+    }
+
+    enif_mutex_lock(q->lock);
+    int result = sendq_configure(q, classes, nclasses, dscp.data);
+    if (result == 0)
+    {
+        q->max_packets = max_packets;
+        q->max_bytes = max_bytes;
+        q->low = low;
+        q->high = high;
+        q->owner = self;
+        if (max_packets == 0)
+        {
+            sendq_clear(q);
+            q->above = false;
+        }
+        fd_obj->queue = max_packets ? q : NULL;
+    }
+    enif_mutex_unlock(q->lock);
+    return result == 0 ? s_ok : make_error(env, -result);
+#else
+    return make_error(env, ENOTSUP);
+#endif
+}
+
+// Return the state of each class of a device's send queue: its configuration,
+// depth, drops, packets sent and queueing delay histogram. Like get_stats, this
+// may be called from any process.
+static ERL_NIF_TERM get_send_queue(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    struct sendq_t *q = atomic_load(&fd_obj->sendq);
+    if (q == NULL)
+    {
+        return enif_make_tuple2(env, s_error, s_disabled);
+    }
+
+    ERL_NIF_TERM items[SENDQ_MAX_CLASSES];
+    enif_mutex_lock(q->lock);
+    unsigned n = q->nclasses;
+    for (unsigned i = 0; i < n; ++i)
+    {
+        struct sendq_class_t *c = &q->classes[i];
+        ERL_NIF_TERM keys[] = {s_class, s_weight, s_priority, s_packets, s_bytes, s_drops, s_sent, s_delay};
+        ERL_NIF_TERM values[] = {
+            enif_make_uint(env, i),
+            enif_make_uint(env, c->config.weight),
+            enif_make_atom(env, (int)i == q->priority ? "true" : "false"),
+            enif_make_uint64(env, c->packets),
+            enif_make_uint64(env, c->bytes),
+            enif_make_uint64(env, c->drops),
+            enif_make_uint64(env, c->sent),
+            hist_to_term(env, &c->delay)};
+        enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(keys[0]), &items[i]);
+    }
+    enif_mutex_unlock(q->lock);
+    return enif_make_tuple2(env, s_ok, enif_make_list_from_array(env, items, n));
+}
+
+// Parse and check a list of {Code, Jt, Jf, K} classic BPF instructions into
+// `*insns` (NULL for an empty list, which captures everything).
+static bool get_capture_filter(ErlNifEnv *env, ERL_NIF_TERM list, struct capture_insn_t **insns, unsigned *n)
+{
+    *insns = NULL;
+    if (!enif_get_list_length(env, list, n) || *n > CAPTURE_MAX_INSNS)
+    {
+        return false;
+    }
+    if (*n == 0)
+    {
+        return true;
+    }
+    if ((*insns = enif_alloc(*n * sizeof(**insns))) == NULL)
+    {
+        return false;
+    }
+
+    ERL_NIF_TERM head;
+    unsigned i = 0;
+    while (enif_get_list_cell(env, list, &head, &list))
+    {
+        const ERL_NIF_TERM *elems;
+        int arity;
+        unsigned code, jt, jf, k;
+        if (!enif_get_tuple(env, head, &arity, &elems) || arity != 4 || !enif_get_uint(env, elems[0], &code) ||
+            !enif_get_uint(env, elems[1], &jt) || !enif_get_uint(env, elems[2], &jf) ||
+            !enif_get_uint(env, elems[3], &k) || code > UINT16_MAX || jt > UINT8_MAX || jf > UINT8_MAX)
+        {
+            break;
+        }
+        (*insns)[i++] = (struct capture_insn_t){(uint16_t)code, (uint8_t)jt, (uint8_t)jf, k};
+    }
+    if (i != *n || !capture_filter_valid(*insns, *n))
+    {
+        enif_free(*insns);
+        *insns = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Start capturing a device's packets to a pcapng file (see capture.h).
+//
+// argv: Ref, Path, Snaplen, Sample, FileSize, Files, Buffer, Filter. Runs on a
+// dirty I/O scheduler since it creates the file.
+static ERL_NIF_TERM start_capture(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    ErlNifBinary path;
+    unsigned snaplen, sample, files;
+    ErlNifUInt64 file_size, buffer;
+    if (argc != 8 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_inspect_binary(env, argv[1], &path) ||
+        path.size == 0 || memchr(path.data, 0, path.size) != NULL || !enif_get_uint(env, argv[2], &snaplen) ||
+        !enif_get_uint(env, argv[3], &sample) || !enif_get_uint64(env, argv[4], &file_size) ||
+        !enif_get_uint(env, argv[5], &files) || !enif_get_uint64(env, argv[6], &buffer) || snaplen == 0 ||
+        sample == 0 || files == 0 || buffer < (ErlNifUInt64)snaplen + 64 || buffer > SIZE_MAX)
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    if (fd_obj->members != NULL)
+    {
+        return enif_make_badarg(env);
+    }
+    if (atomic_load((atomic_int *)&fd_obj->fd) == -1)
+    {
+        return enif_make_tuple2(env, s_error, s_closed);
+    }
+    if (fd_obj->tap != NULL)
+    {
+        return make_error(env, EBUSY);
+    }
+
+    struct capture_config_t config = {
+        .snaplen = snaplen,
+        .sample = sample,
+        .file_size = file_size,
+        .files = files,
+        .buffer = (size_t)buffer};
+    if (!get_capture_filter(env, argv[7], &config.filter, &config.nfilter))
+    {
+        return make_error(env, EINVAL);
+    }
+    if ((config.path = enif_alloc(path.size + 1)) == NULL)
+    {
+        enif_free(config.filter);
+        return make_error(env, ENOMEM);
+    }
+    memcpy(config.path, path.data, path.size);
+    config.path[path.size] = '\0';
+
+    struct capture_t *c = atomic_load(&fd_obj->capture);
+    if (c == NULL)
+    {
+        if ((c = capture_create()) == NULL)
+        {
+            enif_free(config.path);
+            enif_free(config.filter);
+            return make_error(env, ENOMEM);
+        }
+        atomic_store(&fd_obj->capture, c);
+    }
+    int result = capture_start(c, &config);
+    if (result != 0)
+    {
+        return make_error(env, -result);
+    }
+    fd_obj->tap = c;
+    return s_ok;
+}
+
+// Stop a capture, once everything it has buffered is written, and return its
+// counts: packets and bytes written, and packets dropped. Runs on a dirty I/O
+// scheduler since it waits for the final write.
+static ERL_NIF_TERM stop_capture(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    struct capture_t *c = fd_obj->tap;
+    if (c == NULL)
+    {
+        return enif_make_tuple2(env, s_error, s_disabled);
+    }
+
+    fd_obj->tap = NULL;
+    struct capture_stats_t st;
+    capture_stop(c, &st);
+
+    ERL_NIF_TERM keys[] = {s_packets, s_bytes, s_drops};
+    ERL_NIF_TERM values[] = {enif_make_uint64(env, st.packets), enif_make_uint64(env, st.bytes),
+                             enif_make_uint64(env, st.drops)};
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, 3, &map);
+    return enif_make_tuple2(env, s_ok, map);
+}
+
+// Read an impairment configuration tuple {Delay, Jitter, P, R, LossBad,
+// LossGood, Duplicate, Reorder, Rate, Burst, Limit, Seed}. Times are
+// nanoseconds and probabilities fractions of 2^32.
+static bool get_impair_config(ErlNifEnv *env, ERL_NIF_TERM term, struct impair_config_t *config)
+{
+    int arity;
+    const ERL_NIF_TERM *elems;
+    ErlNifSInt64 delay, jitter;
+    ErlNifUInt64 probs[6], rate, burst, seed;
+    if (!enif_get_tuple(env, term, &arity, &elems) || arity != 12 || !enif_get_int64(env, elems[0], &delay) ||
+        !enif_get_int64(env, elems[1], &jitter) || delay < 0 || jitter < 0 || jitter > INT64_MAX / 2 ||
+        !enif_get_uint64(env, elems[8], &rate) || !enif_get_uint64(env, elems[9], &burst) ||
+        !enif_get_uint(env, elems[10], &config->limit) || !enif_get_uint64(env, elems[11], &seed) ||
+        config->limit == 0 || (rate != 0 && burst == 0))
+    {
+        return false;
+    }
+    for (int i = 0; i < 6; ++i)
+    {
+        if (!enif_get_uint64(env, elems[2 + i], &probs[i]) || probs[i] > IMPAIR_ALWAYS)
+        {
+            return false;
+        }
+    }
+    config->delay = delay;
+    config->jitter = jitter;
+    config->p = probs[0];
+    config->r = probs[1];
+    config->loss_bad = probs[2];
+    config->loss_good = probs[3];
+    config->duplicate = probs[4];
+    config->reorder = probs[5];
+    config->rate = rate;
+    config->burst = burst;
+    config->seed = seed;
+    return true;
+}
+
+// Enable, reconfigure or (with an atom) disable the send or recv impairment
+// stage of a device. Disabling the recv stage discards packets waiting to be
+// read; delayed packets still in the wheel are dropped when they are due.
+static ERL_NIF_TERM set_impairment(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 3 || !enif_get_resource(env, argv[0], s_fdrt, &obj) ||
+        (enif_compare(argv[1], s_send) != 0 && enif_compare(argv[1], s_recv) != 0))
+    {
+        return enif_make_badarg(env);
+    }
+    int dir = enif_compare(argv[1], s_send) == 0 ? IMPAIR_SEND : IMPAIR_RECV;
+    bool enable = !enif_is_atom(env, argv[2]);
+    struct impair_config_t config;
+    if (enable && !get_impair_config(env, argv[2], &config))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    if (fd_obj->members != NULL)
+    {
+        return enif_make_badarg(env);
+    }
+    if (atomic_load((atomic_int *)&fd_obj->fd) == -1)
+    {
+        return enif_make_tuple2(env, s_error, s_closed);
+    }
+
+    struct impair_t *imp = atomic_load(&fd_obj->impairment);
+    if (imp == NULL)
+    {
+        if (!enable)
+        {
+            return s_ok;
+        }
+        if ((imp = impair_create()) == NULL)
+        {
+            return make_error(env, ENOMEM);
+        }
+        atomic_store(&fd_obj->impairment, imp);
+    }
+
+    enif_mutex_lock(imp->lock);
+    struct impair_stage_t *stage = &imp->stages[dir];
+    if (enable)
+    {
+        impair_configure(stage, &config, enif_monotonic_time(ERL_NIF_NSEC));
+    }
+    else
+    {
+        stage->enabled = false;
+        if (dir == IMPAIR_RECV)
+        {
+            while (imp->ready != NULL)
+            {
+                struct impair_pkt_t *pkt = imp->ready;
+                imp->ready = pkt->next;
+                stage->held--;
+                enif_free(pkt);
+            }
+            imp->ready_tail = NULL;
+            imp->waiting = false;
+        }
+    }
+    fd_obj->impair = imp->stages[IMPAIR_SEND].enabled || imp->stages[IMPAIR_RECV].enabled ? imp : NULL;
+    enif_mutex_unlock(imp->lock);
+    return s_ok;
+}
+
+static ERL_NIF_TERM impair_stats_to_term(ErlNifEnv *env, const struct impair_stage_t *stage)
+{
+    const struct impair_stats_t *st = &stage->stats;
+    ERL_NIF_TERM keys[] = {s_packets, s_lost, s_duplicated, s_delayed, s_reordered, s_overlimit, s_dropped, s_held};
+    ERL_NIF_TERM values[] = {enif_make_uint64(env, st->packets),    enif_make_uint64(env, st->lost),
+                             enif_make_uint64(env, st->duplicated), enif_make_uint64(env, st->delayed),
+                             enif_make_uint64(env, st->reordered),  enif_make_uint64(env, st->overlimit),
+                             enif_make_uint64(env, st->dropped),    enif_make_uint(env, stage->held)};
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, 8, &map);
+    return map;
+}
+
+// Return the counters of a device's enabled impairment stages. Like
+// get_stats, this may be called from any process.
+static ERL_NIF_TERM get_impairment(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    struct impair_t *imp = atomic_load(&fd_obj->impairment);
+    if (imp == NULL)
+    {
+        return enif_make_tuple2(env, s_error, s_disabled);
+    }
+
+    ERL_NIF_TERM map = enif_make_new_map(env);
+    enif_mutex_lock(imp->lock);
+    bool enabled = imp->stages[IMPAIR_SEND].enabled || imp->stages[IMPAIR_RECV].enabled;
+    if (imp->stages[IMPAIR_SEND].enabled)
+    {
+        enif_make_map_put(env, map, s_send, impair_stats_to_term(env, &imp->stages[IMPAIR_SEND]), &map);
+    }
+    if (imp->stages[IMPAIR_RECV].enabled)
+    {
+        enif_make_map_put(env, map, s_recv, impair_stats_to_term(env, &imp->stages[IMPAIR_RECV]), &map);
+    }
+    enif_mutex_unlock(imp->lock);
+    if (!enabled)
+    {
+        return enif_make_tuple2(env, s_error, s_disabled);
+    }
+    return enif_make_tuple2(env, s_ok, map);
+}
+
+// Return the latency histograms of a device. Like get_stats, this may be
+// called from any process. Values are nanoseconds.
+static ERL_NIF_TERM get_latency(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    struct fd_latency_t *lat = atomic_load(&fd_obj->latency);
+    if (lat == NULL)
+    {
+        return enif_make_tuple2(env, s_error, s_disabled);
+    }
+
+    ERL_NIF_TERM keys[] = {s_recv, s_send, s_ready};
+    ERL_NIF_TERM values[] = {hist_to_term(env, &lat->recv), hist_to_term(env, &lat->send), hist_to_term(env, &lat->ready)};
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, 3, &map);
+    return enif_make_tuple2(env, s_ok, map);
+}
+
+// Create a poll set owned by the calling process (Linux).
+static ERL_NIF_TERM poll_create(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    (void)argv;
+    if (argc != 0)
+    {
+        return enif_make_badarg(env);
+    }
+#ifdef __linux__
+    struct poll_members_t *m = enif_alloc(sizeof(*m));
+    if (m == NULL)
+    {
+        return make_error(env, ENOMEM);
+    }
+    *m = (struct poll_members_t){.lock = enif_mutex_create("tundra_poll"), .slots = NULL, .nslots = 0};
+    if (m->lock == NULL)
+    {
+        enif_free(m);
+        return make_error(env, ENOMEM);
+    }
+
+    struct fd_object_t *set = alloc_fd_object(env);
+    if (set == NULL)
+    {
+        enif_mutex_destroy(m->lock);
+        enif_free(m);
+        return make_error(env, ENOMEM);
+    }
+    set->members = m;
+
+    ERL_NIF_TERM result;
+    set->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (set->fd == -1)
+    {
+        result = make_error(env, errno);
+    }
+    else
+    {
+        result = enif_make_tuple2(env, s_ok, enif_make_resource(env, set));
+    }
+    enif_release_resource(set);
+    return result;
+#else
+    return make_error(env, ENOTSUP);
+#endif
+}
+
+// Fetch a poll set and a device, both of which must be owned by the caller.
+static bool get_set_and_device(ErlNifEnv *env, const ERL_NIF_TERM argv[], struct fd_object_t **set,
+                               struct fd_object_t **dev, ERL_NIF_TERM *error)
+{
+    void *obj1, *obj2;
+    if (!enif_get_resource(env, argv[0], s_fdrt, &obj1) || !enif_get_resource(env, argv[1], s_fdrt, &obj2))
+    {
+        *error = enif_make_badarg(env);
+        return false;
+    }
+    *set = obj1;
+    *dev = obj2;
+    if ((*set)->members == NULL || (*dev)->members != NULL)
+    {
+        *error = enif_make_badarg(env);
+        return false;
+    }
+
+    ErlNifPid self;
+    enif_self(env, &self);
+    if (enif_compare_pids(&(*set)->cp, &self) != 0 || enif_compare_pids(&(*dev)->cp, &self) != 0)
+    {
+        *error = enif_make_tuple2(env, s_error, s_not_owner);
+        return false;
+    }
+    return true;
+}
+
+// Register a device with a poll set. A device belongs to at most one set.
+static ERL_NIF_TERM poll_add(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct fd_object_t *set, *dev;
+    ERL_NIF_TERM error;
+    if (argc != 2)
+    {
+        return enif_make_badarg(env);
+    }
+    if (!get_set_and_device(env, argv, &set, &dev, &error))
+    {
+        return error;
+    }
+    if (dev->ring != NULL || dev->tun != NULL)
+    {
+        // The ring or tunnel thread reads the device
+        return make_error(env, EBUSY);
+    }
+#ifdef __linux__
+    struct poll_members_t *m = set->members;
+    int err = 0;
+    enif_mutex_lock(s_poll_lock);
+    struct fd_object_t *cur = atomic_load(&dev->poll_set);
+    if (cur != NULL)
+    {
+        enif_mutex_unlock(s_poll_lock);
+        return make_error(env, cur == set ? EEXIST : EBUSY);
+    }
+    enif_mutex_lock(m->lock);
+
+    unsigned index = 0;
+    while (index < m->nslots && m->slots[index].dev != NULL)
+    {
+        ++index;
+    }
+    if (index == m->nslots)
+    {
+        unsigned n = m->nslots ? m->nslots * 2 : 16;
+        struct poll_slot_t *slots = enif_realloc(m->slots, n * sizeof(*slots));
+        if (slots == NULL)
+        {
+            err = ENOMEM;
+            goto done;
+        }
+        for (unsigned i = m->nslots; i < n; ++i)
+        {
+            slots[i] = (struct poll_slot_t){NULL, 0};
+        }
+        m->slots = slots;
+        m->nslots = n;
+    }
+
+    struct poll_slot_t *slot = &m->slots[index];
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = ((uint64_t)slot->gen << 32) | index};
+    if (set->fd == -1 || dev->fd == -1)
+    {
+        err = EBADF;
+        goto done;
+    }
+    if (epoll_ctl(set->fd, EPOLL_CTL_ADD, dev->fd, &ev) == -1)
+    {
+        err = errno;
+        goto done;
+    }
+    slot->dev = dev;
+    dev->poll_slot = (int)index;
+    atomic_store(&dev->poll_set, set);
+    enif_keep_resource(dev);
+
+done:
+    enif_mutex_unlock(m->lock);
+    enif_mutex_unlock(s_poll_lock);
+    return err != 0 ? make_error(env, err) : s_ok;
+#else
+    return make_error(env, ENOTSUP);
+#endif
+}
+
+// Remove a device from a poll set.
+static ERL_NIF_TERM poll_remove(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj1, *obj2;
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj1) || !enif_get_resource(env, argv[1], s_fdrt, &obj2))
+    {
+        return enif_make_badarg(env);
+    }
+    struct fd_object_t *set = obj1;
+    struct fd_object_t *dev = obj2;
+    if (set->members == NULL)
+    {
+        return enif_make_badarg(env);
+    }
+
+    // Only the set's owner may remove devices; the device may have moved on
+    ErlNifPid self;
+    if (enif_compare_pids(&set->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+
+    return poll_leave(set, dev) ? s_ok : make_error(env, ENOENT);
+}
+
+// Limits on one poll_wait call, which runs on a scheduler: reads across all
+// devices, and the length of each (the largest IP packet)
+#define POLL_MAX_READS 1024
+#define POLL_MAX_LENGTH 65535
+
+// Return up to `max` ready devices of a poll set, owned by the caller.
+//
+// With a batch of zero, returns {ok, [Dev]}. Otherwise up to `batch` packets of
+// at most `length` bytes are read from each ready device and the result is
+// {ok, [{Dev, Packets | {error, Reason}}]}. Once POLL_MAX_READS packets have
+// been read the remaining devices are left for the next call, which finds them
+// still ready. A device that has changed owner since it was registered is
+// dropped from the set rather than returned.
+//
+// If no device is ready, the set itself is selected for reading and the caller
+// receives {'$socket', {'$tundra_poll', Set}, select, Ref} when one becomes so.
+static ERL_NIF_TERM poll_wait(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    int max, length, batch;
+    if (argc != 4 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_get_int(env, argv[1], &max) ||
+        !enif_get_int(env, argv[2], &length) || !enif_get_int(env, argv[3], &batch) || max <= 0 || length <= 0 ||
+        batch < 0)
+    {
+        return enif_make_badarg(env);
+    }
+    struct fd_object_t *set = obj;
+    if (set->members == NULL)
+    {
+        return enif_make_badarg(env);
+    }
+
+    ErlNifPid self;
+    if (enif_compare_pids(&set->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+#ifdef __linux__
+    if (max > 1024)
+    {
+        max = 1024;
+    }
+    if (batch > POLL_MAX_READS)
+    {
+        batch = POLL_MAX_READS;
+    }
+    if (length > POLL_MAX_LENGTH)
+    {
+        length = POLL_MAX_LENGTH;
+    }
+    struct epoll_event *events = enif_alloc(max * sizeof(*events));
+    ERL_NIF_TERM *items = enif_alloc(max * sizeof(*items));
+    ERL_NIF_TERM *packets = batch ? enif_alloc(batch * sizeof(*packets)) : NULL;
+    struct fd_object_t **dropped = enif_alloc(max * sizeof(*dropped));
+    if (events == NULL || items == NULL || dropped == NULL || (batch && packets == NULL))
+    {
+        enif_free(events);
+        enif_free(items);
+        enif_free(packets);
+        enif_free(dropped);
+        return make_error(env, ENOMEM);
+    }
+
+    ERL_NIF_TERM ret;
+    int count = 0, ndropped = 0, reads = 0;
+    struct poll_members_t *m = set->members;
+    enif_mutex_lock(m->lock);
+
+    int n = set->fd == -1 ? -1 : epoll_wait(set->fd, events, max, 0);
+    int err = n == -1 ? (set->fd == -1 ? EBADF : errno) : 0;
+    for (int i = 0; i < n && (batch == 0 || reads < POLL_MAX_READS); ++i)
+    {
+        uint32_t index = (uint32_t)events[i].data.u64;
+        struct poll_slot_t *slot = index < m->nslots ? &m->slots[index] : NULL;
+        if (slot == NULL || slot->dev == NULL || slot->gen != (uint32_t)(events[i].data.u64 >> 32))
+        {
+            continue;
+        }
+
+        struct fd_object_t *dev = slot->dev;
+        if (enif_compare_pids(&dev->cp, &self) != 0)
+        {
+            // Dropped once the set's lock is released, as s_poll_lock comes first
+            enif_keep_resource(dev);
+            dropped[ndropped++] = dev;
+            continue;
+        }
+
+        ERL_NIF_TERM dev_term = enif_make_resource(env, dev);
+        if (batch == 0)
+        {
+            items[count++] = dev_term;
+            continue;
+        }
+        int limit = POLL_MAX_READS - reads < batch ? POLL_MAX_READS - reads : batch;
+        ERL_NIF_TERM read = read_batch(env, dev, length, &s_no_room, limit, packets);
+        unsigned got;
+        reads += enif_get_list_length(env, read, &got) ? (int)got : 1;
+        items[count++] = enif_make_tuple2(env, dev_term, read);
+    }
+    if (reads > 0)
+    {
+        // Charge the reads to the caller's timeslice, POLL_MAX_READS being all of it
+        int percent = reads * 100 / POLL_MAX_READS;
+        enif_consume_timeslice(env, percent < 1 ? 1 : percent);
+    }
+
+    if (err != 0)
+    {
+        ret = make_error(env, err);
+    }
+    else if (count > 0)
+    {
+        ret = enif_make_tuple2(env, s_ok, enif_make_list_from_array(env, items, count));
+    }
+    else
+    {
+        ERL_NIF_TERM ref = enif_make_ref(env);
+        ERL_NIF_TERM obj = enif_make_tuple2(env, s_tundra_poll, argv[0]);
+        ERL_NIF_TERM msg = enif_make_tuple4(env, s_socket, obj, s_select, ref);
+        if (enif_select_read(env, set->fd, set, NULL, msg, NULL) >= 0)
+        {
+            TUNDRA_PROBE2(select_arm, set->fd, ERL_NIF_SELECT_READ);
+            stat_add(&set->stats.selects, 1);
+            ret = enif_make_tuple2(env, s_select, enif_make_tuple3(env, s_select_info, s_recv, ref));
+        }
+        else
+        {
+            ret = make_error(env, errno);
+        }
+    }
+    enif_mutex_unlock(m->lock);
+
+    for (int i = 0; i < ndropped; ++i)
+    {
+        poll_leave(set, dropped[i]);
+        enif_release_resource(dropped[i]);
+    }
+    enif_free(events);
+    enif_free(items);
+    enif_free(packets);
+    enif_free(dropped);
+    return ret;
+#else
+    (void)max;
+    (void)length;
+    (void)batch;
+    return make_error(env, ENOTSUP);
+#endif
+}
+
+static ERL_NIF_TERM cancel_select(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+
+    const ERL_NIF_TERM *select_info;
+    int arity;
+    if (!enif_get_tuple(env, argv[1], &arity, &select_info) || arity != 3)
+    {
+        return enif_make_badarg(env);
+    }
+    if (enif_compare(select_info[0], s_select_info) != 0)
+    {
+        return enif_make_badarg(env);
+    }
+    if (!enif_is_ref(env, select_info[2]))
+    {
+        return enif_make_badarg(env);
+    }
+
+    if (enif_compare(select_info[1], s_send) == 0 || enif_compare(select_info[1], s_recv) == 0)
+    {
+        enum ErlNifSelectFlags flags = enif_compare(select_info[1], s_send) == 0
+                                           ? ERL_NIF_SELECT_WRITE
+                                           : ERL_NIF_SELECT_READ;
+
+        int res = enif_select(env, fd_obj->fd, flags | ERL_NIF_SELECT_STOP, fd_obj, NULL, select_info[2]);
+        if (res < 0)
+        {
+            return make_error(env, errno);
+        }
+        else
+        {
+            return s_ok;
+        }
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+// Direct TUN device creation (requires privileges). Runs on a dirty I/O
+// scheduler, as it waits on rtnetlink and may enter another namespace.
+static ERL_NIF_TERM create_tun_direct(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+#if defined(__linux__) || defined(__APPLE__)
+    if (argc != 1 || !enif_is_map(env, argv[0]))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct create_tun_request_t req = {0};
+    req.size = sizeof(req);
+
+    // Parse the parameters map
+    if (!get_create_tun_request(env, argv[0], &req))
+    {
+        return enif_make_badarg(env);
+    }
+    int nsfd;
+    int err = get_netns(env, argv[0], &nsfd);
+    if (err < 0)
+    {
+        return make_error(env, -err);
+    }
+
+    TUNDRA_PROBE0(create_entry);
+
+    // Allocate resource for the TUN device
+    struct fd_object_t *fd_obj = alloc_fd_object(env);
+    if (fd_obj == NULL)
+    {
+        if (nsfd != -1)
+        {
+            close(nsfd);
+        }
+        return make_error(env, ENOMEM);
+    }
+
+    ERL_NIF_TERM result;
+    struct create_tun_response_t resp = {0};
+
+#ifdef __linux__
+    if (nsfd != -1)
+    {
+        // Created and configured inside the namespace, which the cache keeps
+        int fd = netns_create_safe(nsfd, NULL, &req, &resp);
+        if (fd < 0)
+        {
+            err = -fd;
+            result = make_error(env, err);
+            goto cleanup;
+        }
+        fd_obj->fd = fd;
+    }
+    else
+#endif
+    {
+        // Create TUN device using shared function
+        int fd = tun_create_safe(&resp);
+        if (fd < 0)
+        {
+            err = -fd;
+            result = make_error(env, err);
+            goto cleanup;
+        }
+
+        fd_obj->fd = fd;
+
+        // Configure the device using shared function
+        int config_result = tun_configure_safe(resp.name, &req);
+        if (config_result < 0)
+        {
+            close(fd_obj->fd);
+            fd_obj->fd = -1;
+            err = -config_result;
+            result = make_error(env, err);
+            goto cleanup;
+        }
+    }
+
+    // Prepare the success result
+    ErlNifBinary name_bin;
+    if (!enif_alloc_binary(strlen(resp.name), &name_bin))
+    {
+        close(fd_obj->fd);
+        fd_obj->fd = -1;
+        err = ENOMEM;
+        result = make_error(env, err);
+        goto cleanup;
+    }
+
+    memcpy(name_bin.data, resp.name, name_bin.size);
+    ERL_NIF_TERM res_term = enif_make_resource(env, fd_obj);
+    ERL_NIF_TERM info = enif_make_tuple2(env, res_term, enif_make_binary(env, &name_bin));
+    enif_release_binary(&name_bin);
+
+    result = enif_make_tuple2(env, s_ok, info);
+
+cleanup:
+    TUNDRA_PROBE2(create_return, resp.name, err);
+    enif_release_resource(fd_obj);
+    return result;
+#else
+    (void)argc;
+    (void)argv;
+    return make_error(env, ENOTSUP);
+#endif
+}
+
+// Apply address/MTU configuration to an existing device (requires privileges).
+//
+// Used to finish off pre-created pool devices, which are brought up without an
+// address. The whole configuration is applied in a single netlink batch, on a
+// dirty I/O scheduler.
+static ERL_NIF_TERM configure_tun(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+#if defined(__linux__) || defined(__APPLE__)
+    char name[IF_NAMESIZE] = {0};
+    if (argc != 2 || !enif_get_string(env, argv[0], name, sizeof(name), ERL_NIF_UTF8) || !enif_is_map(env, argv[1]))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct create_tun_request_t req = {0};
+    req.size = sizeof(req);
+    if (!get_create_tun_request(env, argv[1], &req))
+    {
+        return enif_make_badarg(env);
+    }
+
+    int nsfd;
+    int result = get_netns(env, argv[1], &nsfd);
+    if (result < 0)
+    {
+        return make_error(env, -result);
+    }
+#ifdef __linux__
+    if (nsfd != -1)
+    {
+        result = netns_create_safe(nsfd, name, &req, NULL);
+    }
+    else
+#endif
+    {
+        result = tun_configure_safe(name, &req);
+    }
+    if (result < 0)
+    {
+        return make_error(env, -result);
+    }
+    return s_ok;
+#else
+    (void)argc;
+    (void)argv;
+    return make_error(env, ENOTSUP);
+#endif
+}
+
+// Change a live device owned by the caller (requires privileges).
+//
+// The changes are applied in one netlink batch, to the interface found from
+// the device's descriptor rather than by name (see tun_reconfigure_safe), on a
+// dirty I/O scheduler.
+static ERL_NIF_TERM reconfigure_tun(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    struct configure_tun_request_t req = {.size = sizeof(req)};
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj) ||
+        !get_configure_tun_request(env, argv[1], &req))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    if (fd_obj->members != NULL)
+    {
+        return enif_make_badarg(env);
+    }
+    if (atomic_load((atomic_int *)&fd_obj->fd) == -1)
+    {
+        return enif_make_tuple2(env, s_error, s_closed);
+    }
+
+#if defined(__linux__)
+    // A device in another namespace is changed from inside it
+    struct netns_reconfigure_t r = {.fd = fd_obj->fd, .req = &req};
+    int result = netns_call(netns_reconfigure, &r);
+    return result < 0 ? make_error(env, -result) : s_ok;
+#elif defined(__APPLE__)
+    int result = tun_reconfigure_safe(fd_obj->fd, &req);
+    return result < 0 ? make_error(env, -result) : s_ok;
+#else
+    return make_error(env, ENOTSUP);
+#endif
+}
+
+// Re-open an existing persistent TUN device by name.
+//
+// No configuration is applied; the device keeps its addresses, routes and
+// link state. Requires CAP_NET_ADMIN unless the caller owns the device.
+static ERL_NIF_TERM attach_tun_direct(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+#ifdef __linux__
+    char name[IF_NAMESIZE] = {0};
+    if (argc != 1 || !enif_get_string(env, argv[0], name, sizeof(name), ERL_NIF_UTF8))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = alloc_fd_object(env);
+    if (fd_obj == NULL)
+    {
+        return make_error(env, ENOMEM);
+    }
+
+    ERL_NIF_TERM result;
+    struct create_tun_response_t resp = {0};
+    int fd = tun_attach_safe(name, &resp);
+    if (fd < 0)
+    {
+        result = make_error(env, -fd);
+        goto cleanup;
+    }
+    fd_obj->fd = fd;
+
+    ErlNifBinary name_bin;
+    if (!enif_alloc_binary(strlen(resp.name), &name_bin))
+    {
+        close(fd_obj->fd);
+        fd_obj->fd = -1;
+        result = make_error(env, ENOMEM);
+        goto cleanup;
+    }
+
+    memcpy(name_bin.data, resp.name, name_bin.size);
+    ERL_NIF_TERM info = enif_make_tuple2(env, enif_make_resource(env, fd_obj), enif_make_binary(env, &name_bin));
+    enif_release_binary(&name_bin);
+    result = enif_make_tuple2(env, s_ok, info);
+
+cleanup:
+    enif_release_resource(fd_obj);
+    return result;
+#else
+    (void)argc;
+    (void)argv;
+    return make_error(env, ENOTSUP);
+#endif
+}
+
+// Set or clear persistence (TUNSETPERSIST) on a device owned by the caller.
+static ERL_NIF_TERM set_persist(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_is_atom(env, argv[1]))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
     }
-    else if (errno == EINTR)
+
+    int result = tun_persist_safe(fd_obj->fd, enif_compare(argv[1], s_true) == 0);
+    return result < 0 ? make_error(env, -result) : s_ok;
+}
+
+// Set the send buffer (TUNSETSNDBUF) of a device owned by the caller.
+static ERL_NIF_TERM set_sndbuf(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    int bytes;
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_get_int(env, argv[1], &bytes) ||
+        bytes <= 0)
     {
-        return enif_schedule_nif(env, "try_connect", 0, try_connect, argc, argv);
+        return enif_make_badarg(env);
     }
-    else
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
     {
-        return make_error(env, errno);
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    if (fd_obj->members != NULL)
+    {
+        return enif_make_badarg(env);
     }
+
+    int result = tun_sndbuf_safe(fd_obj->fd, bytes);
+    return result < 0 ? make_error(env, -result) : s_ok;
 }
 
-static ERL_NIF_TERM connect_svr(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Fetch the kernel's counters for a list of interface names, with one netlink
+// dump. Returns {ok, #{Name => Stats}}, omitting interfaces that do not exist.
+// Runs on a dirty scheduler, as the dump grows with the number of interfaces.
+static ERL_NIF_TERM link_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    unsigned n;
+    if (argc != 1 || !enif_get_list_length(env, argv[0], &n))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct tun_link_stats_t *links = enif_alloc((n > 0 ? n : 1) * sizeof(*links));
+    if (links == NULL)
+    {
+        return make_error(env, ENOMEM);
+    }
+
+    // Names too long for an interface cannot match one, and are left empty
+    ERL_NIF_TERM list = argv[0], head, result;
+    for (unsigned i = 0; enif_get_list_cell(env, list, &head, &list); ++i)
+    {
+        ErlNifBinary name;
+        if (!enif_inspect_binary(env, head, &name))
+        {
+            result = enif_make_badarg(env);
+            goto cleanup;
+        }
+        memset(links[i].name, 0, sizeof(links[i].name));
+        if (name.size < sizeof(links[i].name) && memchr(name.data, '\0', name.size) == NULL)
+        {
+            memcpy(links[i].name, name.data, name.size);
+        }
+    }
+
+    int err = tun_link_stats_safe(links, n);
+    if (err < 0)
+    {
+        result = make_error(env, -err);
+        goto cleanup;
+    }
+
+    ERL_NIF_TERM map = enif_make_new_map(env);
+    for (unsigned i = 0; i < n; ++i)
+    {
+        const struct tun_link_stats_t *l = &links[i];
+        if (l->ifindex == 0)
+        {
+            continue;
+        }
+        ERL_NIF_TERM keys[] = {enif_make_atom(env, "ifindex"), s_mtu, s_txqueuelen,
+                               enif_make_atom(env, "up"), enif_make_atom(env, "running"), s_rx_packets,
+                               s_tx_packets, s_rx_bytes, s_tx_bytes, enif_make_atom(env, "rx_errors"),
+                               enif_make_atom(env, "tx_errors"), enif_make_atom(env, "rx_dropped"),
+                               enif_make_atom(env, "tx_dropped")};
+        ERL_NIF_TERM values[] = {enif_make_uint(env, l->ifindex),
+                                 enif_make_uint(env, l->mtu),
+                                 enif_make_uint(env, l->txqlen),
+                                 enif_make_atom(env, l->flags & IFF_UP ? "true" : "false"),
+                                 enif_make_atom(env, l->flags & IFF_RUNNING ? "true" : "false"),
+                                 enif_make_uint64(env, l->rx_packets),
+                                 enif_make_uint64(env, l->tx_packets),
+                                 enif_make_uint64(env, l->rx_bytes),
+                                 enif_make_uint64(env, l->tx_bytes),
+                                 enif_make_uint64(env, l->rx_errors),
+                                 enif_make_uint64(env, l->tx_errors),
+                                 enif_make_uint64(env, l->rx_dropped),
+                                 enif_make_uint64(env, l->tx_dropped)};
+        ERL_NIF_TERM stats, name;
+        size_t len = strlen(l->name);
+        memcpy(enif_make_new_binary(env, len, &name), l->name, len);
+        enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(keys[0]), &stats);
+        enif_make_map_put(env, map, name, stats, &map);
+    }
+    result = enif_make_tuple2(env, s_ok, map);
+
+cleanup:
+    enif_free(links);
+    return result;
+}
+
+// Open a subscription to the kernel's interface notifications (RTNLGRP_LINK),
+// as an fd object owned by the caller and read with link_monitor_read.
+static ERL_NIF_TERM link_monitor_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     (void)argc;
     (void)argv;
+    int fd = tun_link_monitor_safe();
+    if (fd < 0)
+    {
+        return make_error(env, -fd);
+    }
 
     struct fd_object_t *fd_obj = alloc_fd_object(env);
     if (fd_obj == NULL)
     {
+        close(fd);
         return make_error(env, ENOMEM);
     }
+    fd_obj->fd = fd;
+    ERL_NIF_TERM result = enif_make_tuple2(env, s_ok, enif_make_resource(env, fd_obj));
+    enif_release_resource(fd_obj);
+    return result;
+}
 
-    ERL_NIF_TERM ret;
+// Read pending interface notifications as a list of
+// {new | del, Name, Ifindex, Up, Running, Mtu}, oldest first. If there are
+// none the subscription is selected for reading, as for recv_data.
+static ERL_NIF_TERM link_monitor_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
 
-    fd_obj->fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd_obj->fd == -1)
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
     {
-        goto error;
+        return enif_make_tuple2(env, s_error, s_not_owner);
     }
-    if (-1 == fcntl(fd_obj->fd, F_SETFL, fcntl(fd_obj->fd, F_GETFL) | O_NONBLOCK))
+    if (fd_obj->members != NULL)
     {
-        goto error;
+        return enif_make_badarg(env);
     }
-#ifdef __APPLE__
-    if (-1 == setsockopt(fd_obj->fd, SOL_SOCKET, SO_NOSIGPIPE, &(int){1}, sizeof(int)))
+
+    struct tun_link_event_t events[64];
+    int n = tun_link_events_safe(fd_obj->fd, events, sizeof(events) / sizeof(events[0]));
+    if (n < 0)
     {
-        goto error;
+        return make_error(env, -n);
+    }
+    if (n > 0)
+    {
+        ERL_NIF_TERM list = enif_make_list(env, 0);
+        for (int i = n - 1; i >= 0; --i)
+        {
+            const struct tun_link_event_t *ev = &events[i];
+            ERL_NIF_TERM name;
+            size_t len = strlen(ev->name);
+            memcpy(enif_make_new_binary(env, len, &name), ev->name, len);
+            ERL_NIF_TERM items[] = {enif_make_atom(env, ev->removed ? "del" : "new"),
+                                    name,
+                                    enif_make_uint(env, ev->ifindex),
+                                    enif_make_atom(env, ev->flags & IFF_UP ? "true" : "false"),
+                                    enif_make_atom(env, ev->flags & IFF_RUNNING ? "true" : "false"),
+                                    enif_make_uint(env, ev->mtu)};
+            list = enif_make_list_cell(env, enif_make_tuple_from_array(env, items, 6), list);
+        }
+        return enif_make_tuple2(env, s_ok, list);
     }
-#endif
 
-    ERL_NIF_TERM res = enif_make_resource(env, fd_obj);
-    ret = enif_schedule_nif(env, "try_connect", 0, try_connect, 1, &res);
-    goto exit;
+    ERL_NIF_TERM ref = enif_make_ref(env);
+    ERL_NIF_TERM msg = enif_make_tuple4(env, s_socket, enif_make_tuple2(env, s_tundra, argv[0]), s_select, ref);
+    if (enif_select_read(env, fd_obj->fd, fd_obj, NULL, msg, NULL) < 0)
+    {
+        return make_error(env, errno);
+    }
+    return enif_make_tuple2(env, s_select, enif_make_tuple3(env, s_select_info, s_recv, ref));
+}
 
-error:
-    ret = make_error(env, errno);
+// Copy a socket path from a binary. Returns false if it is empty, too long
+// for a Unix socket or contains a NUL.
+static bool get_socket_path(ErlNifEnv *env, ERL_NIF_TERM term, char *path, size_t size)
+{
+    ErlNifBinary bin;
+    if (!enif_inspect_binary(env, term, &bin) || bin.size == 0 || bin.size >= size ||
+        memchr(bin.data, 0, bin.size) != NULL)
+    {
+        return false;
+    }
+    memcpy(path, bin.data, bin.size);
+    path[bin.size] = '\0';
+    return true;
+}
 
-exit:
-    enif_release_resource(fd_obj);
-    return ret;
+// Offer devices owned by the caller, given as a list of {Ref, Metadata}, to
+// another VM on a Unix socket (see handoff.h). Waits up to argv[2]
+// milliseconds, or forever if negative, on a dirty I/O scheduler. The devices
+// stay open here; the caller closes them once this returns ok.
+static ERL_NIF_TERM export_devices(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    unsigned n;
+    int timeout;
+    if (argc != 3 || !get_socket_path(env, argv[0], path, sizeof(path)) ||
+        !enif_get_list_length(env, argv[1], &n) || !enif_get_int(env, argv[2], &timeout))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct handoff_dev_t *devs = enif_alloc((n > 0 ? n : 1) * sizeof(*devs));
+    if (devs == NULL)
+    {
+        return make_error(env, ENOMEM);
+    }
+
+    ERL_NIF_TERM list = argv[1], head, result;
+    ErlNifPid self;
+    enif_self(env, &self);
+    for (unsigned i = 0; enif_get_list_cell(env, list, &head, &list); ++i)
+    {
+        const ERL_NIF_TERM *pair;
+        int arity;
+        void *obj;
+        ErlNifBinary meta;
+        if (!enif_get_tuple(env, head, &arity, &pair) || arity != 2 ||
+            !enif_get_resource(env, pair[0], s_fdrt, &obj) || !enif_inspect_binary(env, pair[1], &meta) ||
+            ((struct fd_object_t *)obj)->members != NULL)
+        {
+            result = enif_make_badarg(env);
+            goto cleanup;
+        }
+        struct fd_object_t *fd_obj = obj;
+        if (enif_compare_pids(&fd_obj->cp, &self) != 0)
+        {
+            result = enif_make_tuple2(env, s_error, s_not_owner);
+            goto cleanup;
+        }
+        if (atomic_load((atomic_int *)&fd_obj->fd) == -1)
+        {
+            result = enif_make_tuple2(env, s_error, s_closed);
+            goto cleanup;
+        }
+        devs[i] = (struct handoff_dev_t){.fd = fd_obj->fd, .meta = meta.data, .meta_len = meta.size};
+    }
+
+    int err = handoff_export(path, devs, n, timeout);
+    result = err < 0 ? make_error(env, -err) : s_ok;
+
+cleanup:
+    enif_free(devs);
+    return result;
 }
 
-static ERL_NIF_TERM controlling_process(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Take the devices offered on a Unix socket by export_devices, as a list of
+// {Ref, Name, Metadata} owned by the caller. Waits up to argv[1] milliseconds,
+// or forever if negative, on a dirty I/O scheduler.
+static ERL_NIF_TERM import_devices(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int timeout;
+    if (argc != 2 || !get_socket_path(env, argv[0], path, sizeof(path)) || !enif_get_int(env, argv[1], &timeout))
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct handoff_dev_t *devs;
+    size_t n;
+    int err = handoff_import(path, timeout, &devs, &n);
+    if (err < 0)
+    {
+        return make_error(env, -err);
+    }
+
+    // Built back to front, so that the list is in the order exported
+    ERL_NIF_TERM list = enif_make_list(env, 0), result;
+    for (size_t i = n; i-- > 0;)
+    {
+        struct fd_object_t *fd_obj = alloc_fd_object(env);
+        if (fd_obj == NULL)
+        {
+            result = make_error(env, ENOMEM);
+            goto cleanup;
+        }
+        fd_obj->fd = devs[i].fd;
+        devs[i].fd = -1;
+
+        ERL_NIF_TERM name, meta;
+        size_t len = strlen(devs[i].name);
+        memcpy(enif_make_new_binary(env, len, &name), devs[i].name, len);
+        if (devs[i].meta_len > 0)
+        {
+            memcpy(enif_make_new_binary(env, devs[i].meta_len, &meta), devs[i].meta, devs[i].meta_len);
+        }
+        else
+        {
+            enif_make_new_binary(env, 0, &meta);
+        }
+        ERL_NIF_TERM dev = enif_make_tuple3(env, enif_make_resource(env, fd_obj), name, meta);
+        enif_release_resource(fd_obj);
+        list = enif_make_list_cell(env, dev, list);
+    }
+    result = enif_make_tuple2(env, s_ok, list);
+
+cleanup:
+    handoff_free(devs, n);
+    return result;
+}
+
+// Put a device owned by the caller in ring mode, given {Slots, SlotSize}, or
+// take it out, given false (see memring.h). While the device is in ring mode
+// packets may still be sent from Elixir, but not received.
+static ERL_NIF_TERM set_ring(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     void *obj;
-    ErlNifPid pid;
-    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj) || !enif_get_local_pid(env, argv[1], &pid))
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+    bool enable = !enif_is_atom(env, argv[1]);
+    const ERL_NIF_TERM *config;
+    int arity;
+    unsigned slots, slot_size;
+    if (enable && (!enif_get_tuple(env, argv[1], &arity, &config) || arity != 2 ||
+                   !enif_get_uint(env, config[0], &slots) || !enif_get_uint(env, config[1], &slot_size)))
     {
         return enif_make_badarg(env);
     }
-    struct fd_object_t *fd_obj = obj;
 
+    struct fd_object_t *fd_obj = obj;
     ErlNifPid self;
     if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
     {
         return enif_make_tuple2(env, s_error, s_not_owner);
     }
+    if (fd_obj->members != NULL)
+    {
+        return enif_make_badarg(env);
+    }
+    if (atomic_load((atomic_int *)&fd_obj->fd) == -1)
+    {
+        return enif_make_tuple2(env, s_error, s_closed);
+    }
 
-    if (enif_compare_pids(&fd_obj->cp, &pid) != 0)
+    struct memring_t *r = atomic_load(&fd_obj->memring);
+    if (!enable)
     {
-        fd_obj->cp = pid;
-        enif_demonitor_process(env, fd_obj, &fd_obj->mon);
-        if (enif_monitor_process(env, fd_obj, &pid, &fd_obj->mon) != 0)
+        if (r != NULL)
         {
-            enif_select(env, fd_obj->fd, ERL_NIF_SELECT_STOP, fd_obj, NULL, enif_make_ref(env));
+            memring_disable(r);
         }
+        fd_obj->ring = NULL;
+        return s_ok;
     }
-
+    if (atomic_load(&fd_obj->poll_set) != NULL || fd_obj->tun != NULL)
+    {
+        // A poll set or the tunnel thread would read the device too
+        return make_error(env, EBUSY);
+    }
+    if (r == NULL)
+    {
+        if ((r = memring_create()) == NULL)
+        {
+            return make_error(env, ENOMEM);
+        }
+        atomic_store(&fd_obj->memring, r);
+    }
+    int err = memring_enable(r, fd_obj->fd, slots, slot_size, fd_obj);
+    if (err < 0)
+    {
+        return make_error(env, -err);
+    }
+    fd_obj->ring = r;
     return s_ok;
 }
 
-static ERL_NIF_TERM close_fd(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Return the descriptors of a device's ring as {Memfd, Rung, Waited}: the
+// eventfd this side rings and the one it waits on. They belong to the ring,
+// and are closed when it is disabled.
+static ERL_NIF_TERM get_ring_fds(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     void *obj;
     if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
@@ -421,175 +4000,359 @@ static ERL_NIF_TERM close_fd(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]
     {
         return enif_make_tuple2(env, s_error, s_not_owner);
     }
+    struct memring_t *r = fd_obj->ring;
+    if (r == NULL)
+    {
+        return enif_make_tuple2(env, s_error, s_disabled);
+    }
 
-    int ret = enif_select(env, fd_obj->fd, ERL_NIF_SELECT_STOP, fd_obj, NULL, enif_make_ref(env));
-    if (ret < 0)
+    enif_mutex_lock(r->lock);
+    ERL_NIF_TERM fds = enif_make_tuple3(env, enif_make_int(env, r->memfd), enif_make_int(env, r->efd_peer),
+                                        enif_make_int(env, r->efd_self));
+    bool closed = r->closed;
+    enif_mutex_unlock(r->lock);
+    return closed ? enif_make_tuple2(env, s_error, s_disabled) : enif_make_tuple2(env, s_ok, fds);
+}
+
+// Pass a device's ring to the process listening on a Unix socket (see
+// memring_share), on a dirty I/O scheduler.
+static ERL_NIF_TERM share_ring(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj) ||
+        !get_socket_path(env, argv[1], path, sizeof(path)))
     {
-        if (ret & ERL_NIF_SELECT_FAILED)
-        {
-            return make_error(env, errno);
-        }
-        else
-        {
-            return make_error(env, EINVAL);
-        }
+        return enif_make_badarg(env);
     }
 
-    return s_ok;
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    struct memring_t *r = fd_obj->ring;
+    if (r == NULL)
+    {
+        return enif_make_tuple2(env, s_error, s_disabled);
+    }
+    int err = memring_share(r, path);
+    return err == -EBADF ? enif_make_tuple2(env, s_error, s_disabled) : err < 0 ? make_error(env, -err) : s_ok;
 }
 
-static ERL_NIF_TERM get_fd(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Return the counters of a device's ring, since it was last enabled. Like
+// get_stats, this may be called from any process.
+static ERL_NIF_TERM get_ring_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     void *obj;
     if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
     {
-        return enif_make_badarg(env);
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    struct memring_t *r = atomic_load(&fd_obj->memring);
+    if (r == NULL)
+    {
+        return enif_make_tuple2(env, s_error, s_disabled);
+    }
+
+    struct memring_stats_t st;
+    memring_get_stats(r, &st);
+    ERL_NIF_TERM keys[] = {s_rx_packets, s_rx_bytes, s_rx_full, s_tx_packets, s_tx_bytes, s_tx_errors, s_wakeups};
+    ERL_NIF_TERM values[] = {enif_make_uint64(env, st.rx_packets), enif_make_uint64(env, st.rx_bytes),
+                             enif_make_uint64(env, st.rx_full),    enif_make_uint64(env, st.tx_packets),
+                             enif_make_uint64(env, st.tx_bytes),   enif_make_uint64(env, st.tx_errors),
+                             enif_make_uint64(env, st.wakeups)};
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, 7, &map);
+    return enif_make_tuple2(env, s_ok, map);
+}
+
+// Put a device owned by the caller in tunnel mode, given {Cipher, {IpBin,
+// Port}, Buffer}, or take it out, given false (see tunnel.h). Returns {ok,
+// Port} with the port the socket is bound to. As in ring mode, packets may
+// still be sent from Elixir but not received.
+static ERL_NIF_TERM set_tunnel(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    {
+        return enif_make_badarg(env);
+    }
+    bool enable = !enif_is_atom(env, argv[1]);
+    const ERL_NIF_TERM *config;
+    int arity;
+    struct tunnel_config_t tc = {0};
+    if (enable &&
+        (!enif_get_tuple(env, argv[1], &arity, &config) || arity != 3 || !get_endpoint(env, config[1], &tc.local) ||
+         !enif_get_int(env, config[2], &tc.buffer)))
+    {
+        return enif_make_badarg(env);
+    }
+    if (enable && enif_compare(config[0], s_chacha20_poly1305) == 0)
+    {
+        tc.cipher = TUNNEL_CHACHA20_POLY1305;
+    }
+    else if (enable && enif_compare(config[0], s_aes_256_gcm) == 0)
+    {
+        tc.cipher = TUNNEL_AES_256_GCM;
+    }
+    else if (enable)
+    {
+        return enif_make_badarg(env);
+    }
+
+    struct fd_object_t *fd_obj = obj;
+    ErlNifPid self;
+    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    {
+        return enif_make_tuple2(env, s_error, s_not_owner);
+    }
+    if (fd_obj->members != NULL)
+    {
+        return enif_make_badarg(env);
+    }
+    if (atomic_load((atomic_int *)&fd_obj->fd) == -1)
+    {
+        return enif_make_tuple2(env, s_error, s_closed);
+    }
+
+    struct tunnel_t *t = atomic_load(&fd_obj->tunnel);
+    if (!enable)
+    {
+        if (t != NULL)
+        {
+            tunnel_disable(t);
+        }
+        fd_obj->tun = NULL;
+        return s_ok;
+    }
+    if (atomic_load(&fd_obj->poll_set) != NULL || fd_obj->ring != NULL)
+    {
+        // A poll set or the ring thread would read the device too
+        return make_error(env, EBUSY);
+    }
+    if (t == NULL)
+    {
+        if ((t = tunnel_create()) == NULL)
+        {
+            return make_error(env, ENOMEM);
+        }
+        atomic_store(&fd_obj->tunnel, t);
+    }
+    int port = tunnel_enable(t, fd_obj->fd, &tc, &self, fd_obj);
+    if (port < 0)
+    {
+        return make_error(env, -port);
     }
-
-    struct fd_object_t *fd_obj = obj;
-    return enif_make_int(env, fd_obj->fd);
+    fd_obj->tun = t;
+    return enif_make_tuple2(env, s_ok, enif_make_int(env, port));
 }
 
-static ERL_NIF_TERM recv_data(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// The tunnel of a device owned by the caller, or NULL with *error set
+static struct tunnel_t *get_tunnel(ErlNifEnv *env, ERL_NIF_TERM term, ERL_NIF_TERM *error)
 {
     void *obj;
-    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    if (!enif_get_resource(env, term, s_fdrt, &obj))
     {
-        return enif_make_badarg(env);
+        *error = enif_make_badarg(env);
+        return NULL;
     }
     struct fd_object_t *fd_obj = obj;
-
     ErlNifPid self;
     if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
     {
-        return enif_make_tuple2(env, s_error, s_not_owner);
+        *error = enif_make_tuple2(env, s_error, s_not_owner);
+        return NULL;
     }
-
-    int length;
-    if (!enif_get_int(env, argv[1], &length) || length <= 0)
+    if (fd_obj->tun == NULL)
     {
-        return enif_make_badarg(env);
+        *error = enif_make_tuple2(env, s_error, s_disabled);
     }
+    return fd_obj->tun;
+}
 
-    // Add 4 bytes for the TUN header that we strip from the result
-    ErlNifBinary buf;
-    if (!enif_alloc_binary(length + 4, &buf))
+// Read a peer's {RemoteIndex, Endpoint | undefined, TxKey, RxKey, Prefixes},
+// where Prefixes is a list of {IpBin, PrefixLen}
+static bool get_tunnel_peer(ErlNifEnv *env, ERL_NIF_TERM term, struct tunnel_peer_config_t *pc)
+{
+    const ERL_NIF_TERM *tuple;
+    int arity;
+    ErlNifBinary tx, rx;
+    if (!enif_get_tuple(env, term, &arity, &tuple) || arity != 5 ||
+        !enif_get_uint(env, tuple[0], &pc->remote_index) ||
+        (!enif_is_atom(env, tuple[1]) && !get_endpoint(env, tuple[1], &pc->endpoint)) ||
+        !enif_inspect_binary(env, tuple[2], &tx) || tx.size != TUNNEL_KEY_SIZE ||
+        !enif_inspect_binary(env, tuple[3], &rx) || rx.size != TUNNEL_KEY_SIZE)
     {
-        return make_error(env, ENOMEM);
+        return false;
     }
+    memcpy(pc->tx_key, tx.data, TUNNEL_KEY_SIZE);
+    memcpy(pc->rx_key, rx.data, TUNNEL_KEY_SIZE);
 
-    ssize_t n = read(fd_obj->fd, buf.data, buf.size);
-
-    ERL_NIF_TERM ret;
-    if (n == -1)
+    ERL_NIF_TERM list = tuple[4], head;
+    while (enif_get_list_cell(env, list, &head, &list))
     {
-        int err = errno;
-        if (err == EAGAIN || err == EWOULDBLOCK)
-        {
-            ERL_NIF_TERM ref = enif_make_ref(env);
-            ERL_NIF_TERM obj = enif_make_tuple2(env, s_tundra, argv[0]);
-            ERL_NIF_TERM msg = enif_make_tuple4(env, s_socket, obj, s_select, ref);
-            if (enif_select_read(env, fd_obj->fd, fd_obj, NULL, msg, NULL) >= 0)
-            {
-                ret = enif_make_tuple2(env, s_select, enif_make_tuple3(env, s_select_info, s_recv, ref));
-            }
-            else
-            {
-                ret = make_error(env, errno);
-            }
-        }
-        else
+        const ERL_NIF_TERM *prefix;
+        ErlNifBinary addr;
+        unsigned prefixlen;
+        if (pc->nprefixes == TUNNEL_MAX_PREFIXES || !enif_get_tuple(env, head, &arity, &prefix) || arity != 2 ||
+            !enif_inspect_binary(env, prefix[0], &addr) || (addr.size != 4 && addr.size != 16) ||
+            !enif_get_uint(env, prefix[1], &prefixlen) || prefixlen > addr.size * 8)
         {
-            ret = make_error(env, err);
+            return false;
         }
+        struct tunnel_prefix_t *p = &pc->prefixes[pc->nprefixes++];
+        p->family = addr.size == 4 ? AF_INET : AF_INET6;
+        p->prefixlen = (unsigned char)prefixlen;
+        memcpy(p->addr, addr.data, addr.size);
     }
-    else if (n < 4)
+    return enif_is_empty_list(env, list);
+}
+
+// Add or replace a peer of a device's tunnel, given its index and
+// configuration (see get_tunnel_peer).
+static ERL_NIF_TERM set_tunnel_peer(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct tunnel_peer_config_t pc = {0};
+    pc.endpoint.ss_family = AF_UNSPEC;
+    if (argc != 3 || !enif_get_uint(env, argv[1], &pc.index) || !get_tunnel_peer(env, argv[2], &pc))
     {
-        // Received less than header size
-        ret = make_error(env, EMSGSIZE);
+        return enif_make_badarg(env);
     }
-    else
+    ERL_NIF_TERM error;
+    struct tunnel_t *t = get_tunnel(env, argv[0], &error);
+    if (t == NULL)
     {
-        ERL_NIF_TERM bin = enif_make_binary(env, &buf);
-        // Skip 4-byte TUN header, return only the IP packet
-        bin = enif_make_sub_binary(env, bin, 4, n - 4);
-        ret = enif_make_tuple2(env, s_ok, bin);
+        return error;
     }
-
-    enif_release_binary(&buf);
-    return ret;
+    int err = tunnel_set_peer(t, &pc);
+    return err == -EBADF ? enif_make_tuple2(env, s_error, s_disabled) : err < 0 ? make_error(env, -err) : s_ok;
 }
 
-static ERL_NIF_TERM send_data(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Remove a peer of a device's tunnel by index.
+static ERL_NIF_TERM delete_tunnel_peer(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    void *obj;
-    if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
+    unsigned index;
+    if (argc != 2 || !enif_get_uint(env, argv[1], &index))
     {
         return enif_make_badarg(env);
     }
-    struct fd_object_t *fd_obj = obj;
-
-    ErlNifPid self;
-    if (enif_compare_pids(&fd_obj->cp, enif_self(env, &self)) != 0)
+    ERL_NIF_TERM error;
+    struct tunnel_t *t = get_tunnel(env, argv[0], &error);
+    if (t == NULL)
     {
-        return enif_make_tuple2(env, s_error, s_not_owner);
+        return error;
     }
+    int err = tunnel_remove_peer(t, index);
+    return err == -EBADF ? enif_make_tuple2(env, s_error, s_disabled) : err < 0 ? make_error(env, -err) : s_ok;
+}
 
-    unsigned max_elements;
-    if (!enif_get_list_length(env, argv[1], &max_elements) || max_elements == 0)
+// Send a datagram, such as a handshake message, from a device's tunnel
+// socket to {IpBin, Port}.
+static ERL_NIF_TERM send_tunnel_control(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct sockaddr_storage to;
+    ErlNifBinary data;
+    if (argc != 3 || !get_endpoint(env, argv[1], &to) || !enif_inspect_iolist_as_binary(env, argv[2], &data))
     {
         return enif_make_badarg(env);
     }
+    ERL_NIF_TERM error;
+    struct tunnel_t *t = get_tunnel(env, argv[0], &error);
+    if (t == NULL)
+    {
+        return error;
+    }
+    int err = tunnel_send_control(t, &to, data.data, data.size);
+    return err == -EBADF ? enif_make_tuple2(env, s_error, s_disabled) : err < 0 ? make_error(env, -err) : s_ok;
+}
 
-    ErlNifIOVec *iovec = NULL;
-    ERL_NIF_TERM tail;
-    if (!enif_inspect_iovec(env, max_elements, argv[1], &tail, &iovec))
+// Return the counters of a device's tunnel since it was last enabled, with
+// those of each peer under `peers`. Like get_stats, this may be called from
+// any process.
+static ERL_NIF_TERM get_tunnel_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    void *obj;
+    if (argc != 1 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
     {
         return enif_make_badarg(env);
     }
 
-    ssize_t n = writev(fd_obj->fd, iovec->iov, iovec->iovcnt);
-
-    if (n < 0)
+    struct fd_object_t *fd_obj = obj;
+    struct tunnel_t *t = atomic_load(&fd_obj->tunnel);
+    if (t == NULL)
     {
-        int err = errno;
-        if (err == EAGAIN || err == EWOULDBLOCK)
-        {
-            // Use a notifaction msg similar to the one used by the erlang socket support
-            ERL_NIF_TERM ref = enif_make_ref(env);
-            ERL_NIF_TERM obj = enif_make_tuple2(env, s_tundra, argv[0]);
-            ERL_NIF_TERM msg = enif_make_tuple4(env, s_socket, obj, s_select, ref);
-            if (enif_select_write(env, fd_obj->fd, fd_obj, NULL, msg, NULL) >= 0)
-            {
-                return enif_make_tuple2(env, s_select, enif_make_tuple3(env, s_select_info, s_send, ref));
-            }
-            else
-            {
-                return make_error(env, errno);
-            }
-        }
-        else
-        {
-            return make_error(env, err);
-        }
+        return enif_make_tuple2(env, s_error, s_disabled);
     }
-    else if ((size_t)n == iovec->size)
+
+    unsigned n = tunnel_get_peer_stats(t, NULL, 0);
+    struct tunnel_peer_stats_t *ps = enif_alloc((n ? n : 1) * sizeof(*ps));
+    if (ps == NULL)
     {
-        return s_ok;
+        return make_error(env, ENOMEM);
     }
-    else
+    unsigned now = tunnel_get_peer_stats(t, ps, n);
+    n = now < n ? now : n;
+    ERL_NIF_TERM peers = enif_make_list(env, 0);
+    ERL_NIF_TERM peer_keys[] = {s_index, s_counter, s_rx_packets, s_rx_bytes, s_tx_packets, s_tx_bytes};
+    for (unsigned i = n; i-- > 0;)
     {
-        return make_error(env, ENOBUFS);
+        ERL_NIF_TERM values[] = {enif_make_uint(env, ps[i].index),        enif_make_uint64(env, ps[i].counter),
+                                 enif_make_uint64(env, ps[i].rx_packets), enif_make_uint64(env, ps[i].rx_bytes),
+                                 enif_make_uint64(env, ps[i].tx_packets), enif_make_uint64(env, ps[i].tx_bytes)};
+        ERL_NIF_TERM peer;
+        enif_make_map_from_arrays(env, peer_keys, values, 6, &peer);
+        peers = enif_make_list_cell(env, peer, peers);
     }
+    enif_free(ps);
+
+    struct tunnel_stats_t st;
+    tunnel_get_stats(t, &st);
+    ERL_NIF_TERM keys[] = {s_rx_packets, s_rx_bytes,      s_tx_packets, s_tx_bytes, s_no_route, s_unknown_peer,
+                           s_auth_failures, s_replays, s_control, s_dropped, s_peers};
+    ERL_NIF_TERM values[] = {enif_make_uint64(env, st.rx_packets),    enif_make_uint64(env, st.rx_bytes),
+                             enif_make_uint64(env, st.tx_packets),    enif_make_uint64(env, st.tx_bytes),
+                             enif_make_uint64(env, st.no_route),      enif_make_uint64(env, st.unknown_peer),
+                             enif_make_uint64(env, st.auth_failures), enif_make_uint64(env, st.replays),
+                             enif_make_uint64(env, st.control),       enif_make_uint64(env, st.dropped),
+                             peers};
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, 11, &map);
+    return enif_make_tuple2(env, s_ok, map);
 }
 
-static ERL_NIF_TERM cancel_select(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Turn flow accounting on for a device owned by the caller, given {MaxFlows,
+// Top, Queue, ActiveTimeout, IdleTimeout, {IpBin, Port} | false, Domain} with
+// the timeouts in seconds, or off, given false (see flow.h).
+static ERL_NIF_TERM set_flow_accounting(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     void *obj;
     if (argc != 2 || !enif_get_resource(env, argv[0], s_fdrt, &obj))
     {
         return enif_make_badarg(env);
     }
+    bool enable = !enif_is_atom(env, argv[1]);
+    const ERL_NIF_TERM *config;
+    int arity;
+    unsigned active, idle;
+    struct flow_config_t fc = {0};
+    fc.collector.ss_family = AF_UNSPEC;
+    if (enable &&
+        (!enif_get_tuple(env, argv[1], &arity, &config) || arity != 7 || !enif_get_uint(env, config[0], &fc.max_flows) ||
+         fc.max_flows == 0 || fc.max_flows > FLOW_MAX_FLOWS || !enif_get_uint(env, config[1], &fc.top) ||
+         fc.top > FLOW_MAX_TOP || !enif_get_uint(env, config[2], &fc.queue) || fc.queue == 0 ||
+         fc.queue > FLOW_MAX_QUEUE || !enif_get_uint(env, config[3], &active) || active == 0 ||
+         !enif_get_uint(env, config[4], &idle) || idle == 0 ||
+         (!enif_is_atom(env, config[5]) && !get_endpoint(env, config[5], &fc.collector)) ||
+         !enif_get_uint(env, config[6], &fc.domain)))
+    {
+        return enif_make_badarg(env);
+    }
+    fc.active_timeout = (int64_t)active * 1000000000;
+    fc.idle_timeout = (int64_t)idle * 1000000000;
 
     struct fd_object_t *fd_obj = obj;
     ErlNifPid self;
@@ -597,148 +4360,201 @@ static ERL_NIF_TERM cancel_select(ErlNifEnv *env, int argc, const ERL_NIF_TERM a
     {
         return enif_make_tuple2(env, s_error, s_not_owner);
     }
-
-    const ERL_NIF_TERM *select_info;
-    int arity;
-    if (!enif_get_tuple(env, argv[1], &arity, &select_info) || arity != 3)
-    {
-        return enif_make_badarg(env);
-    }
-    if (enif_compare(select_info[0], s_select_info) != 0)
+    if (fd_obj->members != NULL)
     {
         return enif_make_badarg(env);
     }
-    if (!enif_is_ref(env, select_info[2]))
+    if (atomic_load((atomic_int *)&fd_obj->fd) == -1)
     {
-        return enif_make_badarg(env);
+        return enif_make_tuple2(env, s_error, s_closed);
     }
 
-    if (enif_compare(select_info[1], s_send) == 0 || enif_compare(select_info[1], s_recv) == 0)
+    struct flow_t *f = atomic_load(&fd_obj->flow);
+    if (!enable)
     {
-        enum ErlNifSelectFlags flags = enif_compare(select_info[1], s_send) == 0
-                                           ? ERL_NIF_SELECT_WRITE
-                                           : ERL_NIF_SELECT_READ;
-
-        int res = enif_select(env, fd_obj->fd, flags | ERL_NIF_SELECT_STOP, fd_obj, NULL, select_info[2]);
-        if (res < 0)
+        fd_obj->acct = NULL;
+        if (f != NULL)
         {
-            return make_error(env, errno);
+            flow_disable(f);
         }
-        else
+        return s_ok;
+    }
+    if (f == NULL)
+    {
+        if ((f = flow_create()) == NULL)
         {
-            return s_ok;
+            return make_error(env, ENOMEM);
         }
+        atomic_store(&fd_obj->flow, f);
     }
-    else
+    int err = flow_enable(f, &fc);
+    if (err < 0)
     {
-        return enif_make_badarg(env);
+        return make_error(env, -err);
     }
+    fd_obj->acct = f;
+    return s_ok;
 }
 
-// Direct TUN device creation (requires privileges)
-static ERL_NIF_TERM create_tun_direct(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// The flow state of a device with accounting on, or NULL with *error set
+static struct flow_t *get_flow(ErlNifEnv *env, ERL_NIF_TERM term, ERL_NIF_TERM *error)
 {
-#if defined(__linux__) || defined(__APPLE__)
-    if (argc != 1 || !enif_is_map(env, argv[0]))
+    void *obj;
+    if (!enif_get_resource(env, term, s_fdrt, &obj))
     {
-        return enif_make_badarg(env);
+        *error = enif_make_badarg(env);
+        return NULL;
+    }
+    struct flow_t *f = atomic_load(&((struct fd_object_t *)obj)->flow);
+    if (f == NULL)
+    {
+        *error = enif_make_tuple2(env, s_error, s_disabled);
     }
+    return f;
+}
 
-    struct create_tun_request_t req = {0};
-    req.size = sizeof(req);
+// Fill in the keys and values of the fields of a flow key, returning how many
+static int make_flow_key(ErlNifEnv *env, const struct flow_key_t *key, ERL_NIF_TERM *keys, ERL_NIF_TERM *values)
+{
+    bool v4 = key->version == 4;
+    ERL_NIF_TERM k[] = {s_direction, s_src, s_dst, s_protocol, s_sport, s_dport};
+    ERL_NIF_TERM v[] = {key->direction == FLOW_INBOUND ? s_inbound : s_outbound,
+                        make_ip(env, key->src, v4),
+                        make_ip(env, key->dst, v4),
+                        enif_make_uint(env, key->protocol),
+                        enif_make_uint(env, key->sport),
+                        enif_make_uint(env, key->dport)};
+    memcpy(keys, k, sizeof(k));
+    memcpy(values, v, sizeof(v));
+    return 6;
+}
 
-    // Parse the parameters map
-    ErlNifMapIterator iter;
-    if (!enif_map_iterator_create(env, argv[0], &iter, ERL_NIF_MAP_ITERATOR_FIRST))
+// Take up to Max of the oldest records of expired flows, as maps with the
+// start and end in system time milliseconds. Like get_stats, this may be
+// called from any process.
+static ERL_NIF_TERM get_flows(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    unsigned max;
+    if (argc != 2 || !enif_get_uint(env, argv[1], &max) || max == 0 || max > FLOW_MAX_QUEUE)
     {
         return enif_make_badarg(env);
     }
-
-    ERL_NIF_TERM key, value;
-    bool ok = true;
-    while (ok && enif_map_iterator_get_pair(env, &iter, &key, &value))
+    ERL_NIF_TERM error;
+    struct flow_t *f = get_flow(env, argv[0], &error);
+    if (f == NULL)
     {
-        if (0 == enif_compare(key, s_addr))
-        {
-            ok = !!enif_get_string(env, value, req.addr, sizeof(req.addr), ERL_NIF_UTF8);
-        }
-        else if (0 == enif_compare(key, s_dstaddr))
-        {
-            ok = !!enif_get_string(env, value, req.dstaddr, sizeof(req.dstaddr), ERL_NIF_UTF8);
-        }
-        else if (0 == enif_compare(key, s_netmask))
-        {
-            ok = !!enif_get_string(env, value, req.netmask, sizeof(req.netmask), ERL_NIF_UTF8);
-        }
-        else if (0 == enif_compare(key, s_mtu))
-        {
-            ok = !!enif_get_int(env, value, &req.mtu);
-        }
+        return error;
+    }
+    struct flow_record_t *records = enif_alloc(max * sizeof(*records));
+    if (records == NULL)
+    {
+        return make_error(env, ENOMEM);
+    }
+    int n = flow_take(f, records, max);
+    if (n < 0)
+    {
+        enif_free(records);
+        return enif_make_tuple2(env, s_error, s_disabled);
+    }
 
-        enif_map_iterator_next(env, &iter);
+    static const ERL_NIF_TERM *reasons[] = {
+        [FLOW_IDLE] = &s_idle, [FLOW_ACTIVE] = &s_active, [FLOW_FORCED] = &s_forced, [FLOW_EVICTED] = &s_evicted};
+    int64_t offset = enif_time_offset(ERL_NIF_NSEC);
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    for (int i = n; i-- > 0;)
+    {
+        const struct flow_record_t *r = &records[i];
+        ERL_NIF_TERM keys[12], values[12];
+        int k = make_flow_key(env, &r->key, keys, values);
+        ERL_NIF_TERM more_keys[] = {s_packets, s_bytes, s_start, s_end, s_tcp_flags, s_reason};
+        ERL_NIF_TERM more_values[] = {enif_make_uint64(env, r->packets),
+                                      enif_make_uint64(env, r->bytes),
+                                      enif_make_int64(env, (r->first + offset) / 1000000),
+                                      enif_make_int64(env, (r->last + offset) / 1000000),
+                                      enif_make_uint(env, r->tcp_flags),
+                                      *reasons[r->reason]};
+        memcpy(keys + k, more_keys, sizeof(more_keys));
+        memcpy(values + k, more_values, sizeof(more_values));
+        ERL_NIF_TERM map;
+        enif_make_map_from_arrays(env, keys, values, 12, &map);
+        list = enif_make_list_cell(env, map, list);
     }
-    enif_map_iterator_destroy(env, &iter);
+    enif_free(records);
+    return enif_make_tuple2(env, s_ok, list);
+}
 
-    if (!ok)
+// Return the heaviest flows by bytes, heaviest first, clearing the summary
+// if Reset is true. May be called from any process.
+static ERL_NIF_TERM get_flow_top(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    if (argc != 2 || !enif_is_atom(env, argv[1]))
     {
         return enif_make_badarg(env);
     }
-
-    // Allocate resource for the TUN device
-    struct fd_object_t *fd_obj = alloc_fd_object(env);
-    if (fd_obj == NULL)
+    ERL_NIF_TERM error;
+    struct flow_t *f = get_flow(env, argv[0], &error);
+    if (f == NULL)
+    {
+        return error;
+    }
+    struct flow_top_t *top = enif_alloc(FLOW_MAX_TOP * sizeof(*top));
+    if (top == NULL)
     {
         return make_error(env, ENOMEM);
     }
-
-    ERL_NIF_TERM result;
-    struct create_tun_response_t resp = {0};
-
-    // Create TUN device using shared function
-    int fd = tun_create_safe(&resp);
-    if (fd < 0)
+    int n = flow_get_top(f, top, enif_compare(argv[1], s_true) == 0);
+    if (n < 0)
     {
-        result = make_error(env, -fd);
-        goto cleanup;
+        enif_free(top);
+        return enif_make_tuple2(env, s_error, s_disabled);
     }
-
-    fd_obj->fd = fd;
-
-    // Configure the device using shared function
-    int config_result = tun_configure_safe(resp.name, &req);
-    if (config_result < 0)
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    for (int i = n; i-- > 0;)
     {
-        close(fd_obj->fd);
-        fd_obj->fd = -1;
-        result = make_error(env, -config_result);
-        goto cleanup;
+        ERL_NIF_TERM keys[9], values[9];
+        int k = make_flow_key(env, &top[i].key, keys, values);
+        ERL_NIF_TERM more_keys[] = {s_packets, s_bytes, s_error};
+        ERL_NIF_TERM more_values[] = {enif_make_uint64(env, top[i].packets), enif_make_uint64(env, top[i].bytes),
+                                      enif_make_uint64(env, top[i].error)};
+        memcpy(keys + k, more_keys, sizeof(more_keys));
+        memcpy(values + k, more_values, sizeof(more_values));
+        ERL_NIF_TERM map;
+        enif_make_map_from_arrays(env, keys, values, 9, &map);
+        list = enif_make_list_cell(env, map, list);
     }
+    enif_free(top);
+    return enif_make_tuple2(env, s_ok, list);
+}
 
-    // Prepare the success result
-    ErlNifBinary name_bin;
-    if (!enif_alloc_binary(strlen(resp.name), &name_bin))
+// Return the flow accounting counters of a device since it was enabled. May
+// be called from any process.
+static ERL_NIF_TERM get_flow_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    if (argc != 1)
     {
-        close(fd_obj->fd);
-        fd_obj->fd = -1;
-        result = make_error(env, ENOMEM);
-        goto cleanup;
+        return enif_make_badarg(env);
     }
-
-    memcpy(name_bin.data, resp.name, name_bin.size);
-    ERL_NIF_TERM res_term = enif_make_resource(env, fd_obj);
-    ERL_NIF_TERM info = enif_make_tuple2(env, res_term, enif_make_binary(env, &name_bin));
-    enif_release_binary(&name_bin);
-
-    result = enif_make_tuple2(env, s_ok, info);
-
-cleanup:
-    enif_release_resource(fd_obj);
-    return result;
-#else
-    (void)argc;
-    (void)argv;
-    return make_error(env, ENOTSUP);
-#endif
+    ERL_NIF_TERM error;
+    struct flow_t *f = get_flow(env, argv[0], &error);
+    if (f == NULL)
+    {
+        return error;
+    }
+    struct flow_stats_t st;
+    if (flow_get_stats(f, &st) < 0)
+    {
+        return enif_make_tuple2(env, s_error, s_disabled);
+    }
+    ERL_NIF_TERM keys[] = {s_packets, s_flows,   s_created, s_expired,       s_evicted,
+                           s_queued,  s_dropped, s_exported, s_export_errors, s_memory};
+    ERL_NIF_TERM values[] = {enif_make_uint64(env, st.packets),  enif_make_uint64(env, st.flows),
+                             enif_make_uint64(env, st.created),  enif_make_uint64(env, st.expired),
+                             enif_make_uint64(env, st.evicted),  enif_make_uint64(env, st.queued),
+                             enif_make_uint64(env, st.dropped),  enif_make_uint64(env, st.exported),
+                             enif_make_uint64(env, st.export_errors), enif_make_uint64(env, st.memory)};
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, 10, &map);
+    return enif_make_tuple2(env, s_ok, map);
 }
 
 // Close a raw (non-resource) file descriptor.
@@ -762,13 +4578,83 @@ static ERL_NIF_TERM close_raw_fd(ErlNifEnv *env, int argc, const ERL_NIF_TERM ar
     return s_ok;
 }
 
+// Create a loopback device: a connected pair of resources, both owned by the
+// caller, backed by a socketpair rather than /dev/net/tun. Each side frames
+// packets with the same 4-byte header as a TUN device, so the NIF data path is
+// unchanged; what one side sends the other receives. The optional buffer size
+// (0 for the system default) sets both socket buffers on both sides.
+//
+// SOCK_SEQPACKET preserves packet boundaries and, like a TUN device, fails a
+// write that does not fit with EAGAIN rather than dropping it. Darwin has no
+// SEQPACKET Unix sockets, so a datagram pair is used there.
+static ERL_NIF_TERM create_loopback_pair(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    int buffer;
+    if (argc != 1 || !enif_get_int(env, argv[0], &buffer) || buffer < 0)
+    {
+        return enif_make_badarg(env);
+    }
+
+#ifdef __APPLE__
+    int type = SOCK_DGRAM;
+#else
+    int type = SOCK_SEQPACKET;
+#endif
+
+    int fds[2];
+    if (socketpair(AF_UNIX, type, 0, fds) == -1)
+    {
+        return make_error(env, errno);
+    }
+
+    ERL_NIF_TERM result;
+    struct fd_object_t *objs[2] = {NULL, NULL};
+    for (int i = 0; i < 2; ++i)
+    {
+        if (fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK) == -1 ||
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1 ||
+            (buffer > 0 && (setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer)) == -1 ||
+                            setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer)) == -1)))
+        {
+            result = make_error(env, errno);
+            goto cleanup;
+        }
+        objs[i] = alloc_fd_object(env);
+        if (objs[i] == NULL)
+        {
+            result = make_error(env, ENOMEM);
+            goto cleanup;
+        }
+        objs[i]->fd = fds[i];
+        fds[i] = -1;
+    }
+
+    result = enif_make_tuple2(env, s_ok,
+                              enif_make_tuple2(env, enif_make_resource(env, objs[0]), enif_make_resource(env, objs[1])));
+
+cleanup:
+    for (int i = 0; i < 2; ++i)
+    {
+        if (fds[i] != -1)
+        {
+            close(fds[i]);
+        }
+        if (objs[i] != NULL)
+        {
+            enif_release_resource(objs[i]);
+        }
+    }
+    return result;
+}
+
 // Adopt an existing TUN file descriptor (Linux).
 //
-// Validates that the descriptor refers to a TUN device, retrieves its name,
-// duplicates it into a NIF resource owned by the calling process and returns
-// {ref, name}. The original descriptor is left open for the caller to close
-// (see close_raw_fd/1). dup(2) shares the open file description, so O_NONBLOCK
-// is set on the copy to satisfy the NIF's non-blocking I/O model.
+// Validates that the descriptor refers to a TUN device with packet information
+// (IFF_TUN without IFF_NO_PI), retrieves its name, duplicates it into a NIF
+// resource owned by the calling process and returns {ref, name}. The original
+// descriptor is left open for the caller to close (see close_raw_fd/1). dup(2)
+// shares the open file description, so O_NONBLOCK is set on the copy to satisfy
+// the NIF's non-blocking I/O model.
 static ERL_NIF_TERM adopt_tun_fd(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
 #ifdef __linux__
@@ -778,12 +4664,17 @@ static ERL_NIF_TERM adopt_tun_fd(ErlNifEnv *env, int argc, const ERL_NIF_TERM ar
         return enif_make_badarg(env);
     }
 
-    // Confirm this is a TUN device and retrieve its name.
+    // Confirm this is a TUN device with the packet information header the
+    // NIF reads and writes, and retrieve its name.
     struct ifreq ifr = {0};
     if (ioctl(orig_fd, TUNGETIFF, &ifr) == -1)
     {
         return make_error(env, errno);
     }
+    if ((ifr.ifr_flags & IFF_TUN) == 0 || (ifr.ifr_flags & IFF_NO_PI) != 0)
+    {
+        return make_error(env, EINVAL);
+    }
 
     int fd = dup(orig_fd);
     if (fd == -1)
@@ -872,16 +4763,58 @@ static ErlNifFunc nif_funcs[] =
     {
         {"connect", 0, connect_svr, 0},
         {"close", 1, close_fd, 0},
+        {"get_stats", 1, get_stats, 0},
+        {"set_latency_tracking", 2, set_latency_tracking, 0},
+        {"set_busy_poll", 2, set_busy_poll, 0},
+        {"get_latency", 1, get_latency, 0},
         {"send_request", 3, send_request, 0},
+        {"send_attach_request", 3, send_attach_request, 0},
+        {"send_configure_request", 4, send_configure_request, 0},
         {"recv_response", 2, recv_response, 0},
         {"get_fd", 1, get_fd, 0},
-        {"recv_data", 2, recv_data, 0},
-        {"send_data", 2, send_data, 0},
+        {"recv_data", 4, recv_data, 0},
+        {"recv_batch_data", 5, recv_batch, 0},
+        {"fill_room", 3, fill_room, 0},
+        {"send_data", 3, send_data, 0},
         {"cancel_select", 2, cancel_select, 0},
         {"controlling_process", 2, controlling_process, 0},
-        {"create_tun_direct", 1, create_tun_direct, 0},
+        {"create_tun_direct", 1, create_tun_direct, ERL_NIF_DIRTY_JOB_IO_BOUND},
+        {"configure_tun", 2, configure_tun, ERL_NIF_DIRTY_JOB_IO_BOUND},
+        {"reconfigure_tun", 2, reconfigure_tun, ERL_NIF_DIRTY_JOB_IO_BOUND},
+        {"attach_tun_direct", 1, attach_tun_direct, 0},
+        {"set_persist", 2, set_persist, 0},
+        {"set_sndbuf", 2, set_sndbuf, 0},
+        {"export_devices", 3, export_devices, ERL_NIF_DIRTY_JOB_IO_BOUND},
+        {"import_devices", 2, import_devices, ERL_NIF_DIRTY_JOB_IO_BOUND},
+        {"link_stats", 1, link_stats, ERL_NIF_DIRTY_JOB_IO_BOUND},
+        {"link_monitor_open", 0, link_monitor_open, 0},
+        {"link_monitor_read", 1, link_monitor_read, 0},
         {"adopt_tun_fd", 1, adopt_tun_fd, 0},
+        {"create_loopback_pair", 1, create_loopback_pair, 0},
+        {"set_send_queue", 7, set_send_queue, 0},
+        {"get_send_queue", 1, get_send_queue, 0},
+        {"capture_start", 8, start_capture, ERL_NIF_DIRTY_JOB_IO_BOUND},
+        {"capture_stop", 1, stop_capture, ERL_NIF_DIRTY_JOB_IO_BOUND},
+        {"set_impairment", 3, set_impairment, 0},
+        {"get_impairment", 1, get_impairment, 0},
+        {"set_ring", 2, set_ring, 0},
+        {"get_ring_fds", 1, get_ring_fds, 0},
+        {"share_ring", 2, share_ring, ERL_NIF_DIRTY_JOB_IO_BOUND},
+        {"get_ring_stats", 1, get_ring_stats, 0},
+        {"set_tunnel", 2, set_tunnel, 0},
+        {"set_tunnel_peer", 3, set_tunnel_peer, 0},
+        {"delete_tunnel_peer", 2, delete_tunnel_peer, 0},
+        {"send_tunnel_control", 3, send_tunnel_control, 0},
+        {"get_tunnel_stats", 1, get_tunnel_stats, 0},
+        {"set_flow_accounting", 2, set_flow_accounting, ERL_NIF_DIRTY_JOB_IO_BOUND},
+        {"get_flows", 2, get_flows, 0},
+        {"get_flow_top", 2, get_flow_top, 0},
+        {"get_flow_stats", 1, get_flow_stats, 0},
+        {"poll_create", 0, poll_create, 0},
+        {"poll_add", 2, poll_add, 0},
+        {"poll_remove", 2, poll_remove, 0},
+        {"poll_wait", 4, poll_wait, 0},
         {"get_utun_name", 1, get_utun_name, 0},
         {"close_raw_fd", 1, close_raw_fd, 0}};
 
-ERL_NIF_INIT(Elixir.Tundra.Client, nif_funcs, load, NULL, NULL, NULL)
+ERL_NIF_INIT(Elixir.Tundra.Client, nif_funcs, load, NULL, NULL, unload)
@@ -0,0 +1,24 @@
+#include "ready.h"
+#include "watch.h"
+
+static void store_ready_at(void *resource, void *arg, int64_t now)
+{
+    (void)resource;
+    atomic_store_explicit((_Atomic int64_t *)arg, now, memory_order_relaxed);
+}
+
+int ready_watch(int fd, void *resource, _Atomic int64_t *ready_at, int *slot)
+{
+    return watch_add(fd, WATCH_READ | WATCH_ONESHOT, resource, store_ready_at, (void *)ready_at, slot);
+}
+
+void ready_unwatch(int fd, int *slot)
+{
+    void *resource = watch_remove(slot, &fd, 1);
+
+    // Released outside the lock as this may run the resource destructor
+    if (resource != NULL)
+    {
+        enif_release_resource(resource);
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef TUNDRA_READY_H
+#define TUNDRA_READY_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <erl_nif.h>
+
+// Readiness timestamps.
+//
+// enif_select notifications are sent by the runtime's poll thread, so the NIF
+// never sees the moment a device became readable. When latency tracking is
+// enabled, a device waiting on input is also registered (one-shot) with the
+// descriptor watcher (see watch.h), which stores the monotonic time, in
+// nanoseconds, at which it woke for the device. The watcher also services
+// rings and tunnels, which can delay its waking.
+//
+// A registration holds a reference to `resource` until ready_unwatch is
+// called. `*slot` identifies the registration, as for watch_add.
+
+// Arm a one-shot readiness watch on `fd`. Returns 0 or -errno; -ENOTSUP where
+// this is not implemented.
+int ready_watch(int fd, void *resource, _Atomic int64_t *ready_at, int *slot);
+
+// Remove the watch on `fd`, if any, and release its resource reference.
+void ready_unwatch(int fd, int *slot);
+
+#endif
@@ -0,0 +1,276 @@
+// ring_bench: throughput of the shared-memory packet rings.
+//
+// By default the benchmark measures the rings alone. It builds a region laid
+// out as Tundra builds it and forks. The child plays Tundra's side, filling
+// the RX ring and publishing and ringing as the NIF does, while the parent
+// takes packets out with the consumer library. Payloads are not written, so
+// this is the cost of the rings themselves. Each run reports packets and bits
+// per second and how often the consumer had to sleep.
+//
+// With -a PATH it is instead a consumer for a real device: it waits for
+// Tundra.ring_share/2 on PATH, then counts the packets it receives each second
+// until Tundra closes the ring. With -e it also sends each packet back.
+//
+// Usage: ring_bench [-n packets] [-s slots] [-b batch]
+//        ring_bench -a PATH [-e]
+
+#define _GNU_SOURCE // memfd_create, eventfd
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "tundra_ring.h"
+
+#define SLOT_SIZE 2048
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void ring_bell(int fd)
+{
+    uint64_t one = 1;
+    ssize_t n = write(fd, &one, sizeof(one));
+    (void)n;
+}
+
+static void wait_bell(int fd)
+{
+    uint64_t rung;
+    ssize_t n = read(fd, &rung, sizeof(rung));
+    (void)n;
+}
+
+// Tundra's side of the RX ring: `count` packets of `size` bytes, published
+// every `batch`
+static void produce(struct tundra_ring_shm *shm, int wait_fd, int notify_fd, unsigned long count, size_t size,
+                    unsigned batch)
+{
+    struct tundra_ring_dir *dir = &shm->rx;
+    uint32_t tail = 0, published = 0;
+    for (unsigned long i = 0; i < count; ++i)
+    {
+        while (tundra_ring_free(shm, dir, tail) == 0)
+        {
+            if (tail != published)
+            {
+                if (tundra_ring_publish(dir, tail))
+                {
+                    ring_bell(notify_fd);
+                }
+                published = tail;
+            }
+            if (tundra_ring_producer_idle(shm, dir, tail))
+            {
+                wait_bell(wait_fd);
+            }
+        }
+        struct tundra_ring_slot *slot = tundra_ring_slot_at(shm, dir, tail);
+        slot->data[TUNDRA_RING_TUN_HEADER] = 0x45;
+        slot->len = (uint32_t)(size + TUNDRA_RING_TUN_HEADER);
+        if (++tail - published >= batch)
+        {
+            if (tundra_ring_publish(dir, tail))
+            {
+                ring_bell(notify_fd);
+            }
+            published = tail;
+        }
+    }
+    if (tundra_ring_publish(dir, tail))
+    {
+        ring_bell(notify_fd);
+    }
+}
+
+static int run(unsigned long count, uint32_t slots, size_t size, unsigned batch)
+{
+    size_t region = tundra_ring_region_size(slots, SLOT_SIZE);
+    int memfd = memfd_create("ring_bench", MFD_CLOEXEC);
+    int to_consumer = eventfd(0, EFD_CLOEXEC);
+    int to_producer = eventfd(0, EFD_CLOEXEC);
+    if (memfd == -1 || to_consumer == -1 || to_producer == -1 || ftruncate(memfd, (off_t)region) == -1)
+    {
+        perror("ring_bench");
+        return -1;
+    }
+    struct tundra_ring_shm *shm = mmap(NULL, region, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shm == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    shm->magic = TUNDRA_RING_MAGIC;
+    shm->version = TUNDRA_RING_VERSION;
+    shm->slots = slots;
+    shm->slot_size = SLOT_SIZE;
+    shm->rx.offset = sizeof(*shm);
+    shm->tx.offset = shm->rx.offset + (uint64_t)slots * SLOT_SIZE;
+
+    pid_t child = fork();
+    if (child == 0)
+    {
+        produce(shm, to_producer, to_consumer, count, size, batch);
+        _exit(0);
+    }
+
+    struct tundra_ring ring;
+    int fds[3] = {memfd, to_consumer, to_producer};
+    if (tundra_ring_attach(&ring, fds) < 0)
+    {
+        fprintf(stderr, "ring_bench: attach failed\n");
+        return -1;
+    }
+
+    struct tundra_ring_pkt pkts[256];
+    unsigned long received = 0, bytes = 0, waits = 0;
+    double start = now();
+    while (received < count)
+    {
+        unsigned n = tundra_ring_recv(&ring, pkts, batch < 256 ? batch : 256);
+        if (n == 0)
+        {
+            waits++;
+            tundra_ring_wait(&ring, -1);
+            continue;
+        }
+        for (unsigned i = 0; i < n; ++i)
+        {
+            bytes += pkts[i].len;
+        }
+        received += n;
+    }
+    tundra_ring_done(&ring);
+    double elapsed = now() - start;
+    waitpid(child, NULL, 0);
+
+    printf("%6zu %6u %9.2f %9.2f %10lu\n", size, batch, received / elapsed / 1e6, bytes * 8 / elapsed / 1e9,
+           waits);
+    tundra_ring_detach(&ring);
+    munmap(shm, region);
+    return 0;
+}
+
+static int consume(const char *path, bool echo)
+{
+    struct tundra_ring ring;
+    printf("waiting for Tundra.ring_share/2 on %s\n", path);
+    int result = tundra_ring_accept(&ring, path, -1);
+    if (result < 0)
+    {
+        fprintf(stderr, "ring_bench: %s\n", strerror(-result));
+        return 1;
+    }
+
+    struct tundra_ring_pkt pkts[64];
+    unsigned long packets = 0, bytes = 0;
+    double mark = now();
+    for (;;)
+    {
+        unsigned n = tundra_ring_recv(&ring, pkts, 64);
+        for (unsigned i = 0; i < n; ++i)
+        {
+            bytes += pkts[i].len;
+            if (echo)
+            {
+                tundra_ring_send(&ring, pkts[i].data, pkts[i].len);
+            }
+        }
+        if (echo)
+        {
+            tundra_ring_flush(&ring);
+        }
+        packets += n;
+        if (now() - mark >= 1.0)
+        {
+            printf("%lu pkt/s %.2f Gbit/s\n", packets, bytes * 8 / 1e9);
+            packets = bytes = 0;
+            mark = now();
+        }
+        if (n == 0 && (result = tundra_ring_wait(&ring, 1000)) < 0)
+        {
+            break;
+        }
+    }
+    printf("ring closed\n");
+    tundra_ring_detach(&ring);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long count = 10000000;
+    uint32_t slots = 1024;
+    unsigned batch = 0;
+    const char *path = NULL;
+    bool echo = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:b:a:e")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            slots = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            batch = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            path = optarg;
+            break;
+        case 'e':
+            echo = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n packets] [-s slots] [-b batch] | -a PATH [-e]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (path != NULL)
+    {
+        return consume(path, echo);
+    }
+    if (slots < 2 || (slots & (slots - 1)) != 0 || batch > slots)
+    {
+        fprintf(stderr, "ring_bench: slots must be a power of two, and no fewer than the batch\n");
+        return 2;
+    }
+
+    const size_t sizes[] = {64, 512, 1400};
+    const unsigned batches[] = {1, 16, 64};
+    printf("%6s %6s %9s %9s %10s\n", "size", "batch", "Mpps", "Gbit/s", "waits");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        for (size_t j = 0; j < sizeof(batches) / sizeof(batches[0]); ++j)
+        {
+            if ((batch == 0 || batch == batches[j]) && run(count, slots, sizes[i], batches[j]) < 0)
+            {
+                return 1;
+            }
+        }
+    }
+    if (batch != 0 && batch != 1 && batch != 16 && batch != 64)
+    {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        {
+            if (run(count, slots, sizes[i], batch) < 0)
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
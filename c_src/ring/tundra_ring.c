@@ -0,0 +1,290 @@
+#define _GNU_SOURCE // struct ucred, accept4, MSG_CMSG_CLOEXEC
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "tundra_ring.h"
+
+static void ring_bell(int fd)
+{
+    uint64_t one = 1;
+    ssize_t n = write(fd, &one, sizeof(one));
+    (void)n;
+}
+
+int tundra_ring_attach(struct tundra_ring *ring, const int fds[3])
+{
+    memset(ring, 0, sizeof(*ring));
+    struct stat st;
+    if (fstat(fds[0], &st) == -1)
+    {
+        return -errno;
+    }
+    if ((size_t)st.st_size < sizeof(struct tundra_ring_shm))
+    {
+        return -EPROTO;
+    }
+    void *shm = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (shm == MAP_FAILED)
+    {
+        return -errno;
+    }
+    ring->shm = shm;
+    ring->size = (size_t)st.st_size;
+    if (ring->shm->magic != TUNDRA_RING_MAGIC || ring->shm->version != TUNDRA_RING_VERSION ||
+        tundra_ring_region_size(ring->shm->slots, ring->shm->slot_size) > ring->size)
+    {
+        munmap(shm, ring->size);
+        return -EPROTO;
+    }
+    ring->memfd = fds[0];
+    ring->wait_fd = fds[1];
+    ring->notify_fd = fds[2];
+    ring->rx_head = atomic_load(&ring->shm->rx.head);
+    ring->tx_tail = ring->tx_published = atomic_load(&ring->shm->tx.tail);
+    return 0;
+}
+
+// Receive the hello and descriptors sent by Tundra.ring_share/2
+static int recv_hello(int conn, int fds[3])
+{
+    struct tundra_ring_hello hello;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n == -1)
+    {
+        return -errno;
+    }
+
+    int count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+        }
+    }
+    if (n != sizeof(hello) || hello.magic != TUNDRA_RING_MAGIC || hello.version != TUNDRA_RING_VERSION || count != 3)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            close(fds[i]);
+        }
+        return -EPROTO;
+    }
+    return 0;
+}
+
+int tundra_ring_accept(struct tundra_ring *ring, const char *path, int timeout)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path))
+    {
+        return -ENAMETOOLONG;
+    }
+    memcpy(addr.sun_path, path, len);
+
+    int result = 0;
+    int conn = -1;
+    bool bound = false;
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listener == -1)
+    {
+        return -errno;
+    }
+
+    // A socket left behind by an earlier run is replaced, anything else at
+    // the path is not
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, 1) == -1)
+    {
+        result = -errno;
+        goto cleanup;
+    }
+    bound = true;
+
+    struct pollfd pfd = {.fd = listener, .events = POLLIN};
+    int ready = poll(&pfd, 1, timeout);
+    if (ready <= 0)
+    {
+        result = ready == 0 ? -ETIMEDOUT : -errno;
+        goto cleanup;
+    }
+    if ((conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) == -1)
+    {
+        result = -errno;
+        goto cleanup;
+    }
+
+    // Only take a ring from the same user
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1)
+    {
+        result = -errno;
+        goto cleanup;
+    }
+    if (cred.uid != geteuid())
+    {
+        result = -EPERM;
+        goto cleanup;
+    }
+
+    int fds[3];
+    if ((result = recv_hello(conn, fds)) < 0)
+    {
+        goto cleanup;
+    }
+    if ((result = tundra_ring_attach(ring, fds)) < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        close(fds[2]);
+    }
+
+cleanup:
+    if (conn != -1)
+    {
+        close(conn);
+    }
+    close(listener);
+    if (bound)
+    {
+        unlink(path);
+    }
+    return result;
+}
+
+void tundra_ring_detach(struct tundra_ring *ring)
+{
+    if (ring->shm != NULL)
+    {
+        munmap(ring->shm, ring->size);
+        ring->shm = NULL;
+    }
+    close(ring->memfd);
+    close(ring->wait_fd);
+    close(ring->notify_fd);
+    ring->memfd = ring->wait_fd = ring->notify_fd = -1;
+}
+
+unsigned tundra_ring_recv(struct tundra_ring *ring, struct tundra_ring_pkt *pkts, unsigned max)
+{
+    tundra_ring_done(ring);
+    struct tundra_ring_shm *shm = ring->shm;
+    uint32_t ready = tundra_ring_ready(&shm->rx, ring->rx_head);
+    unsigned n = ready < max ? ready : max;
+    size_t cap = tundra_ring_capacity(shm);
+    for (unsigned i = 0; i < n; ++i)
+    {
+        struct tundra_ring_slot *slot = tundra_ring_slot_at(shm, &shm->rx, ring->rx_head + i);
+        size_t len = slot->len < cap ? slot->len : cap;
+        pkts[i].data = slot->data + TUNDRA_RING_TUN_HEADER;
+        pkts[i].len = len > TUNDRA_RING_TUN_HEADER ? len - TUNDRA_RING_TUN_HEADER : 0;
+    }
+    ring->rx_taken = n;
+    return n;
+}
+
+void tundra_ring_done(struct tundra_ring *ring)
+{
+    if (ring->rx_taken != 0)
+    {
+        ring->rx_head += ring->rx_taken;
+        ring->rx_taken = 0;
+        if (tundra_ring_release(&ring->shm->rx, ring->rx_head))
+        {
+            ring_bell(ring->notify_fd);
+        }
+    }
+}
+
+bool tundra_ring_send(struct tundra_ring *ring, const void *pkt, size_t len)
+{
+    struct tundra_ring_shm *shm = ring->shm;
+    const unsigned char *ip = pkt;
+    if (len == 0 || len > tundra_ring_capacity(shm) - TUNDRA_RING_TUN_HEADER)
+    {
+        return false;
+    }
+    // The TUN header: no flags, then the protocol by IP version
+    uint16_t proto = ip[0] >> 4 == 4 ? 0x0800 : ip[0] >> 4 == 6 ? 0x86DD : 0;
+    if (proto == 0 || tundra_ring_free(shm, &shm->tx, ring->tx_tail) == 0)
+    {
+        return false;
+    }
+
+    struct tundra_ring_slot *slot = tundra_ring_slot_at(shm, &shm->tx, ring->tx_tail);
+    unsigned char hdr[TUNDRA_RING_TUN_HEADER] = {0, 0, proto >> 8, proto & 0xff};
+    memcpy(slot->data, hdr, sizeof(hdr));
+    memcpy(slot->data + sizeof(hdr), ip, len);
+    slot->len = (uint32_t)(len + sizeof(hdr));
+    slot->reserved = 0;
+    ring->tx_tail++;
+    return true;
+}
+
+void tundra_ring_flush(struct tundra_ring *ring)
+{
+    if (ring->tx_tail != ring->tx_published)
+    {
+        ring->tx_published = ring->tx_tail;
+        if (tundra_ring_publish(&ring->shm->tx, ring->tx_tail))
+        {
+            ring_bell(ring->notify_fd);
+        }
+    }
+}
+
+int tundra_ring_wait(struct tundra_ring *ring, int timeout)
+{
+    struct tundra_ring_shm *shm = ring->shm;
+    tundra_ring_flush(ring);
+    if (atomic_load(&shm->closed))
+    {
+        return -EPIPE;
+    }
+
+    // Ask to be rung when packets arrive and, if the TX ring is full, when
+    // Tundra frees a slot, giving up if either happened meanwhile
+    if (!tundra_ring_consumer_idle(&shm->rx, ring->rx_head + ring->rx_taken))
+    {
+        return 1;
+    }
+    if (tundra_ring_free(shm, &shm->tx, ring->tx_tail) == 0 && !tundra_ring_producer_idle(shm, &shm->tx, ring->tx_tail))
+    {
+        return 1;
+    }
+
+    struct pollfd pfd = {.fd = ring->wait_fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, timeout);
+    if (ready == -1)
+    {
+        return errno == EINTR ? 1 : -errno;
+    }
+    if (ready == 0)
+    {
+        return 0;
+    }
+    uint64_t rung;
+    ssize_t n = read(ring->wait_fd, &rung, sizeof(rung));
+    (void)n;
+    return atomic_load(&shm->closed) ? -EPIPE : 1;
+}
@@ -0,0 +1,209 @@
+#ifndef TUNDRA_RING_H
+#define TUNDRA_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Shared-memory packet rings (Linux).
+//
+// A device in ring mode moves its packets through a pair of single-producer,
+// single-consumer rings in a memfd shared with an external process, rather
+// than through the BEAM. Tundra's ring thread reads packets from the device
+// straight into the RX ring, and writes the packets the external process puts
+// in the TX ring straight to the device.
+//
+// Each ring is an array of fixed-size slots, a power of two of them, indexed
+// by free-running 32-bit head and tail counters. A slot holds one packet
+// framed as the device delivers it, with the 4-byte TUN header first.
+//
+// Each side has an eventfd to sleep on, which the other side rings only when
+// it has said it is about to sleep, and then once per batch rather than per
+// packet. A side announces that it will sleep by setting a waiting flag and
+// then checking the ring again; the other side publishes and then checks the
+// flag. Both use sequentially consistent operations, so at least one of them
+// sees the other and no wakeup is lost.
+//
+// The layout is fixed so that processes in other languages can share it: all
+// fields are native-endian, and the counters and flags are 32-bit atomics.
+// This header is used by the NIF and by the consumer library (tundra_ring.c).
+
+#define TUNDRA_RING_MAGIC 0x474e5254 // "TRNG"
+#define TUNDRA_RING_VERSION 1
+#define TUNDRA_RING_TUN_HEADER 4
+
+struct tundra_ring_dir
+{
+    _Alignas(64) _Atomic uint32_t tail; // the next slot the producer fills
+    _Atomic uint32_t producer_waiting;
+    _Alignas(64) _Atomic uint32_t head; // the next slot the consumer takes
+    _Atomic uint32_t consumer_waiting;
+    _Alignas(64) uint64_t offset; // of the first slot, from the start of the region
+};
+
+struct tundra_ring_shm
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;          // per ring, a power of two
+    uint32_t slot_size;      // bytes, including struct tundra_ring_slot
+    _Atomic uint32_t closed; // set by Tundra when the device leaves ring mode
+    struct tundra_ring_dir rx; // from the device
+    struct tundra_ring_dir tx; // to the device
+};
+
+struct tundra_ring_slot
+{
+    uint32_t len; // bytes of data, including the TUN header
+    uint32_t reserved;
+    unsigned char data[];
+};
+
+// The message Tundra.ring_share/2 sends over a SOCK_SEQPACKET Unix socket, with
+// the memfd, the eventfd Tundra rings and the eventfd it waits on attached as
+// SCM_RIGHTS, in that order
+struct tundra_ring_hello
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size; // of the region
+};
+
+// The size of a region with `slots` slots of `slot_size` bytes in each ring
+static inline size_t tundra_ring_region_size(uint32_t slots, uint32_t slot_size)
+{
+    return sizeof(struct tundra_ring_shm) + 2 * (size_t)slots * slot_size;
+}
+
+static inline struct tundra_ring_slot *tundra_ring_slot_at(struct tundra_ring_shm *shm, struct tundra_ring_dir *dir,
+                                                           uint32_t index)
+{
+    size_t offset = dir->offset + (size_t)(index & (shm->slots - 1)) * shm->slot_size;
+    return (struct tundra_ring_slot *)((unsigned char *)shm + offset);
+}
+
+// The room for data in each slot
+static inline size_t tundra_ring_capacity(const struct tundra_ring_shm *shm)
+{
+    return shm->slot_size - sizeof(struct tundra_ring_slot);
+}
+
+// Producer: the number of free slots, given the producer's own tail
+static inline uint32_t tundra_ring_free(const struct tundra_ring_shm *shm, struct tundra_ring_dir *dir, uint32_t tail)
+{
+    return shm->slots - (tail - atomic_load_explicit(&dir->head, memory_order_acquire));
+}
+
+// Consumer: the number of packets waiting, given the consumer's own head
+static inline uint32_t tundra_ring_ready(struct tundra_ring_dir *dir, uint32_t head)
+{
+    return atomic_load_explicit(&dir->tail, memory_order_acquire) - head;
+}
+
+// Producer: make the slots before `tail` visible. Returns true if the consumer
+// was waiting, and must be woken.
+static inline bool tundra_ring_publish(struct tundra_ring_dir *dir, uint32_t tail)
+{
+    atomic_store(&dir->tail, tail);
+    return atomic_load(&dir->consumer_waiting) != 0 && atomic_exchange(&dir->consumer_waiting, 0) != 0;
+}
+
+// Consumer: hand the slots before `head` back. Returns true if the producer
+// was waiting for space, and must be woken.
+static inline bool tundra_ring_release(struct tundra_ring_dir *dir, uint32_t head)
+{
+    atomic_store(&dir->head, head);
+    return atomic_load(&dir->producer_waiting) != 0 && atomic_exchange(&dir->producer_waiting, 0) != 0;
+}
+
+// Consumer: announce that it is about to sleep. Returns false, having
+// withdrawn the announcement, if packets arrived in the meantime.
+static inline bool tundra_ring_consumer_idle(struct tundra_ring_dir *dir, uint32_t head)
+{
+    atomic_store(&dir->consumer_waiting, 1);
+    if (atomic_load(&dir->tail) != head)
+    {
+        atomic_store(&dir->consumer_waiting, 0);
+        return false;
+    }
+    return true;
+}
+
+// Producer: announce that it is waiting for space. Returns false, having
+// withdrawn the announcement, if space was freed in the meantime.
+static inline bool tundra_ring_producer_idle(const struct tundra_ring_shm *shm, struct tundra_ring_dir *dir,
+                                             uint32_t tail)
+{
+    atomic_store(&dir->producer_waiting, 1);
+    if (tail - atomic_load(&dir->head) < shm->slots)
+    {
+        atomic_store(&dir->producer_waiting, 0);
+        return false;
+    }
+    return true;
+}
+
+// The consumer library, for the external process.
+//
+// The process receives the region and its two eventfds from Tundra, with
+// tundra_ring_accept (see Tundra.ring_share/2) or by any other means followed
+// by tundra_ring_attach, and then loops on tundra_ring_recv, tundra_ring_send
+// and tundra_ring_wait. A ring is used by one thread.
+
+struct tundra_ring
+{
+    struct tundra_ring_shm *shm;
+    size_t size;
+    int memfd;
+    int wait_fd;   // rung by Tundra
+    int notify_fd; // rung to wake Tundra
+    uint32_t rx_head;
+    uint32_t rx_taken; // packets returned by tundra_ring_recv and not yet released
+    uint32_t tx_tail;
+    uint32_t tx_published;
+};
+
+// A packet without its TUN header
+struct tundra_ring_pkt
+{
+    const unsigned char *data;
+    size_t len;
+};
+
+// Map a region given its memfd and eventfds, in the order Tundra passes them:
+// the memfd, the eventfd Tundra rings and the eventfd Tundra waits on. The
+// ring takes the descriptors. Returns 0 or -errno.
+int tundra_ring_attach(struct tundra_ring *ring, const int fds[3]);
+
+// Listen on a Unix socket at `path` for Tundra.ring_share/2, and attach to the
+// ring it passes. Waits up to `timeout` milliseconds, or forever if negative.
+// Returns 0 or -errno.
+int tundra_ring_accept(struct tundra_ring *ring, const char *path, int timeout);
+
+// Unmap the region and close its descriptors.
+void tundra_ring_detach(struct tundra_ring *ring);
+
+// Take up to `max` packets from the device, releasing those taken by the
+// previous call. The packets stay valid until the next call, or until
+// tundra_ring_done. Returns the number taken.
+unsigned tundra_ring_recv(struct tundra_ring *ring, struct tundra_ring_pkt *pkts, unsigned max);
+
+// Release the packets taken by tundra_ring_recv.
+void tundra_ring_done(struct tundra_ring *ring);
+
+// Copy an IPv4 or IPv6 packet into the TX ring. Returns false if the ring is
+// full, the packet is too large for a slot, or it is not an IP packet. Packets
+// are not handed to Tundra until tundra_ring_flush.
+bool tundra_ring_send(struct tundra_ring *ring, const void *pkt, size_t len);
+
+// Hand the packets sent since the last flush to Tundra, ringing it once if it
+// is waiting.
+void tundra_ring_flush(struct tundra_ring *ring);
+
+// Flush, then sleep until packets arrive, space frees up in the TX ring, or
+// `timeout` milliseconds pass (forever if negative). Returns 1 if woken, 0 on
+// timeout, -EPIPE once Tundra has closed the ring, or -errno.
+int tundra_ring_wait(struct tundra_ring *ring, int timeout);
+
+#endif
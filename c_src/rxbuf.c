@@ -0,0 +1,244 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "rxbuf.h"
+
+#define SHARD_BITS 4
+#define SHARDS (1 << SHARD_BITS)
+#define MIN_SLOTS 64
+
+// The buffers whose latest binary starts at a given address, sharded so that
+// schedulers receiving at once rarely share a lock. Each shard is an open
+// addressing table keyed by that address (data + front), with linear probing,
+// that doubles when half full and halves when an eighth full.
+struct shard_t
+{
+    ErlNifMutex *lock;
+    struct rxbuf_t **slots;
+    uint32_t mask; // slots - 1, or 0 before the first insert
+    uint32_t count;
+};
+
+static ErlNifResourceType *s_rxbuf;
+static struct shard_t s_shards[SHARDS];
+
+static const unsigned char *key_of(const struct rxbuf_t *rx)
+{
+    return rx->data + rx->front;
+}
+
+static uint64_t hash_ptr(const unsigned char *p)
+{
+    uint64_t h = (uint64_t)(uintptr_t)p * UINT64_C(0x9E3779B97F4A7C15);
+    return h ^ (h >> 32);
+}
+
+static struct shard_t *shard_of(uint64_t hash)
+{
+    return &s_shards[hash >> (64 - SHARD_BITS)];
+}
+
+// Rehash the shard into a table of `n` slots, which must hold its entries.
+// Called with the shard's lock held.
+static int resize(struct shard_t *s, uint32_t n)
+{
+    struct rxbuf_t **slots = enif_alloc(n * sizeof(*slots));
+    if (slots == NULL)
+    {
+        return -ENOMEM;
+    }
+    memset(slots, 0, n * sizeof(*slots));
+    for (uint32_t i = 0; s->mask && i <= s->mask; ++i)
+    {
+        struct rxbuf_t *rx = s->slots[i];
+        if (rx != NULL)
+        {
+            uint32_t j = (uint32_t)hash_ptr(key_of(rx)) & (n - 1);
+            while (slots[j] != NULL)
+            {
+                j = (j + 1) & (n - 1);
+            }
+            slots[j] = rx;
+        }
+    }
+    enif_free(s->slots);
+    s->slots = slots;
+    s->mask = n - 1;
+    return 0;
+}
+
+// Called with the shard's lock held
+static int insert(struct shard_t *s, uint64_t hash, struct rxbuf_t *rx)
+{
+    if ((s->count + 1) * 2 > s->mask + 1 && resize(s, s->mask ? (s->mask + 1) * 2 : MIN_SLOTS) != 0)
+    {
+        return -ENOMEM;
+    }
+    uint32_t i = (uint32_t)hash & s->mask;
+    while (s->slots[i] != NULL)
+    {
+        i = (i + 1) & s->mask;
+    }
+    s->slots[i] = rx;
+    s->count++;
+    rx->registered = true;
+    return 0;
+}
+
+// Called with the shard's lock held
+static uint32_t lookup(struct shard_t *s, uint64_t hash, const unsigned char *key)
+{
+    if (s->mask == 0)
+    {
+        return UINT32_MAX;
+    }
+    for (uint32_t i = (uint32_t)hash & s->mask; s->slots[i] != NULL; i = (i + 1) & s->mask)
+    {
+        if (key_of(s->slots[i]) == key)
+        {
+            return i;
+        }
+    }
+    return UINT32_MAX;
+}
+
+// Remove the entry in slot `i`, shifting later entries of its run back so that
+// lookups need no tombstones. Called with the shard's lock held.
+static void remove_slot(struct shard_t *s, uint32_t i)
+{
+    s->slots[i]->registered = false;
+    s->slots[i] = NULL;
+    s->count--;
+    for (uint32_t j = (i + 1) & s->mask; s->slots[j] != NULL; j = (j + 1) & s->mask)
+    {
+        uint32_t home = (uint32_t)hash_ptr(key_of(s->slots[j])) & s->mask;
+        // Move the entry back if its home is not between the hole and it
+        if (((j - home) & s->mask) >= ((j - i) & s->mask))
+        {
+            s->slots[i] = s->slots[j];
+            s->slots[j] = NULL;
+            i = j;
+        }
+    }
+    // Halve a table that has emptied out, so that a burst of buffers does not
+    // keep its high-water size; if that fails the table just stays larger
+    if (s->mask + 1 > MIN_SLOTS && s->count * 8 < s->mask + 1)
+    {
+        resize(s, (s->mask + 1) / 2);
+    }
+}
+
+static void rxbuf_dtor(ErlNifEnv *env, void *obj)
+{
+    (void)env;
+    struct rxbuf_t *rx = obj;
+    if (rx->registered)
+    {
+        uint64_t hash = hash_ptr(key_of(rx));
+        struct shard_t *s = shard_of(hash);
+        enif_mutex_lock(s->lock);
+        uint32_t i = lookup(s, hash, key_of(rx));
+        if (i != UINT32_MAX)
+        {
+            remove_slot(s, i);
+        }
+        enif_mutex_unlock(s->lock);
+    }
+}
+
+static const ErlNifResourceTypeInit s_rxbuf_init = {.dtor = rxbuf_dtor};
+
+int rxbuf_init(ErlNifEnv *env)
+{
+    // The registry lives as long as the library, as buffers can outlive an
+    // unload of the module that made them
+    for (int i = 0; i < SHARDS; ++i)
+    {
+        if (s_shards[i].lock == NULL && (s_shards[i].lock = enif_mutex_create("tundra_rxbuf")) == NULL)
+        {
+            return -1;
+        }
+    }
+    s_rxbuf = enif_init_resource_type(env, "rxbuf", &s_rxbuf_init, ERL_NIF_RT_CREATE, NULL);
+    return s_rxbuf ? 0 : -1;
+}
+
+struct rxbuf_t *rxbuf_alloc(size_t headroom, size_t length, size_t tailroom, size_t reserve)
+{
+    size_t front = headroom > reserve ? headroom : reserve;
+    struct rxbuf_t *rx = enif_alloc_resource(s_rxbuf, sizeof(*rx) + front + length + tailroom);
+    if (rx == NULL)
+    {
+        return NULL;
+    }
+    rx->size = front + length + tailroom;
+    rx->base = front - headroom;
+    rx->front = front;
+    rx->back = front;
+    rx->registered = false;
+    return rx;
+}
+
+void rxbuf_release(struct rxbuf_t *rx)
+{
+    enif_release_resource(rx);
+}
+
+int rxbuf_publish(ErlNifEnv *env, struct rxbuf_t *rx, size_t len, ERL_NIF_TERM *term)
+{
+    rx->back = rx->front + len;
+    uint64_t hash = hash_ptr(key_of(rx));
+    struct shard_t *s = shard_of(hash);
+    enif_mutex_lock(s->lock);
+    int err = insert(s, hash, rx);
+    enif_mutex_unlock(s->lock);
+    if (err == 0)
+    {
+        *term = enif_make_resource_binary(env, rx, key_of(rx), len);
+    }
+    return err;
+}
+
+int rxbuf_fill(ErlNifEnv *env, const ErlNifBinary *bin, const ErlNifBinary *header, const ErlNifBinary *trailer,
+               ERL_NIF_TERM *term)
+{
+    // A binary holds its buffer, so one found here cannot be freed meanwhile
+    // and no other buffer can have a binary at the same address
+    uint64_t hash = hash_ptr(bin->data);
+    struct shard_t *s = shard_of(hash);
+    enif_mutex_lock(s->lock);
+    uint32_t i = bin->size == 0 ? UINT32_MAX : lookup(s, hash, bin->data);
+    struct rxbuf_t *rx = i == UINT32_MAX ? NULL : s->slots[i];
+    if (rx == NULL || rx->back - rx->front != bin->size)
+    {
+        enif_mutex_unlock(s->lock);
+        return -EINVAL;
+    }
+    if (header->size > rx->front - rx->base || trailer->size > rx->size - rx->back)
+    {
+        enif_mutex_unlock(s->lock);
+        return -ENOSPC;
+    }
+    // Taking the buffer out claims the bytes around its binary, so another
+    // fill of the same binary finds nothing
+    remove_slot(s, i);
+    enif_mutex_unlock(s->lock);
+
+    memcpy(rx->data + rx->front - header->size, header->data, header->size);
+    memcpy(rx->data + rx->back, trailer->data, trailer->size);
+    rx->front -= header->size;
+    rx->back += trailer->size;
+
+    hash = hash_ptr(key_of(rx));
+    s = shard_of(hash);
+    enif_mutex_lock(s->lock);
+    int err = insert(s, hash, rx);
+    enif_mutex_unlock(s->lock);
+    if (err != 0)
+    {
+        // The result is made anyway; it just cannot be filled again
+        rx->registered = false;
+    }
+    *term = enif_make_resource_binary(env, rx, key_of(rx), rx->back - rx->front);
+    return 0;
+}
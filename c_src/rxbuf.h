@@ -0,0 +1,57 @@
+#ifndef TUNDRA_RXBUF_H
+#define TUNDRA_RXBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <erl_nif.h>
+
+// Receive buffers with headroom and tailroom.
+//
+// A packet read with headroom or tailroom lands inside a larger native buffer,
+// with at least that much unused space before and after it, and is returned
+// as a binary over just the packet. rxbuf_fill later writes a header into the
+// space before the packet and a trailer into the space after it, and makes a
+// binary over the whole: one contiguous datagram, without copying the packet.
+//
+// Binaries never change: only bytes outside every binary made so far are
+// written, and only a buffer's latest binary can be filled, so headers stack
+// outwards. Buffers are found from the data pointer of their latest binary
+// through a registry, which is how any other binary is refused. A buffer is
+// freed with the last binary over it.
+
+#define RXBUF_MAX_ROOM 4096
+
+struct rxbuf_t
+{
+    size_t size;  // of data
+    size_t base;  // the lowest byte a header may be written to
+    size_t front; // the latest binary's first byte
+    size_t back;  // and the byte after its last
+    bool registered;
+    unsigned char data[];
+};
+
+// Open the resource type and create the registry's locks. Called from the NIF
+// load callback.
+int rxbuf_init(ErlNifEnv *env);
+
+// Allocate a buffer for a packet of up to `length` bytes, with `headroom` bytes
+// before it and `tailroom` bytes after it. The packet starts at `front`, and
+// `reserve` bytes before it (such as a TUN header) may be read into too; they
+// share the headroom where it is large enough. Returns NULL on failure.
+struct rxbuf_t *rxbuf_alloc(size_t headroom, size_t length, size_t tailroom, size_t reserve);
+
+// Release the caller's reference, freeing the buffer if no binary was made.
+void rxbuf_release(struct rxbuf_t *rx);
+
+// Make the first binary, over the `len` bytes from `front`, and register it.
+// Returns 0 or -ENOMEM.
+int rxbuf_publish(ErlNifEnv *env, struct rxbuf_t *rx, size_t len, ERL_NIF_TERM *term);
+
+// Write `header` before and `trailer` after `bin` and make a binary over all
+// three. Returns 0; -EINVAL if `bin` is not the latest binary over a buffer,
+// or -ENOSPC if the header or trailer does not fit.
+int rxbuf_fill(ErlNifEnv *env, const ErlNifBinary *bin, const ErlNifBinary *header, const ErlNifBinary *trailer,
+               ERL_NIF_TERM *term);
+
+#endif
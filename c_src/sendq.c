@@ -0,0 +1,317 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#define HAVE_SYS_UIO_H 1
+#include <unistd.h>
+#include "sendq.h"
+#include "watch.h"
+
+static sendq_drain_fn s_drain;
+
+struct sendq_t *sendq_create(void)
+{
+    struct sendq_t *q = enif_alloc(sizeof(*q));
+    if (q == NULL)
+    {
+        return NULL;
+    }
+    if ((q->lock = enif_mutex_create("tundra_sendq")) == NULL)
+    {
+        enif_free(q);
+        return NULL;
+    }
+    q->classes = NULL;
+    q->nclasses = 0;
+    q->priority = -1;
+    q->rr = 0;
+    q->turn = false;
+    memset(q->dscp, 0, sizeof(q->dscp));
+    q->max_packets = 0;
+    q->max_bytes = q->low = q->high = 0;
+    q->above = false;
+    q->closed = false;
+    q->watch = -1;
+    atomic_init(&q->packets, 0);
+    atomic_init(&q->bytes, 0);
+    atomic_init(&q->drops, 0);
+    return q;
+}
+
+static void free_packets(struct sendq_t *q)
+{
+    for (unsigned i = 0; i < q->nclasses; ++i)
+    {
+        struct sendq_pkt_t *pkt = q->classes[i].head;
+        while (pkt != NULL)
+        {
+            struct sendq_pkt_t *next = pkt->next;
+            enif_free(pkt);
+            pkt = next;
+        }
+    }
+}
+
+void sendq_destroy(struct sendq_t *q)
+{
+    if (q != NULL)
+    {
+        free_packets(q);
+        enif_free(q->classes);
+        enif_mutex_destroy(q->lock);
+        enif_free(q);
+    }
+}
+
+static inline void counter_add(_Atomic uint64_t *counter, int64_t n)
+{
+    uint64_t cur = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, cur + (uint64_t)n, memory_order_relaxed);
+}
+
+int sendq_configure(struct sendq_t *q, const struct sendq_class_config_t *classes, unsigned nclasses,
+                    const uint8_t dscp[64])
+{
+    if (nclasses != q->nclasses)
+    {
+        struct sendq_class_t *c = enif_alloc(nclasses * sizeof(*c));
+        if (c == NULL)
+        {
+            return -ENOMEM;
+        }
+        sendq_clear(q);
+        enif_free(q->classes);
+        for (unsigned i = 0; i < nclasses; ++i)
+        {
+            c[i].head = c[i].tail = NULL;
+            c[i].deficit = 0;
+            c[i].packets = c[i].bytes = c[i].drops = c[i].sent = 0;
+            hist_reset(&c[i].delay);
+        }
+        q->classes = c;
+        q->nclasses = nclasses;
+        q->rr = 0;
+        q->turn = false;
+    }
+
+    q->priority = -1;
+    for (unsigned i = 0; i < nclasses; ++i)
+    {
+        q->classes[i].config = classes[i];
+        if (classes[i].priority && q->priority < 0)
+        {
+            q->priority = (int)i;
+        }
+    }
+    for (unsigned i = 0; i < 64; ++i)
+    {
+        q->dscp[i] = dscp[i] < nclasses ? dscp[i] : 0;
+    }
+    return 0;
+}
+
+// Return the byte at `offset` of a packet held in an I/O vector, or 0.
+static unsigned char iov_byte(const ErlNifIOVec *iov, size_t offset)
+{
+    for (int i = 0; i < iov->iovcnt; ++i)
+    {
+        if (offset < iov->iov[i].iov_len)
+        {
+            return ((const unsigned char *)iov->iov[i].iov_base)[offset];
+        }
+        offset -= iov->iov[i].iov_len;
+    }
+    return 0;
+}
+
+unsigned sendq_classify(const struct sendq_t *q, const ErlNifIOVec *iov)
+{
+    // The DSCP is the top six bits of the IPv4 TOS byte, or of the IPv6
+    // traffic class, which straddles the first two bytes
+    unsigned char b0 = iov_byte(iov, 4);
+    unsigned dscp;
+    switch (b0 >> 4)
+    {
+    case 4:
+        dscp = iov_byte(iov, 5) >> 2;
+        break;
+    case 6:
+        dscp = ((b0 & 0x0F) << 2) | (iov_byte(iov, 5) >> 6);
+        break;
+    default:
+        dscp = 0;
+        break;
+    }
+    return q->dscp[dscp];
+}
+
+bool sendq_push(struct sendq_t *q, unsigned cls, const ErlNifIOVec *iov)
+{
+    struct sendq_class_t *c = cls < q->nclasses ? &q->classes[cls] : NULL;
+    uint64_t packets = atomic_load_explicit(&q->packets, memory_order_relaxed);
+    uint64_t bytes = atomic_load_explicit(&q->bytes, memory_order_relaxed);
+    struct sendq_pkt_t *pkt = NULL;
+    if (c != NULL && packets < q->max_packets && bytes + iov->size <= q->max_bytes &&
+        c->packets < c->config.max_packets && c->bytes + iov->size <= c->config.max_bytes)
+    {
+        pkt = enif_alloc(sizeof(*pkt) + iov->size);
+    }
+    if (pkt == NULL)
+    {
+        if (c != NULL)
+        {
+            c->drops++;
+        }
+        counter_add(&q->drops, 1);
+        return false;
+    }
+
+    size_t off = 0;
+    for (int i = 0; i < iov->iovcnt; ++i)
+    {
+        memcpy(pkt->data + off, iov->iov[i].iov_base, iov->iov[i].iov_len);
+        off += iov->iov[i].iov_len;
+    }
+    pkt->size = off;
+    pkt->next = NULL;
+    pkt->queued_at = enif_monotonic_time(ERL_NIF_NSEC);
+    if (c->tail != NULL)
+    {
+        c->tail->next = pkt;
+    }
+    else
+    {
+        c->head = pkt;
+    }
+    c->tail = pkt;
+    c->packets++;
+    c->bytes += pkt->size;
+    counter_add(&q->packets, 1);
+    counter_add(&q->bytes, (int64_t)pkt->size);
+    return true;
+}
+
+struct sendq_pkt_t *sendq_next(struct sendq_t *q, unsigned *cls)
+{
+    if (q->priority >= 0 && q->classes[q->priority].head != NULL)
+    {
+        *cls = (unsigned)q->priority;
+        return q->classes[q->priority].head;
+    }
+    if (atomic_load_explicit(&q->packets, memory_order_relaxed) == 0)
+    {
+        return NULL;
+    }
+
+    // Deficit round-robin: on its turn a class is credited its weight and may
+    // send while its head packet fits in the credit. The priority class is
+    // empty here, so some other class has a packet and the loop ends.
+    for (;;)
+    {
+        struct sendq_class_t *c = &q->classes[q->rr];
+        if ((int)q->rr != q->priority && c->head != NULL)
+        {
+            if (!q->turn)
+            {
+                c->deficit += c->config.weight;
+                q->turn = true;
+            }
+            if ((int64_t)c->head->size <= c->deficit)
+            {
+                *cls = q->rr;
+                return c->head;
+            }
+        }
+        else
+        {
+            c->deficit = 0;
+        }
+        q->turn = false;
+        q->rr = (q->rr + 1) % q->nclasses;
+    }
+}
+
+void sendq_pop(struct sendq_t *q, unsigned cls, bool sent)
+{
+    struct sendq_class_t *c = &q->classes[cls];
+    struct sendq_pkt_t *pkt = c->head;
+    if (pkt == NULL)
+    {
+        return;
+    }
+
+    c->head = pkt->next;
+    if (c->head == NULL)
+    {
+        c->tail = NULL;
+    }
+    c->packets--;
+    c->bytes -= pkt->size;
+    counter_add(&q->packets, -1);
+    counter_add(&q->bytes, -(int64_t)pkt->size);
+    if (sent)
+    {
+        c->sent++;
+        int64_t delay = enif_monotonic_time(ERL_NIF_NSEC) - pkt->queued_at;
+        hist_record(&c->delay, delay > 0 ? (uint64_t)delay : 0);
+    }
+    else
+    {
+        c->drops++;
+        counter_add(&q->drops, 1);
+    }
+    if ((int)cls != q->priority)
+    {
+        c->deficit -= (int64_t)pkt->size;
+        if (c->head == NULL)
+        {
+            // An idle class keeps no credit; move on to the next one
+            c->deficit = 0;
+            if (cls == q->rr)
+            {
+                q->turn = false;
+                q->rr = (q->rr + 1) % q->nclasses;
+            }
+        }
+    }
+    enif_free(pkt);
+}
+
+void sendq_clear(struct sendq_t *q)
+{
+    for (unsigned i = 0; i < q->nclasses; ++i)
+    {
+        while (q->classes[i].head != NULL)
+        {
+            sendq_pop(q, i, false);
+        }
+    }
+}
+
+static void drain(void *resource, void *arg, int64_t now)
+{
+    (void)arg;
+    (void)now;
+    s_drain(resource);
+}
+
+int sendq_init(sendq_drain_fn fn)
+{
+    s_drain = fn;
+    return 0;
+}
+
+int sendq_watch(int fd, void *resource, int *slot)
+{
+    return watch_add(fd, WATCH_WRITE | WATCH_ONESHOT, resource, drain, NULL, slot);
+}
+
+void sendq_unwatch(int fd, int *slot)
+{
+    void *resource = watch_remove(slot, &fd, 1);
+
+    // Released outside the lock as this may run the resource destructor
+    if (resource != NULL)
+    {
+        enif_release_resource(resource);
+    }
+}
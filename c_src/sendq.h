@@ -0,0 +1,131 @@
+#ifndef TUNDRA_SENDQ_H
+#define TUNDRA_SENDQ_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <erl_nif.h>
+#include "hist.h"
+
+// Per-device send queues.
+//
+// When a device's send queue is enabled, a write that would block is copied
+// into the queue rather than handed back to the caller, and the descriptor
+// watcher (see watch.h) writes it out once the kernel reports the device
+// writable. While the queue is non-empty, new packets are appended to it
+// rather than written directly, so nothing overtakes a queued packet of its
+// own class.
+//
+// A queue has one or more classes, chosen per packet by an explicit tag or by
+// its DSCP. A class marked priority is always served first; the others share
+// the device by deficit round-robin, each sending up to its weight in bytes
+// per round. Each class has its own limits, on top of the queue-wide ones, and
+// a histogram of the time its packets spent queued.
+//
+// All fields other than the queue-wide counters are protected by `lock`. The
+// counters are written under the lock and may be read without it (see
+// get_stats).
+
+#define SENDQ_MAX_CLASSES 8
+
+struct sendq_pkt_t
+{
+    struct sendq_pkt_t *next;
+    int64_t queued_at;
+    size_t size;
+    unsigned char data[];
+};
+
+struct sendq_class_config_t
+{
+    uint32_t weight; // bytes per round; ignored for the priority class
+    unsigned max_packets;
+    size_t max_bytes;
+    bool priority;
+};
+
+struct sendq_class_t
+{
+    struct sendq_class_config_t config;
+    struct sendq_pkt_t *head;
+    struct sendq_pkt_t *tail;
+    int64_t deficit;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t drops;
+    uint64_t sent;
+    struct hist_t delay; // nanoseconds from enqueue to write
+};
+
+struct sendq_t
+{
+    ErlNifMutex *lock;
+    struct sendq_class_t *classes;
+    unsigned nclasses;
+    int priority; // index of the priority class, or -1
+    unsigned rr;  // round-robin position
+    bool turn;    // the class at `rr` has had its weight for this round
+    uint8_t dscp[64]; // DSCP to class
+    unsigned max_packets; // 0 when the queue is disabled
+    size_t max_bytes;
+    size_t low;  // watermarks, in bytes
+    size_t high;
+    bool above;  // the high watermark has been reported and the low one has not
+    bool closed; // the device is being closed; nothing may be written
+    ErlNifPid owner;
+    int watch; // watcher slot (see sendq_watch)
+    _Atomic uint64_t packets;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t drops;
+};
+
+// Called by the descriptor watcher (see watch.h) when a watched device is
+// writable. The resource is kept for the duration of the call.
+typedef void (*sendq_drain_fn)(void *resource);
+
+// Set the function that drains a device. Called from the NIF load callback.
+int sendq_init(sendq_drain_fn drain);
+
+// Allocate an empty, disabled queue. Returns NULL on failure.
+struct sendq_t *sendq_create(void);
+
+// Free a queue and any packets left in it.
+void sendq_destroy(struct sendq_t *q);
+
+// Set the classes of a queue and its DSCP map. If the number of classes
+// changes, queued packets are dropped. Returns 0 or -errno. Called with the
+// lock held.
+int sendq_configure(struct sendq_t *q, const struct sendq_class_config_t *classes, unsigned nclasses,
+                    const uint8_t dscp[64]);
+
+// Return the class of a packet (including its 4-byte TUN header) by DSCP.
+unsigned sendq_classify(const struct sendq_t *q, const ErlNifIOVec *iov);
+
+// Append a copy of a packet to a class. Returns false, counting a drop, if the
+// queue is disabled or the packet would exceed a limit. Called with the lock
+// held.
+bool sendq_push(struct sendq_t *q, unsigned cls, const ErlNifIOVec *iov);
+
+// Return the next packet to write and set `*cls` to its class, or return NULL
+// if the queue is empty. The packet stays queued until sendq_pop. Called with
+// the lock held.
+struct sendq_pkt_t *sendq_next(struct sendq_t *q, unsigned *cls);
+
+// Remove the packet at the head of a class. `sent` records it as written,
+// along with its queueing delay. Called with the lock held.
+void sendq_pop(struct sendq_t *q, unsigned cls, bool sent);
+
+// Drop every queued packet, counting them as drops. Called with the lock held.
+void sendq_clear(struct sendq_t *q);
+
+// Arm a one-shot writability watch on `fd`. `*slot` identifies the
+// registration, as for watch_add, which holds a reference to `resource` until
+// sendq_unwatch is called. Returns 0 or -errno; -ENOTSUP where this is not
+// implemented.
+int sendq_watch(int fd, void *resource, int *slot);
+
+// Remove the watch on `fd`, if any, and release its resource reference.
+void sendq_unwatch(int fd, int *slot);
+
+#endif
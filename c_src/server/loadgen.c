@@ -0,0 +1,1285 @@
+/*
+ * loadgen.c - Traffic generator and pcap replay tool for TUN devices
+ *
+ * Writes synthetic IPv4/IPv6 UDP or TCP streams, or the packets of a pcap
+ * file, into a TUN device at a target rate, and counts the generated packets
+ * that come back out: on a UDP socket bound to the destination (the local
+ * stack's side of the device) and/or read back from the device itself (when
+ * another process forwards them into it). Reports achieved rates, loss,
+ * reordering and one-way latency.
+ *
+ * Linux only. See README.md for usage.
+ */
+
+#define _GNU_SOURCE // recvmmsg, SO_RCVBUFFORCE, IP_FREEBIND
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "src/server.h"
+
+#define TUN_HDR 4
+#define MAX_PACKET 65535
+#define MAX_BATCH 1024
+#define MAX_FLOWS 65536
+#define RX_BATCH 64
+#define BASE_PORT 20000
+
+// Every generated packet carries this stamp at the start of its payload
+#define STAMP_MAGIC 0x544c4731 // "TLG1"
+#define STAMP_SIZE 24
+
+struct stamp_t
+{
+    uint32_t magic;
+    uint32_t flow;
+    uint64_t seq;
+    uint64_t ts; // CLOCK_MONOTONIC, ns
+};
+
+struct options_t
+{
+    const char *attach;
+    int fd;
+    const char *local;
+    const char *peer;
+    const char *src;
+    const char *dst;
+    int prefix;
+    int mtu;
+    int family;
+    int proto;
+    int size;
+    int flows;
+    int port;
+    uint64_t rate;
+    uint64_t count;
+    double duration;
+    int batch;
+    const char *replay;
+    double speed;
+    int loops;
+    bool sink;
+    bool tun_rx;
+    double interval;
+    int drain_ms;
+};
+
+// Counters shared between the sender, receiver and reporter
+struct stats_t
+{
+    _Atomic uint64_t tx_packets;
+    _Atomic uint64_t tx_bytes;
+    _Atomic uint64_t tx_errors;
+    _Atomic uint64_t rx_packets;
+    _Atomic uint64_t rx_bytes;
+    _Atomic uint64_t rx_other;
+    _Atomic uint64_t reordered;
+};
+
+// Latency histogram, log-linear with 8 buckets per power of two (owned by the
+// receiver thread and read after it has been joined)
+#define LAT_SUB 3
+#define LAT_BUCKETS ((64 - LAT_SUB + 1) << LAT_SUB)
+
+struct latency_t
+{
+    uint64_t buckets[LAT_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+};
+
+// Per-flow receive state (owned by the receiver thread)
+struct flow_t
+{
+    uint64_t next;
+    uint64_t received;
+};
+
+struct receiver_t
+{
+    int sink;
+    size_t sink_hdr; // IP and UDP header bytes not seen by the sink
+    int tun;
+    int flows;
+    struct flow_t *flow;
+    struct latency_t latency;
+    struct stats_t *stats;
+    _Atomic bool stop;
+};
+
+// A batch of packets, each prefixed with the TUN header, written back to back
+struct batch_t
+{
+    uint8_t *buf;
+    size_t cap;
+    size_t len;
+    size_t end[MAX_BATCH];
+    int n;
+    int max;
+};
+
+static volatile sig_atomic_t s_stop;
+
+static void exit_error(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    s_stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+    struct timespec ts = {.tv_sec = (time_t)(deadline / 1000000000ULL), .tv_nsec = (long)(deadline % 1000000000ULL)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !s_stop)
+    {
+    }
+}
+
+/*
+ * Checksums
+ *
+ * Sums are accumulated unfolded in 32 bits (enough for any IP packet) and
+ * folded once at the end, so that a precomputed sum over the constant part of
+ * a packet can be extended with the few fields that change per packet.
+ */
+static uint32_t csum_add(uint32_t sum, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    for (; len > 1; p += 2, len -= 2)
+    {
+        sum += (uint32_t)(p[0] << 8 | p[1]);
+    }
+    if (len == 1)
+    {
+        sum += (uint32_t)(p[0] << 8);
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, (uint16_t)(v >> 16));
+    put16(p + 2, (uint16_t)v);
+}
+
+/*
+ * Latency histogram
+ */
+static unsigned lat_index(uint64_t v)
+{
+    if (v < (1u << LAT_SUB))
+    {
+        return (unsigned)v;
+    }
+    unsigned msb = 63u - (unsigned)__builtin_clzll(v);
+    return ((msb - LAT_SUB + 1) << LAT_SUB) | (unsigned)((v >> (msb - LAT_SUB)) & ((1u << LAT_SUB) - 1));
+}
+
+static uint64_t lat_upper(unsigned index)
+{
+    if (index < (1u << LAT_SUB))
+    {
+        return index;
+    }
+    unsigned msb = (index >> LAT_SUB) + LAT_SUB - 1;
+    uint64_t sub = index & ((1u << LAT_SUB) - 1);
+    uint64_t lower = ((1ULL << LAT_SUB) | sub) << (msb - LAT_SUB);
+    return lower + (1ULL << (msb - LAT_SUB)) - 1;
+}
+
+static void lat_record(struct latency_t *lat, uint64_t v)
+{
+    lat->buckets[lat_index(v)]++;
+    lat->count++;
+    lat->sum += v;
+    if (lat->count == 1 || v < lat->min)
+    {
+        lat->min = v;
+    }
+    if (v > lat->max)
+    {
+        lat->max = v;
+    }
+}
+
+static uint64_t lat_percentile(const struct latency_t *lat, double p)
+{
+    uint64_t rank = (uint64_t)(p * (double)lat->count / 100.0 + 0.999999);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < LAT_BUCKETS; ++i)
+    {
+        seen += lat->buckets[i];
+        if (seen >= rank && seen > 0)
+        {
+            uint64_t upper = lat_upper(i);
+            return upper < lat->max ? upper : lat->max;
+        }
+    }
+    return lat->max;
+}
+
+/*
+ * Device setup
+ */
+static void set_addr4(int sock, const char *name, unsigned long request, struct in_addr addr)
+{
+    struct ifreq ifr = {0};
+    struct sockaddr_in sin = {.sin_family = AF_INET, .sin_addr = addr};
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    memcpy(&ifr.ifr_addr, &sin, sizeof(sin));
+    if (ioctl(sock, request, &ifr) == -1)
+    {
+        exit_error("ioctl");
+    }
+}
+
+// Create a device and configure it with the local and peer addresses. IPv6
+// addressing goes through the same netlink path as the server; IPv4 (which
+// the server does not configure) is set with the classic ioctls.
+static int create_device(const struct options_t *o, char *name)
+{
+    struct create_tun_response_t resp = {.size = sizeof(resp)};
+    int tun = tun_create_safe(&resp);
+    if (tun < 0)
+    {
+        errno = -tun;
+        exit_error("tun_create_safe");
+    }
+    strcpy(name, resp.name);
+
+    struct create_tun_request_t req = {.size = sizeof(req), .mtu = o->mtu};
+    if (o->family == AF_INET6)
+    {
+        struct in6_addr mask = {0};
+        for (int i = 0; i < o->prefix; ++i)
+        {
+            mask.s6_addr[i / 8] |= (uint8_t)(0x80 >> (i % 8));
+        }
+        strncpy(req.addr, o->local, sizeof(req.addr) - 1);
+        strncpy(req.dstaddr, o->peer, sizeof(req.dstaddr) - 1);
+        inet_ntop(AF_INET6, &mask, req.netmask, sizeof(req.netmask));
+    }
+
+    int result = tun_configure_safe(name, &req);
+    if (result < 0)
+    {
+        errno = -result;
+        exit_error("tun_configure_safe");
+    }
+
+    if (o->family == AF_INET)
+    {
+        struct in_addr local, peer, mask = {.s_addr = htonl(o->prefix ? ~0u << (32 - o->prefix) : 0)};
+        if (inet_pton(AF_INET, o->local, &local) != 1 || inet_pton(AF_INET, o->peer, &peer) != 1)
+        {
+            fprintf(stderr, "Invalid IPv4 address\n");
+            exit(1);
+        }
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock == -1)
+        {
+            exit_error("socket");
+        }
+        set_addr4(sock, name, SIOCSIFADDR, local);
+        set_addr4(sock, name, SIOCSIFDSTADDR, peer);
+        set_addr4(sock, name, SIOCSIFNETMASK, mask);
+        close(sock);
+    }
+    return tun;
+}
+
+static int open_device(const struct options_t *o, char *name)
+{
+    if (o->fd >= 0)
+    {
+        struct ifreq ifr = {0};
+        if (ioctl(o->fd, TUNGETIFF, &ifr) == -1)
+        {
+            exit_error("TUNGETIFF");
+        }
+        if ((ifr.ifr_flags & IFF_TUN) == 0 || (ifr.ifr_flags & IFF_NO_PI) != 0)
+        {
+            fprintf(stderr, "Descriptor %d is not a TUN device with packet information\n", o->fd);
+            exit(1);
+        }
+        if (fcntl(o->fd, F_SETFL, fcntl(o->fd, F_GETFL) | O_NONBLOCK) == -1)
+        {
+            exit_error("fcntl");
+        }
+        snprintf(name, IFNAMSIZ, "%s", ifr.ifr_name);
+        return o->fd;
+    }
+
+    if (o->attach != NULL)
+    {
+        struct create_tun_response_t resp = {.size = sizeof(resp)};
+        int tun = tun_attach_safe(o->attach, &resp);
+        if (tun < 0)
+        {
+            errno = -tun;
+            exit_error("tun_attach_safe");
+        }
+        strcpy(name, resp.name);
+        return tun;
+    }
+
+    return create_device(o, name);
+}
+
+static int open_sink(const struct options_t *o, const uint8_t *dst)
+{
+    int sock = socket(o->family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock == -1)
+    {
+        exit_error("socket");
+    }
+
+    // Root can exceed rmem_max; fall back to the capped size otherwise
+    int size = 16 << 20;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == -1)
+    {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+
+    // The destination may be beyond the device rather than on it
+    int one = 1;
+    struct sockaddr_storage ss = {0};
+    socklen_t len;
+    if (o->family == AF_INET6)
+    {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons((uint16_t)o->port);
+        memcpy(&sin6->sin6_addr, dst, 16);
+        setsockopt(sock, IPPROTO_IPV6, IPV6_FREEBIND, &one, sizeof(one));
+        len = sizeof(*sin6);
+    }
+    else
+    {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons((uint16_t)o->port);
+        memcpy(&sin->sin_addr, dst, 4);
+        setsockopt(sock, IPPROTO_IP, IP_FREEBIND, &one, sizeof(one));
+        len = sizeof(*sin);
+    }
+
+    if (bind(sock, (struct sockaddr *)&ss, len) == -1)
+    {
+        exit_error("bind");
+    }
+    return sock;
+}
+
+/*
+ * Receiver
+ */
+static void rx_payload(struct receiver_t *r, const uint8_t *payload, size_t len, uint64_t now)
+{
+    struct stamp_t stamp;
+    if (len < STAMP_SIZE)
+    {
+        atomic_fetch_add_explicit(&r->stats->rx_other, 1, memory_order_relaxed);
+        return;
+    }
+    memcpy(&stamp, payload, sizeof(stamp));
+    if (stamp.magic != STAMP_MAGIC || stamp.flow >= (uint32_t)r->flows)
+    {
+        atomic_fetch_add_explicit(&r->stats->rx_other, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct flow_t *flow = &r->flow[stamp.flow];
+    flow->received++;
+    if (stamp.seq < flow->next)
+    {
+        // Overtaken by a later packet of the same flow
+        atomic_fetch_add_explicit(&r->stats->reordered, 1, memory_order_relaxed);
+    }
+    else
+    {
+        flow->next = stamp.seq + 1;
+    }
+    if (now >= stamp.ts)
+    {
+        lat_record(&r->latency, now - stamp.ts);
+    }
+}
+
+// Locate the transport payload of a packet read back from the device
+static void rx_packet(struct receiver_t *r, const uint8_t *pkt, size_t len, uint64_t now)
+{
+    size_t ip_len = 0;
+    uint8_t proto = 0;
+    if (len >= 20 && pkt[0] >> 4 == 4)
+    {
+        ip_len = (size_t)(pkt[0] & 0x0F) * 4;
+        proto = pkt[9];
+    }
+    else if (len >= 40 && pkt[0] >> 4 == 6)
+    {
+        ip_len = 40;
+        proto = pkt[6];
+    }
+
+    size_t off = 0;
+    if (proto == IPPROTO_UDP && len >= ip_len + 8)
+    {
+        off = ip_len + 8;
+    }
+    else if (proto == IPPROTO_TCP && len >= ip_len + 20)
+    {
+        off = ip_len + (size_t)(pkt[ip_len + 12] >> 4) * 4;
+    }
+
+    if (off == 0 || off > len)
+    {
+        atomic_fetch_add_explicit(&r->stats->rx_other, 1, memory_order_relaxed);
+        return;
+    }
+    rx_payload(r, pkt + off, len - off, now);
+}
+
+static void rx_count(struct receiver_t *r, uint64_t packets, uint64_t bytes)
+{
+    atomic_fetch_add_explicit(&r->stats->rx_packets, packets, memory_order_relaxed);
+    atomic_fetch_add_explicit(&r->stats->rx_bytes, bytes, memory_order_relaxed);
+}
+
+static void *receiver_thread(void *arg)
+{
+    struct receiver_t *r = arg;
+    static uint8_t bufs[RX_BATCH][MAX_PACKET + TUN_HDR];
+    struct mmsghdr msgs[RX_BATCH];
+    struct iovec iovs[RX_BATCH];
+    for (int i = 0; i < RX_BATCH; ++i)
+    {
+        iovs[i] = (struct iovec){.iov_base = bufs[i], .iov_len = sizeof(bufs[i])};
+        msgs[i] = (struct mmsghdr){.msg_hdr = {.msg_iov = &iovs[i], .msg_iovlen = 1}};
+    }
+
+    struct pollfd fds[2];
+    nfds_t nfds = 0;
+    if (r->sink >= 0)
+    {
+        fds[nfds++] = (struct pollfd){.fd = r->sink, .events = POLLIN};
+    }
+    if (r->tun >= 0)
+    {
+        fds[nfds++] = (struct pollfd){.fd = r->tun, .events = POLLIN};
+    }
+
+    while (!atomic_load(&r->stop))
+    {
+        if (poll(fds, nfds, 100) <= 0)
+        {
+            continue;
+        }
+
+        if (r->sink >= 0)
+        {
+            int n;
+            while ((n = recvmmsg(r->sink, msgs, RX_BATCH, MSG_DONTWAIT, NULL)) > 0)
+            {
+                uint64_t now = now_ns();
+                uint64_t bytes = 0;
+                for (int i = 0; i < n; ++i)
+                {
+                    bytes += msgs[i].msg_len + r->sink_hdr;
+                    rx_payload(r, bufs[i], msgs[i].msg_len, now);
+                }
+                rx_count(r, (uint64_t)n, bytes);
+            }
+        }
+
+        if (r->tun >= 0)
+        {
+            ssize_t n;
+            while ((n = read(r->tun, bufs[0], sizeof(bufs[0]))) > TUN_HDR)
+            {
+                rx_packet(r, bufs[0] + TUN_HDR, (size_t)n - TUN_HDR, now_ns());
+                rx_count(r, 1, (uint64_t)n - TUN_HDR);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Sender
+ */
+static void batch_init(struct batch_t *b, int max, size_t packet)
+{
+    b->max = max;
+    b->cap = (size_t)max * (packet + TUN_HDR);
+    if (b->cap < MAX_PACKET + TUN_HDR)
+    {
+        b->cap = MAX_PACKET + TUN_HDR;
+    }
+    b->buf = malloc(b->cap);
+    if (b->buf == NULL)
+    {
+        exit_error("malloc");
+    }
+    b->len = 0;
+    b->n = 0;
+}
+
+// Reserve space for a packet of `len` bytes after its TUN header
+static uint8_t *batch_add(struct batch_t *b, size_t len)
+{
+    uint8_t *p = b->buf + b->len;
+    b->len += TUN_HDR + len;
+    b->end[b->n++] = b->len;
+    return p + TUN_HDR;
+}
+
+// Fill in the TUN header once the packet is in place
+static void batch_header(uint8_t *packet)
+{
+    struct tun_pi pi = {.flags = 0, .proto = htons((packet[0] >> 4) == 6 ? 0x86DD : 0x0800)};
+    memcpy(packet - TUN_HDR, &pi, TUN_HDR);
+}
+
+// The TUN device takes one packet per write(2), so a batch is written with
+// back-to-back calls from a buffer built up front.
+static void batch_flush(int tun, struct batch_t *b, struct stats_t *st)
+{
+    uint64_t packets = 0, bytes = 0, errors = 0;
+    size_t start = 0;
+    for (int i = 0; i < b->n; ++i)
+    {
+        size_t len = b->end[i] - start;
+        ssize_t n = write(tun, b->buf + start, len);
+        if (n == -1 && errno == EAGAIN)
+        {
+            struct pollfd pfd = {.fd = tun, .events = POLLOUT};
+            poll(&pfd, 1, 100);
+            n = write(tun, b->buf + start, len);
+        }
+        if (n == (ssize_t)len)
+        {
+            packets++;
+            bytes += len - TUN_HDR;
+        }
+        else
+        {
+            errors++;
+        }
+        start = b->end[i];
+    }
+    atomic_fetch_add_explicit(&st->tx_packets, packets, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->tx_bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->tx_errors, errors, memory_order_relaxed);
+    b->len = 0;
+    b->n = 0;
+}
+
+/*
+ * Periodic report
+ */
+struct report_t
+{
+    uint64_t start;
+    uint64_t next;
+    uint64_t period;
+    uint64_t last;
+    uint64_t tx;
+    uint64_t txb;
+    uint64_t rx;
+    uint64_t reordered;
+};
+
+static void report_tick(struct report_t *rep, struct stats_t *st, uint64_t now)
+{
+    if (rep->period == 0 || now < rep->next)
+    {
+        return;
+    }
+    uint64_t tx = atomic_load(&st->tx_packets), txb = atomic_load(&st->tx_bytes);
+    uint64_t rx = atomic_load(&st->rx_packets), ro = atomic_load(&st->reordered);
+    double secs = (double)(now - rep->last) / 1e9;
+    if (rep->last == rep->start)
+    {
+        printf("%8s %12s %12s %12s %10s %10s\n", "time", "tx pps", "tx Mbit/s", "rx pps", "lost", "reordered");
+    }
+    printf("%8.2f %12.0f %12.1f %12.0f %10lld %10llu\n",
+           (double)(now - rep->start) / 1e9,
+           (double)(tx - rep->tx) / secs,
+           (double)(txb - rep->txb) * 8 / secs / 1e6,
+           (double)(rx - rep->rx) / secs,
+           (long long)(tx - rx),
+           (unsigned long long)(ro - rep->reordered));
+    fflush(stdout);
+    rep->tx = tx;
+    rep->txb = txb;
+    rep->rx = rx;
+    rep->reordered = ro;
+    rep->last = now;
+    rep->next += rep->period;
+}
+
+/*
+ * Synthetic traffic
+ *
+ * All flows share one packet template; a flow differs only in its source
+ * port (and, for TCP, its sequence number). The checksum over the constant
+ * part is computed once and extended with the per-packet fields.
+ */
+struct template_t
+{
+    uint8_t data[MAX_PACKET];
+    size_t len;
+    size_t l4;  // transport header offset
+    size_t csum; // transport checksum offset
+    uint32_t base;
+};
+
+static void build_template(const struct options_t *o, const uint8_t *src, const uint8_t *dst, struct template_t *t)
+{
+    bool v6 = o->family == AF_INET6;
+    size_t ip_len = v6 ? 40 : 20;
+    size_t l4_len = o->proto == IPPROTO_UDP ? 8 : 20;
+    size_t addr_len = v6 ? 16 : 4;
+    uint16_t seg = (uint16_t)(o->size - ip_len);
+
+    memset(t->data, 0, (size_t)o->size);
+    t->len = (size_t)o->size;
+    t->l4 = ip_len;
+
+    uint8_t *ip = t->data;
+    if (v6)
+    {
+        ip[0] = 0x60;
+        put16(ip + 4, seg);
+        ip[6] = (uint8_t)o->proto;
+        ip[7] = 64;
+        memcpy(ip + 8, src, 16);
+        memcpy(ip + 24, dst, 16);
+    }
+    else
+    {
+        ip[0] = 0x45;
+        put16(ip + 2, (uint16_t)o->size);
+        put16(ip + 6, 0x4000); // DF
+        ip[8] = 64;
+        ip[9] = (uint8_t)o->proto;
+        memcpy(ip + 12, src, 4);
+        memcpy(ip + 16, dst, 4);
+        put16(ip + 10, csum_fold(csum_add(0, ip, 20)));
+    }
+
+    uint8_t *l4 = t->data + ip_len;
+    put16(l4 + 2, (uint16_t)o->port);
+    if (o->proto == IPPROTO_UDP)
+    {
+        put16(l4 + 4, seg);
+        t->csum = ip_len + 6;
+    }
+    else
+    {
+        put32(l4 + 8, 1);    // ack
+        l4[12] = 5 << 4;     // data offset
+        l4[13] = 0x18;       // PSH|ACK
+        put16(l4 + 14, 0xFFFF);
+        t->csum = ip_len + 16;
+    }
+
+    // Pseudo-header plus everything that does not vary per packet
+    uint8_t pseudo[4] = {0, 0, 0, (uint8_t)o->proto};
+    uint32_t sum = csum_add(0, src, addr_len);
+    sum = csum_add(sum, dst, addr_len);
+    sum += seg;
+    sum = csum_add(sum, pseudo, sizeof(pseudo));
+    sum = csum_add(sum, l4, l4_len);
+    t->base = sum;
+}
+
+static void fill_packet(const struct template_t *t, uint8_t *p, int proto, uint32_t flow, uint64_t seq, uint32_t tcp_seq)
+{
+    memcpy(p, t->data, t->len);
+
+    uint8_t *l4 = p + t->l4;
+    uint16_t sport = (uint16_t)(BASE_PORT + flow);
+    put16(l4, sport);
+
+    size_t payload = t->l4 + (proto == IPPROTO_UDP ? 8 : 20);
+    struct stamp_t stamp = {.magic = STAMP_MAGIC, .flow = flow, .seq = seq, .ts = now_ns()};
+    memcpy(p + payload, &stamp, sizeof(stamp));
+
+    uint32_t sum = t->base + sport;
+    if (proto == IPPROTO_TCP)
+    {
+        put32(l4 + 4, tcp_seq);
+        sum += (tcp_seq >> 16) + (tcp_seq & 0xFFFF);
+    }
+    sum = csum_add(sum, &stamp, sizeof(stamp));
+    uint16_t csum = csum_fold(sum);
+    if (proto == IPPROTO_UDP && csum == 0)
+    {
+        csum = 0xFFFF;
+    }
+    put16(p + t->csum, csum);
+}
+
+static void generate(int tun, const struct options_t *o, const uint8_t *src, const uint8_t *dst,
+                     struct stats_t *st, struct report_t *rep)
+{
+    static struct template_t t;
+    build_template(o, src, dst, &t);
+
+    uint64_t *seqs = calloc((size_t)o->flows, sizeof(*seqs));
+    uint32_t *tcp_seqs = calloc((size_t)o->flows, sizeof(*tcp_seqs));
+    if (seqs == NULL || tcp_seqs == NULL)
+    {
+        exit_error("calloc");
+    }
+    uint32_t payload_len = (uint32_t)(t.len - t.l4 - 20);
+
+    struct batch_t b;
+    batch_init(&b, o->batch, t.len);
+
+    uint64_t start = now_ns();
+    uint64_t end = o->duration > 0 ? start + (uint64_t)(o->duration * 1e9) : UINT64_MAX;
+    uint64_t next = start;
+    uint64_t sent = 0;
+    uint32_t flow = 0;
+
+    while (!s_stop && (o->count == 0 || sent < o->count))
+    {
+        uint64_t now = now_ns();
+        if (now >= end)
+        {
+            break;
+        }
+        report_tick(rep, st, now);
+
+        int n = o->batch;
+        if (o->count > 0 && o->count - sent < (uint64_t)n)
+        {
+            n = (int)(o->count - sent);
+        }
+
+        if (o->rate > 0)
+        {
+            if (next > now)
+            {
+                sleep_until(next);
+            }
+            else if (now - next > 10000000)
+            {
+                // More than 10ms behind: don't try to catch up in one burst
+                next = now;
+            }
+            next += (uint64_t)n * 1000000000ULL / o->rate;
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            uint8_t *p = batch_add(&b, t.len);
+            fill_packet(&t, p, o->proto, flow, seqs[flow], tcp_seqs[flow]);
+            batch_header(p);
+            seqs[flow]++;
+            tcp_seqs[flow] += payload_len;
+            flow = flow + 1 == (uint32_t)o->flows ? 0 : flow + 1;
+        }
+        batch_flush(tun, &b, st);
+        sent += (uint64_t)n;
+    }
+
+    free(b.buf);
+    free(seqs);
+    free(tcp_seqs);
+}
+
+/*
+ * pcap replay
+ *
+ * Classic pcap files only (convert pcapng with `editcap -F pcap`). Link
+ * layer headers are stripped and non-IP packets skipped.
+ */
+struct pcap_t
+{
+    FILE *f;
+    bool swap;
+    bool nsec;
+    uint32_t linktype;
+};
+
+static uint32_t pcap32(const struct pcap_t *p, uint32_t v)
+{
+    return p->swap ? __builtin_bswap32(v) : v;
+}
+
+static void pcap_open(struct pcap_t *p, const char *path)
+{
+    uint32_t hdr[6];
+    p->f = fopen(path, "rb");
+    if (p->f == NULL)
+    {
+        exit_error(path);
+    }
+    if (fread(hdr, sizeof(hdr), 1, p->f) != 1)
+    {
+        fprintf(stderr, "%s: not a pcap file\n", path);
+        exit(1);
+    }
+    switch (hdr[0])
+    {
+    case 0xA1B2C3D4: p->swap = false; p->nsec = false; break;
+    case 0xD4C3B2A1: p->swap = true; p->nsec = false; break;
+    case 0xA1B23C4D: p->swap = false; p->nsec = true; break;
+    case 0x4D3CB2A1: p->swap = true; p->nsec = true; break;
+    default:
+        fprintf(stderr, "%s: not a pcap file (pcapng is not supported)\n", path);
+        exit(1);
+    }
+    p->linktype = pcap32(p, hdr[5]) & 0xFFFF;
+}
+
+// Offset of the IP header for the file's link type, or -1 to skip the packet
+static long pcap_l3(const struct pcap_t *p, const uint8_t *data, size_t len)
+{
+    size_t off;
+    switch (p->linktype)
+    {
+    case 0:   // NULL
+    case 108: // LOOP
+        off = 4;
+        break;
+    case 1: // Ethernet
+        off = 14;
+        if (len >= 18 && data[12] == 0x81 && data[13] == 0x00)
+        {
+            off = 18;
+        }
+        break;
+    case 12:  // RAW (OpenBSD)
+    case 14:  // RAW
+    case 101: // RAW
+    case 228: // IPV4
+    case 229: // IPV6
+        off = 0;
+        break;
+    case 113: // Linux cooked
+        off = 16;
+        break;
+    case 276: // Linux cooked v2
+        off = 20;
+        break;
+    default:
+        return -1;
+    }
+    if (len <= off || (data[off] >> 4 != 4 && data[off] >> 4 != 6))
+    {
+        return -1;
+    }
+    return (long)off;
+}
+
+static void replay(int tun, const struct options_t *o, struct stats_t *st, struct report_t *rep, uint64_t *skipped)
+{
+    struct pcap_t p;
+    pcap_open(&p, o->replay);
+
+    static uint8_t data[MAX_PACKET + 64];
+    struct batch_t b;
+    batch_init(&b, o->batch, 2048);
+
+    uint64_t start = now_ns();
+    uint64_t end = o->duration > 0 ? start + (uint64_t)(o->duration * 1e9) : UINT64_MAX;
+    uint64_t next = start;
+    uint64_t sent = 0;
+    uint64_t loop_start = start;
+    uint64_t loop_last = start;
+
+    for (int loop = 0; !s_stop && (o->loops == 0 || loop < o->loops); ++loop)
+    {
+        fseek(p.f, 24, SEEK_SET);
+        bool first = true;
+        uint64_t first_ts = 0;
+        uint32_t rec[4];
+
+        while (!s_stop && fread(rec, sizeof(rec), 1, p.f) == 1)
+        {
+            uint32_t incl = pcap32(&p, rec[2]);
+            if (incl > sizeof(data) || fread(data, incl, 1, p.f) != 1)
+            {
+                break;
+            }
+
+            long off = pcap_l3(&p, data, incl);
+            size_t len = off < 0 ? 0 : incl - (size_t)off;
+            if (off < 0 || len > MAX_PACKET)
+            {
+                (*skipped)++;
+                continue;
+            }
+
+            uint64_t now = now_ns();
+            if (now >= end || (o->count > 0 && sent >= o->count))
+            {
+                s_stop = 1;
+                break;
+            }
+            report_tick(rep, st, now);
+
+            uint64_t deadline = now;
+            if (o->speed > 0)
+            {
+                uint64_t ts = (uint64_t)pcap32(&p, rec[0]) * 1000000000ULL +
+                              (uint64_t)pcap32(&p, rec[1]) * (p.nsec ? 1 : 1000);
+                if (first)
+                {
+                    first_ts = ts;
+                    first = false;
+                }
+                deadline = loop_start + (uint64_t)((double)(ts - first_ts) / o->speed);
+                loop_last = deadline;
+            }
+            else if (o->rate > 0)
+            {
+                deadline = next;
+                next += 1000000000ULL / o->rate;
+            }
+
+            // Flush what is due before waiting for the next packet
+            if (deadline > now)
+            {
+                if (b.n > 0)
+                {
+                    batch_flush(tun, &b, st);
+                }
+                sleep_until(deadline);
+            }
+            if (b.n == b.max || b.len + TUN_HDR + len > b.cap)
+            {
+                batch_flush(tun, &b, st);
+            }
+
+            uint8_t *pkt = batch_add(&b, len);
+            memcpy(pkt, data + off, len);
+            batch_header(pkt);
+            sent++;
+        }
+        if (b.n > 0)
+        {
+            batch_flush(tun, &b, st);
+        }
+        // The next pass starts where this one ended
+        loop_start = loop_last > now_ns() ? loop_last : now_ns();
+    }
+
+    free(b.buf);
+    fclose(p.f);
+}
+
+/*
+ * Main
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "\n"
+            "Device (default: create one):\n"
+            "  --attach NAME       attach to a persistent device\n"
+            "  --fd N              use an inherited TUN descriptor\n"
+            "  --local ADDR        device address (created devices)\n"
+            "  --peer ADDR         peer address (created devices)\n"
+            "  --prefix N          prefix length (default 64, or 24 with -4)\n"
+            "  --mtu N             device MTU (created devices)\n"
+            "\n"
+            "Traffic:\n"
+            "  -4, -6              IP version (default 6)\n"
+            "  --tcp               TCP segments rather than UDP datagrams\n"
+            "  --src ADDR          source address (default: peer)\n"
+            "  --dst ADDR          destination address (default: local)\n"
+            "  --port N            destination port (default 9000)\n"
+            "  --size N            IP packet size in bytes (default 512)\n"
+            "  --flows N           number of flows (source ports) (default 1)\n"
+            "  --rate PPS          target rate, 0 for unlimited (default 100000)\n"
+            "  --batch N           packets per burst of writes (default 32)\n"
+            "  --count N           stop after N packets\n"
+            "  --duration SECS     stop after SECS seconds (default 10)\n"
+            "  --replay FILE       replay a pcap file instead\n"
+            "  --speed X           replay timing scale, 0 to ignore timestamps (default 1)\n"
+            "  --loop N            replay N times, 0 for ever (default 1)\n"
+            "\n"
+            "Measurement:\n"
+            "  --no-sink           do not bind a UDP socket to the destination\n"
+            "  --tun-rx            count packets read back from the device\n"
+            "  --interval SECS     report interval, 0 for none (default 1)\n"
+            "  --drain MS          wait for stragglers after sending (default 500)\n",
+            prog);
+    exit(2);
+}
+
+static void parse_addr(int family, const char *str, uint8_t *out)
+{
+    if (inet_pton(family, str, out) != 1)
+    {
+        fprintf(stderr, "Invalid %s address: %s\n", family == AF_INET6 ? "IPv6" : "IPv4", str);
+        exit(2);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    enum
+    {
+        OPT_ATTACH = 256, OPT_FD, OPT_LOCAL, OPT_PEER, OPT_PREFIX, OPT_MTU, OPT_TCP, OPT_SRC, OPT_DST,
+        OPT_PORT, OPT_SIZE, OPT_FLOWS, OPT_RATE, OPT_BATCH, OPT_COUNT, OPT_DURATION, OPT_REPLAY,
+        OPT_SPEED, OPT_LOOP, OPT_NO_SINK, OPT_TUN_RX, OPT_INTERVAL, OPT_DRAIN
+    };
+    static const struct option longopts[] = {
+        {"attach", required_argument, NULL, OPT_ATTACH},
+        {"fd", required_argument, NULL, OPT_FD},
+        {"local", required_argument, NULL, OPT_LOCAL},
+        {"peer", required_argument, NULL, OPT_PEER},
+        {"prefix", required_argument, NULL, OPT_PREFIX},
+        {"mtu", required_argument, NULL, OPT_MTU},
+        {"tcp", no_argument, NULL, OPT_TCP},
+        {"src", required_argument, NULL, OPT_SRC},
+        {"dst", required_argument, NULL, OPT_DST},
+        {"port", required_argument, NULL, OPT_PORT},
+        {"size", required_argument, NULL, OPT_SIZE},
+        {"flows", required_argument, NULL, OPT_FLOWS},
+        {"rate", required_argument, NULL, OPT_RATE},
+        {"batch", required_argument, NULL, OPT_BATCH},
+        {"count", required_argument, NULL, OPT_COUNT},
+        {"duration", required_argument, NULL, OPT_DURATION},
+        {"replay", required_argument, NULL, OPT_REPLAY},
+        {"speed", required_argument, NULL, OPT_SPEED},
+        {"loop", required_argument, NULL, OPT_LOOP},
+        {"no-sink", no_argument, NULL, OPT_NO_SINK},
+        {"tun-rx", no_argument, NULL, OPT_TUN_RX},
+        {"interval", required_argument, NULL, OPT_INTERVAL},
+        {"drain", required_argument, NULL, OPT_DRAIN},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+
+    struct options_t o = {
+        .fd = -1,
+        .prefix = -1,
+        .family = AF_INET6,
+        .proto = IPPROTO_UDP,
+        .size = 512,
+        .flows = 1,
+        .port = 9000,
+        .rate = 100000,
+        .duration = 10,
+        .batch = 32,
+        .speed = 1,
+        .loops = 1,
+        .sink = true,
+        .interval = 1,
+        .drain_ms = 500};
+    bool duration_set = false;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "46h", longopts, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case '4': o.family = AF_INET; break;
+        case '6': o.family = AF_INET6; break;
+        case OPT_ATTACH: o.attach = optarg; break;
+        case OPT_FD: o.fd = atoi(optarg); break;
+        case OPT_LOCAL: o.local = optarg; break;
+        case OPT_PEER: o.peer = optarg; break;
+        case OPT_PREFIX: o.prefix = atoi(optarg); break;
+        case OPT_MTU: o.mtu = atoi(optarg); break;
+        case OPT_TCP: o.proto = IPPROTO_TCP; break;
+        case OPT_SRC: o.src = optarg; break;
+        case OPT_DST: o.dst = optarg; break;
+        case OPT_PORT: o.port = atoi(optarg); break;
+        case OPT_SIZE: o.size = atoi(optarg); break;
+        case OPT_FLOWS: o.flows = atoi(optarg); break;
+        case OPT_RATE: o.rate = strtoull(optarg, NULL, 10); break;
+        case OPT_BATCH: o.batch = atoi(optarg); break;
+        case OPT_COUNT: o.count = strtoull(optarg, NULL, 10); break;
+        case OPT_DURATION: o.duration = atof(optarg); duration_set = true; break;
+        case OPT_REPLAY: o.replay = optarg; break;
+        case OPT_SPEED: o.speed = atof(optarg); break;
+        case OPT_LOOP: o.loops = atoi(optarg); break;
+        case OPT_NO_SINK: o.sink = false; break;
+        case OPT_TUN_RX: o.tun_rx = true; break;
+        case OPT_INTERVAL: o.interval = atof(optarg); break;
+        case OPT_DRAIN: o.drain_ms = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+
+    bool v6 = o.family == AF_INET6;
+    size_t min_size = (v6 ? 40 : 20) + (o.proto == IPPROTO_UDP ? 8 : 20) + STAMP_SIZE;
+    if (o.local == NULL)
+    {
+        o.local = v6 ? "fd11:b7b7:4362::2" : "10.212.0.2";
+    }
+    if (o.peer == NULL)
+    {
+        o.peer = v6 ? "fd11:b7b7:4362::1" : "10.212.0.1";
+    }
+    if (o.prefix < 0)
+    {
+        o.prefix = v6 ? 64 : 24;
+    }
+    if (o.count > 0 && !duration_set)
+    {
+        o.duration = 0;
+    }
+    if (o.size < (int)min_size || o.size > MAX_PACKET || o.flows < 1 || o.flows > MAX_FLOWS ||
+        o.batch < 1 || o.batch > MAX_BATCH || o.prefix > (v6 ? 128 : 32) || o.port < 1 || o.port > 65535 ||
+        o.speed < 0)
+    {
+        fprintf(stderr, "Invalid options (packet size must be at least %zu bytes)\n", min_size);
+        usage(argv[0]);
+    }
+
+    uint8_t src[16], dst[16];
+    parse_addr(o.family, o.src ? o.src : o.peer, src);
+    parse_addr(o.family, o.dst ? o.dst : o.local, dst);
+
+    char name[IFNAMSIZ] = {0};
+    int tun = open_device(&o, name);
+    printf("Using %s\n", name);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    // Replayed packets carry no stamp, so only the device is watched for them
+    struct stats_t stats = {0};
+    static struct receiver_t r;
+    r.sink = o.sink && o.replay == NULL && o.proto == IPPROTO_UDP ? open_sink(&o, dst) : -1;
+    r.sink_hdr = (v6 ? 40 : 20) + 8;
+    r.tun = o.tun_rx ? tun : -1;
+    r.flows = o.flows;
+    r.flow = calloc((size_t)o.flows, sizeof(*r.flow));
+    r.stats = &stats;
+    if (r.flow == NULL)
+    {
+        exit_error("calloc");
+    }
+
+    pthread_t rx_thread;
+    bool receiving = r.sink >= 0 || r.tun >= 0;
+    if (receiving && pthread_create(&rx_thread, NULL, receiver_thread, &r) != 0)
+    {
+        fprintf(stderr, "Failed to start the receiver\n");
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    struct report_t rep = {.start = start, .next = start, .last = start, .period = (uint64_t)(o.interval * 1e9)};
+    rep.next += rep.period;
+    uint64_t skipped = 0;
+
+    if (o.replay != NULL)
+    {
+        replay(tun, &o, &stats, &rep, &skipped);
+    }
+    else
+    {
+        generate(tun, &o, src, dst, &stats, &rep);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    if (receiving)
+    {
+        sleep_until(now_ns() + (uint64_t)o.drain_ms * 1000000ULL);
+        atomic_store(&r.stop, true);
+        pthread_join(rx_thread, NULL);
+    }
+
+    double secs = (double)elapsed / 1e9;
+    uint64_t tx = atomic_load(&stats.tx_packets), txb = atomic_load(&stats.tx_bytes);
+    uint64_t rx = atomic_load(&stats.rx_packets), other = atomic_load(&stats.rx_other);
+    uint64_t stamped = rx - other;
+
+    printf("\n");
+    printf("sent       %12llu packets %14llu bytes in %.2f s (%.0f pps, %.1f Mbit/s), %llu errors\n",
+           (unsigned long long)tx, (unsigned long long)txb, secs, (double)tx / secs, (double)txb * 8 / secs / 1e6,
+           (unsigned long long)atomic_load(&stats.tx_errors));
+    if (skipped > 0)
+    {
+        printf("skipped    %12llu non-IP or oversized packets\n", (unsigned long long)skipped);
+    }
+    if (receiving)
+    {
+        printf("received   %12llu packets %14llu bytes (%.0f pps), %llu unrecognised\n",
+               (unsigned long long)rx, (unsigned long long)atomic_load(&stats.rx_bytes), (double)rx / secs,
+               (unsigned long long)other);
+    }
+    if (receiving && o.replay == NULL)
+    {
+        uint64_t lost = tx > stamped ? tx - stamped : 0;
+        printf("lost       %12llu (%.3f%%)\n", (unsigned long long)lost, tx ? 100.0 * (double)lost / (double)tx : 0.0);
+        printf("reordered  %12llu\n", (unsigned long long)atomic_load(&stats.reordered));
+        if (r.latency.count > 0)
+        {
+            printf("latency    min %.1f us, avg %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+                   (double)r.latency.min / 1e3, (double)r.latency.sum / (double)r.latency.count / 1e3,
+                   (double)lat_percentile(&r.latency, 50) / 1e3, (double)lat_percentile(&r.latency, 99) / 1e3,
+                   (double)lat_percentile(&r.latency, 99.9) / 1e3, (double)r.latency.max / 1e3);
+        }
+    }
+
+    if (r.sink >= 0)
+    {
+        close(r.sink);
+    }
+    free(r.flow);
+    if (tun != o.fd)
+    {
+        close(tun);
+    }
+    return 0;
+}
@@ -17,6 +17,7 @@
 #include <sys/un.h>
 #include <unistd.h>
 #include "server.h"
+#include "usdt.h"
 
 #define TUNDRA_GROUP "tundra"
 
@@ -26,25 +27,111 @@ static void exit_error(const char *msg)
     exit(1);
 }
 
-static void run_child(int client_fd)
+// Each connection keeps a netlink context per namespace it creates devices in
+static struct tun_netns_cache_t netns_cache;
+
+// Pass a device to the client, or tell it why there is none. A failed
+// request leaves the connection usable.
+static void send_device(int client_fd, int tun_fd, struct response_t *resp)
+{
+    if (tun_fd < 0)
+    {
+        resp->error = -tun_fd;
+        send_with_retry(client_fd, resp, sizeof(*resp));
+        return;
+    }
+    sendfd_with_retry(client_fd, tun_fd, resp, sizeof(*resp));
+    close(tun_fd);
+}
+
+static void handle_request(int client_fd)
 {
     struct request_t req;
-    struct response_t resp;
+    struct response_t resp = {.header = TUNDRA_MESSAGE_HEADER};
 
-    read_with_retry(client_fd, &req, sizeof(req));
+    // The device of a CONFIGURE_TUN request, or the namespace of a CREATE_TUN
+    // request
+    int passed_fd = recv_request_with_retry(client_fd, &req);
+    if (req.header.magic != TUNDRA_PROTOCOL_MAGIC || req.header.version != TUNDRA_PROTOCOL_VERSION)
+    {
+        // A client of another version, whose request cannot be read: tell it
+        // so in a response that names this version, and hang up
+        fprintf(stderr, "request of another protocol version refused\n");
+        resp.error = EPROTO;
+        send_with_retry(client_fd, &resp, sizeof(resp));
+        exit(0);
+    }
+    TUNDRA_PROBE2(server_request, client_fd, req.type);
 
     if (req.type == REQUEST_TYPE_CREATE_TUN &&
         req.msg.create_tun.size == sizeof(req.msg.create_tun))
     {
-        int tun_fd = tun_create(&resp);
-        tun_configure(resp.msg.create_tun.name, &req.msg.create_tun);
-        sendfd_with_retry(client_fd, tun_fd, &resp, sizeof(resp));
-        close(tun_fd);
+        int tun_fd;
+        if (passed_fd != -1)
+        {
+            tun_fd = tun_create_netns(&netns_cache, passed_fd, peer_uid(client_fd), &req.msg.create_tun, &resp);
+            passed_fd = -1; // kept by the cache
+        }
+        else
+        {
+            tun_fd = tun_create(&req.msg.create_tun, peer_uid(client_fd), &resp);
+        }
+        send_device(client_fd, tun_fd, &resp);
+    }
+    else if (req.type == REQUEST_TYPE_ATTACH_TUN &&
+             req.msg.attach_tun.size == sizeof(req.msg.attach_tun))
+    {
+        req.msg.attach_tun.name[sizeof(req.msg.attach_tun.name) - 1] = '\0';
+        int tun_fd = tun_attach(req.msg.attach_tun.name, peer_uid(client_fd), &resp);
+        send_device(client_fd, tun_fd, &resp);
+    }
+    else if (req.type == REQUEST_TYPE_CONFIGURE_TUN &&
+             req.msg.configure_tun.size == sizeof(req.msg.configure_tun) && passed_fd != -1)
+    {
+        // A change refused, by the server or the kernel, is reported to the
+        // client rather than closing the connection: the device itself is
+        // unaffected
+        resp.error = -tun_configure(passed_fd, peer_uid(client_fd), &req.msg.configure_tun, &resp);
+        send_with_retry(client_fd, &resp, sizeof(resp));
     }
     else
     {
         exit_error("unknown request type");
     }
+
+    if (passed_fd != -1)
+    {
+        close(passed_fd);
+    }
+}
+
+// Serve requests until the client closes the connection (read_with_retry
+// exits the child on EOF). Clients keep connections open across requests, so
+// the fork is paid once per connection rather than once per device.
+static void run_child(int client_fd)
+{
+    tun_netns_cache_init(&netns_cache);
+#ifdef __linux__
+    // Failed requests no longer end the child, but one that could not return
+    // from a client's namespace must not serve the next from inside it
+    int home = netns_open("/proc/thread-self/ns/net", -1);
+    if (home < 0)
+    {
+        errno = -home;
+        exit_error("netns_open");
+    }
+#endif
+    for (;;)
+    {
+        handle_request(client_fd);
+#ifdef __linux__
+        if (netns_is_current(home) != 1)
+        {
+            errno = EIO;
+            exit_error("netns_leave");
+        }
+#endif
+    }
 }
 
 int main(int argc, char **argv)
@@ -121,9 +208,11 @@ int main(int argc, char **argv)
         {
             exit_error("accept");
         }
+        TUNDRA_PROBE1(server_accept, client_fd);
 
         // Fork child process to handle request
         pid_t pid = fork();
+        TUNDRA_PROBE2(server_fork, client_fd, pid);
         if (pid > 0)
         {
             // Parent process
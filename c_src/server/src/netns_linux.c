@@ -0,0 +1,114 @@
+/*
+ * netns_linux.c - Network namespace switching
+ *
+ * Kept apart from tun_linux.c, which cannot be built with _GNU_SOURCE (its
+ * <linux/if.h> and <net/if.h> would then clash), as setns(2) needs it.
+ */
+
+#ifdef __linux__
+
+#define _GNU_SOURCE // setns, CLONE_NEWNET, O_CLOEXEC
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/nsfs.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "server.h"
+
+/*
+ * Open a network namespace by path (such as /run/netns/NAME or
+ * /proc/PID/ns/net), or duplicate the descriptor `fd` if path is NULL
+ * Returns: a close-on-exec descriptor on success, -errno on error
+ */
+int netns_open(const char *path, int fd)
+{
+    int nsfd = path != NULL ? open(path, O_RDONLY | O_CLOEXEC) : fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    return nsfd == -1 ? -errno : nsfd;
+}
+
+/*
+ * Move the calling thread into the namespace `nsfd`, saving a descriptor for
+ * the one it was in to `origin`, which netns_leave returns it to
+ * Returns: 0 on success, -errno on error (-EINVAL if nsfd is not a network
+ * namespace)
+ */
+int netns_enter(int nsfd, int *origin)
+{
+    *origin = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (*origin == -1)
+    {
+        return -errno;
+    }
+    if (setns(nsfd, CLONE_NEWNET) == -1)
+    {
+        int err = errno;
+        close(*origin);
+        *origin = -1;
+        return -err;
+    }
+    return 0;
+}
+
+/*
+ * Return the calling thread to the namespace saved by netns_enter
+ * Returns: 0 on success, -errno on error, in which case the thread is left
+ * where it was
+ */
+int netns_leave(int origin)
+{
+    int result = setns(origin, CLONE_NEWNET) == -1 ? -errno : 0;
+    close(origin);
+    return result;
+}
+
+/*
+ * Tell whether `nsfd` is the calling thread's namespace
+ * Returns: 1 if it is, 0 if not, -errno on error
+ */
+int netns_is_current(int nsfd)
+{
+    struct stat ns, current;
+    if (fstat(nsfd, &ns) == -1 || stat("/proc/thread-self/ns/net", &current) == -1)
+    {
+        return -errno;
+    }
+    return ns.st_dev == current.st_dev && ns.st_ino == current.st_ino;
+}
+
+/*
+ * Identify a namespace, whichever descriptor refers to it
+ * Returns: 0 on success, -errno on error
+ */
+int netns_id(int nsfd, uint64_t *dev, uint64_t *ino)
+{
+    struct stat st;
+    if (fstat(nsfd, &st) == -1)
+    {
+        return -errno;
+    }
+    *dev = (uint64_t)st.st_dev;
+    *ino = (uint64_t)st.st_ino;
+    return 0;
+}
+
+/*
+ * Find the user that owns the namespace `nsfd`, which is the owner of the
+ * user namespace that it belongs to
+ * Returns: 0 on success, -errno on error (-EINVAL if nsfd is not a namespace)
+ */
+int netns_owner(int nsfd, uid_t *uid)
+{
+    int userns = ioctl(nsfd, NS_GET_USERNS);
+    if (userns == -1)
+    {
+        return errno == ENOTTY ? -EINVAL : -errno;
+    }
+    int result = ioctl(userns, NS_GET_OWNER_UID, uid) == -1 ? -errno : 0;
+    close(userns);
+    return result;
+}
+
+#endif // __linux__
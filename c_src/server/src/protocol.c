@@ -4,6 +4,10 @@
  * Handles reading requests and sending responses with file descriptor passing
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE // struct ucred
+#endif
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +16,7 @@
 #include <sys/uio.h>
 #include <unistd.h>
 #include "server.h"
+#include "usdt.h"
 
 static void exit_error(const char *msg)
 {
@@ -41,6 +46,101 @@ void read_with_retry(int fd, void *buf, size_t count)
     }
 }
 
+/*
+ * Read `count` bytes, like read_with_retry, keeping the first descriptor
+ * passed with them in *passed (if it is still -1). Any further descriptors
+ * are closed.
+ */
+static void recv_part(int fd, void *buf, size_t count, int *passed)
+{
+    size_t total = 0;
+    while (total < count)
+    {
+        union
+        {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct iovec iov = {
+            .iov_base = (uint8_t *)buf + total,
+            .iov_len = count - total
+        };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf)
+        };
+
+        ssize_t n = recvmsg(fd, &msg, 0);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            exit_error("recvmsg");
+        }
+        if (n == 0)
+        {
+            exit(0);
+        }
+        total += n;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+            size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < n_fds; ++i)
+            {
+                int received;
+                memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (*passed == -1)
+                {
+                    *passed = received;
+                }
+                else
+                {
+                    close(received);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Read a request, returning the descriptor passed with it via SCM_RIGHTS, or
+ * -1 if there was none. The header is read first, and the rest only if it
+ * names this version of the protocol: a request of another version may be of
+ * another size, and waiting for this version's would never end.
+ */
+int recv_request_with_retry(int fd, struct request_t *req)
+{
+    int passed = -1;
+    recv_part(fd, &req->header, sizeof(req->header), &passed);
+    if (req->header.magic == TUNDRA_PROTOCOL_MAGIC && req->header.version == TUNDRA_PROTOCOL_VERSION)
+    {
+        recv_part(fd, (uint8_t *)req + sizeof(req->header), sizeof(*req) - sizeof(req->header), &passed);
+    }
+    return passed;
+}
+
+void send_with_retry(int dest, const void *buf, size_t sz)
+{
+    ssize_t ret = send(dest, buf, sz, TUNDRA_MSG_NOSIGNAL);
+    while (ret == -1 && errno == EINTR)
+    {
+        ret = send(dest, buf, sz, TUNDRA_MSG_NOSIGNAL);
+    }
+    if (ret == -1)
+    {
+        exit_error("send");
+    }
+}
+
 void sendfd_with_retry(int dest, int fd, const void *buf, size_t sz)
 {
     char cmsgbuf[CMSG_SPACE(sizeof(int))];
@@ -67,8 +167,30 @@ void sendfd_with_retry(int dest, int fd, const void *buf, size_t sz)
     {
         ret = sendmsg(dest, &msg, TUNDRA_MSG_NOSIGNAL);
     }
+    TUNDRA_PROBE3(server_sendfd, dest, fd, ret == -1 ? errno : 0);
     if (ret == -1)
     {
         exit_error("sendmsg");
     }
 }
+
+uid_t peer_uid(int fd)
+{
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+    {
+        exit_error("getsockopt(SO_PEERCRED)");
+    }
+    return cred.uid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) == -1)
+    {
+        exit_error("getpeereid");
+    }
+    return uid;
+#endif
+}
@@ -8,16 +8,37 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include <net/if.h>
 #include <netinet/in.h>
 
 // Unix domain socket path for client/server communication
 #define SVR_PATH "/var/run/tundra.sock"
 
+// Every request and response starts with a header naming the version of this
+// file it was built from. The server is packaged separately from the library,
+// and the layout of the messages below changes between versions, so a server
+// answers a request of another version with EPROTO in a response of its own
+// version, then closes the connection, rather than misreading it. Increment
+// TUNDRA_PROTOCOL_VERSION with any change to the messages. (Before the header
+// was added, requests began with their type.)
+#define TUNDRA_PROTOCOL_MAGIC 0x52444e54u // "TNDR" in little-endian order
+#define TUNDRA_PROTOCOL_VERSION 2
+
+struct message_header_t
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+#define TUNDRA_MESSAGE_HEADER {.magic = TUNDRA_PROTOCOL_MAGIC, .version = TUNDRA_PROTOCOL_VERSION}
+
 // Request types
 enum request_type_t
 {
-    REQUEST_TYPE_CREATE_TUN = 0
+    REQUEST_TYPE_CREATE_TUN = 0,
+    REQUEST_TYPE_ATTACH_TUN = 1,
+    REQUEST_TYPE_CONFIGURE_TUN = 2
 };
 
 // CREATE_TUN request payload
@@ -28,6 +49,7 @@ struct create_tun_request_t
     char dstaddr[INET6_ADDRSTRLEN];
     char netmask[INET6_ADDRSTRLEN];
     int mtu;
+    int txqueuelen; // 0 leaves the kernel default (Linux only)
 };
 
 // CREATE_TUN response payload
@@ -37,22 +59,82 @@ struct create_tun_response_t
     char name[IF_NAMESIZE];
 };
 
+// ATTACH_TUN request payload (reopen an existing persistent device)
+struct attach_tun_request_t
+{
+    size_t size;
+    char name[IF_NAMESIZE];
+};
+
+// The most changes a CONFIGURE_TUN request may carry
+#define TUN_MAX_CHANGES 16
+
+// A change to a live device
+enum tun_change_op_t
+{
+    TUN_CHANGE_MTU = 0,
+    TUN_CHANGE_LINK = 1, // value is 1 to bring the link up, 0 to take it down
+    TUN_CHANGE_ADD_ADDRESS = 2,
+    TUN_CHANGE_REMOVE_ADDRESS = 3,
+    TUN_CHANGE_ADD_ROUTE = 4,
+    TUN_CHANGE_REMOVE_ROUTE = 5
+};
+
+struct tun_change_t
+{
+    enum tun_change_op_t op;
+    int value;                 // MTU or link state
+    int family;                // AF_INET or AF_INET6, for addresses and routes
+    unsigned char prefixlen;
+    unsigned char addr[16];    // in network order; the first 4 bytes for AF_INET
+};
+
+// CONFIGURE_TUN request payload (change a device the client already holds)
+//
+// The device's descriptor is passed with the request via SCM_RIGHTS, which is
+// what shows that the client may change it.
+struct configure_tun_request_t
+{
+    size_t size;
+    unsigned count;
+    struct tun_change_t changes[TUN_MAX_CHANGES];
+};
+
+// CONFIGURE_TUN response payload (no FD is passed back; the outcome is the
+// response's `error`)
+struct configure_tun_response_t
+{
+    size_t size;
+};
+
 // Request message (sent from client to server)
 struct request_t
 {
+    struct message_header_t header;
     enum request_type_t type;
     union
     {
         struct create_tun_request_t create_tun;
+        struct attach_tun_request_t attach_tun;
+        struct configure_tun_request_t configure_tun;
     } msg;
 };
 
 // Response message (sent from server to client, includes FD via SCM_RIGHTS)
+//
+// ATTACH_TUN responses carry the same payload as CREATE_TUN responses.
+// CONFIGURE_TUN responses carry no FD, and nor does a response to a request
+// that failed, which gives the reason in `error`.
 struct response_t
 {
+    struct message_header_t header;
     enum request_type_t type;
+    int error; // 0, or the errno value of a failed request (for CONFIGURE_TUN,
+               // of the first change that failed)
     union
     {
         struct create_tun_response_t create_tun;
+        struct create_tun_response_t attach_tun;
+        struct configure_tun_response_t configure_tun;
     } msg;
 };
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/types.h>
 #include "protocol.h"
 
 // Platform-specific MSG_NOSIGNAL flag
@@ -11,14 +14,99 @@
 #define TUNDRA_MSG_NOSIGNAL MSG_NOSIGNAL
 #endif
 
-// Platform-specific TUN device functions (server-facing, exit on error)
-int tun_create(struct response_t *resp);
-void tun_configure(const char *name, struct create_tun_request_t *msg);
+// Platform-specific TUN device functions (server-facing). They fill in the
+// response and return the device's fd (0 for tun_configure), or -errno to
+// report to the client.
+int tun_create(const struct create_tun_request_t *msg, uid_t uid, struct response_t *resp);
+int tun_attach(const char *name, uid_t uid, struct response_t *resp);
+int tun_configure(int fd, uid_t uid, const struct configure_tun_request_t *msg, struct response_t *resp);
 
 // Safe versions that return error codes (for NIF use)
 int tun_create_safe(struct create_tun_response_t *resp);
 int tun_configure_safe(const char *name, const struct create_tun_request_t *msg);
+int tun_attach_safe(const char *name, struct create_tun_response_t *resp);
+int tun_persist_safe(int fd, bool persist);
+int tun_sndbuf_safe(int fd, int bytes);
+int tun_reconfigure_safe(int fd, const struct configure_tun_request_t *msg);
+
+// Kernel interface counters and settings (Linux: IFLA_STATS64)
+struct tun_link_stats_t
+{
+    char name[IF_NAMESIZE]; // filled in by the caller
+    unsigned ifindex;       // 0 if there is no such interface
+    unsigned mtu;
+    unsigned txqlen;
+    unsigned flags;
+    uint64_t rx_packets;
+    uint64_t tx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t rx_errors;
+    uint64_t tx_errors;
+    uint64_t rx_dropped;
+    uint64_t tx_dropped;
+};
+
+// A change to an interface, as reported to RTNLGRP_LINK subscribers
+struct tun_link_event_t
+{
+    char name[IF_NAMESIZE];
+    unsigned ifindex;
+    unsigned mtu;
+    unsigned flags;
+    bool removed;
+};
+
+// Network namespaces (Linux)
+//
+// A TUN device is created in the namespace of the thread that opens
+// /dev/net/tun, and a netlink socket acts on the namespace it was opened in.
+// A context holds a namespace and a netlink socket opened inside it, so that
+// the devices created there in turn share one socket rather than each moving
+// in from the root namespace. A cache keeps the contexts of the namespaces
+// used most recently, and with them the namespaces themselves.
+struct tun_netns_t
+{
+    int nsfd;       // -1 when unused
+    int netlink_fd;
+    uint32_t seq;   // of the last request sent on it
+    uint64_t dev;   // identify the namespace, whichever descriptor names it
+    uint64_t ino;
+    uint64_t used;  // for eviction
+};
+
+#define TUN_NETNS_CACHE 16
+
+struct tun_netns_cache_t
+{
+    struct tun_netns_t ns[TUN_NETNS_CACHE];
+    uint64_t clock;
+};
+
+void tun_netns_cache_init(struct tun_netns_cache_t *cache);
+void tun_netns_cache_clear(struct tun_netns_cache_t *cache);
+int tun_netns_get_safe(struct tun_netns_cache_t *cache, int nsfd, struct tun_netns_t **ns);
+int tun_create_netns_safe(struct tun_netns_t *ns, const struct create_tun_request_t *msg,
+                          struct create_tun_response_t *resp);
+int tun_configure_netns_safe(struct tun_netns_t *ns, const char *name, const struct create_tun_request_t *msg);
+int tun_create_netns(struct tun_netns_cache_t *cache, int nsfd, uid_t uid, const struct create_tun_request_t *msg,
+                     struct response_t *resp);
+
+// Switching namespaces (netns_linux.c)
+int netns_open(const char *path, int fd);
+int netns_enter(int nsfd, int *origin);
+int netns_leave(int origin);
+int netns_is_current(int nsfd);
+int netns_id(int nsfd, uint64_t *dev, uint64_t *ino);
+int netns_owner(int nsfd, uid_t *uid);
+
+int tun_link_stats_safe(struct tun_link_stats_t *links, size_t n);
+int tun_link_monitor_safe(void);
+int tun_link_events_safe(int fd, struct tun_link_event_t *events, int max);
 
 // Protocol helpers
 void read_with_retry(int fd, void *buf, size_t count);
+int recv_request_with_retry(int fd, struct request_t *req);
+void send_with_retry(int dest, const void *buf, size_t sz);
 void sendfd_with_retry(int dest, int fd, const void *buf, size_t sz);
+uid_t peer_uid(int fd);
@@ -26,12 +26,6 @@
 
 #define UTUN_CONTROL_NAME "com.apple.net.utun_control"
 
-static void exit_error(const char *msg)
-{
-    perror(msg);
-    exit(1);
-}
-
 /*
  * Create utun device - error-returning version
  * Returns: fd on success, -errno on error
@@ -93,6 +87,11 @@ int tun_create_safe(struct create_tun_response_t *resp)
 
 /*
  * Configure utun device using ioctl - error-returning version
+ *
+ * An empty msg->addr leaves the device unaddressed and an mtu of zero leaves
+ * the default in place; the interface is always brought up. utun devices
+ * have no transmit queue, so msg->txqueuelen is ignored.
+ *
  * Returns: 0 on success, -errno on error
  */
 int tun_configure_safe(const char *name, const struct create_tun_request_t *msg)
@@ -103,6 +102,11 @@ int tun_configure_safe(const char *name, const struct create_tun_request_t *msg)
         return -errno;
     }
 
+    if (msg->addr[0] == '\0')
+    {
+        goto link;
+    }
+
     struct in6_aliasreq ifr6;
     memset(&ifr6, 0, sizeof(ifr6));
     strncpy(ifr6.ifra_name, name, sizeof(ifr6.ifra_name));
@@ -149,12 +153,13 @@ int tun_configure_safe(const char *name, const struct create_tun_request_t *msg)
         return -err;
     }
 
+link:;
     // Set MTU
     struct ifreq ifr;
     memset(&ifr, 0, sizeof(ifr));
     strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name));
     ifr.ifr_mtu = msg->mtu;
-    if (ioctl(fd, SIOCSIFMTU, &ifr) == -1)
+    if (msg->mtu > 0 && ioctl(fd, SIOCSIFMTU, &ifr) == -1)
     {
         int err = errno;
         close(fd);
@@ -183,28 +188,143 @@ int tun_configure_safe(const char *name, const struct create_tun_request_t *msg)
     return 0;
 }
 
-// Server-facing wrapper that exits on error
-int tun_create(struct response_t *resp)
+// Server-facing: create a device and configure it (utun devices have no
+// owner, and cannot be changed once configured)
+int tun_create(const struct create_tun_request_t *msg, uid_t uid, struct response_t *resp)
 {
-    int result = tun_create_safe(&resp->msg.create_tun);
+    (void)uid;
+    resp->type = REQUEST_TYPE_CREATE_TUN;
+    int fd = tun_create_safe(&resp->msg.create_tun);
+    if (fd < 0)
+    {
+        return fd;
+    }
+    int result = tun_configure_safe(resp->msg.create_tun.name, msg);
     if (result < 0)
     {
-        errno = -result;
-        exit_error("tun_create_safe");
+        close(fd);
+        return result;
     }
-    resp->type = REQUEST_TYPE_CREATE_TUN;
-    return result;
+    return fd;
 }
 
-// Server-facing wrapper that exits on error
-void tun_configure(const char *name, struct create_tun_request_t *msg)
+// utun devices cannot outlive their control socket
+int tun_attach_safe(const char *name, struct create_tun_response_t *resp)
 {
-    int result = tun_configure_safe(name, msg);
-    if (result < 0)
+    (void)name;
+    (void)resp;
+    return -ENOTSUP;
+}
+
+int tun_persist_safe(int fd, bool persist)
+{
+    (void)fd;
+    (void)persist;
+    return -ENOTSUP;
+}
+
+// A utun device is a socket, so its send buffer is the socket's
+int tun_sndbuf_safe(int fd, int bytes)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)) == -1)
     {
-        errno = -result;
-        exit_error("tun_configure_safe");
+        return -errno;
     }
+    return 0;
+}
+
+// Live reconfiguration is sent over rtnetlink, which Darwin lacks
+int tun_reconfigure_safe(int fd, const struct configure_tun_request_t *msg)
+{
+    (void)fd;
+    (void)msg;
+    return -ENOTSUP;
+}
+
+// Darwin has no network namespaces
+void tun_netns_cache_init(struct tun_netns_cache_t *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+}
+
+void tun_netns_cache_clear(struct tun_netns_cache_t *cache)
+{
+    (void)cache;
+}
+
+int tun_netns_get_safe(struct tun_netns_cache_t *cache, int nsfd, struct tun_netns_t **ns)
+{
+    (void)cache;
+    (void)ns;
+    close(nsfd);
+    return -ENOTSUP;
+}
+
+int tun_create_netns_safe(struct tun_netns_t *ns, const struct create_tun_request_t *msg,
+                          struct create_tun_response_t *resp)
+{
+    (void)ns;
+    (void)msg;
+    (void)resp;
+    return -ENOTSUP;
+}
+
+int tun_configure_netns_safe(struct tun_netns_t *ns, const char *name, const struct create_tun_request_t *msg)
+{
+    (void)ns;
+    (void)name;
+    (void)msg;
+    return -ENOTSUP;
+}
+
+// Interface statistics and events are read from rtnetlink, which Darwin lacks
+int tun_link_stats_safe(struct tun_link_stats_t *links, size_t n)
+{
+    (void)links;
+    (void)n;
+    return -ENOTSUP;
+}
+
+int tun_link_monitor_safe(void)
+{
+    return -ENOTSUP;
+}
+
+int tun_link_events_safe(int fd, struct tun_link_event_t *events, int max)
+{
+    (void)fd;
+    (void)events;
+    (void)max;
+    return -ENOTSUP;
+}
+
+// Server-facing: network namespaces are Linux only
+int tun_create_netns(struct tun_netns_cache_t *cache, int nsfd, uid_t uid, const struct create_tun_request_t *msg,
+                     struct response_t *resp)
+{
+    (void)cache;
+    (void)uid;
+    (void)msg;
+    resp->type = REQUEST_TYPE_CREATE_TUN;
+    close(nsfd);
+    return -ENOTSUP;
+}
+
+// Server-facing: live reconfiguration is Linux only
+int tun_configure(int fd, uid_t uid, const struct configure_tun_request_t *msg, struct response_t *resp)
+{
+    (void)uid;
+    resp->type = REQUEST_TYPE_CONFIGURE_TUN;
+    resp->msg.configure_tun.size = sizeof(resp->msg.configure_tun);
+    return tun_reconfigure_safe(fd, msg);
+}
+
+// Server-facing: utun devices cannot be reopened
+int tun_attach(const char *name, uid_t uid, struct response_t *resp)
+{
+    (void)uid;
+    resp->type = REQUEST_TYPE_ATTACH_TUN;
+    return tun_attach_safe(name, &resp->msg.attach_tun);
 }
 
 #endif // __APPLE__
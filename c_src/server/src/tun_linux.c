@@ -14,6 +14,7 @@
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <net/if.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,12 +22,7 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include "server.h"
-
-static void exit_error(const char *msg)
-{
-    perror(msg);
-    exit(1);
-}
+#include "usdt.h"
 
 static unsigned char netmask_to_prefixlen(const struct in6_addr *netmask)
 {
@@ -61,6 +57,7 @@ static unsigned char netmask_to_prefixlen(const struct in6_addr *netmask)
 int tun_create_safe(struct create_tun_response_t *resp)
 {
     int tun = open("/dev/net/tun", O_RDWR);
+    TUNDRA_PROBE2(create_open, tun, tun == -1 ? errno : 0);
     if (tun == -1)
     {
         return -errno;
@@ -69,7 +66,9 @@ int tun_create_safe(struct create_tun_response_t *resp)
     struct ifreq ifr = {0};
     ifr.ifr_flags = IFF_TUN;  // | IFF_NO_PI
 
-    if (ioctl(tun, TUNSETIFF, (void *)&ifr) == -1)
+    int ret = ioctl(tun, TUNSETIFF, (void *)&ifr);
+    TUNDRA_PROBE3(create_setiff, tun, ifr.ifr_name, ret == -1 ? errno : 0);
+    if (ret == -1)
     {
         int err = errno;
         close(tun);
@@ -90,27 +89,136 @@ int tun_create_safe(struct create_tun_response_t *resp)
 }
 
 /*
- * Configure TUN device - error-returning version
- * Returns: 0 on success, -errno on error
+ * Read the flags of the TUN or TAP device `name`, as TUNGETIFF reports them
+ * Returns: the flags on success, -errno on error; -EINVAL if the interface is
+ * not a TUN or TAP device
  */
-int tun_configure_safe(const char *name, const struct create_tun_request_t *msg)
+static int tun_flags(const char *name)
 {
-    struct in6_addr addr, dstaddr, netmask;
-    static const struct in6_addr zero_addr = {0};
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/class/net/%.*s/tun_flags", IFNAMSIZ - 1, name);
 
-    if (inet_pton(AF_INET6, msg->addr, &addr) != 1)
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
     {
-        return -EINVAL;
+        return errno == ENOENT ? -EINVAL : -errno;
+    }
+    unsigned flags;
+    bool read = fscanf(f, "%x", &flags) == 1;
+    fclose(f);
+    return read ? (int)(flags & 0xFFFF) : -EINVAL;
+}
+
+/*
+ * Attach to an existing persistent TUN device - error-returning version
+ * Returns: fd on success, -errno on error
+ *
+ * Fails with -ENODEV if there is no persistent TUN device of that name, with
+ * -EINVAL if the device is a TAP device or has no packet information header
+ * (IFF_NO_PI), and with -EBUSY if the device is already attached to another
+ * descriptor.
+ */
+int tun_attach_safe(const char *name, struct create_tun_response_t *resp)
+{
+    if (strlen(name) >= IFNAMSIZ || if_nametoindex(name) == 0)
+    {
+        return -ENODEV;
     }
-    if (inet_pton(AF_INET6, msg->dstaddr, &dstaddr) != 1)
+
+    // TUNSETIFF replaces the flags of the device it attaches to, so attaching
+    // with IFF_TUN would quietly give an IFF_NO_PI device the header. The
+    // flags are read from sysfs beforehand instead.
+    int flags = tun_flags(name);
+    if (flags < 0)
     {
-        return -EINVAL;
+        return flags;
     }
-    if (inet_pton(AF_INET6, msg->netmask, &netmask) != 1)
+    if ((flags & IFF_TUN) == 0 || (flags & IFF_NO_PI) != 0)
     {
         return -EINVAL;
     }
 
+    int tun = open("/dev/net/tun", O_RDWR);
+    if (tun == -1)
+    {
+        return -errno;
+    }
+
+    struct ifreq ifr = {0};
+    ifr.ifr_flags = IFF_TUN;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+
+    if (ioctl(tun, TUNSETIFF, (void *)&ifr) == -1)
+    {
+        int err = errno;
+        close(tun);
+        return -err;
+    }
+
+    // TUNSETIFF creates the device if it vanished in the meantime. Such a
+    // device is not persistent, so closing the descriptor removes it again.
+    if (ioctl(tun, TUNGETIFF, (void *)&ifr) == -1 || !(ifr.ifr_flags & IFF_PERSIST))
+    {
+        close(tun);
+        return -ENODEV;
+    }
+
+    if (fcntl(tun, F_SETFL, fcntl(tun, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        int err = errno;
+        close(tun);
+        return -err;
+    }
+
+    strncpy(resp->name, ifr.ifr_name, sizeof(resp->name) - 1);
+    resp->name[sizeof(resp->name) - 1] = '\0';
+
+    return tun;
+}
+
+/*
+ * Make a TUN device outlive its descriptor (or stop it doing so)
+ * Returns: 0 on success, -errno on error
+ *
+ * A persistent device is owned by the effective uid of the caller, so that
+ * the same user can later re-attach to it without CAP_NET_ADMIN.
+ */
+int tun_persist_safe(int fd, bool persist)
+{
+    if (persist && ioctl(fd, TUNSETOWNER, (unsigned long)geteuid()) == -1)
+    {
+        return -errno;
+    }
+    if (ioctl(fd, TUNSETPERSIST, persist ? 1UL : 0UL) == -1)
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Set the socket send buffer of a TUN device, which bounds the bytes queued
+ * towards the kernel by writes that have not yet been processed
+ * Returns: 0 on success, -errno on error
+ */
+int tun_sndbuf_safe(int fd, int bytes)
+{
+    if (ioctl(fd, TUNSETSNDBUF, &bytes) == -1)
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Netlink batch helpers
+ *
+ * Several rtnetlink requests are packed back to back into one buffer and
+ * handed to the kernel with a single send(2); the acknowledgements are then
+ * collected in order. This keeps device configuration to one round trip.
+ */
+static int nl_open(void)
+{
     int netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
     if (netlink_fd == -1)
     {
@@ -133,136 +241,1006 @@ int tun_configure_safe(const char *name, const struct create_tun_request_t *msg)
         return -err;
     }
 
-    struct
+    return netlink_fd;
+}
+
+struct nl_batch
+{
+    union
     {
-        struct nlmsghdr header;
-        struct nlmsgerr content;
-    } response = {0};
+        struct nlmsghdr align;
+        char buf[1024];
+    } u;
+    size_t len;
+    unsigned count;
+    uint32_t seq; // requests are numbered from seq + 1
+};
 
-    // Set IPv6 address
-    struct
+// Append a request with the given fixed-size body; returns NULL if full
+static struct nlmsghdr *nl_batch_add(struct nl_batch *b, unsigned short type,
+                                     const void *body, size_t body_len)
+{
+    size_t len = NLMSG_LENGTH(body_len);
+    if (b->len + NLMSG_ALIGN(len) > sizeof(b->u.buf))
     {
-        struct nlmsghdr header;
-        struct ifaddrmsg content;
-        char attributes_buf[RTA_LENGTH(sizeof(addr)) + RTA_LENGTH(sizeof(dstaddr))];
-    } set_addr = {0};
+        return NULL;
+    }
 
-    size_t attributes_buf_avail = sizeof(set_addr.attributes_buf);
+    struct nlmsghdr *header = (struct nlmsghdr *)(b->u.buf + b->len);
+    memset(header, 0, NLMSG_ALIGN(len));
+    header->nlmsg_len = len;
+    header->nlmsg_type = type;
+    header->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    header->nlmsg_seq = b->seq + ++b->count;
+    memcpy(NLMSG_DATA(header), body, body_len);
+    b->len += NLMSG_ALIGN(len);
+    return header;
+}
 
-    set_addr.header.nlmsg_len = NLMSG_LENGTH(sizeof(set_addr.content));
-    set_addr.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-    set_addr.header.nlmsg_type = RTM_NEWADDR;
-    set_addr.header.nlmsg_seq = 1;
+// Append an attribute to the most recently added request
+static int nl_batch_attr(struct nl_batch *b, struct nlmsghdr *header,
+                         unsigned short type, const void *data, size_t data_len)
+{
+    size_t offset = NLMSG_ALIGN(header->nlmsg_len);
+    size_t rta_len = RTA_LENGTH(data_len);
+    if ((char *)header + offset + RTA_ALIGN(rta_len) > b->u.buf + sizeof(b->u.buf))
+    {
+        return -ENOBUFS;
+    }
 
-    set_addr.content.ifa_index = if_nametoindex(name);
-    set_addr.content.ifa_family = AF_INET6;
-    set_addr.content.ifa_prefixlen = netmask_to_prefixlen(&netmask);
+    struct rtattr *attr = (struct rtattr *)((char *)header + offset);
+    attr->rta_type = type;
+    attr->rta_len = rta_len;
+    memcpy(RTA_DATA(attr), data, data_len);
+    header->nlmsg_len = offset + RTA_ALIGN(rta_len);
+    b->len = (char *)header - b->u.buf + NLMSG_ALIGN(header->nlmsg_len);
+    return 0;
+}
 
-    struct rtattr *request_attr = IFA_RTA(&set_addr.content);
-    request_attr->rta_type = IFA_LOCAL;
-    request_attr->rta_len = RTA_LENGTH(sizeof(addr));
-    set_addr.header.nlmsg_len += request_attr->rta_len;
-    memcpy(RTA_DATA(request_attr), &addr, sizeof(addr));
+// Send the whole batch at once and wait for every acknowledgement.
+// Returns 0 on success or the first error reported by the kernel.
+//
+// Acknowledgements of other requests are skipped, so that a socket which is
+// reused after a failure does not mistake one left over for the batch's own.
+static int nl_batch_commit(int netlink_fd, const struct nl_batch *b)
+{
+    if (b->count == 0)
+    {
+        return 0;
+    }
 
-    if (memcmp(&dstaddr, &zero_addr, sizeof(dstaddr)) != 0)
+    if (send(netlink_fd, b->u.buf, b->len, 0) != (ssize_t)b->len)
     {
-        request_attr = RTA_NEXT(request_attr, attributes_buf_avail);
-        request_attr->rta_type = IFA_ADDRESS;
-        request_attr->rta_len = RTA_LENGTH(sizeof(dstaddr));
-        set_addr.header.nlmsg_len += request_attr->rta_len;
-        memcpy(RTA_DATA(request_attr), &dstaddr, sizeof(dstaddr));
+        return -errno;
     }
 
-    if (send(netlink_fd, &set_addr, set_addr.header.nlmsg_len, 0) !=
-        (ssize_t)set_addr.header.nlmsg_len)
+    int result = 0;
+    unsigned acked = 0;
+    while (acked < b->count)
     {
-        int err = errno;
-        close(netlink_fd);
-        return -err;
+        union
+        {
+            struct nlmsghdr align;
+            char buf[512];
+        } resp;
+
+        ssize_t n = recv(netlink_fd, resp.buf, sizeof(resp.buf), 0);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -errno;
+        }
+
+        size_t remaining = (size_t)n;
+        for (struct nlmsghdr *h = &resp.align; NLMSG_OK(h, remaining); h = NLMSG_NEXT(h, remaining))
+        {
+            if (h->nlmsg_type != NLMSG_ERROR || h->nlmsg_seq <= b->seq || h->nlmsg_seq > b->seq + b->count)
+            {
+                continue;
+            }
+            const struct nlmsgerr *err = NLMSG_DATA(h);
+            if (err->error != 0 && result == 0)
+            {
+                result = err->error;
+            }
+            acked++;
+        }
     }
 
-    if (recv(netlink_fd, &response, sizeof(response), 0) != sizeof(response))
+    return result;
+}
+
+// Configure a device through `netlink_fd`, which is opened for the purpose
+// if it is -1, and whose requests are then numbered from *seq
+static int configure(int netlink_fd, uint32_t *seq, const char *name, const struct create_tun_request_t *msg)
+{
+    struct in6_addr addr, dstaddr, netmask;
+    static const struct in6_addr zero_addr = {0};
+    bool has_addr = msg->addr[0] != '\0';
+
+    if (has_addr)
     {
-        int err = errno;
-        close(netlink_fd);
-        return -err;
+        if (inet_pton(AF_INET6, msg->addr, &addr) != 1)
+        {
+            return -EINVAL;
+        }
+        if (inet_pton(AF_INET6, msg->dstaddr, &dstaddr) != 1)
+        {
+            return -EINVAL;
+        }
+        if (inet_pton(AF_INET6, msg->netmask, &netmask) != 1)
+        {
+            return -EINVAL;
+        }
     }
-    if (response.content.error != 0)
+
+    unsigned ifindex = if_nametoindex(name);
+    TUNDRA_PROBE2(configure_entry, name, ifindex);
+    if (ifindex == 0)
     {
-        close(netlink_fd);
-        return response.content.error;
+        return -errno;
+    }
+
+    struct nl_batch batch = {.len = 0, .count = 0, .seq = seq != NULL ? *seq : 0};
+
+    // Set IPv6 address
+    if (has_addr)
+    {
+        struct ifaddrmsg set_addr = {
+            .ifa_family = AF_INET6,
+            .ifa_prefixlen = netmask_to_prefixlen(&netmask),
+            .ifa_index = ifindex};
+
+        struct nlmsghdr *header = nl_batch_add(&batch, RTM_NEWADDR, &set_addr, sizeof(set_addr));
+        if (header == NULL || nl_batch_attr(&batch, header, IFA_LOCAL, &addr, sizeof(addr)) < 0)
+        {
+            return -ENOBUFS;
+        }
+        if (memcmp(&dstaddr, &zero_addr, sizeof(dstaddr)) != 0 &&
+            nl_batch_attr(&batch, header, IFA_ADDRESS, &dstaddr, sizeof(dstaddr)) < 0)
+        {
+            return -ENOBUFS;
+        }
     }
 
     // Set MTU and bring interface up
-    struct
+    struct ifinfomsg set_link = {
+        .ifi_family = AF_UNSPEC,
+        .ifi_index = ifindex,
+        .ifi_change = IFF_UP,
+        .ifi_flags = IFF_UP};
+
+    struct nlmsghdr *header = nl_batch_add(&batch, RTM_SETLINK, &set_link, sizeof(set_link));
+    if (header == NULL)
+    {
+        return -ENOBUFS;
+    }
+    if (msg->mtu > 0 && nl_batch_attr(&batch, header, IFLA_MTU, &msg->mtu, sizeof(msg->mtu)) < 0)
+    {
+        return -ENOBUFS;
+    }
+    if (msg->txqueuelen > 0 &&
+        nl_batch_attr(&batch, header, IFLA_TXQLEN, &msg->txqueuelen, sizeof(msg->txqueuelen)) < 0)
     {
-        struct nlmsghdr header;
-        struct ifinfomsg content;
-        char attributes_buf[RTA_LENGTH(sizeof(msg->mtu))];
-    } set_mtu = {0};
+        return -ENOBUFS;
+    }
 
-    set_mtu.header.nlmsg_len = NLMSG_LENGTH(sizeof(set_mtu.content));
-    set_mtu.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-    set_mtu.header.nlmsg_type = RTM_SETLINK;
-    set_mtu.header.nlmsg_seq = 2;
+    int own_fd = -1;
+    if (netlink_fd < 0 && (netlink_fd = own_fd = nl_open()) < 0)
+    {
+        return netlink_fd;
+    }
 
-    set_mtu.content.ifi_index = if_nametoindex(name);
-    set_mtu.content.ifi_family = AF_UNSPEC;
-    set_mtu.content.ifi_change = IFF_UP;
-    set_mtu.content.ifi_flags = IFF_UP;
+    int result = nl_batch_commit(netlink_fd, &batch);
+    TUNDRA_PROBE3(configure_commit, name, batch.count, -result);
+    if (seq != NULL)
+    {
+        *seq += batch.count;
+    }
+    if (own_fd >= 0)
+    {
+        close(own_fd);
+    }
+    return result;
+}
 
-    request_attr = (struct rtattr *)(((char *)&set_mtu) +
-                                     NLMSG_ALIGN(set_mtu.header.nlmsg_len));
-    request_attr->rta_type = IFLA_MTU;
-    request_attr->rta_len = RTA_LENGTH(sizeof(msg->mtu));
-    set_mtu.header.nlmsg_len += request_attr->rta_len;
-    memcpy(RTA_DATA(request_attr), &msg->mtu, sizeof(msg->mtu));
+/*
+ * Configure TUN device - error-returning version
+ *
+ * The address (if any) and the link settings are sent as a single netlink
+ * batch. An empty msg->addr leaves the device unaddressed and an mtu of zero
+ * leaves the kernel default in place; the link is always brought up.
+ *
+ * Returns: 0 on success, -errno on error
+ */
+int tun_configure_safe(const char *name, const struct create_tun_request_t *msg)
+{
+    return configure(-1, NULL, name, msg);
+}
 
-    if (send(netlink_fd, &set_mtu, set_mtu.header.nlmsg_len, 0) !=
-        (ssize_t)set_mtu.header.nlmsg_len)
+/*
+ * Find the interface of a TUN descriptor
+ *
+ * The kernel only gives the name, so the name is looked up and then read
+ * again from the descriptor: if the device was renamed in between, the index
+ * found may be another interface's, and -EAGAIN is returned instead.
+ * Returns: the ifindex on success, -errno on error; -ENOTSUP if the
+ * descriptor is not a TUN device (such as one end of a loopback pair)
+ */
+static int tun_ifindex(int fd)
+{
+    struct ifreq ifr = {0};
+    if (ioctl(fd, TUNGETIFF, (void *)&ifr) == -1)
+    {
+        return errno == ENOTTY ? -ENOTSUP : -errno;
+    }
+    unsigned ifindex = if_nametoindex(ifr.ifr_name);
+    if (ifindex == 0)
+    {
+        return -ENODEV;
+    }
+
+    struct ifreq check = {0};
+    if (ioctl(fd, TUNGETIFF, (void *)&check) == -1)
+    {
+        return -errno;
+    }
+    if (strncmp(ifr.ifr_name, check.ifr_name, IFNAMSIZ) != 0)
+    {
+        return -EAGAIN;
+    }
+    return (int)ifindex;
+}
+
+static bool valid_change(const struct tun_change_t *change)
+{
+    switch (change->op)
+    {
+    case TUN_CHANGE_MTU:
+        return change->value > 0;
+    case TUN_CHANGE_LINK:
+        return change->value == 0 || change->value == 1;
+    case TUN_CHANGE_ADD_ADDRESS:
+    case TUN_CHANGE_REMOVE_ADDRESS:
+    case TUN_CHANGE_ADD_ROUTE:
+    case TUN_CHANGE_REMOVE_ROUTE:
+        return (change->family == AF_INET && change->prefixlen <= 32) ||
+               (change->family == AF_INET6 && change->prefixlen <= 128);
+    default:
+        return false;
+    }
+}
+
+// Append the MTU (if non-zero) and link state (-1 to leave it) to the batch
+static int add_link(struct nl_batch *b, unsigned ifindex, int mtu, int link)
+{
+    struct ifinfomsg set_link = {
+        .ifi_family = AF_UNSPEC,
+        .ifi_index = (int)ifindex,
+        .ifi_change = link == -1 ? 0 : IFF_UP,
+        .ifi_flags = link == 1 ? IFF_UP : 0};
+
+    struct nlmsghdr *header = nl_batch_add(b, RTM_SETLINK, &set_link, sizeof(set_link));
+    if (header == NULL || (mtu > 0 && nl_batch_attr(b, header, IFLA_MTU, &mtu, sizeof(mtu)) < 0))
+    {
+        return -ENOBUFS;
+    }
+    return 0;
+}
+
+// Append an address or route change to the batch
+static int add_change(struct nl_batch *b, unsigned ifindex, const struct tun_change_t *change)
+{
+    size_t addr_len = change->family == AF_INET ? 4 : 16;
+    struct nlmsghdr *header;
+
+    if (change->op == TUN_CHANGE_ADD_ADDRESS || change->op == TUN_CHANGE_REMOVE_ADDRESS)
+    {
+        struct ifaddrmsg ifa = {
+            .ifa_family = (unsigned char)change->family,
+            .ifa_prefixlen = change->prefixlen,
+            .ifa_index = ifindex};
+        bool add = change->op == TUN_CHANGE_ADD_ADDRESS;
+        header = nl_batch_add(b, add ? RTM_NEWADDR : RTM_DELADDR, &ifa, sizeof(ifa));
+        if (header == NULL || nl_batch_attr(b, header, IFA_LOCAL, change->addr, addr_len) < 0)
+        {
+            return -ENOBUFS;
+        }
+    }
+    else
+    {
+        struct rtmsg rt = {
+            .rtm_family = (unsigned char)change->family,
+            .rtm_dst_len = change->prefixlen,
+            .rtm_table = RT_TABLE_MAIN,
+            .rtm_protocol = RTPROT_BOOT,
+            .rtm_scope = RT_SCOPE_LINK,
+            .rtm_type = RTN_UNICAST};
+        bool add = change->op == TUN_CHANGE_ADD_ROUTE;
+        header = nl_batch_add(b, add ? RTM_NEWROUTE : RTM_DELROUTE, &rt, sizeof(rt));
+        if (header == NULL || nl_batch_attr(b, header, RTA_DST, change->addr, addr_len) < 0 ||
+            nl_batch_attr(b, header, RTA_OIF, &ifindex, sizeof(ifindex)) < 0)
+        {
+            return -ENOBUFS;
+        }
+    }
+
+    // An address or route that is already there is an error, as it would be
+    // for ip(8)
+    if (header->nlmsg_type == RTM_NEWADDR || header->nlmsg_type == RTM_NEWROUTE)
+    {
+        header->nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+    }
+    return 0;
+}
+
+// Build and commit the batch of tun_reconfigure_safe in the current
+// namespace
+static int reconfigure(int fd, const struct configure_tun_request_t *msg, int mtu, int link)
+{
+    int ifindex = tun_ifindex(fd);
+    TUNDRA_PROBE2(reconfigure_entry, fd, ifindex);
+    if (ifindex < 0)
+    {
+        return ifindex;
+    }
+
+    struct nl_batch batch = {.len = 0, .count = 0};
+    bool set_link = mtu > 0 || link != -1;
+    if (set_link && link != 0 && add_link(&batch, (unsigned)ifindex, mtu, link) < 0)
+    {
+        return -ENOBUFS;
+    }
+    for (unsigned i = 0; i < msg->count; ++i)
+    {
+        const struct tun_change_t *change = &msg->changes[i];
+        if (change->op != TUN_CHANGE_MTU && change->op != TUN_CHANGE_LINK &&
+            add_change(&batch, (unsigned)ifindex, change) < 0)
+        {
+            return -ENOBUFS;
+        }
+    }
+    if (set_link && link == 0 && add_link(&batch, (unsigned)ifindex, mtu, link) < 0)
+    {
+        return -ENOBUFS;
+    }
+
+    int netlink_fd = nl_open();
+    if (netlink_fd < 0)
+    {
+        return netlink_fd;
+    }
+
+    int result = nl_batch_commit(netlink_fd, &batch);
+    TUNDRA_PROBE3(reconfigure_commit, fd, batch.count, -result);
+    close(netlink_fd);
+    return result;
+}
+
+/*
+ * Change a live TUN device, identified by its descriptor
+ *
+ * Every change is sent in a single netlink batch addressed by ifindex. The
+ * MTU and link state go in one RTM_SETLINK, which comes first when it brings
+ * the link up, so that routes can be added through it, and last when it
+ * takes it down; addresses and routes keep the order they were given in.
+ * The kernel applies the requests in turn, so those before a failure remain.
+ *
+ * Returns: 0 on success, the first error on failure (-errno)
+ */
+int tun_reconfigure_safe(int fd, const struct configure_tun_request_t *msg)
+{
+    if (msg->count > TUN_MAX_CHANGES)
+    {
+        return -EINVAL;
+    }
+
+    int mtu = 0;
+    int link = -1;
+    for (unsigned i = 0; i < msg->count; ++i)
+    {
+        const struct tun_change_t *change = &msg->changes[i];
+        if (!valid_change(change))
+        {
+            return -EINVAL;
+        }
+        if (change->op == TUN_CHANGE_MTU)
+        {
+            mtu = change->value;
+        }
+        else if (change->op == TUN_CHANGE_LINK)
+        {
+            link = change->value;
+        }
+    }
+
+    // A device that was created in, or moved to, another namespace is
+    // changed there (TUNGETDEVNETNS, Linux 5.2 and later)
+    int nsfd = ioctl(fd, TUNGETDEVNETNS);
+    if (nsfd == -1)
+    {
+        return errno == EPERM ? -EPERM : reconfigure(fd, msg, mtu, link);
+    }
+    int result = netns_is_current(nsfd);
+    if (result != 0)
+    {
+        close(nsfd);
+        return result < 0 ? result : reconfigure(fd, msg, mtu, link);
+    }
+
+    int origin;
+    result = netns_enter(nsfd, &origin);
+    close(nsfd);
+    if (result < 0)
+    {
+        return result;
+    }
+    result = reconfigure(fd, msg, mtu, link);
+    int left = netns_leave(origin);
+    return left < 0 ? left : result;
+}
+
+void tun_netns_cache_init(struct tun_netns_cache_t *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+    for (int i = 0; i < TUN_NETNS_CACHE; ++i)
+    {
+        cache->ns[i].nsfd = cache->ns[i].netlink_fd = -1;
+    }
+}
+
+static void netns_release(struct tun_netns_t *ns)
+{
+    if (ns->nsfd != -1)
+    {
+        close(ns->netlink_fd);
+        close(ns->nsfd);
+        ns->nsfd = ns->netlink_fd = -1;
+    }
+}
+
+void tun_netns_cache_clear(struct tun_netns_cache_t *cache)
+{
+    for (int i = 0; i < TUN_NETNS_CACHE; ++i)
+    {
+        netns_release(&cache->ns[i]);
+    }
+}
+
+/*
+ * Find the context of the namespace `nsfd`, creating it (and evicting the
+ * least recently used one if the cache is full) if there is none
+ *
+ * Takes ownership of nsfd: a new context keeps it, and it is closed if the
+ * namespace already has one. Returns: 0 on success, -errno on error
+ */
+int tun_netns_get_safe(struct tun_netns_cache_t *cache, int nsfd, struct tun_netns_t **ns)
+{
+    uint64_t dev, ino;
+    int result = netns_id(nsfd, &dev, &ino);
+    if (result < 0)
+    {
+        close(nsfd);
+        return result;
+    }
+
+    struct tun_netns_t *victim = &cache->ns[0];
+    for (int i = 0; i < TUN_NETNS_CACHE; ++i)
+    {
+        struct tun_netns_t *entry = &cache->ns[i];
+        if (entry->nsfd != -1 && entry->dev == dev && entry->ino == ino)
+        {
+            close(nsfd);
+            entry->used = ++cache->clock;
+            *ns = entry;
+            return 0;
+        }
+        if (entry->nsfd == -1 || (victim->nsfd != -1 && entry->used < victim->used))
+        {
+            victim = entry;
+        }
+    }
+
+    // The netlink socket is opened inside the namespace, where it stays
+    int origin;
+    if ((result = netns_enter(nsfd, &origin)) < 0)
+    {
+        close(nsfd);
+        return result;
+    }
+    int netlink_fd = nl_open();
+    if ((result = netns_leave(origin)) < 0 || netlink_fd < 0)
+    {
+        if (netlink_fd >= 0)
+        {
+            close(netlink_fd);
+        }
+        close(nsfd);
+        return result < 0 ? result : netlink_fd;
+    }
+
+    netns_release(victim);
+    *victim = (struct tun_netns_t){
+        .nsfd = nsfd, .netlink_fd = netlink_fd, .seq = 0, .dev = dev, .ino = ino, .used = ++cache->clock};
+    *ns = victim;
+    return 0;
+}
+
+/*
+ * Create and configure a TUN device inside a namespace
+ *
+ * The calling thread enters the namespace to open /dev/net/tun and look up
+ * the new interface, and configures it through the context's netlink socket.
+ * Returns: fd on success, -errno on error; the thread is back in its own
+ * namespace either way, unless returning to it failed.
+ */
+int tun_create_netns_safe(struct tun_netns_t *ns, const struct create_tun_request_t *msg,
+                          struct create_tun_response_t *resp)
+{
+    int origin;
+    int result = netns_enter(ns->nsfd, &origin);
+    if (result < 0)
+    {
+        return result;
+    }
+
+    int tun = tun_create_safe(resp);
+    if (tun >= 0 && (result = configure(ns->netlink_fd, &ns->seq, resp->name, msg)) < 0)
+    {
+        close(tun);
+        tun = result;
+    }
+
+    if ((result = netns_leave(origin)) < 0)
+    {
+        if (tun >= 0)
+        {
+            close(tun);
+        }
+        return result;
+    }
+    return tun;
+}
+
+/*
+ * Configure an existing device inside a namespace, as tun_configure_safe
+ * Returns: 0 on success, -errno on error
+ */
+int tun_configure_netns_safe(struct tun_netns_t *ns, const char *name, const struct create_tun_request_t *msg)
+{
+    int origin;
+    int result = netns_enter(ns->nsfd, &origin);
+    if (result < 0)
+    {
+        return result;
+    }
+
+    // Only the name lookup needs the namespace, but it is cheaper to stay
+    // than to leave and come back
+    result = configure(ns->netlink_fd, &ns->seq, name, msg);
+    int left = netns_leave(origin);
+    return left < 0 ? left : result;
+}
+
+// Copy the attributes of an RTM_NEWLINK message that both link statistics and
+// link events report
+static void parse_link(const struct nlmsghdr *h, char *name, unsigned *mtu,
+                       unsigned *txqlen, struct rtnl_link_stats64 *stats)
+{
+    const struct ifinfomsg *info = NLMSG_DATA(h);
+    int len = (int)IFLA_PAYLOAD(h);
+    for (const struct rtattr *attr = IFLA_RTA(info); RTA_OK(attr, len); attr = RTA_NEXT(attr, len))
+    {
+        size_t size = RTA_PAYLOAD(attr);
+        switch (attr->rta_type)
+        {
+        case IFLA_IFNAME:
+            size = size < IF_NAMESIZE ? size : IF_NAMESIZE - 1;
+            memcpy(name, RTA_DATA(attr), size);
+            name[size] = '\0';
+            break;
+        case IFLA_MTU:
+            if (size >= sizeof(*mtu))
+            {
+                memcpy(mtu, RTA_DATA(attr), sizeof(*mtu));
+            }
+            break;
+        case IFLA_TXQLEN:
+            if (txqlen != NULL && size >= sizeof(*txqlen))
+            {
+                memcpy(txqlen, RTA_DATA(attr), sizeof(*txqlen));
+            }
+            break;
+        case IFLA_STATS64:
+            // Older kernels send a shorter structure
+            if (stats != NULL)
+            {
+                memcpy(stats, RTA_DATA(attr), size < sizeof(*stats) ? size : sizeof(*stats));
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static int compare_link_names(const void *a, const void *b)
+{
+    return strcmp(((const struct tun_link_stats_t *)a)->name,
+                  ((const struct tun_link_stats_t *)b)->name);
+}
+
+/*
+ * Fetch the counters and settings of the named interfaces
+ *
+ * Every interface is read with a single RTM_GETLINK dump, however many are
+ * asked for, rather than one request per name. The array is sorted by name;
+ * an interface that does not exist is left with an ifindex of zero.
+ *
+ * Returns: 0 on success, -errno on error
+ */
+int tun_link_stats_safe(struct tun_link_stats_t *links, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        char name[IF_NAMESIZE];
+        memcpy(name, links[i].name, sizeof(name));
+        memset(&links[i], 0, sizeof(links[i]));
+        memcpy(links[i].name, name, sizeof(name));
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+    qsort(links, n, sizeof(*links), compare_link_names);
+
+    struct nl_batch batch = {.len = 0, .count = 0};
+    struct ifinfomsg get_link = {.ifi_family = AF_UNSPEC};
+    struct nlmsghdr *header = nl_batch_add(&batch, RTM_GETLINK, &get_link, sizeof(get_link));
+    if (header == NULL)
+    {
+        return -ENOBUFS;
+    }
+    header->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+
+    // The kernel fills each dump datagram up to 32KiB, truncating it if the
+    // buffer is smaller
+    size_t size = 32768;
+    char *buf = malloc(size);
+    if (buf == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    int result = 0;
+    int netlink_fd = nl_open();
+    if (netlink_fd < 0)
+    {
+        result = netlink_fd;
+        goto cleanup;
+    }
+    if (send(netlink_fd, batch.u.buf, batch.len, 0) != (ssize_t)batch.len)
+    {
+        result = -errno;
+        goto cleanup;
+    }
+
+    for (bool done = false; !done;)
+    {
+        ssize_t received = recv(netlink_fd, buf, size, 0);
+        if (received == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            result = -errno;
+            goto cleanup;
+        }
+
+        size_t remaining = (size_t)received;
+        for (struct nlmsghdr *h = (struct nlmsghdr *)buf; NLMSG_OK(h, remaining); h = NLMSG_NEXT(h, remaining))
+        {
+            if (h->nlmsg_seq != header->nlmsg_seq)
+            {
+                continue;
+            }
+            if (h->nlmsg_type == NLMSG_DONE)
+            {
+                done = true;
+                break;
+            }
+            if (h->nlmsg_type == NLMSG_ERROR)
+            {
+                const struct nlmsgerr *err = NLMSG_DATA(h);
+                result = err->error != 0 ? err->error : -EIO;
+                goto cleanup;
+            }
+            if (h->nlmsg_type != RTM_NEWLINK)
+            {
+                continue;
+            }
+
+            struct tun_link_stats_t key = {.name = {0}};
+            unsigned mtu = 0, txqlen = 0;
+            struct rtnl_link_stats64 stats = {0};
+            parse_link(h, key.name, &mtu, &txqlen, &stats);
+            struct tun_link_stats_t *link = bsearch(&key, links, n, sizeof(*links), compare_link_names);
+            if (link == NULL)
+            {
+                continue;
+            }
+
+            const struct ifinfomsg *info = NLMSG_DATA(h);
+            link->ifindex = (unsigned)info->ifi_index;
+            link->flags = info->ifi_flags;
+            link->mtu = mtu;
+            link->txqlen = txqlen;
+            link->rx_packets = stats.rx_packets;
+            link->tx_packets = stats.tx_packets;
+            link->rx_bytes = stats.rx_bytes;
+            link->tx_bytes = stats.tx_bytes;
+            link->rx_errors = stats.rx_errors;
+            link->tx_errors = stats.tx_errors;
+            link->rx_dropped = stats.rx_dropped;
+            link->tx_dropped = stats.tx_dropped;
+        }
+    }
+
+cleanup:
+    if (netlink_fd >= 0)
     {
-        int err = errno;
         close(netlink_fd);
-        return -err;
     }
-    if (recv(netlink_fd, &response, sizeof(response), 0) != sizeof(response))
+    free(buf);
+    return result;
+}
+
+/*
+ * Open a netlink socket subscribed to RTNLGRP_LINK, which the kernel notifies
+ * of every interface that is added, removed or changed
+ * Returns: the non-blocking socket on success, -errno on error
+ */
+int tun_link_monitor_safe(void)
+{
+    int netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if (netlink_fd == -1)
+    {
+        return -errno;
+    }
+
+    struct sockaddr_nl sockaddr = {.nl_family = AF_NETLINK, .nl_groups = RTMGRP_LINK};
+    if (bind(netlink_fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
     {
         int err = errno;
         close(netlink_fd);
         return -err;
     }
-    if (response.content.error != 0)
+
+    return netlink_fd;
+}
+
+/*
+ * Read the pending notifications from a socket opened by
+ * tun_link_monitor_safe, up to `max` of them
+ *
+ * The kernel sends one notification per datagram, so none is lost by
+ * stopping at `max`. Returns: the number of events read, which is zero if
+ * none was pending, or -errno on error. -ENOBUFS means that notifications
+ * were dropped because the socket's buffer was full, and that the caller
+ * should resynchronise.
+ */
+int tun_link_events_safe(int fd, struct tun_link_event_t *events, int max)
+{
+    union
     {
-        close(netlink_fd);
-        return response.content.error;
-    }
+        struct nlmsghdr align;
+        char buf[8192];
+    } msg;
 
-    close(netlink_fd);
-    return 0;
+    int count = 0;
+    while (count < max)
+    {
+        ssize_t received = recv(fd, msg.buf, sizeof(msg.buf), MSG_DONTWAIT);
+        if (received == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -errno;
+        }
+
+        size_t remaining = (size_t)received;
+        for (struct nlmsghdr *h = &msg.align; NLMSG_OK(h, remaining) && count < max;
+             h = NLMSG_NEXT(h, remaining))
+        {
+            if (h->nlmsg_type != RTM_NEWLINK && h->nlmsg_type != RTM_DELLINK)
+            {
+                continue;
+            }
+
+            const struct ifinfomsg *info = NLMSG_DATA(h);
+            struct tun_link_event_t *ev = &events[count++];
+            memset(ev, 0, sizeof(*ev));
+            ev->ifindex = (unsigned)info->ifi_index;
+            ev->flags = info->ifi_flags;
+            ev->removed = h->nlmsg_type == RTM_DELLINK;
+            parse_link(h, ev->name, &ev->mtu, NULL, NULL);
+        }
+    }
+    return count;
 }
 
-// Server-facing wrapper that exits on error
-int tun_create(struct response_t *resp)
+// Server-facing: create a device for the client `uid` and configure it
+//
+// The device is owned by the client, as one it had made persistent itself
+// would be, which is what later lets it change the device (see tun_configure).
+int tun_create(const struct create_tun_request_t *msg, uid_t uid, struct response_t *resp)
 {
-    int result = tun_create_safe(&resp->msg.create_tun);
+    resp->type = REQUEST_TYPE_CREATE_TUN;
+    int fd = tun_create_safe(&resp->msg.create_tun);
+    if (fd < 0)
+    {
+        return fd;
+    }
+    int result = ioctl(fd, TUNSETOWNER, (unsigned long)uid) == -1 ? -errno : 0;
+    if (result == 0)
+    {
+        result = tun_configure_safe(resp->msg.create_tun.name, msg);
+    }
     if (result < 0)
     {
-        errno = -result;
-        exit_error("tun_create_safe");
+        close(fd);
+        return result;
     }
+    return fd;
+}
+
+// Server-facing: create a device in the namespace `nsfd`, passed by the
+// client `uid`, which the cache takes
+//
+// The server enters the namespace with its own privileges, so a descriptor
+// alone proves nothing: namespaces under /run/netns can be opened by anyone.
+// Only a namespace that the client owns, through the user namespace it
+// belongs to, is entered, unless the client is root and could enter any.
+int tun_create_netns(struct tun_netns_cache_t *cache, int nsfd, uid_t uid, const struct create_tun_request_t *msg,
+                     struct response_t *resp)
+{
     resp->type = REQUEST_TYPE_CREATE_TUN;
-    return result;
+    uid_t owner;
+    int result = netns_owner(nsfd, &owner);
+    if (result == 0 && uid != 0 && owner != uid)
+    {
+        result = -EPERM;
+    }
+    if (result < 0)
+    {
+        close(nsfd);
+        return result;
+    }
+
+    struct tun_netns_t *ns;
+    result = tun_netns_get_safe(cache, nsfd, &ns);
+    return result < 0 ? result : tun_create_netns_safe(ns, msg, &resp->msg.create_tun);
+}
+
+// Whether the device `name` in the server's namespace is owned by `uid`
+// Returns: 0 if it is, -EPERM if not (or it has no owner), -ENODEV if there
+// is no such device
+static int device_owned(const char *name, uid_t uid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/class/net/%.*s/owner", IFNAMSIZ - 1, name);
+
+    long owner = -1;
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return errno == ENOENT ? -ENODEV : -EPERM;
+    }
+    bool owned = fscanf(f, "%ld", &owner) == 1 && owner == (long)uid;
+    fclose(f);
+    return owned ? 0 : -EPERM;
 }
 
-// Server-facing wrapper that exits on error
-void tun_configure(const char *name, struct create_tun_request_t *msg)
+// Server-facing: reopen a persistent device
+//
+// The server runs as root, so the kernel's own owner check does not apply;
+// only devices owned by the requesting user may be attached.
+int tun_attach(const char *name, uid_t uid, struct response_t *resp)
 {
-    int result = tun_configure_safe(name, msg);
+    resp->type = REQUEST_TYPE_ATTACH_TUN;
+    int result = device_owned(name, uid);
+    return result < 0 ? result : tun_attach_safe(name, &resp->msg.attach_tun);
+}
+
+// Whether `uid` may change the device open on `fd` with the server's
+// privileges. In the server's namespace the device must be the client's own,
+// and may not be given a route or address covering everything (prefix length
+// 0), which would take the traffic of the whole host. In another namespace it
+// is enough that the client owns the namespace, as for tun_create_netns: the
+// client could make any change there itself.
+static int may_configure(int fd, uid_t uid, const struct configure_tun_request_t *msg)
+{
+    int nsfd = ioctl(fd, TUNGETDEVNETNS);
+    if (nsfd == -1 && errno == EPERM)
+    {
+        return -EPERM;
+    }
+    if (nsfd != -1)
+    {
+        uid_t owner;
+        int result = netns_is_current(nsfd);
+        if (result == 0)
+        {
+            result = netns_owner(nsfd, &owner);
+            if (result == 0 && owner != uid)
+            {
+                result = -EPERM;
+            }
+            close(nsfd);
+            return result;
+        }
+        close(nsfd);
+        if (result < 0)
+        {
+            return result;
+        }
+    }
+
+    // As in tun_ifindex, a rename between reading the name and the owner
+    // could make the owner another device's
+    struct ifreq ifr = {0};
+    struct ifreq check = {0};
+    if (ioctl(fd, TUNGETIFF, (void *)&ifr) == -1)
+    {
+        return errno == ENOTTY ? -ENOTSUP : -errno;
+    }
+    int result = device_owned(ifr.ifr_name, uid);
     if (result < 0)
     {
-        errno = -result;
-        exit_error("tun_configure_safe");
+        return result;
     }
+    if (ioctl(fd, TUNGETIFF, (void *)&check) == -1)
+    {
+        return -errno;
+    }
+    if (strncmp(ifr.ifr_name, check.ifr_name, IFNAMSIZ) != 0)
+    {
+        return -EAGAIN;
+    }
+
+    for (unsigned i = 0; i < msg->count && i < TUN_MAX_CHANGES; ++i)
+    {
+        const struct tun_change_t *change = &msg->changes[i];
+        bool prefixed = change->op != TUN_CHANGE_MTU && change->op != TUN_CHANGE_LINK;
+        if (prefixed && change->prefixlen == 0)
+        {
+            return -EPERM;
+        }
+    }
+    return 0;
+}
+
+// Server-facing: change the device open on `fd`, passed by the client `uid`
+//
+// The server makes the changes with its own privileges, so, as with a
+// namespace, holding the descriptor proves nothing by itself. Root may
+// change any device.
+int tun_configure(int fd, uid_t uid, const struct configure_tun_request_t *msg, struct response_t *resp)
+{
+    resp->type = REQUEST_TYPE_CONFIGURE_TUN;
+    resp->msg.configure_tun.size = sizeof(resp->msg.configure_tun);
+    int result = uid == 0 ? 0 : may_configure(fd, uid, msg);
+    return result < 0 ? result : tun_reconfigure_safe(fd, msg);
 }
 
 #endif // __linux__
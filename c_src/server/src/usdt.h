@@ -0,0 +1,79 @@
+#ifndef TUNDRA_USDT_H
+#define TUNDRA_USDT_H
+
+/*
+ * usdt.h - Userland statically defined tracepoints
+ *
+ * Each probe compiles to a nop plus an ELF note in the .note.stapsdt section,
+ * in the format used by SystemTap's <sys/sdt.h>, so bpftrace, perf and bcc can
+ * attach to a running NIF or server without recompiling and without a runtime
+ * dependency. All probes belong to the "tundra" provider and take up to three
+ * arguments, each passed as a signed 64-bit value; pointer arguments such as
+ * device names can be read with str() in bpftrace.
+ *
+ * Probes are compiled in on Linux x86_64 and aarch64 unless TUNDRA_NO_USDT is
+ * defined; elsewhere they expand to nothing. Arguments are evaluated even when
+ * no tracer is attached, so keep them cheap.
+ *
+ * The probes and their arguments are listed in bpftrace/README.md.
+ */
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__)) && !defined(TUNDRA_NO_USDT)
+
+#include <stdint.h>
+
+#define TUNDRA_USDT_NOTE(name, args)                                      \
+    "990: nop\n"                                                          \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                         \
+    ".balign 4\n"                                                         \
+    ".4byte 992f-991f,994f-993f,3\n"                                      \
+    "991: .asciz \"stapsdt\"\n"                                           \
+    "992: .balign 4\n"                                                    \
+    "993: .8byte 990b\n"                                                  \
+    ".8byte _.stapsdt.base\n"                                             \
+    ".8byte 0\n"                                                          \
+    ".asciz \"tundra\"\n"                                                 \
+    ".asciz \"" #name "\"\n"                                              \
+    ".asciz \"" args "\"\n"                                               \
+    "994: .balign 4\n"                                                    \
+    ".popsection\n"                                                       \
+    ".ifndef _.stapsdt.base\n"                                            \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"                                              \
+    ".hidden _.stapsdt.base\n"                                            \
+    "_.stapsdt.base: .space 1\n"                                          \
+    ".size _.stapsdt.base,1\n"                                            \
+    ".popsection\n"                                                       \
+    ".endif\n"
+
+#define TUNDRA_USDT_ARG(x) "nor"((int64_t)(x))
+
+#define TUNDRA_PROBE0(name) \
+    __asm__ __volatile__(TUNDRA_USDT_NOTE(name, ""))
+
+#define TUNDRA_PROBE1(name, a0)                             \
+    __asm__ __volatile__(TUNDRA_USDT_NOTE(name, "-8@%[arg0]") \
+                         :                                  \
+                         : [arg0] TUNDRA_USDT_ARG(a0))
+
+#define TUNDRA_PROBE2(name, a0, a1)                                     \
+    __asm__ __volatile__(TUNDRA_USDT_NOTE(name, "-8@%[arg0] -8@%[arg1]") \
+                         :                                              \
+                         : [arg0] TUNDRA_USDT_ARG(a0), [arg1] TUNDRA_USDT_ARG(a1))
+
+#define TUNDRA_PROBE3(name, a0, a1, a2)                                            \
+    __asm__ __volatile__(TUNDRA_USDT_NOTE(name, "-8@%[arg0] -8@%[arg1] -8@%[arg2]") \
+                         :                                                         \
+                         : [arg0] TUNDRA_USDT_ARG(a0), [arg1] TUNDRA_USDT_ARG(a1),   \
+                           [arg2] TUNDRA_USDT_ARG(a2))
+
+#else
+
+#define TUNDRA_PROBE0(name) ((void)0)
+#define TUNDRA_PROBE1(name, a0) ((void)(a0))
+#define TUNDRA_PROBE2(name, a0, a1) ((void)(a0), (void)(a1))
+#define TUNDRA_PROBE3(name, a0, a1, a2) ((void)(a0), (void)(a1), (void)(a2))
+
+#endif
+
+#endif
@@ -41,6 +41,56 @@ fi
 echo "Server started (PID: $SERVER_PID)"
 echo
 
+# test_client exits with the errno value a request was refused with
+expect_status() {
+    EXPECTED=$1
+    shift
+    STATUS=0
+    "$@" || STATUS=$?
+    if [ "$STATUS" -ne "$EXPECTED" ]; then
+        echo "Error: expected status $EXPECTED, got $STATUS"
+        kill $SERVER_PID
+        exit 1
+    fi
+}
+
+expect_eperm() {
+    expect_status 1 "$@"
+}
+
+# A client of another protocol version is answered with EPROTO (71 on Linux,
+# 100 on Darwin) rather than left waiting
+echo "Checking that another protocol version is refused..."
+if [ "$(uname -s)" = "Linux" ]; then EPROTO=71; else EPROTO=100; fi
+expect_status $EPROTO ./test_client --protocol-version 1
+echo
+
+# A namespace is only entered for the user that owns it (Linux). Check as an
+# unprivileged member of the tundra group, with the descriptor opened here.
+if [ "$(uname -s)" = "Linux" ] && command -v setpriv >/dev/null; then
+    AS_MEMBER="setpriv --reuid=nobody --regid=tundra --clear-groups"
+
+    echo "Checking that another user's namespace is refused..."
+    expect_eperm $AS_MEMBER ./test_client --netns-fd 3 3</proc/self/ns/net
+
+    if $AS_MEMBER unshare -Un true 2>/dev/null; then
+        echo "Checking that the user's own namespace is accepted..."
+        $AS_MEMBER unshare -Un sh -c './test_client --netns-fd 3 3</proc/self/ns/net'
+    fi
+
+    # Likewise a device is only changed for the user that owns it, and never
+    # given a route covering everything in the host's namespace
+    echo "Checking that a route through the user's own device is added..."
+    $AS_MEMBER ./test_client --configure 64
+
+    echo "Checking that a default route is refused..."
+    expect_eperm $AS_MEMBER ./test_client --configure 0
+
+    echo "Checking that another user's device is refused..."
+    expect_eperm ./test_client --configure-as "$(id -u nobody)"
+    echo
+fi
+
 # Run test client
 echo "Running test client..."
 echo "Note: The test will keep the device alive until you press Enter"
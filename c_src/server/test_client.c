@@ -1,14 +1,30 @@
 /*
  * test_client.c - Simple test client for tundra server
  *
- * Connects to the server and requests a TUN device
+ * Connects to the server and requests a TUN device. With --netns-fd N, asks
+ * for the device inside the network namespace open on descriptor N instead,
+ * reports the outcome and exits with the errno value the server answered
+ * with, or 0 if the device was created.
+ *
+ * With --configure LEN, asks for a route to fd01::/LEN (:: for a LEN of 0)
+ * through the new device, and with --configure-as UID asks for a /64 route
+ * from a second connection made as UID (in the tundra group) instead. Both
+ * exit with the errno value of the CONFIGURE_TUN response.
+ *
+ * With --protocol-version N, sends the request as protocol version N, which
+ * the server refuses with EPROTO unless it is its own.
  */
 
+#define _DEFAULT_SOURCE // setgroups
+
+#include <errno.h>
+#include <grp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include "src/server.h"
 
@@ -18,6 +34,7 @@ static void exit_error(const char *msg)
     exit(1);
 }
 
+// Returns the descriptor passed with the response, or -1 if there is none
 static int recv_fd(int sock, void *buf, size_t sz)
 {
     char cmsgbuf[CMSG_SPACE(sizeof(int))];
@@ -39,7 +56,11 @@ static int recv_fd(int sock, void *buf, size_t sz)
     }
 
     struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    if (cmsg == NULL)
+    {
+        return -1;
+    }
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
     {
         fprintf(stderr, "Invalid control message\n");
         exit(1);
@@ -50,9 +71,34 @@ static int recv_fd(int sock, void *buf, size_t sz)
     return fd;
 }
 
-int main(void)
+// Send a request with a descriptor attached
+static void send_with_fd(int sock, const void *buf, size_t sz, int fd)
+{
+    char cmsgbuf[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = sz
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cmsgbuf,
+        .msg_controllen = sizeof(cmsgbuf)
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+    if (sendmsg(sock, &msg, 0) != (ssize_t)sz)
+    {
+        exit_error("sendmsg");
+    }
+}
+
+static int connect_server(void)
 {
-    // Connect to server
     int sock = socket(AF_UNIX, SOCK_STREAM, 0);
     if (sock == -1)
     {
@@ -67,11 +113,76 @@ int main(void)
     {
         exit_error("connect");
     }
+    return sock;
+}
+
+// Ask for a route to fd01::/prefixlen (:: for 0) through the device on tun_fd
+static int configure_route(int sock, int tun_fd, int prefixlen)
+{
+    struct request_t req = {
+        .header = TUNDRA_MESSAGE_HEADER,
+        .type = REQUEST_TYPE_CONFIGURE_TUN,
+        .msg.configure_tun = {
+            .size = sizeof(struct configure_tun_request_t),
+            .count = 1,
+            .changes[0] = {.op = TUN_CHANGE_ADD_ROUTE, .family = AF_INET6, .prefixlen = (unsigned char)prefixlen}
+        }
+    };
+    inet_pton(AF_INET6, prefixlen == 0 ? "::" : "fd01::", req.msg.configure_tun.changes[0].addr);
+    send_with_fd(sock, &req, sizeof(req), tun_fd);
+
+    struct response_t resp;
+    recv_fd(sock, &resp, sizeof(resp));
+    printf("Route to /%d: %s\n", prefixlen, resp.error == 0 ? "added" : strerror(resp.error));
+    return resp.error;
+}
+
+// Continue as another member of the tundra group, on a new connection
+static int become(uid_t uid)
+{
+    struct group *grp = getgrnam("tundra");
+    if (grp == NULL || setgroups(0, NULL) == -1 || setgid(grp->gr_gid) == -1 || setuid(uid) == -1)
+    {
+        exit_error("become");
+    }
+    return connect_server();
+}
+
+int main(int argc, char **argv)
+{
+    int nsfd = -1;
+    int prefixlen = -1;
+    long as_uid = -1;
+    struct message_header_t header = TUNDRA_MESSAGE_HEADER;
+    if (argc == 3 && strcmp(argv[1], "--netns-fd") == 0)
+    {
+        nsfd = atoi(argv[2]);
+    }
+    else if (argc == 3 && strcmp(argv[1], "--configure") == 0)
+    {
+        prefixlen = atoi(argv[2]);
+    }
+    else if (argc == 3 && strcmp(argv[1], "--configure-as") == 0)
+    {
+        as_uid = atol(argv[2]);
+    }
+    else if (argc == 3 && strcmp(argv[1], "--protocol-version") == 0)
+    {
+        header.version = (uint32_t)atol(argv[2]);
+    }
+    else if (argc != 1)
+    {
+        fprintf(stderr, "usage: %s [--netns-fd N | --configure LEN | --configure-as UID | --protocol-version N]\n", argv[0]);
+        return 1;
+    }
+
+    int sock = connect_server();
 
     printf("Connected to tundra server at %s\n", SVR_PATH);
 
     // Create request
     struct request_t req = {
+        .header = header,
         .type = REQUEST_TYPE_CREATE_TUN,
         .msg.create_tun = {
             .size = sizeof(struct create_tun_request_t),
@@ -85,7 +196,11 @@ int main(void)
     req.msg.create_tun.mtu = 1500;
 
     // Send request
-    if (send(sock, &req, sizeof(req), 0) != sizeof(req))
+    if (nsfd != -1)
+    {
+        send_with_fd(sock, &req, sizeof(req), nsfd);
+    }
+    else if (send(sock, &req, sizeof(req), 0) != sizeof(req))
     {
         exit_error("send");
     }
@@ -95,6 +210,24 @@ int main(void)
     // Receive response
     struct response_t resp;
     int tun_fd = recv_fd(sock, &resp, sizeof(resp));
+    if (tun_fd == -1)
+    {
+        printf("Refused: %s\n", strerror(resp.error));
+        return resp.error;
+    }
+    if (nsfd != -1)
+    {
+        printf("Created %s in the namespace\n", resp.msg.create_tun.name);
+        return 0;
+    }
+    if (prefixlen != -1)
+    {
+        return configure_route(sock, tun_fd, prefixlen);
+    }
+    if (as_uid != -1)
+    {
+        return configure_route(become((uid_t)as_uid), tun_fd, 64);
+    }
 
     printf("Success!\n");
     printf("  Device name: %s\n", resp.msg.create_tun.name);
@@ -0,0 +1,885 @@
+#ifdef __linux__
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "tunnel.h"
+
+struct tunnel_t *tunnel_create(void)
+{
+    struct tunnel_t *t = enif_alloc(sizeof(*t));
+    if (t == NULL)
+    {
+        return NULL;
+    }
+    memset(t, 0, sizeof(*t));
+    if ((t->lock = enif_mutex_create("tundra_tunnel")) == NULL)
+    {
+        enif_free(t);
+        return NULL;
+    }
+    t->closed = true;
+    t->fd = t->sock = -1;
+    t->watch = -1;
+    return t;
+}
+
+void tunnel_destroy(struct tunnel_t *t)
+{
+    if (t == NULL)
+    {
+        return;
+    }
+    // The registration holds the device, so a tunnel is disabled before it
+    // can be freed
+    tunnel_disable(t);
+    enif_mutex_destroy(t->lock);
+    enif_free(t);
+}
+
+void tunnel_get_stats(struct tunnel_t *t, struct tunnel_stats_t *stats)
+{
+    stats->rx_packets = atomic_load_explicit(&t->rx_packets, memory_order_relaxed);
+    stats->rx_bytes = atomic_load_explicit(&t->rx_bytes, memory_order_relaxed);
+    stats->tx_packets = atomic_load_explicit(&t->tx_packets, memory_order_relaxed);
+    stats->tx_bytes = atomic_load_explicit(&t->tx_bytes, memory_order_relaxed);
+    stats->no_route = atomic_load_explicit(&t->no_route, memory_order_relaxed);
+    stats->unknown_peer = atomic_load_explicit(&t->unknown_peer, memory_order_relaxed);
+    stats->auth_failures = atomic_load_explicit(&t->auth_failures, memory_order_relaxed);
+    stats->replays = atomic_load_explicit(&t->replays, memory_order_relaxed);
+    stats->control = atomic_load_explicit(&t->control, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&t->dropped, memory_order_relaxed);
+}
+
+void tunnel_set_owner(struct tunnel_t *t, const ErlNifPid *owner)
+{
+    enif_mutex_lock(t->lock);
+    t->owner = *owner;
+    enif_mutex_unlock(t->lock);
+}
+
+static inline void count(_Atomic uint64_t *counter, uint64_t n)
+{
+    uint64_t cur = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, cur + n, memory_order_relaxed);
+}
+
+#if defined(__linux__) && !defined(TUNDRA_NO_CRYPTO)
+#include <netinet/in.h>
+#include <openssl/evp.h>
+#include "watch.h"
+
+#define BATCH 32 // datagrams per sendmmsg or recvmmsg
+#define ROUNDS 4 // batches each way per wakeup, so that busy devices take turns
+#define TUN_HEADER 4
+#define HEADER 16
+#define TAG 16
+#define MAX_PACKET 65535
+#define BUF_SIZE (HEADER + MAX_PACKET + TAG)
+#define MSG_DATA 4
+#define REPLAY_WORDS 32                           // a window of 2048 counters, less one word
+#define REJECT_AFTER (UINT64_MAX - (1ULL << 13)) // as WireGuard's REJECT_AFTER_MESSAGES
+
+struct replay_t
+{
+    uint64_t top; // the highest counter accepted
+    uint64_t bitmap[REPLAY_WORDS];
+};
+
+struct tunnel_peer_t
+{
+    uint32_t index;
+    uint32_t remote_index;
+    struct sockaddr_storage endpoint;
+    socklen_t endpoint_len; // 0 until known
+    EVP_CIPHER_CTX *tx;
+    EVP_CIPHER_CTX *rx;
+    uint64_t counter;
+    struct replay_t replay;
+    struct tunnel_prefix_t prefixes[TUNNEL_MAX_PREFIXES];
+    unsigned nprefixes;
+    uint64_t gen;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+};
+
+static ErlNifMutex *s_lock; // protects s_bufs
+static tunnel_control_fn s_control;
+static unsigned char (*s_bufs)[BUF_SIZE]; // the watcher thread's, BATCH of them
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static EVP_CIPHER_CTX *key_context(enum tunnel_cipher_t cipher, const unsigned char *key, int enc)
+{
+    const EVP_CIPHER *c = cipher == TUNNEL_AES_256_GCM ? EVP_aes_256_gcm() : EVP_chacha20_poly1305();
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (ctx != NULL && EVP_CipherInit_ex(ctx, c, NULL, key, NULL, enc) != 1)
+    {
+        EVP_CIPHER_CTX_free(ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+static void make_nonce(unsigned char nonce[12], const unsigned char *header)
+{
+    memset(nonce, 0, 4);
+    memcpy(nonce + 4, header + 8, 8);
+}
+
+// Seal the `len` bytes after the header at `buf` in place, authenticating the
+// header too, and append the tag
+static bool seal(EVP_CIPHER_CTX *ctx, unsigned char *buf, size_t len)
+{
+    unsigned char nonce[12];
+    int outl;
+    make_nonce(nonce, buf);
+    return EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce) == 1 &&
+           EVP_EncryptUpdate(ctx, NULL, &outl, buf, HEADER) == 1 &&
+           (len == 0 || EVP_EncryptUpdate(ctx, buf + HEADER, &outl, buf + HEADER, (int)len) == 1) &&
+           EVP_EncryptFinal_ex(ctx, buf + HEADER + len, &outl) == 1 &&
+           EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG, buf + HEADER + len) == 1;
+}
+
+// Open a datagram with `len` bytes between its header and tag in place. The
+// plaintext is not to be used unless this returns true.
+static bool open_sealed(EVP_CIPHER_CTX *ctx, unsigned char *buf, size_t len)
+{
+    unsigned char nonce[12];
+    int outl;
+    make_nonce(nonce, buf);
+    return EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) == 1 &&
+           EVP_DecryptUpdate(ctx, NULL, &outl, buf, HEADER) == 1 &&
+           (len == 0 || EVP_DecryptUpdate(ctx, buf + HEADER, &outl, buf + HEADER, (int)len) == 1) &&
+           EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TAG, buf + HEADER + len) == 1 &&
+           EVP_DecryptFinal_ex(ctx, buf + HEADER + len, &outl) == 1;
+}
+
+// Whether a counter may be accepted: neither seen already nor too far behind
+// the highest seen (RFC 6479). Checked before opening, updated after.
+static bool replay_check(const struct replay_t *r, uint64_t counter)
+{
+    if (counter >= REJECT_AFTER || counter + (REPLAY_WORDS - 1) * 64 < r->top)
+    {
+        return false;
+    }
+    if (counter > r->top)
+    {
+        return true;
+    }
+    return !(r->bitmap[(counter >> 6) % REPLAY_WORDS] & 1ULL << (counter & 63));
+}
+
+static void replay_update(struct replay_t *r, uint64_t counter)
+{
+    uint64_t index = counter >> 6;
+    if (counter > r->top)
+    {
+        uint64_t current = r->top >> 6;
+        uint64_t diff = index - current < REPLAY_WORDS ? index - current : REPLAY_WORDS;
+        for (uint64_t i = 1; i <= diff; ++i)
+        {
+            r->bitmap[(current + i) % REPLAY_WORDS] = 0;
+        }
+        r->top = counter;
+    }
+    r->bitmap[index % REPLAY_WORDS] |= 1ULL << (counter & 63);
+}
+
+// The family and the source or destination address of an IP packet, or 0 if
+// it is not one
+static int packet_addr(const unsigned char *ip, size_t len, bool dst, const unsigned char **addr)
+{
+    if (len >= 20 && ip[0] >> 4 == 4)
+    {
+        *addr = ip + (dst ? 16 : 12);
+        return AF_INET;
+    }
+    if (len >= 40 && ip[0] >> 4 == 6)
+    {
+        *addr = ip + (dst ? 24 : 8);
+        return AF_INET6;
+    }
+    return 0;
+}
+
+static bool prefix_match(const struct tunnel_prefix_t *p, int family, const unsigned char *addr)
+{
+    unsigned bytes = p->prefixlen / 8, bits = p->prefixlen % 8;
+    return p->family == family && memcmp(p->addr, addr, bytes) == 0 &&
+           (bits == 0 || ((p->addr[bytes] ^ addr[bytes]) & (0xff << (8 - bits)) & 0xff) == 0);
+}
+
+// The peer whose prefixes best match a packet's destination; of two with the
+// same prefix, the one set last
+static struct tunnel_peer_t *route(struct tunnel_t *t, const unsigned char *ip, size_t len)
+{
+    const unsigned char *addr;
+    int family = packet_addr(ip, len, true, &addr);
+    struct tunnel_peer_t *best = NULL;
+    int best_len = -1;
+    for (unsigned i = 0; family != 0 && i < t->npeers; ++i)
+    {
+        struct tunnel_peer_t *p = &t->peers[i];
+        for (unsigned j = 0; j < p->nprefixes; ++j)
+        {
+            int plen = p->prefixes[j].prefixlen;
+            if ((plen > best_len || (plen == best_len && p->gen > best->gen)) &&
+                prefix_match(&p->prefixes[j], family, addr))
+            {
+                best = p;
+                best_len = plen;
+            }
+        }
+    }
+    return best;
+}
+
+// Whether a packet from a peer has a source address it may use
+static bool allowed(const struct tunnel_peer_t *p, const unsigned char *ip, size_t len)
+{
+    const unsigned char *addr;
+    int family = packet_addr(ip, len, false, &addr);
+    for (unsigned i = 0; family != 0 && i < p->nprefixes; ++i)
+    {
+        if (prefix_match(&p->prefixes[i], family, addr))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static struct tunnel_peer_t *find_peer(struct tunnel_t *t, uint32_t index)
+{
+    for (unsigned i = 0; i < t->npeers; ++i)
+    {
+        if (t->peers[i].index == index)
+        {
+            return &t->peers[i];
+        }
+    }
+    return NULL;
+}
+
+// An address to send to from the tunnel's socket: IPv4 addresses are mapped
+// for a dual-stack socket
+static int socket_addr(const struct tunnel_t *t, const struct sockaddr_storage *in, struct sockaddr_storage *out,
+                       socklen_t *len)
+{
+    if (in->ss_family == t->family)
+    {
+        *out = *in;
+        *len = t->family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        return 0;
+    }
+    if (in->ss_family == AF_INET && t->family == AF_INET6)
+    {
+        const struct sockaddr_in *v4 = (const struct sockaddr_in *)in;
+        struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)out;
+        memset(out, 0, sizeof(*out));
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = v4->sin_port;
+        v6->sin6_addr.s6_addr[10] = v6->sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&v6->sin6_addr.s6_addr[12], &v4->sin_addr, 4);
+        *len = sizeof(*v6);
+        return 0;
+    }
+    return -EAFNOSUPPORT;
+}
+
+// Send the datagrams sealed by egress. A datagram the socket refuses is
+// dropped; when it is out of room, so are the rest.
+static void send_batch(struct tunnel_t *t, struct mmsghdr *msgs, struct tunnel_peer_t **to, unsigned n)
+{
+    unsigned sent = 0;
+    while (sent < n)
+    {
+        int r = sendmmsg(t->sock, msgs + sent, n - sent, MSG_DONTWAIT);
+        if (r == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (r == -1)
+        {
+            bool full = errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS;
+            count(&t->dropped, full ? n - sent : 1);
+            sent = full ? n : sent + 1;
+            continue;
+        }
+        for (unsigned i = sent; i < sent + (unsigned)r; ++i)
+        {
+            uint64_t bytes = msgs[i].msg_hdr.msg_iov->iov_len - HEADER - TAG;
+            to[i]->tx_packets++;
+            to[i]->tx_bytes += bytes;
+            count(&t->tx_packets, 1);
+            count(&t->tx_bytes, bytes);
+        }
+        sent += (unsigned)r;
+    }
+}
+
+// Device to peers. Each packet is read in place after room for the datagram
+// header, which then overwrites its TUN header.
+static void egress(struct tunnel_t *t)
+{
+    struct mmsghdr msgs[BATCH];
+    struct iovec iovs[BATCH];
+    struct tunnel_peer_t *to[BATCH];
+    for (int round = 0; round < ROUNDS && !t->rx_eof; ++round)
+    {
+        unsigned n = 0;
+        bool more = true;
+        while (n < BATCH)
+        {
+            unsigned char *buf = s_bufs[n];
+            ssize_t len = read(t->fd, buf + HEADER - TUN_HEADER, TUN_HEADER + MAX_PACKET);
+            if (len == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (len <= 0)
+            {
+                // As in memring.c, stop reading a device that has hung up
+                t->rx_eof = len == 0 || errno != EAGAIN;
+                more = false;
+                break;
+            }
+            size_t iplen = (size_t)len > TUN_HEADER ? (size_t)len - TUN_HEADER : 0;
+            struct tunnel_peer_t *peer = route(t, buf + HEADER, iplen);
+            if (peer == NULL)
+            {
+                count(&t->no_route, 1);
+                continue;
+            }
+            if (peer->endpoint_len == 0 || peer->counter >= REJECT_AFTER)
+            {
+                count(&t->dropped, 1);
+                continue;
+            }
+            buf[0] = MSG_DATA;
+            buf[1] = buf[2] = buf[3] = 0;
+            put_le32(buf + 4, peer->remote_index);
+            put_le64(buf + 8, peer->counter++);
+            if (!seal(peer->tx, buf, iplen))
+            {
+                count(&t->dropped, 1);
+                continue;
+            }
+            iovs[n] = (struct iovec){.iov_base = buf, .iov_len = HEADER + iplen + TAG};
+            msgs[n].msg_hdr = (struct msghdr){.msg_name = &peer->endpoint,
+                                              .msg_namelen = peer->endpoint_len,
+                                              .msg_iov = &iovs[n],
+                                              .msg_iovlen = 1};
+            to[n++] = peer;
+        }
+        send_batch(t, msgs, to, n);
+        if (!more)
+        {
+            break;
+        }
+    }
+}
+
+// Check, open and deliver one datagram, whose plaintext is left in place for
+// its TUN header to be written in front of it
+static void receive(struct tunnel_t *t, void *resource, unsigned char *buf, size_t len,
+                    const struct sockaddr_storage *from, socklen_t from_len)
+{
+    if (len > 0 && buf[0] != MSG_DATA)
+    {
+        count(&t->control, 1);
+        s_control(resource, &t->owner, from, buf, len);
+        return;
+    }
+    if (len < HEADER + TAG || (buf[1] | buf[2] | buf[3]) != 0)
+    {
+        count(&t->dropped, 1);
+        return;
+    }
+    struct tunnel_peer_t *peer = find_peer(t, get_le32(buf + 4));
+    if (peer == NULL)
+    {
+        count(&t->unknown_peer, 1);
+        return;
+    }
+    uint64_t counter = get_le64(buf + 8);
+    if (!replay_check(&peer->replay, counter))
+    {
+        count(&t->replays, 1);
+        return;
+    }
+    size_t plen = len - HEADER - TAG;
+    if (!open_sealed(peer->rx, buf, plen))
+    {
+        count(&t->auth_failures, 1);
+        return;
+    }
+    replay_update(&peer->replay, counter);
+
+    // Roam to wherever the peer's latest authentic datagram came from
+    memcpy(&peer->endpoint, from, from_len);
+    peer->endpoint_len = from_len;
+    if (plen == 0)
+    {
+        return; // keepalive
+    }
+
+    const unsigned char *ip = buf + HEADER;
+    if (!allowed(peer, ip, plen))
+    {
+        count(&t->dropped, 1);
+        return;
+    }
+    unsigned char *frame = buf + HEADER - TUN_HEADER;
+    uint16_t proto = ip[0] >> 4 == 4 ? 0x0800 : 0x86DD;
+    frame[0] = frame[1] = 0;
+    frame[2] = (unsigned char)(proto >> 8);
+    frame[3] = (unsigned char)proto;
+    ssize_t n;
+    do
+    {
+        n = write(t->fd, frame, plen + TUN_HEADER);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1)
+    {
+        count(&t->dropped, 1);
+        return;
+    }
+    peer->rx_packets++;
+    peer->rx_bytes += plen;
+    count(&t->rx_packets, 1);
+    count(&t->rx_bytes, plen);
+}
+
+// Peers to device
+static void ingress(struct tunnel_t *t, void *resource)
+{
+    struct mmsghdr msgs[BATCH];
+    struct iovec iovs[BATCH];
+    struct sockaddr_storage from[BATCH];
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        for (unsigned i = 0; i < BATCH; ++i)
+        {
+            iovs[i] = (struct iovec){.iov_base = s_bufs[i], .iov_len = BUF_SIZE};
+            msgs[i].msg_hdr = (struct msghdr){
+                .msg_name = &from[i], .msg_namelen = sizeof(from[i]), .msg_iov = &iovs[i], .msg_iovlen = 1};
+        }
+        int n = recvmmsg(t->sock, msgs, BATCH, MSG_DONTWAIT, NULL);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            receive(t, resource, s_bufs[i], msgs[i].msg_len, &from[i], msgs[i].msg_hdr.msg_namelen);
+        }
+        if (n < BATCH)
+        {
+            break;
+        }
+    }
+}
+
+static void service(void *resource, void *arg, int64_t now)
+{
+    (void)now;
+    struct tunnel_t *t = arg;
+    enif_mutex_lock(t->lock);
+    if (t->closed)
+    {
+        enif_mutex_unlock(t->lock);
+        return;
+    }
+    egress(t);
+    ingress(t, resource);
+    if (t->rx_eof && t->events != 0)
+    {
+        watch_delete(t->fd);
+        t->events = 0;
+    }
+    enif_mutex_unlock(t->lock);
+}
+
+// Watch the device and the socket of a tunnel, allocating the watcher
+// thread's buffers on first use. Called with the tunnel's lock held.
+static int watch(struct tunnel_t *t, void *resource)
+{
+    enif_mutex_lock(s_lock);
+    if (s_bufs == NULL)
+    {
+        s_bufs = enif_alloc(BATCH * sizeof(*s_bufs));
+    }
+    bool bufs = s_bufs != NULL;
+    enif_mutex_unlock(s_lock);
+    if (!bufs)
+    {
+        return -ENOMEM;
+    }
+
+    int result = watch_add(t->fd, t->events, resource, service, t, &t->watch);
+    if (result == 0 && (result = watch_add(t->sock, WATCH_READ, NULL, NULL, NULL, &t->watch)) < 0)
+    {
+        // The caller holds a reference too, so this cannot run the destructor
+        enif_release_resource(watch_remove(&t->watch, &t->fd, 1));
+    }
+    return result;
+}
+
+// Stop watching a tunnel, returning the resource reference the watch held, to
+// be released once the tunnel's lock is released. Called with that lock held.
+static void *unwatch(struct tunnel_t *t)
+{
+    int fds[] = {t->fd, t->sock};
+    return watch_remove(&t->watch, fds, 2);
+}
+
+static void free_peer(struct tunnel_peer_t *p)
+{
+    // Freeing a context cleanses the key schedule it holds
+    EVP_CIPHER_CTX_free(p->tx);
+    EVP_CIPHER_CTX_free(p->rx);
+    p->tx = p->rx = NULL;
+}
+
+// Forget the peers and close the socket. Called with the tunnel's lock held.
+static void release_tunnel(struct tunnel_t *t)
+{
+    for (unsigned i = 0; i < t->npeers; ++i)
+    {
+        free_peer(&t->peers[i]);
+    }
+    enif_free(t->peers);
+    t->peers = NULL;
+    t->npeers = 0;
+    if (t->sock != -1)
+    {
+        close(t->sock);
+        t->sock = -1;
+    }
+    t->fd = -1;
+}
+
+int tunnel_init(tunnel_control_fn control)
+{
+    s_control = control;
+    s_lock = enif_mutex_create("tundra_tunnel_bufs");
+    return s_lock ? 0 : -1;
+}
+
+int tunnel_enable(struct tunnel_t *t, int fd, const struct tunnel_config_t *config, const ErlNifPid *owner,
+                  void *resource)
+{
+    int family = config->local.ss_family;
+    if ((config->cipher != TUNNEL_CHACHA20_POLY1305 && config->cipher != TUNNEL_AES_256_GCM) ||
+        (family != AF_INET && family != AF_INET6) || config->buffer < 0)
+    {
+        return -EINVAL;
+    }
+
+    int result = 0;
+    enif_mutex_lock(t->lock);
+    if (!t->closed)
+    {
+        result = -EBUSY;
+        goto done;
+    }
+
+    // An IPv6 socket also takes IPv4 peers, unless bound to an IPv4 address
+    struct sockaddr_storage bound;
+    socklen_t len = family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+    int off = 0;
+    t->sock = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (t->sock == -1 ||
+        (family == AF_INET6 && setsockopt(t->sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) == -1) ||
+        (config->buffer > 0 &&
+         (setsockopt(t->sock, SOL_SOCKET, SO_RCVBUF, &config->buffer, sizeof(config->buffer)) == -1 ||
+          setsockopt(t->sock, SOL_SOCKET, SO_SNDBUF, &config->buffer, sizeof(config->buffer)) == -1)) ||
+        bind(t->sock, (const struct sockaddr *)&config->local, len) == -1 ||
+        getsockname(t->sock, (struct sockaddr *)&bound, &len) == -1)
+    {
+        result = -errno;
+        release_tunnel(t);
+        goto done;
+    }
+
+    t->fd = fd;
+    t->family = family;
+    t->cipher = config->cipher;
+    t->owner = *owner;
+    t->gen = 0;
+    t->events = WATCH_READ;
+    t->rx_eof = false;
+    _Atomic uint64_t *counters[] = {&t->rx_packets, &t->rx_bytes,      &t->tx_packets,    &t->tx_bytes,
+                                    &t->no_route,   &t->unknown_peer,  &t->auth_failures, &t->replays,
+                                    &t->control,    &t->dropped};
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+    {
+        atomic_store(counters[i], 0);
+    }
+    if ((result = watch(t, resource)) < 0)
+    {
+        release_tunnel(t);
+        goto done;
+    }
+    t->closed = false;
+    result = ntohs(family == AF_INET ? ((struct sockaddr_in *)&bound)->sin_port
+                                     : ((struct sockaddr_in6 *)&bound)->sin6_port);
+
+done:
+    enif_mutex_unlock(t->lock);
+    return result;
+}
+
+void tunnel_disable(struct tunnel_t *t)
+{
+    void *resource = NULL;
+    enif_mutex_lock(t->lock);
+    if (!t->closed)
+    {
+        t->closed = true;
+        resource = unwatch(t);
+        release_tunnel(t);
+    }
+    enif_mutex_unlock(t->lock);
+
+    // Released outside the lock as this may run the resource destructor
+    if (resource != NULL)
+    {
+        enif_release_resource(resource);
+    }
+}
+
+int tunnel_set_peer(struct tunnel_t *t, const struct tunnel_peer_config_t *config)
+{
+    if (config->nprefixes > TUNNEL_MAX_PREFIXES)
+    {
+        return -EINVAL;
+    }
+    for (unsigned i = 0; i < config->nprefixes; ++i)
+    {
+        const struct tunnel_prefix_t *p = &config->prefixes[i];
+        if (!(p->family == AF_INET && p->prefixlen <= 32) && !(p->family == AF_INET6 && p->prefixlen <= 128))
+        {
+            return -EINVAL;
+        }
+    }
+
+    int result = 0;
+    EVP_CIPHER_CTX *tx = NULL, *rx = NULL;
+    enif_mutex_lock(t->lock);
+    if (t->closed)
+    {
+        result = -EBADF;
+        goto done;
+    }
+    struct sockaddr_storage endpoint = {0};
+    socklen_t endpoint_len = 0;
+    if (config->endpoint.ss_family != AF_UNSPEC &&
+        (result = socket_addr(t, &config->endpoint, &endpoint, &endpoint_len)) < 0)
+    {
+        goto done;
+    }
+    tx = key_context(t->cipher, config->tx_key, 1);
+    rx = key_context(t->cipher, config->rx_key, 0);
+    if (tx == NULL || rx == NULL)
+    {
+        result = -ENOMEM;
+        goto done;
+    }
+
+    struct tunnel_peer_t *p = find_peer(t, config->index);
+    if (p != NULL)
+    {
+        free_peer(p);
+    }
+    else if (t->npeers == TUNNEL_MAX_PEERS)
+    {
+        result = -ENOSPC;
+        goto done;
+    }
+    else
+    {
+        struct tunnel_peer_t *peers = enif_realloc(t->peers, (t->npeers + 1) * sizeof(*peers));
+        if (peers == NULL)
+        {
+            result = -ENOMEM;
+            goto done;
+        }
+        t->peers = peers;
+        p = &t->peers[t->npeers++];
+    }
+    memset(p, 0, sizeof(*p));
+    p->index = config->index;
+    p->remote_index = config->remote_index;
+    p->endpoint = endpoint;
+    p->endpoint_len = endpoint_len;
+    p->tx = tx;
+    p->rx = rx;
+    memcpy(p->prefixes, config->prefixes, config->nprefixes * sizeof(config->prefixes[0]));
+    p->nprefixes = config->nprefixes;
+    p->gen = ++t->gen;
+    tx = rx = NULL;
+
+done:
+    enif_mutex_unlock(t->lock);
+    EVP_CIPHER_CTX_free(tx);
+    EVP_CIPHER_CTX_free(rx);
+    return result;
+}
+
+int tunnel_remove_peer(struct tunnel_t *t, uint32_t index)
+{
+    int result = 0;
+    enif_mutex_lock(t->lock);
+    struct tunnel_peer_t *p = t->closed ? NULL : find_peer(t, index);
+    if (p == NULL)
+    {
+        result = t->closed ? -EBADF : -ENOENT;
+    }
+    else
+    {
+        free_peer(p);
+        *p = t->peers[--t->npeers];
+    }
+    enif_mutex_unlock(t->lock);
+    return result;
+}
+
+int tunnel_send_control(struct tunnel_t *t, const struct sockaddr_storage *to, const void *data, size_t len)
+{
+    int result = 0;
+    enif_mutex_lock(t->lock);
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if (t->closed)
+    {
+        result = -EBADF;
+    }
+    else if ((result = socket_addr(t, to, &addr, &addr_len)) == 0 &&
+             sendto(t->sock, data, len, MSG_DONTWAIT, (struct sockaddr *)&addr, addr_len) == -1)
+    {
+        result = -errno;
+    }
+    enif_mutex_unlock(t->lock);
+    return result;
+}
+
+unsigned tunnel_get_peer_stats(struct tunnel_t *t, struct tunnel_peer_stats_t *stats, unsigned max)
+{
+    enif_mutex_lock(t->lock);
+    unsigned n = t->npeers;
+    for (unsigned i = 0; i < n && i < max; ++i)
+    {
+        const struct tunnel_peer_t *p = &t->peers[i];
+        stats[i] = (struct tunnel_peer_stats_t){.index = p->index,
+                                                .counter = p->counter,
+                                                .rx_packets = p->rx_packets,
+                                                .rx_bytes = p->rx_bytes,
+                                                .tx_packets = p->tx_packets,
+                                                .tx_bytes = p->tx_bytes};
+    }
+    enif_mutex_unlock(t->lock);
+    return n;
+}
+
+void tunnel_shutdown(void)
+{
+    enif_free(s_bufs);
+    s_bufs = NULL;
+    if (s_lock != NULL)
+    {
+        enif_mutex_destroy(s_lock);
+        s_lock = NULL;
+    }
+}
+
+#else
+
+int tunnel_init(tunnel_control_fn control)
+{
+    (void)control;
+    return 0;
+}
+
+int tunnel_enable(struct tunnel_t *t, int fd, const struct tunnel_config_t *config, const ErlNifPid *owner,
+                  void *resource)
+{
+    (void)t;
+    (void)fd;
+    (void)config;
+    (void)owner;
+    (void)resource;
+    return -ENOTSUP;
+}
+
+void tunnel_disable(struct tunnel_t *t)
+{
+    (void)t;
+}
+
+int tunnel_set_peer(struct tunnel_t *t, const struct tunnel_peer_config_t *config)
+{
+    (void)t;
+    (void)config;
+    return -ENOTSUP;
+}
+
+int tunnel_remove_peer(struct tunnel_t *t, uint32_t index)
+{
+    (void)t;
+    (void)index;
+    return -ENOTSUP;
+}
+
+int tunnel_send_control(struct tunnel_t *t, const struct sockaddr_storage *to, const void *data, size_t len)
+{
+    (void)t;
+    (void)to;
+    (void)data;
+    (void)len;
+    return -ENOTSUP;
+}
+
+unsigned tunnel_get_peer_stats(struct tunnel_t *t, struct tunnel_peer_stats_t *stats, unsigned max)
+{
+    (void)t;
+    (void)stats;
+    (void)max;
+    return 0;
+}
+
+void tunnel_shutdown(void)
+{
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef TUNDRA_TUNNEL_H
+#define TUNDRA_TUNNEL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <erl_nif.h>
+
+// Tunnel mode: a device's packets encrypted to and from peers over UDP (Linux,
+// with the system libcrypto).
+//
+// While a device is in tunnel mode, the descriptor watcher's thread (see
+// watch.h) reads its packets, seals each with the AEAD key of the peer whose
+// allowed prefixes best match the destination, and sends them from the
+// device's UDP socket in batches. Datagrams arriving on the socket are opened with the key of the
+// peer their header names, checked against that peer's replay window and
+// allowed prefixes, and written to the device. Everything else that arrives on
+// the socket (handshakes, cookies) goes to the device's owner, which keeps the
+// key exchange and rotation and installs the resulting keys with
+// tunnel_set_peer.
+//
+// A data datagram is laid out as WireGuard's transport message: a 16-byte
+// header (type 4, three zero bytes, the receiver's peer index and a 64-bit
+// counter, both little-endian), the sealed packet and a 16-byte tag. The nonce
+// is four zero bytes and the counter; the header is authenticated too. An
+// empty packet is a keepalive: it moves the peer's endpoint and replay window
+// but writes nothing to the device.
+//
+// A device's tunnel is allocated when tunnel mode is first enabled and freed
+// with the device, as for rings (see memring.h). Disabling closes the socket
+// and forgets the peers and their keys. Fields other than the counters are
+// protected by `lock`.
+
+#define TUNNEL_KEY_SIZE 32
+#define TUNNEL_MAX_PREFIXES 8
+#define TUNNEL_MAX_PEERS 4096
+
+enum tunnel_cipher_t
+{
+    TUNNEL_CHACHA20_POLY1305 = 0,
+    TUNNEL_AES_256_GCM = 1,
+};
+
+struct tunnel_config_t
+{
+    enum tunnel_cipher_t cipher;
+    struct sockaddr_storage local; // address and port to bind, port 0 for any
+    int buffer;                    // socket buffer sizes, 0 for the system default
+};
+
+struct tunnel_prefix_t
+{
+    int family;
+    unsigned char prefixlen;
+    unsigned char addr[16];
+};
+
+struct tunnel_peer_config_t
+{
+    uint32_t index;        // ours: the receiver index of the peer's datagrams
+    uint32_t remote_index; // the peer's: put in the datagrams we send it
+    struct sockaddr_storage endpoint; // family AF_UNSPEC until known
+    unsigned char tx_key[TUNNEL_KEY_SIZE];
+    unsigned char rx_key[TUNNEL_KEY_SIZE];
+    struct tunnel_prefix_t prefixes[TUNNEL_MAX_PREFIXES];
+    unsigned nprefixes;
+};
+
+struct tunnel_stats_t
+{
+    uint64_t rx_packets; // packets written to the device
+    uint64_t rx_bytes;
+    uint64_t tx_packets; // packets sent to peers
+    uint64_t tx_bytes;
+    uint64_t no_route;      // device packets no peer's prefixes match
+    uint64_t unknown_peer;  // datagrams naming a peer index there is none for
+    uint64_t auth_failures; // datagrams that did not open
+    uint64_t replays;       // datagrams outside or already seen in the window
+    uint64_t control;       // datagrams passed to the owner
+    uint64_t dropped;       // malformed, disallowed source, or refused by the device or socket
+};
+
+struct tunnel_peer_stats_t
+{
+    uint32_t index;
+    uint64_t counter; // the next to send, which must be rekeyed before it reaches 2^64 - 2^13
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+};
+
+struct tunnel_peer_t;
+
+struct tunnel_t
+{
+    ErlNifMutex *lock;
+    bool closed;
+    int fd;   // the device
+    int sock; // the UDP socket
+    int family;
+    enum tunnel_cipher_t cipher;
+    ErlNifPid owner;
+    struct tunnel_peer_t *peers;
+    unsigned npeers;
+    uint64_t gen; // orders peers by when they were set
+    uint32_t events; // watch interest in the device
+    bool rx_eof;     // the device can no longer be read, e.g. a loopback peer closed
+    int watch;       // watcher slot
+    _Atomic uint64_t rx_packets;
+    _Atomic uint64_t rx_bytes;
+    _Atomic uint64_t tx_packets;
+    _Atomic uint64_t tx_bytes;
+    _Atomic uint64_t no_route;
+    _Atomic uint64_t unknown_peer;
+    _Atomic uint64_t auth_failures;
+    _Atomic uint64_t replays;
+    _Atomic uint64_t control;
+    _Atomic uint64_t dropped;
+};
+
+// Called by the thread, with the tunnel's lock held, for each datagram that is
+// not a data message. `resource` is the device's.
+typedef void (*tunnel_control_fn)(void *resource, ErlNifPid *owner, const struct sockaddr_storage *from,
+                                  const unsigned char *data, size_t len);
+
+// Set the function control datagrams are passed to and create the lock of the
+// watcher thread's buffers. Called from the NIF load callback.
+int tunnel_init(tunnel_control_fn control);
+
+// Allocate a closed tunnel. Returns NULL on failure.
+struct tunnel_t *tunnel_create(void);
+
+// Free a tunnel, disabling it first if needed.
+void tunnel_destroy(struct tunnel_t *t);
+
+// Put device `fd` in tunnel mode with a new socket bound as `config` says,
+// resetting the counters, and start servicing it. The registration holds a
+// reference to `resource` until tunnel_disable. Returns the bound port or
+// -errno; -EBUSY if the tunnel is already enabled, -ENOTSUP where this is not
+// implemented.
+int tunnel_enable(struct tunnel_t *t, int fd, const struct tunnel_config_t *config, const ErlNifPid *owner,
+                  void *resource);
+
+// Leave tunnel mode: stop servicing the device, close the socket and forget
+// the peers. Does nothing if already disabled.
+void tunnel_disable(struct tunnel_t *t);
+
+// Add a peer, or replace the one with the same index, with a zero counter and
+// an empty replay window. Returns 0 or -errno; -EBADF if the tunnel is
+// disabled.
+int tunnel_set_peer(struct tunnel_t *t, const struct tunnel_peer_config_t *config);
+
+// Remove a peer. Returns 0 or -errno; -ENOENT if there is no such peer.
+int tunnel_remove_peer(struct tunnel_t *t, uint32_t index);
+
+// Send a datagram from the tunnel's socket, such as a handshake message.
+// Returns 0 or -errno; -EBADF if the tunnel is disabled.
+int tunnel_send_control(struct tunnel_t *t, const struct sockaddr_storage *to, const void *data, size_t len);
+
+// Change the process control datagrams are sent to.
+void tunnel_set_owner(struct tunnel_t *t, const ErlNifPid *owner);
+
+// Read the counters. May be called at any time.
+void tunnel_get_stats(struct tunnel_t *t, struct tunnel_stats_t *stats);
+
+// Read the counters of up to `max` peers. Returns the number of peers, which
+// may be more than `max`.
+unsigned tunnel_get_peer_stats(struct tunnel_t *t, struct tunnel_peer_stats_t *stats, unsigned max);
+
+// Release the watcher thread's buffers. Called on unload, after the watcher
+// has stopped.
+void tunnel_shutdown(void);
+
+#endif
@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <erl_nif.h>
+#include "watch.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+
+#define WAKE_TOKEN UINT64_MAX
+#define MAX_EVENTS 64
+
+struct slot_t
+{
+    void *resource;
+    watch_fn fn;
+    void *arg;
+    uint32_t gen;
+    bool used;
+};
+
+static ErlNifMutex *s_lock;
+static ErlNifTid s_tid;
+static bool s_running;
+static int s_epfd = -1;
+static int s_wake[2] = {-1, -1};
+static struct slot_t *s_slots;
+static unsigned s_nslots;
+
+static void *watch_thread(void *arg)
+{
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct slot_t ready[MAX_EVENTS];
+    uint32_t indices[MAX_EVENTS];
+    for (;;)
+    {
+        int n = epoll_wait(s_epfd, events, MAX_EVENTS, -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        int64_t now = enif_monotonic_time(ERL_NIF_NSEC);
+        int nready = 0;
+        bool stop = false;
+        enif_mutex_lock(s_lock);
+        for (int i = 0; i < n; ++i)
+        {
+            uint64_t token = events[i].data.u64;
+            if (token == WAKE_TOKEN)
+            {
+                stop = true;
+                continue;
+            }
+            uint32_t index = (uint32_t)token;
+            struct slot_t *slot = index < s_nslots ? &s_slots[index] : NULL;
+            if (slot != NULL && slot->used && slot->gen == (uint32_t)(token >> 32))
+            {
+                // The descriptors of a slot share its token, so a slot may be
+                // ready more than once
+                bool seen = false;
+                for (int j = 0; j < nready && !seen; ++j)
+                {
+                    seen = indices[j] == index;
+                }
+                if (!seen)
+                {
+                    enif_keep_resource(slot->resource);
+                    indices[nready] = index;
+                    ready[nready++] = *slot;
+                }
+            }
+        }
+        enif_mutex_unlock(s_lock);
+
+        for (int i = 0; i < nready; ++i)
+        {
+            ready[i].fn(ready[i].resource, ready[i].arg, now);
+            enif_release_resource(ready[i].resource);
+        }
+
+        if (stop)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Called with the lock held.
+static int start_thread(void)
+{
+    s_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (s_epfd == -1)
+    {
+        return -errno;
+    }
+    if (pipe(s_wake) == -1)
+    {
+        goto cleanup;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = WAKE_TOKEN};
+    if (epoll_ctl(s_epfd, EPOLL_CTL_ADD, s_wake[0], &ev) == -1)
+    {
+        goto cleanup;
+    }
+    if (enif_thread_create("tundra_watch", &s_tid, watch_thread, NULL, NULL) != 0)
+    {
+        errno = EAGAIN;
+        goto cleanup;
+    }
+    s_running = true;
+    return 0;
+
+cleanup:;
+    int err = errno;
+    close(s_epfd);
+    s_epfd = -1;
+    if (s_wake[0] != -1)
+    {
+        close(s_wake[0]);
+        close(s_wake[1]);
+        s_wake[0] = s_wake[1] = -1;
+    }
+    return -err;
+}
+
+// Called with the lock held.
+static int alloc_slot(void)
+{
+    for (unsigned i = 0; i < s_nslots; ++i)
+    {
+        if (!s_slots[i].used)
+        {
+            return (int)i;
+        }
+    }
+    unsigned n = s_nslots ? s_nslots * 2 : 16;
+    struct slot_t *slots = enif_realloc(s_slots, n * sizeof(*slots));
+    if (slots == NULL)
+    {
+        return -ENOMEM;
+    }
+    for (unsigned i = s_nslots; i < n; ++i)
+    {
+        slots[i] = (struct slot_t){0};
+    }
+    s_slots = slots;
+    int index = (int)s_nslots;
+    s_nslots = n;
+    return index;
+}
+
+static uint32_t epoll_events(uint32_t events)
+{
+    return ((events & WATCH_READ) ? EPOLLIN : 0) | ((events & WATCH_WRITE) ? EPOLLOUT : 0) |
+           ((events & WATCH_ONESHOT) ? EPOLLONESHOT : 0);
+}
+
+int watch_init(void)
+{
+    s_lock = enif_mutex_create("tundra_watch");
+    return s_lock ? 0 : -1;
+}
+
+int watch_add(int fd, uint32_t events, void *resource, watch_fn fn, void *arg, int *slot)
+{
+    int result = 0;
+    enif_mutex_lock(s_lock);
+    if (!s_running && (result = start_thread()) < 0)
+    {
+        goto done;
+    }
+
+    if (*slot >= 0)
+    {
+        // Re-arm the descriptor, or add it to the registration
+        struct slot_t *s = &s_slots[*slot];
+        struct epoll_event ev = {.events = epoll_events(events), .data.u64 = ((uint64_t)s->gen << 32) | (uint32_t)*slot};
+        if (epoll_ctl(s_epfd, EPOLL_CTL_MOD, fd, &ev) == -1 &&
+            (errno != ENOENT || epoll_ctl(s_epfd, EPOLL_CTL_ADD, fd, &ev) == -1))
+        {
+            result = -errno;
+        }
+        goto done;
+    }
+
+    int index = alloc_slot();
+    if (index < 0)
+    {
+        result = index;
+        goto done;
+    }
+    struct slot_t *s = &s_slots[index];
+    struct epoll_event ev = {.events = epoll_events(events), .data.u64 = ((uint64_t)(s->gen + 1) << 32) | (uint32_t)index};
+    if (epoll_ctl(s_epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        result = -errno;
+        goto done;
+    }
+    s->gen++;
+    s->used = true;
+    s->resource = resource;
+    s->fn = fn;
+    s->arg = arg;
+    enif_keep_resource(resource);
+    *slot = index;
+
+done:
+    enif_mutex_unlock(s_lock);
+    return result;
+}
+
+void watch_delete(int fd)
+{
+    epoll_ctl(s_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void *watch_remove(int *slot, const int *fds, unsigned nfds)
+{
+    void *resource = NULL;
+    enif_mutex_lock(s_lock);
+    if (*slot >= 0)
+    {
+        struct slot_t *s = &s_slots[*slot];
+        for (unsigned i = 0; i < nfds; ++i)
+        {
+            epoll_ctl(s_epfd, EPOLL_CTL_DEL, fds[i], NULL);
+        }
+        resource = s->resource;
+        *s = (struct slot_t){.gen = s->gen};
+        *slot = -1;
+    }
+    enif_mutex_unlock(s_lock);
+    return resource;
+}
+
+void watch_shutdown(void)
+{
+    if (s_running)
+    {
+        ssize_t n = write(s_wake[1], "x", 1);
+        (void)n;
+        enif_thread_join(s_tid, NULL);
+        close(s_epfd);
+        close(s_wake[0]);
+        close(s_wake[1]);
+        s_running = false;
+    }
+    enif_free(s_slots);
+    s_slots = NULL;
+    s_nslots = 0;
+    if (s_lock != NULL)
+    {
+        enif_mutex_destroy(s_lock);
+        s_lock = NULL;
+    }
+}
+
+#else
+
+int watch_init(void)
+{
+    return 0;
+}
+
+int watch_add(int fd, uint32_t events, void *resource, watch_fn fn, void *arg, int *slot)
+{
+    (void)fd;
+    (void)events;
+    (void)resource;
+    (void)fn;
+    (void)arg;
+    (void)slot;
+    return -ENOTSUP;
+}
+
+void watch_delete(int fd)
+{
+    (void)fd;
+}
+
+void *watch_remove(int *slot, const int *fds, unsigned nfds)
+{
+    (void)slot;
+    (void)fds;
+    (void)nfds;
+    return NULL;
+}
+
+void watch_shutdown(void)
+{
+}
+
+#endif
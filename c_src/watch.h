@@ -0,0 +1,53 @@
+#ifndef TUNDRA_WATCH_H
+#define TUNDRA_WATCH_H
+
+#include <stdint.h>
+
+// Descriptor watcher.
+//
+// One native thread, started on first use, waits on the descriptors of every
+// device that is serviced off the schedulers: readiness timestamps (ready.h),
+// send queues (sendq.h), rings (memring.h) and tunnels (tunnel.h). Each
+// registration occupies a slot, which may watch several descriptors, holds a
+// reference to a resource, and names the callback the thread runs when any of
+// its descriptors reports an event.
+//
+// Events carry a slot index and generation rather than a pointer, so an event
+// for a registration removed after epoll_wait returned is simply ignored. The
+// callbacks run once per slot and wakeup, in turn, outside the watcher's lock
+// and with the slot's resource kept, so a callback may re-arm its own
+// registration. A slow callback delays every other slot.
+//
+// `*slot` identifies a registration: it must be initialised to -1 and is only
+// read or written by these functions, under the watcher's lock.
+
+#define WATCH_READ 0x1u
+#define WATCH_WRITE 0x2u
+#define WATCH_ONESHOT 0x4u
+
+// Called by the watcher thread with the registration's resource and argument,
+// and the monotonic time, in nanoseconds, at which the thread woke.
+typedef void (*watch_fn)(void *resource, void *arg, int64_t now);
+
+// Create the watcher's lock. Called from the NIF load callback.
+int watch_init(void);
+
+// Watch `fd` for `events`, starting the watcher thread if needed. If `*slot` is
+// -1, a new registration is made, which holds a reference to `resource` and
+// runs `fn` with `arg`. Otherwise `fd` is added to that registration, or
+// re-armed if already part of it, and the other arguments are ignored. Returns
+// 0 or -errno; -ENOTSUP where this is not implemented.
+int watch_add(int fd, uint32_t events, void *resource, watch_fn fn, void *arg, int *slot);
+
+// Stop watching `fd`, leaving its registration in place.
+void watch_delete(int fd);
+
+// Stop watching the `nfds` descriptors in `fds` and remove the registration in
+// `*slot`, if any. Returns the resource reference the registration held, or
+// NULL. The caller releases it, outside any lock the resource destructor takes.
+void *watch_remove(int *slot, const int *fds, unsigned nfds);
+
+// Stop the watcher thread and release its resources. Called on unload.
+void watch_shutdown(void);
+
+#endif
@@ -15,13 +15,22 @@ defmodule Tundra do
      device creation to a separate privileged server daemon (`tundra_server`).
 
   Tundra automatically attempts direct creation first and falls back to the server
-  if privileges are insufficient. Once created, the device is represented within the
-  runtime as a socket on Darwin and a NIF resource on Linux, with process-ownership
-  semantics:
+  if privileges are insufficient. The outcome of the first attempt is remembered, so
+  later creations go straight to the NIF or straight to the server. Direct creation
+  runs entirely in the calling process; server requests are spread over a small set
+  of long-lived connections. Both can be configured:
+
+      config :tundra,
+        mode: :auto,             # or :direct / :server to skip detection
+        server_connections: 4    # connections kept open to tundra_server, read at start
+
+  Once created, the device is represented within the runtime as a socket on Darwin
+  and a NIF resource on Linux, with process-ownership semantics:
 
   - Only the owning process can read from or write to the device and receive i/o
     notifications from it.
-  - The TUN device is removed when the owning process exits.
+  - The TUN device is removed when the owning process exits, unless it was
+    created with `persist: true` (see `reattach/1`).
 
   ## Server Process
 
@@ -129,6 +138,11 @@ defmodule Tundra do
   """
   @type tun_device() :: :socket.socket() | {:"$tundra", reference()}
 
+  @typedoc """
+  A poll set, as returned by `create_poll_set/0`.
+  """
+  @type poll_set() :: {:"$tundra_poll", reference()}
+
   @typedoc """
   A TUN device address. May be represented either as tuple or a
   string containing a dotted IP address.
@@ -142,6 +156,42 @@ defmodule Tundra do
           {:dstaddr, tun_address()}
           | {:netmask, tun_address()}
           | {:mtu, non_neg_integer()}
+          | {:persist, boolean()}
+          | {:txqueuelen, pos_integer()}
+          | {:sndbuf, pos_integer()}
+          | {:netns, Path.t() | non_neg_integer()}
+
+  @typedoc """
+  A change to a live TUN device, as applied by `configure/2`.
+  """
+  @type configure_change() ::
+          {:mtu, pos_integer()}
+          | {:up, boolean()}
+          | {:add_address | :remove_address, {tun_address(), non_neg_integer()}}
+          | {:add_route | :remove_route, {tun_address(), non_neg_integer()}}
+
+  @typedoc """
+  Device I/O counters, as returned by `stats/1`.
+
+  Byte counts and `:max_packet` exclude the TUN framing header.
+  """
+  @type stats() :: %{
+          rx_packets: non_neg_integer(),
+          rx_bytes: non_neg_integer(),
+          tx_packets: non_neg_integer(),
+          tx_bytes: non_neg_integer(),
+          eagain: non_neg_integer(),
+          selects: non_neg_integer(),
+          enobufs: non_neg_integer(),
+          emsgsize: non_neg_integer(),
+          max_packet: non_neg_integer(),
+          send_queue_packets: non_neg_integer(),
+          send_queue_bytes: non_neg_integer(),
+          send_queue_drops: non_neg_integer(),
+          busy_polls: non_neg_integer(),
+          busy_poll_hits: non_neg_integer(),
+          busy_poll_time: non_neg_integer()
+        }
 
   @spec create(tun_address(), list(tun_option())) ::
           {:ok, {tun_device(), String.t()}} | {:error, any()}
@@ -154,6 +204,21 @@ defmodule Tundra do
   - `:netmask` - The netmask of the device.
   - `:dstaddr` - The destination address of the device.
   - `:mtu` - The maximum transmission unit of the device.
+  - `:persist` - When `true`, the device is not removed when it is closed or its
+    owner exits (Linux only). See `reattach/1`.
+  - `:txqueuelen` - The length of the kernel's transmit queue for the device, in
+    packets (Linux only; ignored on Darwin). Packets routed to the device wait
+    there until read, and are dropped once it is full.
+  - `:sndbuf` - The send buffer of the device, in bytes, which bounds how much
+    written data the kernel holds before writes block.
+  - `:netns` - The network namespace to create the device in, as a path such as
+    `/run/netns/NAME` or `/proc/PID/ns/net`, or an open descriptor for one
+    (Linux only). The device is created and configured inside the namespace,
+    rather than created here and moved; the devices created in a namespace
+    share one netlink socket there. Creating directly needs `CAP_SYS_ADMIN` as
+    well as `CAP_NET_ADMIN`; the server is handed the namespace's descriptor,
+    and refuses with `{:error, :eperm}` a namespace whose user namespace the
+    calling user does not own.
 
   On success returns a tuple containing a device tuple and the name of the device.
 
@@ -167,19 +232,126 @@ defmodule Tundra do
       {:ok, {{:"$tundra", #Reference<0.2990923237.3512074243.109526>}, "tun0"}}  # Linux
   """
   def create(address, opts \\ []) do
-    alias Tundra.DynamicSupervisor, as: Sup
-
     case convert_opts(Keyword.put(opts, :addr, address)) do
       params when is_map(params) ->
-        with {:ok, pid} <- DynamicSupervisor.start_child(Sup, Tundra.Client) do
-          Tundra.Client.create_tun_device(pid, params)
-        end
+        create_device(params)
 
       error ->
         error
     end
   end
 
+  # Create a device from already-converted parameters. A parameters map without
+  # an `:addr` key yields a device that is up but unaddressed (see Tundra.Pool).
+  @doc false
+  def create_device(params) when is_map(params) do
+    Tundra.Client.create_tun_device(params)
+  end
+
+  @spec configure(tun_device(), list(configure_change())) :: :ok | {:error, any()}
+  @doc """
+  Change a TUN device while it carries traffic.
+
+  Applies a list of changes to the device's interface without recreating it:
+
+  - `{:mtu, mtu}` - Set the maximum transmission unit.
+  - `{:up, boolean}` - Bring the link up or take it down.
+  - `{:add_address, {address, prefix_len}}`,
+    `{:remove_address, {address, prefix_len}}` - Add or remove an IPv4 or IPv6
+    address.
+  - `{:add_route, {prefix, prefix_len}}`, `{:remove_route, {prefix, prefix_len}}` -
+    Add or remove a route through the device in the main table.
+
+  Up to 16 changes are sent to the kernel in a single netlink batch, addressed
+  by the interface index found from the device's descriptor rather than by
+  name, so a device that has since been renamed is still the one changed.
+  The MTU and link state are applied together, first if the link is brought
+  up, so that routes can be added through it, and last if it is taken down;
+  addresses and routes are applied in the order given. The kernel applies the
+  changes in turn, so if one fails, for example with `{:error, :eexist}` for
+  an address the device already has, those before it remain.
+
+  Without the privileges to change the interface directly the changes are
+  made by the Tundra server, which is handed the device's descriptor. As the
+  server makes them with its own privileges, it only changes a device that the
+  caller's user owns, as devices created through the server are, or one in a
+  namespace the user owns (see the `:netns` option of `create/2`), and it
+  refuses a route or address with a prefix length of 0 in its own namespace;
+  either is refused with `{:error, :eperm}`. Must be called by the owner of the
+  device. Linux only; loopback devices have no interface and return
+  `{:error, :enotsup}`.
+
+  ## Examples
+
+      iex> {:ok, {dev, _name}} = Tundra.create("fd11:b7b7:4360::2", mtu: 1500)
+      iex> Tundra.configure(dev,
+              mtu: 9000,
+              add_address: {"fd11:b7b7:4361::2", 64},
+              add_route: {"fd12::", 48})
+      :ok
+  """
+  def configure(dev, changes)
+  def configure({:"$socket", _}, _changes), do: {:error, :enotsup}
+
+  def configure({:"$tundra", ref}, changes) when is_list(changes) and length(changes) <= 16 do
+    changes = Enum.map(changes, &convert_change/1)
+
+    if Enum.member?(changes, :error) do
+      {:error, :einval}
+    else
+      Tundra.Client.reconfigure(ref, changes)
+    end
+  end
+
+  def configure({:"$tundra", _}, _changes), do: {:error, :einval}
+
+  @prefix_changes [:add_address, :remove_address, :add_route, :remove_route]
+
+  # Addresses and prefixes are passed to the NIF as 4 or 16-byte binaries
+  defp convert_change({:mtu, n}) when is_integer(n) and n in 1..0x7FFFFFFF, do: {:mtu, n}
+  defp convert_change({:up, up}) when is_boolean(up), do: {:up, up}
+
+  defp convert_change({op, prefix}) when op in @prefix_changes do
+    case convert_prefix(prefix) do
+      :error -> :error
+      prefix -> {op, prefix}
+    end
+  end
+
+  defp convert_change(_), do: :error
+
+  defp convert_prefix({addr, len}) when is_integer(len) do
+    with {:ok, ip} <- parse_ip(addr),
+         bin = ip_to_binary(ip),
+         true <- len in 0..bit_size(bin) do
+      {bin, len}
+    else
+      _ -> :error
+    end
+  end
+
+  defp convert_prefix(_), do: :error
+
+  defp convert_endpoint({addr, port}) when is_integer(port) and port in 1..65_535 do
+    case parse_ip(addr) do
+      {:ok, ip} -> {ip_to_binary(ip), port}
+      _ -> :error
+    end
+  end
+
+  defp convert_endpoint(_), do: :error
+
+  defp parse_ip(addr) when is_binary(addr), do: :inet.parse_strict_address(to_charlist(addr))
+
+  defp parse_ip(addr) when is_tuple(addr) do
+    if :inet.is_ip_address(addr), do: {:ok, addr}, else: :error
+  end
+
+  defp parse_ip(_), do: :error
+
+  defp ip_to_binary({a, b, c, d}), do: <<a, b, c, d>>
+  defp ip_to_binary(ip), do: for(x <- Tuple.to_list(ip), into: <<>>, do: <<x::16>>)
+
   @spec adopt(non_neg_integer()) :: {:ok, {tun_device(), String.t()}} | {:error, any()}
   @doc """
   Adopt an already-created TUN device from an open file descriptor.
@@ -193,7 +365,8 @@ defmodule Tundra do
   `fd` is the integer file descriptor of the device:
 
   - On Linux, a descriptor opened on `/dev/net/tun` and attached to a TUN device
-    via `TUNSETIFF`.
+    via `TUNSETIFF`, with `IFF_TUN` and without `IFF_NO_PI`. Any other
+    descriptor is refused with `{:error, :einval}`.
   - On Darwin, a `utun` control socket descriptor
     (`PF_SYSTEM`/`SYSPROTO_CONTROL`).
 
@@ -218,17 +391,195 @@ defmodule Tundra do
     Tundra.Client.adopt(fd)
   end
 
+  @spec create_loopback(keyword()) :: {:ok, {tun_device(), tun_device()}} | {:error, any()}
+  @doc """
+  Create a loopback device, which needs no privileges.
+
+  A loopback device behaves like a TUN device created by `create/2` — the same
+  packet framing, `{:"$socket", dev, :select, _}` notifications, ownership
+  rules, `controlling_process/2`, `stats/1` and latency tracking — but is backed
+  by a socket pair instead of `/dev/net/tun`, so it can be used in tests and
+  benchmarks without root or `CAP_NET_ADMIN`.
+
+  Returns the device and its peer, which stands in for the kernel side of the
+  device: packets sent on the device are received on the peer, and packets sent
+  on the peer are received on the device. The peer is driven with the same
+  functions as the device, and both are owned by the caller; hand the peer to
+  another process with `controlling_process/2`.
+
+  Unlike a TUN device, a write that does not fit in the peer's buffer returns
+  `{:select, select_info}` rather than being dropped, and once either side is
+  closed `recv/3` on the other returns `{:error, :closed}` (Linux).
+
+  The following options are supported:
+
+  - `:buffer` - The socket send and receive buffer size in bytes, on both
+    sides. Defaults to the system default.
+
+  ## Examples
+
+      iex> {:ok, {dev, peer}} = Tundra.create_loopback()
+      iex> Tundra.send(peer, packet, :nowait)
+      :ok
+      iex> Tundra.recv(dev, 1500, :nowait)
+      {:ok, packet}
+  """
+  def create_loopback(opts \\ []) do
+    case Keyword.get(opts, :buffer, 0) do
+      buffer when is_integer(buffer) and buffer >= 0 -> Tundra.Client.create_loopback(buffer)
+      _ -> {:error, :einval}
+    end
+  end
+
+  @spec reattach(String.t()) :: {:ok, {tun_device(), String.t()}} | {:error, any()}
+  @doc """
+  Re-open a persistent TUN device by name (Linux only).
+
+  A device created with `persist: true` survives the exit of its owner and of
+  the VM itself, keeping its addresses, routes and link state. `reattach/1`
+  takes ownership of such a device again without reconfiguring it, so traffic
+  can resume after a restart at the cost of an `open` and an `ioctl`.
+
+  Devices are opened directly when the VM owns the device (persistent devices
+  are owned by the user that created them) or is privileged; otherwise the
+  request is passed to the server, which only attaches devices owned by the
+  requesting user.
+
+  Returns `{:error, :enodev}` if there is no persistent device of that name,
+  `{:error, :einval}` if it is a TAP device or was created with `IFF_NO_PI`, and
+  `{:error, :ebusy}` if the device is already attached elsewhere.
+
+  ## Examples
+
+      iex> Tundra.reattach("tun0")
+      {:ok, {{:"$tundra", #Reference<0.2990923237.3512074243.109526>}, "tun0"}}
+  """
+  def reattach(name) when is_binary(name) do
+    Tundra.Client.attach(name)
+  end
+
+  @spec reap(keyword()) :: {:ok, list(String.t())} | {:error, any()}
+  @doc """
+  Remove orphaned persistent TUN devices (Linux only).
+
+  Every persistent TUN device owned by the current user that is not attached
+  to any process is made non-persistent and closed, which removes it. Devices
+  that are in use are left alone. Returns the names of the removed devices.
+
+  The following options are supported:
+
+  - `:keep` - A list of device names that must not be removed.
+  """
+  def reap(opts \\ []) do
+    keep = Keyword.get(opts, :keep, [])
+
+    with {:ok, names} <- Tundra.Client.persistent_devices() do
+      {:ok, for(name <- names, name not in keep, remove_persistent(name) == :ok, do: name)}
+    end
+  end
+
+  defp remove_persistent(name) do
+    with {:ok, {{:"$tundra", ref} = dev, _}} <- reattach(name) do
+      result = Tundra.Client.unpersist(ref)
+      _ = close(dev)
+      result
+    end
+  end
+
+  @spec export_devices(list(tun_device() | {tun_device(), term()}), String.t(), keyword()) ::
+          :ok | {:error, any()}
+  @doc """
+  Hand live TUN devices to another VM (Linux only).
+
+  For deploys without downtime: the old VM exports its devices on a Unix
+  socket at `path` and the new VM takes them with `import_devices/2`. Each
+  device is passed as its open descriptor, by `SCM_RIGHTS` in batches, with
+  its name and TUN flags and any metadata given as a `{dev, metadata}` tuple.
+  Nothing is torn down or reconfigured, and packets queued in the kernel wait
+  for the new VM, so the switchover takes one round trip on the socket.
+
+  The caller must own the devices. This call waits for the new VM to connect
+  and acknowledge the devices, and then closes them here; on error they are
+  left open and still owned by the caller. Only a VM running as the same user
+  may connect. Packets waiting in a device's send queue (see `send_queue/2`)
+  are not passed on, so the queue should be drained first.
+
+  The following options are supported:
+
+  - `:timeout` - How long to wait for the new VM, in milliseconds, or
+    `:infinity`. Defaults to 30 seconds.
+
+  ## Examples
+
+      # In the old VM
+      :ok = Tundra.export_devices([{dev, %{role: :uplink}}], "/run/myapp/handoff.sock")
+
+      # In the new VM
+      {:ok, [{dev, "tun0", %{role: :uplink}}]} = Tundra.import_devices("/run/myapp/handoff.sock")
+  """
+  def export_devices(devs, path, opts \\ []) when is_list(devs) and is_binary(path) do
+    with {:ok, timeout} <- handoff_timeout(opts),
+         {:ok, pairs} <- handoff_pairs(devs),
+         :ok <- Tundra.Client.handoff_export(pairs, path, timeout) do
+      Enum.each(pairs, fn {ref, _} -> Tundra.Client.close(ref) end)
+    end
+  end
+
+  defp handoff_pairs(devs) do
+    Enum.reduce_while(Enum.reverse(devs), {:ok, []}, fn
+      {{:"$tundra", ref}, meta}, {:ok, acc} -> {:cont, {:ok, [{ref, meta} | acc]}}
+      {:"$tundra", ref}, {:ok, acc} -> {:cont, {:ok, [{ref, nil} | acc]}}
+      _, _ -> {:halt, {:error, :enotsup}}
+    end)
+  end
+
+  defp handoff_timeout(opts) do
+    case Keyword.get(opts, :timeout, 30_000) do
+      :infinity -> {:ok, -1}
+      ms when is_integer(ms) and ms >= 0 -> {:ok, min(ms, 0x7FFFFFFF)}
+      _ -> {:error, :einval}
+    end
+  end
+
+  @spec import_devices(String.t(), keyword()) ::
+          {:ok, list({tun_device(), String.t(), term()})} | {:error, any()}
   @doc """
-  Transfer control of a TUN device to another process.
+  Take the TUN devices exported by another VM with `export_devices/3` (Linux
+  only).
+
+  Connects to the Unix socket at `path` and returns the devices, with their
+  names and metadata (`nil` if none was given), in the order they were
+  exported. They are owned by the caller and may be read at once; the old VM
+  closes its copies when this returns. Each descriptor is checked to be the
+  TUN device it is said to be.
+
+  Returns `{:error, :enoent}` or `{:error, :econnrefused}` if no VM is
+  exporting on `path`.
+
+  The following options are supported:
+
+  - `:timeout` - How long to wait for the devices, in milliseconds, or
+    `:infinity`. Defaults to 30 seconds.
+  """
+  def import_devices(path, opts \\ []) when is_binary(path) do
+    with {:ok, timeout} <- handoff_timeout(opts),
+         {:ok, devs} <- Tundra.Client.handoff_import(path, timeout) do
+      {:ok, for({ref, name, meta} <- devs, do: {{:"$tundra", ref}, name, meta})}
+    end
+  end
+
+  @doc """
+  Transfer control of a TUN device or poll set to another process.
 
   Must be called by the current owner of the device.
   """
-  @spec controlling_process(tun_device(), pid()) :: :ok | {:error, any()}
+  @spec controlling_process(tun_device() | poll_set(), pid()) :: :ok | {:error, any()}
   def controlling_process({:"$socket", _} = sock, pid) when is_pid(pid) do
     :socket.setopt(sock, {:otp, :controlling_process}, pid)
   end
 
-  def controlling_process({:"$tundra", ref}, pid) when is_pid(pid) do
+  def controlling_process({tag, ref}, pid)
+      when tag in [:"$tundra", :"$tundra_poll"] and is_pid(pid) do
     Tundra.Client.controlling_process(ref, pid)
   end
 
@@ -242,20 +593,117 @@ defmodule Tundra do
   The `:nowait` option specifies that the operation should not block if no data is
   available. If data is available, it will be returned immediately. If no data is
   available, the function will return `{:select, select_info}`.
+
+  The following options are supported, except by macOS utun devices, which
+  return `{:error, :enotsup}`:
+
+  - `:headroom` - Bytes to reserve before the packet, up to 4096. Defaults to 0.
+  - `:tailroom` - Bytes to reserve after it, up to 4096, in addition to what
+    `length` leaves unused. Defaults to 0.
+
+  A packet read with reserved room is returned as usual, but sits in a larger
+  buffer, so that `fill_headroom/3` can later put a header before it and a
+  trailer after it without copying it: encapsulating a packet this way gives
+  one contiguous binary to send, rather than iodata that the socket copies
+  again. Returns `{:error, :einval}` for invalid options.
   """
-  @spec recv(tun_device(), non_neg_integer(), :nowait) ::
+  @spec recv(tun_device(), non_neg_integer(), :nowait, keyword()) ::
           {:ok, binary()} | {:select, :socket.select_info()} | {:error, any()}
-  def recv({:"$socket", _} = sock, length, :nowait) when is_integer(length) do
-    # Add 4 bytes for the Darwin utun header that we strip from the result
-    case :socket.recv(sock, length + 4, [], :nowait) do
-      {:ok, <<_header::binary-size(4), data::binary>>} -> {:ok, data}
-      {:ok, _data} -> {:error, :emsgsize}
-      other -> other
+  def recv(dev, length, mode, opts \\ [])
+
+  def recv({:"$socket", _} = sock, length, :nowait, opts) when is_integer(length) do
+    case room(opts) do
+      [] ->
+        # Add 4 bytes for the Darwin utun header that we strip from the result
+        case :socket.recv(sock, length + 4, [], :nowait) do
+          {:ok, <<_header::binary-size(4), data::binary>>} -> {:ok, data}
+          {:ok, _data} -> {:error, :emsgsize}
+          other -> other
+        end
+
+      :error ->
+        {:error, :einval}
+
+      _room ->
+        {:error, :enotsup}
+    end
+  end
+
+  def recv({:"$tundra", ref}, length, :nowait, opts) when is_integer(length) do
+    case room(opts) do
+      :error -> {:error, :einval}
+      room -> Tundra.Client.recv(ref, length, room, :nowait)
     end
   end
 
-  def recv({:"$tundra", ref}, length, :nowait) when is_integer(length) do
-    Tundra.Client.recv(ref, length, [], :nowait)
+  @max_room 4096
+
+  # The headroom and tailroom options of recv/4 and recv_batch/5, with those
+  # of 0 left out
+  defp room(opts) do
+    Enum.reduce_while(opts, [], fn
+      {key, 0}, acc when key in [:headroom, :tailroom] ->
+        {:cont, Keyword.delete(acc, key)}
+
+      {key, n}, acc when key in [:headroom, :tailroom] and is_integer(n) and n in 1..@max_room ->
+        {:cont, Keyword.put(acc, key, n)}
+
+      _, _ ->
+        {:halt, :error}
+    end)
+  end
+
+  @spec fill_headroom(binary(), iodata(), iodata()) :: {:ok, binary()} | {:error, any()}
+  @doc """
+  Put a header before, and a trailer after, a packet read with reserved room.
+
+  `packet` must have been returned by `recv/4` or `recv_batch/5` with
+  `:headroom` or `:tailroom`, or by an earlier `fill_headroom/3`, and the header
+  and trailer are written into its reserved room. Returns `{:ok, datagram}`, a
+  binary of the header, the packet and the trailer that shares the packet's
+  memory. `packet` itself is unchanged.
+
+  Only the latest binary made over a packet's buffer can be filled, so headers
+  can be stacked from the inside out by filling each result in turn; filling
+  an older one, or any other binary, returns `{:error, :einval}`. Returns
+  `{:error, :enospc}` if the header or trailer does not fit in the room left.
+
+  ## Examples
+
+      iex> {:ok, packet} = Tundra.recv(dev, 1500, :nowait, headroom: 16)
+      iex> {:ok, datagram} = Tundra.fill_headroom(packet, <<4, 0::24, index::32, counter::64>>)
+      iex> :socket.sendto(sock, datagram, peer)
+  """
+  def fill_headroom(packet, header, trailer \\ <<>>) when is_binary(packet) do
+    Tundra.Client.fill_headroom(packet, header, trailer)
+  end
+
+  @doc """
+  Receive up to `max` packets from a TUN device in one call.
+
+  As `recv/3`, but returns `{:ok, packets}` with between one and `max` packets,
+  oldest first, saving a call per packet when the device is busy. If no packet
+  is available, returns `{:select, select_info}` as `recv/3` does. `max` is
+  capped at 1024. On macOS a single packet is returned per call.
+
+  Packets read this way bypass the `:recv` stage of `impair/3`. The options are
+  those of `recv/4`.
+  """
+  @spec recv_batch(tun_device(), non_neg_integer(), pos_integer(), :nowait, keyword()) ::
+          {:ok, [binary()]} | {:select, :socket.select_info()} | {:error, any()}
+  def recv_batch(dev, length, max, mode, opts \\ [])
+
+  def recv_batch({:"$socket", _} = sock, length, max, :nowait, opts)
+      when is_integer(max) and max > 0 do
+    with {:ok, packet} <- recv(sock, length, :nowait, opts), do: {:ok, [packet]}
+  end
+
+  def recv_batch({:"$tundra", ref}, length, max, :nowait, opts)
+      when is_integer(length) and is_integer(max) and max > 0 do
+    case room(opts) do
+      :error -> {:error, :einval}
+      room -> Tundra.Client.recv_batch(ref, length, max, room, :nowait)
+    end
   end
 
   @doc """
@@ -267,13 +715,24 @@ defmodule Tundra do
 
   The `:nowait` option specifies that the operation should not block if the device's
   output buffer is full. If the buffer is full, the function will return
-  `{:select, select_info}`.
+  `{:select, select_info}`, unless the device has a send queue (see
+  `send_queue/2`), in which case the packet is queued and `:ok` returned, or
+  `{:error, :queue_full}` if the queue has no room for it.
+
+  The following options are supported:
+
+  - `:class` - The send queue class to queue the packet in if it cannot be
+    written at once, overriding classification by DSCP. Ignored if the device
+    has no send queue.
   """
   @spec(
-    send(tun_device(), iodata(), :nowait) :: :ok | {:select, :socket.select_info()},
+    send(tun_device(), iodata(), :nowait, keyword()) ::
+      :ok | {:select, :socket.select_info()},
     {:error, any()}
   )
-  def send({:"$socket", _} = sock, data, :nowait) do
+  def send(dev, data, mode, opts \\ [])
+
+  def send({:"$socket", _} = sock, data, :nowait, _opts) do
     # Prepend 4-byte address family header for Darwin utun
     packet = :erlang.iolist_to_binary(data)
 
@@ -293,7 +752,7 @@ defmodule Tundra do
     end
   end
 
-  def send({:"$tundra", ref}, data, :nowait) do
+  def send({:"$tundra", ref}, data, :nowait, opts) do
     # Prepend 4-byte TUN header for Linux: 2 bytes flags + 2 bytes protocol
     packet = :erlang.iolist_to_binary(data)
 
@@ -307,27 +766,1115 @@ defmodule Tundra do
       end
 
     if header do
-      Tundra.Client.send(ref, [header, packet], [], :nowait)
+      Tundra.Client.send(ref, [header, packet], Keyword.take(opts, [:class]), :nowait)
     else
       {:error, :einval}
     end
   end
 
   @doc """
-  Cancel a pending operation on a TUN device.
+  Cancel a pending operation on a TUN device or poll set.
   """
-  @spec cancel(tun_device(), :socket.select_info()) :: :ok | {:error, any()}
+  @spec cancel(tun_device() | poll_set(), :socket.select_info()) :: :ok | {:error, any()}
   def cancel({:"$socket", _} = sock, select_info), do: :socket.cancel(sock, select_info)
   def cancel({:"$tundra", ref}, select_info), do: Tundra.Client.cancel(ref, select_info)
+  def cancel({:"$tundra_poll", ref}, select_info), do: Tundra.Client.cancel(ref, select_info)
+
+  @doc """
+  Return the I/O counters of a TUN device.
+
+  Unlike the other device functions, `stats/1` may be called from any process,
+  not just the owner. Counters are maintained on the data path at the cost of a
+  few relaxed atomic updates per packet and are read without locking, so
+  individual counters are current but not a consistent snapshot of each other.
+
+  - `:rx_packets`, `:rx_bytes` - Packets and bytes read from the device.
+  - `:tx_packets`, `:tx_bytes` - Packets and bytes written to the device.
+  - `:eagain` - Reads and writes that would have blocked.
+  - `:selects` - Readiness notifications requested as a result.
+  - `:enobufs` - Writes that were only partially accepted.
+  - `:emsgsize` - Reads shorter than the TUN header, or truncated to fit the
+    requested length.
+  - `:max_packet` - The largest packet read or written.
+  - `:send_queue_packets`, `:send_queue_bytes` - Packets and bytes (including
+    the 4-byte TUN header) waiting in the send queue. See `send_queue/2`.
+  - `:send_queue_drops` - Packets refused by, or dropped from, the send queue.
+  - `:busy_polls` - Empty reads that spun waiting for a packet. See
+    `busy_poll/2`.
+  - `:busy_poll_hits` - Spins that ended with a packet to read.
+  - `:busy_poll_time` - Time spent spinning, in nanoseconds.
+
+  On Darwin, devices created via the server are sockets and the counters are
+  derived from `:socket.info/1`; `:enobufs`, `:emsgsize`, the send queue and
+  the busy poll counters are always zero.
+
+  Returns `{:error, :closed}` once the device has been closed. See
+  `Tundra.Telemetry` to publish the counters periodically.
+  """
+  @spec stats(tun_device()) :: {:ok, stats()} | {:error, any()}
+  def stats({:"$socket", _} = sock) do
+    case :socket.info(sock) do
+      %{counters: counters} = info ->
+        if :closed in Map.get(info, :rstates, []) do
+          {:error, :closed}
+        else
+          {:ok, socket_stats(counters)}
+        end
+
+      _ ->
+        {:error, :closed}
+    end
+  end
+
+  def stats({:"$tundra", ref}), do: Tundra.Client.stats(ref)
+
+  # Map the socket counters onto the NIF counters. Socket byte counts include
+  # the 4-byte utun header.
+  defp socket_stats(counters) do
+    get = &Map.get(counters, &1, 0)
+    waits = get.(:read_waits) + get.(:write_waits)
+
+    %{
+      rx_packets: get.(:read_pkg),
+      rx_bytes: max(get.(:read_byte) - 4 * get.(:read_pkg), 0),
+      tx_packets: get.(:write_pkg),
+      tx_bytes: max(get.(:write_byte) - 4 * get.(:write_pkg), 0),
+      eagain: waits,
+      selects: waits,
+      enobufs: 0,
+      emsgsize: 0,
+      max_packet: max(max(get.(:read_pkg_max), get.(:write_pkg_max)) - 4, 0),
+      send_queue_packets: 0,
+      send_queue_bytes: 0,
+      send_queue_drops: 0,
+      busy_polls: 0,
+      busy_poll_hits: 0,
+      busy_poll_time: 0
+    }
+  end
+
+  @typedoc """
+  Kernel interface counters and settings, as returned by `link_stats/1`.
+  """
+  @type link_stats() :: %{
+          ifindex: pos_integer(),
+          mtu: non_neg_integer(),
+          txqueuelen: non_neg_integer(),
+          up: boolean(),
+          running: boolean(),
+          rx_packets: non_neg_integer(),
+          tx_packets: non_neg_integer(),
+          rx_bytes: non_neg_integer(),
+          tx_bytes: non_neg_integer(),
+          rx_errors: non_neg_integer(),
+          tx_errors: non_neg_integer(),
+          rx_dropped: non_neg_integer(),
+          tx_dropped: non_neg_integer()
+        }
+
+  @spec link_stats(String.t() | list(String.t())) ::
+          {:ok, %{String.t() => link_stats()}} | {:error, any()}
+  @doc """
+  Return the kernel's counters and settings for one or more interfaces.
+
+  Unlike `stats/1`, which counts what passes through a device's descriptor,
+  these are the kernel's own counters for the interface (`IFLA_STATS64`),
+  including packets it dropped before they could be read. Any interface may be
+  named, not only TUN devices, and any process may ask.
+
+  All the interfaces are read with a single netlink dump, so asking for many at
+  once costs little more than asking for one. Returns a map from name to
+  statistics, without the names of interfaces that do not exist.
+
+  Linux only; returns `{:error, :enotsup}` elsewhere. See `Tundra.LinkMonitor`
+  to be told when an interface changes.
+
+  ## Examples
+
+      iex> Tundra.link_stats(["tun0", "tun1"])
+      {:ok, %{"tun0" => %{ifindex: 12, mtu: 1500, up: true, rx_packets: 10, ...}}}
+  """
+  def link_stats(names) when is_list(names) do
+    if Enum.all?(names, &is_binary/1) do
+      Tundra.Client.interface_stats(names)
+    else
+      {:error, :einval}
+    end
+  end
+
+  def link_stats(name) when is_binary(name), do: link_stats([name])
+
+  @doc """
+  Turn latency tracking on or off for a TUN device.
+
+  While tracking is on, the NIF records how long each `recv/3` and `send/3`
+  call takes and, on Linux, the delay between the kernel reporting the device
+  readable and the next successful `recv/3`. That delay covers delivery of the
+  select notification, scheduling of the owner and any work it does before
+  reading. See `latency/1`.
+
+  Tracking is off by default and then costs a single branch per call. When on,
+  each call additionally reads the monotonic clock twice. Enabling tracking
+  clears previously recorded values. Must be called by the owner of the device.
+
+  While the owner is waiting for input with tracking on, a native watcher holds
+  a reference to the device, so it must be closed explicitly (or its owner
+  exit) for it to be removed.
+  """
+  @spec track_latency(tun_device(), boolean()) :: :ok | {:error, any()}
+  def track_latency({:"$socket", _}, enabled) when is_boolean(enabled), do: {:error, :enotsup}
+
+  def track_latency({:"$tundra", ref}, enabled) when is_boolean(enabled) do
+    Tundra.Client.track_latency(ref, enabled)
+  end
 
   @doc """
-  Close a TUN device.
+  Return the latency histograms of a TUN device.
+
+  Returns a map with the following `Tundra.Histogram`s, in nanoseconds:
+
+  - `:recv` - The duration of `recv/3` calls.
+  - `:send` - The duration of `send/3` calls.
+  - `:ready` - The delay from the device becoming readable to the next
+    successful `recv/3` (Linux only; empty elsewhere).
+
+  Like `stats/1`, this may be called from any process. Returns
+  `{:error, :disabled}` if tracking has never been enabled for the device.
+
+  ## Examples
+
+      iex> :ok = Tundra.track_latency(dev, true)
+      iex> {:ok, %{recv: recv}} = Tundra.latency(dev)
+      iex> Tundra.Histogram.percentiles(recv)
+      %{50 => 1471, 90 => 2175, 99 => 5887, 99.9 => 14335}
   """
-  @spec close(tun_device()) :: :ok | {:error, atom()}
+  @spec latency(tun_device()) :: {:ok, %{atom() => Tundra.Histogram.t()}} | {:error, any()}
+  def latency({:"$socket", _}), do: {:error, :enotsup}
+  def latency({:"$tundra", ref}), do: Tundra.Client.latency(ref)
+
+  @doc """
+  Turn busy polling on or off for a TUN device.
+
+  Normally, when `recv/3` or `recv_batch/4` finds no packet waiting, the device
+  is selected at once and the owner waits for the select message. With busy
+  polling on, the NIF first spins on the device for up to `usec` microseconds
+  (at most 1000), and returns a packet that arrives meanwhile directly. This
+  saves the delivery of the select message and the rescheduling of the owner,
+  which is most of the latency of a lightly loaded device, at the cost of a
+  scheduler spinning while the device is idle.
+
+  The spin adapts to the traffic. A spin that sees a packet aims the next at
+  twice the wait, and one that does not halves it, so a device whose packets
+  arrive further apart than `usec` soon stops spinning; from then on only one
+  empty read in 32 spins, to notice when traffic picks up again. Spinning is
+  charged to the owner's reductions in proportion to its length, so the owner
+  is scheduled out no later than if it had been running Erlang code. The
+  `:busy_poll*` counters of `stats/1` show how much time spinning costs and
+  how often it pays off.
+
+  Off (0) by default. Devices in ring or tunnel mode are read by native
+  threads and a device in a poll set is read by `poll/3`, neither of which
+  spins, and spins are skipped while the recv impairment stage is on. Must be
+  called by the owner of the device. Returns `{:error, :einval}` if `usec` is
+  out of range.
+  """
+  @spec busy_poll(tun_device(), non_neg_integer()) :: :ok | {:error, any()}
+  def busy_poll({:"$socket", _}, _usec), do: {:error, :enotsup}
+
+  def busy_poll({:"$tundra", ref}, usec) when usec in 0..1000 do
+    Tundra.Client.busy_poll(ref, usec)
+  end
+
+  def busy_poll({:"$tundra", _}, _usec), do: {:error, :einval}
+
+  @spec create_poll_set() :: {:ok, poll_set()} | {:error, any()}
+  @doc """
+  Create a poll set (Linux only).
+
+  A poll set lets one process wait for input on many devices at once: rather
+  than arming a select on every idle device, the owner arms a single one on the
+  set and `poll/3` returns whichever devices are readable. Readiness is
+  level-triggered, so a device that is not drained is reported again by the
+  next `poll/3`.
+
+  The set is owned by the calling process, like a device, and is closed when
+  that process exits. It can be handed to another process with
+  `controlling_process/2` and closed with `close/1`.
+
+  Returns `{:error, :enotsup}` on other platforms.
+  """
+  def create_poll_set, do: Tundra.Client.new_poll_set()
+
+  @spec poll_add(poll_set(), tun_device()) :: :ok | {:error, any()}
+  @doc """
+  Add a device to a poll set.
+
+  The caller must own both the set and the device. A device belongs to at most
+  one set at a time: adding it again returns `{:error, :eexist}`, and adding it
+  to a second set returns `{:error, :ebusy}`. Closing either the device or the
+  set removes the registration.
+
+  Devices created via the server on Darwin are sockets and cannot be added.
+  """
+  def poll_add({:"$tundra_poll", set}, {:"$tundra", ref}) do
+    Tundra.Client.poll_register(set, ref)
+  end
+
+  def poll_add({:"$tundra_poll", _}, {:"$socket", _}), do: {:error, :enotsup}
+
+  @spec poll_remove(poll_set(), tun_device()) :: :ok | {:error, any()}
+  @doc """
+  Remove a device from a poll set.
+
+  Must be called by the owner of the set; the device may since have been
+  handed to another process. Returns `{:error, :enoent}` if the device is not
+  in the set.
+  """
+  def poll_remove({:"$tundra_poll", set}, {:"$tundra", ref}) do
+    Tundra.Client.poll_unregister(set, ref)
+  end
+
+  def poll_remove({:"$tundra_poll", _}, {:"$socket", _}), do: {:error, :enoent}
+
+  @spec poll(poll_set(), pos_integer(), keyword()) ::
+          {:ok, list(tun_device() | {tun_device(), list(binary()) | {:error, any()}})}
+          | {:select, :socket.select_info()}
+          | {:error, any()}
+  @doc """
+  Return up to `max` readable devices from a poll set.
+
+  Must be called by the owner of the set. If no device is readable, arms a
+  select on the set and returns `{:select, select_info}`; a notification of
+  the following form is then sent when one becomes readable:
+
+      {:"$socket", set, :select, select_handle}
+
+  Only devices owned by the caller are returned. A device that has been handed
+  to another process is dropped from the set when it is next found readable.
+
+  The following options are supported:
+
+  - `:batch` - When positive, also read up to this many packets from each
+    readable device, saving a `recv/3` call per device. Each device is then
+    returned as `{dev, packets}`, or `{dev, {:error, reason}}` if the first
+    read failed (for example `{:error, :closed}` once the peer of a loopback
+    device has closed). At most 1024 packets are read per call across all
+    devices; devices left over are returned by the next call. Defaults to 0.
+  - `:length` - The maximum number of bytes to read per packet when batching,
+    as for `recv/3`, up to 65535. Defaults to 1500.
+
+  ## Examples
+
+      iex> {:ok, set} = Tundra.create_poll_set()
+      iex> :ok = Tundra.poll_add(set, dev)
+      iex> Tundra.poll(set, 64)
+      {:select, {:select_info, :recv, #Reference<0.2990923237.3512074243.109526>}}
+      iex> Tundra.poll(set, 64, batch: 8)
+      {:ok, [{{:"$tundra", #Reference<0.2990923237.3512074243.109530>}, [packet]}]}
+  """
+  def poll({:"$tundra_poll", set}, max, opts \\ []) when is_integer(max) and max > 0 do
+    batch = Keyword.get(opts, :batch, 0)
+    length = Keyword.get(opts, :length, 1500)
+
+    if is_integer(batch) and batch >= 0 and is_integer(length) and length > 0 do
+      Tundra.Client.poll(set, max, length, batch)
+    else
+      {:error, :einval}
+    end
+  end
+
+  @spec send_queue(tun_device(), keyword() | false) :: :ok | {:error, any()}
+  @doc """
+  Enable, resize or disable the send queue of a TUN device (Linux only).
+
+  Without a send queue, `send/3` returns `{:select, select_info}` when the
+  device's transmit queue is full and the caller must hold on to the packet and
+  retry once notified. With one, such a packet is copied into a bounded queue in
+  the NIF and `send/3` returns `:ok`; a native thread writes queued packets out,
+  in order, as soon as the device is writable again. While the queue is not
+  empty new packets join the back of it, and a packet that does not fit is
+  refused with `{:error, :queue_full}`.
+
+  The owner is told when the queued bytes rise to the high watermark and when
+  they fall back to the low one, so it can slow down and resume:
+
+      {:tundra_send_queue, dev, :high}
+      {:tundra_send_queue, dev, :low}
+
+  The following options are supported. Byte counts include the 4-byte TUN
+  header of each packet.
+
+  - `:packets` - The maximum number of queued packets. Defaults to 1024.
+  - `:bytes` - The maximum number of queued bytes. Defaults to 1 MiB.
+  - `:high_watermark` - Defaults to three quarters of `:bytes`.
+  - `:low_watermark` - Defaults to a quarter of `:bytes`, or the high
+    watermark if that is lower.
+
+  - `:classes` - A list of scheduling classes, each a keyword list (see below).
+    Defaults to a single class.
+  - `:dscp` - A map from DSCP value (0 to 63) to class index, used to classify
+    packets sent without an explicit `:class` (see `send/4`). Unmapped values
+    go to class 0.
+
+  Each class has its own queue. A class with `priority: true` is always served
+  first; the others share the device by deficit round-robin, each sending up to
+  its weight in bytes per round while it has packets, so an idle class gives
+  its share to the busy ones. Class options are:
+
+  - `:weight` - Bytes per round. Defaults to 1500. Ignored for the priority
+    class, of which there may be at most one.
+  - `:priority` - Defaults to `false`.
+  - `:packets`, `:bytes` - Limits for this class, applied on top of those of the
+    whole queue. Default to the latter.
+
+  For example, to serve expedited forwarding traffic ahead of everything else
+  and give bulk traffic a quarter of what is left:
+
+      Tundra.send_queue(dev,
+        classes: [[], [priority: true, packets: 64], [weight: 500]],
+        dscp: %{46 => 1, 8 => 2})
+
+  Pass `false` to disable the queue, dropping any packets still in it. Packets
+  still queued when the device is closed, or when the number of classes is
+  changed, are dropped too. The queue depth and drop count are reported by
+  `stats/1`, and by class, along with queueing delay, by `send_queue_stats/1`.
+  Must be called by the owner of the device.
+  """
+  def send_queue({:"$socket", _}, _opts), do: {:error, :enotsup}
+
+  def send_queue({:"$tundra", ref}, false) do
+    Tundra.Client.send_queue(ref, %{packets: 0, bytes: 0, low: 0, high: 0})
+  end
+
+  def send_queue({:"$tundra", ref}, opts) when is_list(opts) do
+    with packets when is_integer(packets) and packets > 0 <- Keyword.get(opts, :packets, 1024),
+         bytes when is_integer(bytes) and bytes > 0 <- Keyword.get(opts, :bytes, 1_048_576),
+         high when is_integer(high) and high >= 0 and high <= bytes <-
+           Keyword.get(opts, :high_watermark, div(bytes * 3, 4)),
+         low when is_integer(low) and low >= 0 and low <= high <-
+           Keyword.get(opts, :low_watermark, min(div(bytes, 4), high)),
+         {:ok, classes} <- queue_classes(Keyword.get(opts, :classes, [[]]), packets, bytes),
+         {:ok, dscp} <- dscp_map(Keyword.get(opts, :dscp, %{}), length(classes)) do
+      config = %{packets: packets, bytes: bytes, low: low, high: high, classes: classes}
+      Tundra.Client.send_queue(ref, Map.put(config, :dscp, dscp))
+    else
+      _ -> {:error, :einval}
+    end
+  end
+
+  @max_classes 8
+
+  defp queue_classes(classes, packets, bytes)
+       when is_list(classes) and classes != [] and length(classes) <= @max_classes do
+    classes = Enum.map(classes, &queue_class(&1, packets, bytes))
+
+    if Enum.all?(classes, &valid_class?/1) and Enum.count(classes, &elem(&1, 3)) <= 1,
+      do: {:ok, classes},
+      else: :error
+  end
+
+  defp queue_classes(_, _, _), do: :error
+
+  defp queue_class(opts, packets, bytes) when is_list(opts) do
+    {Keyword.get(opts, :weight, 1500), Keyword.get(opts, :packets, packets),
+     Keyword.get(opts, :bytes, bytes), Keyword.get(opts, :priority, false)}
+  end
+
+  defp queue_class(_, _, _), do: :error
+
+  defp valid_class?({weight, packets, bytes, priority})
+       when is_integer(weight) and weight > 0 and is_integer(packets) and packets >= 0 and
+              is_integer(bytes) and bytes >= 0 and is_boolean(priority),
+       do: true
+
+  defp valid_class?(_), do: false
+
+  defp dscp_map(map, n) when is_map(map) do
+    if Enum.all?(map, fn {k, v} -> k in 0..63 and is_integer(v) and v >= 0 and v < n end) do
+      {:ok, for(dscp <- 0..63, into: <<>>, do: <<Map.get(map, dscp, 0)>>)}
+    else
+      :error
+    end
+  end
+
+  defp dscp_map(_, _), do: :error
+
+  @spec send_queue_stats(tun_device()) :: {:ok, list(map())} | {:error, any()}
+  @doc """
+  Return the state of each class of a device's send queue.
+
+  Returns a list with a map for each class, in order, with the following keys:
+
+  - `:class`, `:weight`, `:priority` - The class and its configuration.
+  - `:packets`, `:bytes` - Packets and bytes waiting in the class.
+  - `:drops` - Packets refused by, or dropped from, the class.
+  - `:sent` - Packets written from the class after being queued.
+  - `:delay` - A `Tundra.Histogram` of how long, in nanoseconds, those packets
+    spent queued.
+
+  Like `stats/1`, this may be called from any process. Returns
+  `{:error, :disabled}` if the device has never had a send queue.
+  """
+  def send_queue_stats({:"$socket", _}), do: {:error, :enotsup}
+  def send_queue_stats({:"$tundra", ref}), do: Tundra.Client.send_queue_stats(ref)
+
+  @spec capture(tun_device(), String.t(), keyword()) :: :ok | {:error, any()}
+  @doc """
+  Start capturing the packets of a TUN device to a pcapng file.
+
+  Every packet read with `recv/3` (or `recv_batch/4` and `poll/3`) and every
+  packet accepted by `send/3` is copied, in the NIF, into a buffer that a native
+  thread writes out to `path`. Packets are raw IP, timestamped to the
+  nanosecond and marked inbound or outbound, and the file can be read by
+  Wireshark or `tcpdump -r`. A packet that arrives while the buffer is full is
+  dropped from the capture (never from the device). While no capture is running
+  the data path pays a single branch per call.
+
+  The following options are supported:
+
+  - `:snaplen` - The most bytes of each packet to keep. Defaults to 65535.
+  - `:sample` - Capture one in every `n` matching packets. Defaults to 1.
+  - `:filter` - A classic BPF program for raw IP packets: either a list of
+    `{code, jt, jf, k}` instructions or the output of `tcpdump -ddd`, for
+    example `tcpdump -i tun0 -ddd 'udp port 53'`. A packet is captured if the
+    program returns non-zero, truncated to at most that many bytes.
+  - `:file_size` - Start a new file once this many bytes have been written,
+    keeping the previous ones as `path.1`, `path.2` and so on, newest first.
+    Defaults to 0, for no limit.
+  - `:files` - The number of files to keep when `:file_size` is set, including
+    `path`. Defaults to 2.
+  - `:buffer` - The size in bytes of each of the two buffers. Defaults to 1 MiB.
+
+  Returns `{:error, :ebusy}` if a capture is already running. Must be called by
+  the owner of the device. The capture runs until `stop_capture/1` is called or
+  the device is closed.
+  """
+  def capture(dev, path, opts \\ [])
+  def capture({:"$socket", _}, _path, _opts), do: {:error, :enotsup}
+
+  def capture({:"$tundra", ref}, path, opts) when is_binary(path) and is_list(opts) do
+    with snaplen when is_integer(snaplen) and snaplen > 0 <- Keyword.get(opts, :snaplen, 65_535),
+         sample when is_integer(sample) and sample > 0 <- Keyword.get(opts, :sample, 1),
+         size when is_integer(size) and size >= 0 <- Keyword.get(opts, :file_size, 0),
+         files when is_integer(files) and files > 0 <- Keyword.get(opts, :files, 2),
+         buffer when is_integer(buffer) and buffer >= snaplen + 64 <-
+           Keyword.get(opts, :buffer, 1_048_576),
+         {:ok, filter} <- capture_filter(Keyword.get(opts, :filter, [])) do
+      config = %{snaplen: snaplen, sample: sample, file_size: size, files: files, buffer: buffer}
+      Tundra.Client.capture(ref, path, Map.put(config, :filter, filter))
+    else
+      _ -> {:error, :einval}
+    end
+  end
+
+  # `tcpdump -ddd` prints the number of instructions, then one per line
+  defp capture_filter(text) when is_binary(text) do
+    with [count | lines] <- String.split(text, "\n", trim: true),
+         {count, ""} <- Integer.parse(String.trim(count)),
+         true <- count == length(lines),
+         insns = Enum.map(lines, &filter_insn/1),
+         true <- Enum.all?(insns, &is_tuple/1) do
+      {:ok, insns}
+    else
+      _ -> :error
+    end
+  end
+
+  defp capture_filter(insns) when is_list(insns), do: {:ok, insns}
+  defp capture_filter(_), do: :error
+
+  defp filter_insn(line) do
+    case line |> String.split() |> Enum.map(&Integer.parse/1) do
+      [{code, ""}, {jt, ""}, {jf, ""}, {k, ""}] -> {code, jt, jf, k}
+      _ -> nil
+    end
+  end
+
+  @spec stop_capture(tun_device()) :: {:ok, map()} | {:error, any()}
+  @doc """
+  Stop capturing the packets of a TUN device.
+
+  Returns once everything captured has been written, with a map of:
+
+  - `:packets`, `:bytes` - Packets and bytes written to the capture files.
+  - `:drops` - Packets that were not, because the buffer was full or a write
+    failed.
+
+  Returns `{:error, :disabled}` if no capture is running. Must be called by the
+  owner of the device.
+  """
+  def stop_capture({:"$socket", _}), do: {:error, :enotsup}
+  def stop_capture({:"$tundra", ref}), do: Tundra.Client.stop_capture(ref)
+
+  @spec impair(tun_device(), :send | :recv | :both, keyword() | false) :: :ok | {:error, any()}
+  @doc """
+  Emulate an impaired network on one or both directions of a TUN device.
+
+  An impairment stage in the NIF decides the fate of every packet written with
+  `send/3` (`:send`) or read with `recv/3` (`:recv`): whether to lose it,
+  whether to duplicate it and how long to hold it before it is delivered.
+  Held packets wait in a timer wheel with 1ms slots, serviced by a single
+  native thread, so a delay is never shorter than asked but may be a
+  millisecond or two longer. Passing `false` removes the stage.
+
+  The following options are supported:
+
+  - `:delay` - The delay, in milliseconds, added to every packet. Defaults to 0.
+  - `:jitter` - The delay varies uniformly within this many milliseconds
+    either side of `:delay`. Defaults to 0.
+  - `:loss` - The chance of losing a packet, or
+    `{:gilbert_elliott, p, r}` to lose packets in bursts: `p` is the chance
+    of entering the lossy state and `r` of leaving it. The five element form
+    `{:gilbert_elliott, p, r, loss_bad, loss_good}` sets the loss in each
+    state, which default to 1 and 0. Defaults to 0.
+  - `:duplicate` - The chance of delivering a packet twice. Defaults to 0.
+  - `:reorder` - The chance of a packet skipping the delay, and so overtaking
+    the packets before it. Defaults to 0.
+  - `:rate` - Limit the stage to this many bits per second, holding packets
+    that exceed it. Defaults to 0, for no limit.
+  - `:burst` - The bytes that may pass at once under `:rate`. Defaults to a
+    hundredth of a second's worth, and at least 1500.
+  - `:limit` - The most packets held at once; further packets are lost.
+    Defaults to 1000.
+  - `:seed` - Seeds the random choices, so that a stage given the same
+    packets makes the same choices. Defaults to a random seed.
+
+  Delayed sends are written by the wheel thread and bypass any send queue; a
+  packet the device will not take is counted as dropped. Packets read with
+  `poll/3` or `recv_batch/4` bypass the `:recv` stage. Reconfiguring a stage
+  resets its counters.
+  Must be called by the owner of the device.
+  """
+  def impair(dev, direction, opts)
+  def impair({:"$socket", _}, _direction, _opts), do: {:error, :enotsup}
+
+  def impair({:"$tundra", ref}, direction, opts) when direction in [:send, :recv, :both] do
+    with {:ok, config} <- impair_config(opts) do
+      directions = if direction == :both, do: [:send, :recv], else: [direction]
+
+      Enum.reduce_while(directions, :ok, fn dir, :ok ->
+        case Tundra.Client.impair(ref, dir, config) do
+          :ok -> {:cont, :ok}
+          error -> {:halt, error}
+        end
+      end)
+    else
+      _ -> {:error, :einval}
+    end
+  end
+
+  def impair({:"$tundra", _}, _direction, _opts), do: {:error, :einval}
+
+  @seed_limit 18_446_744_073_709_551_616
+
+  defguardp is_probability(p) when is_number(p) and p >= 0 and p <= 1
+
+  defp impair_config(false), do: {:ok, false}
+
+  defp impair_config(opts) when is_list(opts) do
+    with delay when is_number(delay) and delay >= 0 <- Keyword.get(opts, :delay, 0),
+         jitter when is_number(jitter) and jitter >= 0 <- Keyword.get(opts, :jitter, 0),
+         {:ok, loss} <- impair_loss(Keyword.get(opts, :loss, 0)),
+         duplicate when is_probability(duplicate) <- Keyword.get(opts, :duplicate, 0),
+         reorder when is_probability(reorder) <- Keyword.get(opts, :reorder, 0),
+         rate when is_integer(rate) and rate >= 0 <- Keyword.get(opts, :rate, 0),
+         burst when is_integer(burst) and burst > 0 <-
+           Keyword.get(opts, :burst, max(1500, div(rate, 800))),
+         limit when is_integer(limit) and limit > 0 <- Keyword.get(opts, :limit, 1000),
+         seed when is_integer(seed) and seed >= 0 and seed < @seed_limit <-
+           Keyword.get_lazy(opts, :seed, fn -> :rand.uniform(@seed_limit) - 1 end) do
+      {:ok,
+       %{
+         delay: round(delay * 1_000_000),
+         jitter: round(jitter * 1_000_000),
+         loss: loss,
+         duplicate: duplicate,
+         reorder: reorder,
+         rate: div(rate, 8),
+         burst: burst,
+         limit: limit,
+         seed: seed
+       }}
+    else
+      _ -> :error
+    end
+  end
+
+  defp impair_config(_), do: :error
+
+  # {p, r, loss_bad, loss_good}; Bernoulli loss never leaves the good state
+  defp impair_loss(loss) when is_probability(loss), do: {:ok, {0, 0, 0, loss}}
+  defp impair_loss({:gilbert_elliott, p, r}), do: impair_loss({:gilbert_elliott, p, r, 1, 0})
+
+  defp impair_loss({:gilbert_elliott, p, r, bad, good})
+       when is_probability(p) and is_probability(r) and is_probability(bad) and
+              is_probability(good),
+       do: {:ok, {p, r, bad, good}}
+
+  defp impair_loss(_), do: :error
+
+  @spec impair_stats(tun_device()) :: {:ok, map()} | {:error, any()}
+  @doc """
+  Return the counters of a TUN device's impairment stages.
+
+  Returns a map with a `:send` and a `:recv` key for each stage in place, each
+  a map of:
+
+  - `:packets` - Packets that passed through the stage.
+  - `:lost`, `:duplicated`, `:delayed`, `:reordered` - Packets lost,
+    duplicated, held and reordered.
+  - `:overlimit` - Packets lost because `:limit` packets were already held.
+  - `:dropped` - Held packets lost on delivery, for example to a full device.
+  - `:held` - Packets held now.
+
+  Like `stats/1`, this may be called from any process. Returns
+  `{:error, :disabled}` if the device has no impairment stage.
+  """
+  def impair_stats({:"$socket", _}), do: {:error, :enotsup}
+  def impair_stats({:"$tundra", ref}), do: Tundra.Client.impair_stats(ref)
+
+  @spec ring(tun_device(), keyword() | false) :: :ok | {:error, any()}
+  @doc """
+  Hand a TUN device's traffic to another native process through shared memory.
+
+  In ring mode a native thread reads the device's packets into a ring in a
+  memfd region rather than leaving them for `recv/3`, and writes the packets
+  the other process puts in a second ring to the device. Neither direction
+  passes through the BEAM or copies a packet more than once. Each side sleeps
+  on an eventfd, which the other rings only when it has said it is waiting,
+  and then once per batch. Share the ring with `ring_share/2`, or with
+  `ring_fds/1`. Passing `false` leaves ring mode: the other process is told
+  that the ring has closed, and the region and descriptors are released.
+
+  The other process uses the layout and consumer library in `c_src/ring`
+  (`tundra_ring.h`), which also has a benchmark.
+
+  The following options are supported:
+
+  - `:slots` - The packets each ring holds, a power of two. Defaults to 1024.
+  - `:slot_size` - The bytes in each slot, a multiple of 8. A slot holds an
+    8-byte header and the packet with its 4-byte TUN header, so longer packets
+    are truncated. Defaults to 2048.
+
+  While the device is in ring mode, `recv/3` and `recv_batch/4` return
+  `{:error, :ebusy}`, and it cannot be added to a poll set, but packets may
+  still be sent with `send/3`. Ring mode ends when the device is closed.
+  Must be called by the owner of the device. Linux only.
+
+  ## Examples
+
+      iex> {:ok, {dev, _name}} = Tundra.create("fd11:b7b7:4360::2")
+      iex> :ok = Tundra.ring(dev, slots: 4096)
+      iex> :ok = Tundra.ring_share(dev, "/run/sidecar.sock")
+  """
+  def ring(dev, opts)
+  def ring({:"$socket", _}, _opts), do: {:error, :enotsup}
+  def ring({:"$tundra", ref}, false), do: Tundra.Client.ring(ref, false)
+
+  def ring({:"$tundra", ref}, opts) when is_list(opts) do
+    with slots when is_integer(slots) and slots in 2..65_536 <- Keyword.get(opts, :slots, 1024),
+         true <- Bitwise.band(slots, slots - 1) == 0,
+         size when is_integer(size) and size in 64..65_536 and rem(size, 8) == 0 <-
+           Keyword.get(opts, :slot_size, 2048) do
+      Tundra.Client.ring(ref, {slots, size})
+    else
+      _ -> {:error, :einval}
+    end
+  end
+
+  def ring({:"$tundra", _}, _opts), do: {:error, :einval}
+
+  @spec ring_fds(tun_device()) ::
+          {:ok, {non_neg_integer(), non_neg_integer(), non_neg_integer()}} | {:error, any()}
+  @doc """
+  Return the descriptors of a TUN device's ring, for passing to another
+  process by other means than `ring_share/2`.
+
+  Returns `{memfd, rung, waited}`: the memfd holding the rings, the eventfd
+  Tundra rings to wake the other process and the eventfd the other process
+  rings to wake Tundra. The descriptors belong to the ring and are closed when
+  it is; they must not be closed by the caller.
+  Must be called by the owner of the device. Returns `{:error, :disabled}` if
+  the device is not in ring mode.
+  """
+  def ring_fds({:"$socket", _}), do: {:error, :enotsup}
+  def ring_fds({:"$tundra", ref}), do: Tundra.Client.ring_fds(ref)
+
+  @spec ring_share(tun_device(), String.t()) :: :ok | {:error, any()}
+  @doc """
+  Pass a TUN device's ring to the process listening on a Unix socket.
+
+  The process listens with `tundra_ring_accept()` from `c_src/ring`, or any
+  `SOCK_SEQPACKET` socket, and receives the descriptors of `ring_fds/1` as
+  `SCM_RIGHTS`. Only a process running as the same user is accepted. Returns
+  `{:error, :enoent}` or `{:error, :econnrefused}` if nothing is listening
+  yet. Sharing the ring again, for example with a restarted process, passes
+  the same ring, which carries on where it left off.
+  Must be called by the owner of the device.
+  """
+  def ring_share({:"$socket", _}, _path), do: {:error, :enotsup}
+
+  def ring_share({:"$tundra", ref}, path) when is_binary(path),
+    do: Tundra.Client.ring_share(ref, path)
+
+  @spec ring_stats(tun_device()) :: {:ok, map()} | {:error, any()}
+  @doc """
+  Return the counters of a TUN device's ring, since ring mode was last
+  entered.
+
+  - `:rx_packets`, `:rx_bytes` - Packets read from the device into the ring,
+    and their bytes including the TUN header.
+  - `:rx_full` - Times the device was left unread because the other process
+    had not freed a slot.
+  - `:tx_packets`, `:tx_bytes` - Packets from the ring written to the device.
+  - `:tx_errors` - Packets from the ring the device refused, or that were
+    malformed.
+  - `:wakeups` - Times the other process was woken.
+
+  Like `stats/1`, this may be called from any process, and the counters
+  remain after ring mode is left. Returns `{:error, :disabled}` if the device
+  has never been in ring mode.
+  """
+  def ring_stats({:"$socket", _}), do: {:error, :enotsup}
+  def ring_stats({:"$tundra", ref}), do: Tundra.Client.ring_stats(ref)
+
+  @tunnel_ciphers [:chacha20_poly1305, :aes_256_gcm]
+
+  @spec tunnel(tun_device(), keyword() | false) ::
+          {:ok, :inet.port_number()} | :ok | {:error, any()}
+  @doc """
+  Encrypt a TUN device's traffic to peers over UDP in native code.
+
+  In tunnel mode a native thread reads the device's packets, seals each with
+  the key of the peer whose allowed prefixes best match its destination, and
+  sends it from a UDP socket of the device's own, in batches with
+  `sendmmsg(2)`. Datagrams arriving on the socket are opened in batches too,
+  checked against the peer's 2048-counter anti-replay window and allowed
+  prefixes, and written to the device. No packet passes through the BEAM.
+  Returns `{:ok, port}` with the socket's port. Passing `false` leaves tunnel
+  mode, closing the socket and forgetting the peers and their keys.
+
+  Datagrams are laid out as WireGuard transport messages: type 4, a receiver
+  index, a 64-bit counter and the sealed packet. Keys come from the system
+  libcrypto; the handshake that agrees them, and their rotation, are left to
+  Elixir. Every datagram that is not a transport message (a handshake, say) is
+  sent to the owner of the device as
+
+      {:tundra_tunnel, dev, {ip, port}, data}
+
+  and the owner replies with `tunnel_send/3`, then installs the keys with
+  `tunnel_peer/3`.
+
+  The following options are supported:
+
+  - `:cipher` - `:chacha20_poly1305` (the default) or `:aes_256_gcm`, for
+    every peer of the device.
+  - `:ip` - The address to bind the socket to. Defaults to `::`, which also
+    takes IPv4 peers.
+  - `:port` - The port to bind the socket to. Defaults to 0, for any.
+  - `:buffer` - The socket's send and receive buffer sizes, in bytes.
+    Defaults to the system's.
+
+  While the device is in tunnel mode, `recv/3` and `recv_batch/4` return
+  `{:error, :ebusy}` and it cannot be in ring mode or a poll set, but packets
+  may still be sent with `send/3`. Tunnel mode ends when the device is
+  closed. Must be called by the owner of the device. Linux only; a NIF built
+  without libcrypto (see the installation notes in the README) returns
+  `{:error, :enotsup}`.
+
+  ## Examples
+
+      iex> {:ok, {dev, _name}} = Tundra.create("fd11:b7b7:4360::2")
+      iex> {:ok, port} = Tundra.tunnel(dev, cipher: :chacha20_poly1305)
+      iex> :ok = Tundra.tunnel_peer(dev, 1,
+      ...>   remote_index: 7,
+      ...>   endpoint: {"198.51.100.7", 51820},
+      ...>   tx_key: tx_key,
+      ...>   rx_key: rx_key,
+      ...>   allowed_ips: [{"fd11:b7b7:4360::1", 128}])
+  """
+  def tunnel(dev, opts)
+  def tunnel({:"$socket", _}, _opts), do: {:error, :enotsup}
+  def tunnel({:"$tundra", ref}, false), do: Tundra.Client.tunnel(ref, false)
+
+  def tunnel({:"$tundra", ref}, opts) when is_list(opts) do
+    with cipher when cipher in @tunnel_ciphers <- Keyword.get(opts, :cipher, :chacha20_poly1305),
+         {:ok, ip} <- parse_ip(Keyword.get(opts, :ip, {0, 0, 0, 0, 0, 0, 0, 0})),
+         port when is_integer(port) and port in 0..65_535 <- Keyword.get(opts, :port, 0),
+         buffer when is_integer(buffer) and buffer in 0..0x7FFFFFFF <-
+           Keyword.get(opts, :buffer, 0) do
+      Tundra.Client.tunnel(ref, {cipher, {ip_to_binary(ip), port}, buffer})
+    else
+      _ -> {:error, :einval}
+    end
+  end
+
+  def tunnel({:"$tundra", _}, _opts), do: {:error, :einval}
+
+  @spec tunnel_peer(tun_device(), non_neg_integer(), keyword()) :: :ok | {:error, any()}
+  @doc """
+  Add a peer to a TUN device's tunnel, or replace the one with the same index.
+
+  `index` is the receiver index the peer puts in the datagrams it sends. A
+  peer is set with a zero counter and an empty replay window, so rotating its
+  keys means setting it under a new index, agreed in the handshake, and
+  removing the old one with `remove_tunnel_peer/2` once the new one is in use.
+  Where the prefixes of two peers are equally specific, packets go to the one
+  set last.
+
+  The following options are supported:
+
+  - `:remote_index` - The index to put in the datagrams sent to the peer.
+    Required.
+  - `:tx_key`, `:rx_key` - The 32-byte keys for sending to and receiving from
+    the peer. Required.
+  - `:endpoint` - The peer's `{ip, port}`. Until it is known, packets to the
+    peer are dropped. Either way, it moves to the source of the peer's latest
+    authentic datagram.
+  - `:allowed_ips` - Up to 8 `{address, prefix_length}` prefixes: the
+    destinations routed to the peer, and the sources accepted from it.
+    Defaults to none.
+
+  Must be called by the owner of the device. Returns `{:error, :disabled}` if
+  the device is not in tunnel mode.
+  """
+  def tunnel_peer(dev, index, opts)
+  def tunnel_peer({:"$socket", _}, _index, _opts), do: {:error, :enotsup}
+
+  def tunnel_peer({:"$tundra", ref}, index, opts)
+      when is_integer(index) and index in 0..0xFFFFFFFF and is_list(opts) do
+    with remote when is_integer(remote) and remote in 0..0xFFFFFFFF <-
+           Keyword.get(opts, :remote_index),
+         <<_::binary-32>> = tx <- Keyword.get(opts, :tx_key),
+         <<_::binary-32>> = rx <- Keyword.get(opts, :rx_key),
+         endpoint when endpoint != :error <-
+           if(opts[:endpoint], do: convert_endpoint(opts[:endpoint]), else: :undefined),
+         prefixes when is_list(prefixes) and length(prefixes) <= 8 <-
+           Keyword.get(opts, :allowed_ips, []),
+         prefixes = Enum.map(prefixes, &convert_prefix/1),
+         false <- Enum.member?(prefixes, :error) do
+      Tundra.Client.tunnel_peer(ref, index, {remote, endpoint, tx, rx, prefixes})
+    else
+      _ -> {:error, :einval}
+    end
+  end
+
+  def tunnel_peer({:"$tundra", _}, _index, _opts), do: {:error, :einval}
+
+  @spec remove_tunnel_peer(tun_device(), non_neg_integer()) :: :ok | {:error, any()}
+  @doc """
+  Remove a peer from a TUN device's tunnel, forgetting its keys.
+
+  Returns `{:error, :enoent}` if there is no such peer.
+  Must be called by the owner of the device.
+  """
+  def remove_tunnel_peer({:"$socket", _}, _index), do: {:error, :enotsup}
+
+  def remove_tunnel_peer({:"$tundra", ref}, index)
+      when is_integer(index) and index in 0..0xFFFFFFFF,
+      do: Tundra.Client.remove_tunnel_peer(ref, index)
+
+  def remove_tunnel_peer({:"$tundra", _}, _index), do: {:error, :einval}
+
+  @spec tunnel_send(tun_device(), {tun_address(), :inet.port_number()}, iodata()) ::
+          :ok | {:error, any()}
+  @doc """
+  Send a datagram from a TUN device's tunnel socket, such as a handshake
+  message, as is.
+
+  Must be called by the owner of the device.
+  """
+  def tunnel_send({:"$socket", _}, _to, _data), do: {:error, :enotsup}
+
+  def tunnel_send({:"$tundra", ref}, to, data) do
+    case convert_endpoint(to) do
+      :error -> {:error, :einval}
+      to -> Tundra.Client.tunnel_send(ref, to, data)
+    end
+  end
+
+  @spec tunnel_stats(tun_device()) :: {:ok, map()} | {:error, any()}
+  @doc """
+  Return the counters of a TUN device's tunnel, since tunnel mode was last
+  entered.
+
+  - `:rx_packets`, `:rx_bytes` - Packets opened and written to the device, and
+    their bytes.
+  - `:tx_packets`, `:tx_bytes` - Packets sealed and sent to peers.
+  - `:no_route` - Packets from the device that no peer's prefixes match.
+  - `:unknown_peer` - Datagrams naming an index there is no peer for.
+  - `:auth_failures` - Datagrams that did not open with the peer's key.
+  - `:replays` - Datagrams already seen, or too old for the replay window.
+  - `:control` - Datagrams passed to the owner.
+  - `:dropped` - Datagrams that were malformed or had a source the peer may
+    not use, and packets the device or socket would not take.
+  - `:peers` - For each peer, a map of its `:index`, `:counter` (the next it
+    will send, which must not reach 2^64 - 2^13), and its own `:rx_packets`,
+    `:rx_bytes`, `:tx_packets` and `:tx_bytes`.
+
+  Like `stats/1`, this may be called from any process. Returns
+  `{:error, :disabled}` if the device has never been in tunnel mode.
+  """
+  def tunnel_stats({:"$socket", _}), do: {:error, :enotsup}
+  def tunnel_stats({:"$tundra", ref}), do: Tundra.Client.tunnel_stats(ref)
+
+  @spec flow_accounting(tun_device(), keyword() | false) :: :ok | {:error, any()}
+  @doc """
+  Account a TUN device's packets to flows in native code.
+
+  While accounting is on, every packet read with `recv/3` or `recv_batch/4`
+  or written with `send/3` is counted against its flow: the direction,
+  addresses, protocol and ports (for ICMP, the type and code, as
+  `type * 256 + code` in the destination port). Packets moved by a ring or a
+  tunnel thread are not seen. Flows are held in a table of fixed size, so
+  memory stays bounded however many there are; when it is full, the least
+  recently seen of a few flows near the new one is expired to make room.
+
+  A flow is expired once it has been idle for `:idle_timeout` or active for
+  `:active_timeout`, and its record queued. With a `:collector`, a native
+  thread sends the queued records to it as IPFIX (RFC 7011) over UDP, with
+  the templates repeated every minute; otherwise they are taken with
+  `flows/2`. Alongside the table, the heaviest flows by bytes are tracked
+  with a space-saving summary, read with `flow_top/2`.
+
+  The following options are supported:
+
+  - `:max_flows` - The flows held at once. Defaults to 16384, at most
+    1048576.
+  - `:top` - The flows tracked by the summary, which is certain to hold any
+    flow with more than 1/top of the bytes. Defaults to 32, at most 1024; 0
+    turns it off.
+  - `:queue` - The records held until they are taken or sent. Records that do
+    not fit are counted as dropped. Defaults to 4096.
+  - `:active_timeout`, `:idle_timeout` - In seconds. Default to 60 and 15.
+  - `:collector` - The `{ip, port}` of an IPFIX collector.
+  - `:observation_domain` - The observation domain ID in the IPFIX messages.
+    Defaults to 0.
+
+  Passing `false` turns accounting off, sending the flows still in the table
+  to the collector, if there is one, and freeing the table. Accounting is
+  turned off when the device is closed too. Must be called by the owner of
+  the device. Returns `{:error, :ebusy}` if accounting is already on.
+
+  ## Examples
+
+      iex> {:ok, {dev, _name}} = Tundra.create("fd11:b7b7:4360::2")
+      iex> :ok = Tundra.flow_accounting(dev, collector: {"192.0.2.10", 4739})
+  """
+  def flow_accounting(dev, opts)
+  def flow_accounting({:"$socket", _}, _opts), do: {:error, :enotsup}
+
+  def flow_accounting({:"$tundra", ref}, false),
+    do: Tundra.Client.flow_accounting(ref, false)
+
+  def flow_accounting({:"$tundra", ref}, opts) when is_list(opts) do
+    with max when is_integer(max) and max in 1..1_048_576 <-
+           Keyword.get(opts, :max_flows, 16_384),
+         top when is_integer(top) and top in 0..1024 <- Keyword.get(opts, :top, 32),
+         queue when is_integer(queue) and queue in 1..1_048_576 <-
+           Keyword.get(opts, :queue, 4096),
+         active when is_integer(active) and active in 1..0xFFFFFFFF <-
+           Keyword.get(opts, :active_timeout, 60),
+         idle when is_integer(idle) and idle in 1..0xFFFFFFFF <-
+           Keyword.get(opts, :idle_timeout, 15),
+         collector when collector != :error <-
+           if(opts[:collector], do: convert_endpoint(opts[:collector]), else: false),
+         domain when is_integer(domain) and domain in 0..0xFFFFFFFF <-
+           Keyword.get(opts, :observation_domain, 0) do
+      Tundra.Client.flow_accounting(ref, {max, top, queue, active, idle, collector, domain})
+    else
+      _ -> {:error, :einval}
+    end
+  end
+
+  def flow_accounting({:"$tundra", _}, _opts), do: {:error, :einval}
+
+  @spec flows(tun_device(), pos_integer()) :: {:ok, [map()]} | {:error, any()}
+  @doc """
+  Take up to `max` of the oldest records of expired flows, oldest first.
+
+  Each record is a map of:
+
+  - `:direction` - `:inbound` for packets read from the device, `:outbound`
+    for those written to it.
+  - `:src`, `:dst` - The addresses, as tuples.
+  - `:protocol`, `:sport`, `:dport` - The IP protocol number and ports.
+  - `:packets`, `:bytes` - The flow's packets and their bytes.
+  - `:start`, `:end` - When its first and last packets were seen, in
+    `System.system_time(:millisecond)`.
+  - `:tcp_flags` - The TCP flags of all its packets, or'ed together.
+  - `:reason` - Why it was expired: `:idle`, `:active`, `:evicted` or
+    `:forced`.
+
+  With a collector, records are normally sent before they can be taken. Like
+  `stats/1`, this may be called from any process. Returns
+  `{:error, :disabled}` if accounting is off.
+  """
+  def flows(dev, max \\ 1000)
+  def flows({:"$socket", _}, _max), do: {:error, :enotsup}
+
+  def flows({:"$tundra", ref}, max) when is_integer(max) and max in 1..1_048_576,
+    do: Tundra.Client.flows(ref, max)
+
+  def flows({:"$tundra", _}, _max), do: {:error, :einval}
+
+  @spec flow_top(tun_device(), keyword()) :: {:ok, [map()]} | {:error, any()}
+  @doc """
+  Return the heaviest flows by bytes, heaviest first, since accounting was
+  turned on or the summary was last reset.
+
+  Each is a map of the flow's `:direction`, `:src`, `:dst`, `:protocol`,
+  `:sport` and `:dport` as for `flows/2`, with its `:packets` and `:bytes`
+  and the `:error`, the most by which `:bytes` may overstate it. Pass
+  `reset: true` to clear the summary once it is read.
+
+  Like `stats/1`, this may be called from any process. Returns
+  `{:error, :disabled}` if accounting is off.
+  """
+  def flow_top(dev, opts \\ [])
+  def flow_top({:"$socket", _}, _opts), do: {:error, :enotsup}
+
+  def flow_top({:"$tundra", ref}, opts) when is_list(opts) do
+    case Keyword.get(opts, :reset, false) do
+      reset when is_boolean(reset) -> Tundra.Client.flow_top(ref, reset)
+      _ -> {:error, :einval}
+    end
+  end
+
+  def flow_top({:"$tundra", _}, _opts), do: {:error, :einval}
+
+  @spec flow_stats(tun_device()) :: {:ok, map()} | {:error, any()}
+  @doc """
+  Return the flow accounting counters of a TUN device, since accounting was
+  turned on.
+
+  - `:packets` - Packets counted.
+  - `:flows` - Flows in the table.
+  - `:created` - Flows added to the table.
+  - `:expired` - Flows expired on either timeout.
+  - `:evicted` - Flows expired early to make room.
+  - `:queued` - Records waiting to be taken or sent.
+  - `:dropped` - Records the queue had no room for.
+  - `:exported` - Records sent to the collector.
+  - `:export_errors` - IPFIX messages that could not be sent.
+  - `:memory` - Bytes allocated for the table, queue and summary.
+
+  Like `stats/1`, this may be called from any process. Returns
+  `{:error, :disabled}` if accounting is off.
+  """
+  def flow_stats({:"$socket", _}), do: {:error, :enotsup}
+  def flow_stats({:"$tundra", ref}), do: Tundra.Client.flow_stats(ref)
+
+  @doc """
+  Close a TUN device or poll set.
+  """
+  @spec close(tun_device() | poll_set()) :: :ok | {:error, atom()}
   def close({:"$socket", _} = sock), do: :socket.close(sock)
   def close({:"$tundra", ref}), do: Tundra.Client.close(ref)
+  def close({:"$tundra_poll", ref}), do: Tundra.Client.close(ref)
 
-  defp convert_opts(opts) do
+  @doc false
+  def convert_opts(opts) do
     Enum.reduce_while(opts, %{}, fn
       {key, val}, acc when key in [:addr, :dstaddr, :netmask] ->
         case convert_addr(val) do
@@ -344,6 +1891,27 @@ defmodule Tundra do
       {:mtu, _}, _ ->
         {:halt, {:error, :einval}}
 
+      {:persist, p}, acc when is_boolean(p) ->
+        {:cont, Map.put(acc, :persist, p)}
+
+      {:persist, _}, _ ->
+        {:halt, {:error, :einval}}
+
+      {key, n}, acc when key in [:txqueuelen, :sndbuf] and n in 1..0x7FFFFFFF ->
+        {:cont, Map.put(acc, key, n)}
+
+      {key, _}, _ when key in [:txqueuelen, :sndbuf] ->
+        {:halt, {:error, :einval}}
+
+      {:netns, path}, acc when is_binary(path) and path != "" ->
+        {:cont, Map.put(acc, :netns, to_charlist(path))}
+
+      {:netns, fd}, acc when is_integer(fd) and fd >= 0 ->
+        {:cont, Map.put(acc, :netns, fd)}
+
+      {:netns, _}, _ ->
+        {:halt, {:error, :einval}}
+
       _, acc ->
         {:cont, acc}
     end)
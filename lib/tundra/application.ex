@@ -7,6 +7,14 @@ defmodule Tundra.Application do
 
   @impl true
   def start(_type, _args) do
-    DynamicSupervisor.start_link(strategy: :one_for_one, name: Tundra.DynamicSupervisor)
+    children = [
+      {Registry, keys: :duplicate, name: Tundra.Registry},
+      {DynamicSupervisor,
+       strategy: :one_for_one,
+       name: Tundra.DynamicSupervisor,
+       max_children: Tundra.Client.max_connections()}
+    ]
+
+    Supervisor.start_link(children, strategy: :rest_for_one, name: Tundra.Supervisor)
   end
 end
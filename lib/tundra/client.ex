@@ -7,15 +7,57 @@ defmodule Tundra.Client do
   if Version.match?(System.version(), ">= 1.16.0") do
     @nifs connect: 0,
           send_request: 3,
+          send_attach_request: 3,
+          send_configure_request: 4,
           recv_response: 2,
           controlling_process: 2,
           close: 1,
           get_fd: 1,
-          recv_data: 2,
-          send_data: 2,
+          get_stats: 1,
+          set_latency_tracking: 2,
+          get_latency: 1,
+          set_busy_poll: 2,
+          set_send_queue: 7,
+          get_send_queue: 1,
+          capture_start: 8,
+          capture_stop: 1,
+          set_impairment: 3,
+          get_impairment: 1,
+          set_ring: 2,
+          get_ring_fds: 1,
+          share_ring: 2,
+          get_ring_stats: 1,
+          set_tunnel: 2,
+          set_tunnel_peer: 3,
+          delete_tunnel_peer: 2,
+          send_tunnel_control: 3,
+          get_tunnel_stats: 1,
+          set_flow_accounting: 2,
+          get_flows: 2,
+          get_flow_top: 2,
+          get_flow_stats: 1,
+          recv_data: 4,
+          recv_batch_data: 5,
+          fill_room: 3,
+          send_data: 3,
           cancel_select: 2,
           create_tun_direct: 1,
+          configure_tun: 2,
+          reconfigure_tun: 2,
+          attach_tun_direct: 1,
+          set_persist: 2,
+          set_sndbuf: 2,
+          export_devices: 3,
+          import_devices: 2,
+          link_stats: 1,
+          link_monitor_open: 0,
+          link_monitor_read: 1,
           adopt_tun_fd: 1,
+          create_loopback_pair: 1,
+          poll_create: 0,
+          poll_add: 2,
+          poll_remove: 2,
+          poll_wait: 4,
           get_utun_name: 1,
           close_raw_fd: 1
   end
@@ -29,28 +71,196 @@ defmodule Tundra.Client do
     }
   end
 
-  def create_tun_device(pid, params) when is_pid(pid) and is_map(params) do
-    # Try direct creation first (requires privileges)
-    case create_tun_direct(params) do
+  @mode_key {__MODULE__, :mode}
+  @default_connections 4
+
+  def create_tun_device(params) when is_map(params) do
+    with {:ok, {dev, _name}} = result <- create_tun(params) do
+      case set_fd_opts(dev, params) do
+        :ok ->
+          result
+
+        error ->
+          _ = close_device(dev)
+          error
+      end
+    end
+  end
+
+  # The creation mode is :direct, :server or :auto (the default). In :auto mode
+  # the outcome of the first direct attempt is cached, so that once the VM is
+  # known to be unprivileged creations go straight to the server.
+  defp create_tun(params) do
+    case mode() do
+      :server ->
+        create_via_server(params)
+
+      :direct ->
+        create_direct(params)
+
+      :auto ->
+        # Try direct creation first (requires privileges)
+        case create_direct(params) do
+          {:ok, _} = result ->
+            cache_mode(:direct)
+            result
+
+          {:error, reason} when reason in [:eperm, :eacces, :enotsup] ->
+            # No privileges, or platform not supported for direct creation
+            cache_mode(:server)
+            create_via_server(params)
+
+          {:error, _other} = error ->
+            # Other error, return it
+            error
+        end
+    end
+  end
+
+  defp create_direct(params) do
+    with {:ok, {ref, name}} <- create_tun_direct(params) do
+      # Both Linux and Darwin use $tundra refs for directly created devices
+      {:ok, {{:"$tundra", ref}, name}}
+    end
+  end
+
+  defp mode do
+    case Application.get_env(:tundra, :mode, :auto) do
+      :auto -> :persistent_term.get(@mode_key, :auto)
+      mode -> mode
+    end
+  end
+
+  defp cache_mode(mode) do
+    if :persistent_term.get(@mode_key, nil) != mode do
+      :persistent_term.put(@mode_key, mode)
+    end
+  end
+
+  # Persistence and the send buffer are set from the client side on either
+  # creation path: once the descriptor is attached, neither TUNSETPERSIST nor
+  # TUNSETSNDBUF needs further privileges.
+  defp set_fd_opts(dev, params) do
+    with :ok <- persist(dev, Map.get(params, :persist, false)) do
+      sndbuf(dev, Map.get(params, :sndbuf))
+    end
+  end
+
+  defp persist(_dev, false), do: :ok
+  defp persist({:"$tundra", ref}, true), do: set_persist(ref, true)
+  defp persist({:"$socket", _}, true), do: {:error, :enotsup}
+
+  defp sndbuf(_dev, nil), do: :ok
+  defp sndbuf({:"$tundra", ref}, bytes), do: set_sndbuf(ref, bytes)
+  defp sndbuf({:"$socket", _} = sock, bytes), do: :socket.setopt(sock, {:socket, :sndbuf}, bytes)
+
+  defp close_device({:"$tundra", ref}), do: close(ref)
+  defp close_device({:"$socket", _} = sock), do: :socket.close(sock)
+
+  @spec attach(String.t()) ::
+          {:ok, {{:"$socket", reference()} | {:"$tundra", reference()}, String.t()}}
+          | {:error, any()}
+  def attach(name) when is_binary(name) do
+    case attach_tun_direct(to_charlist(name)) do
       {:ok, {ref, name}} ->
-        # Direct creation succeeded - both Linux and Darwin use $tundra refs
         {:ok, {{:"$tundra", ref}, name}}
 
-      {:error, :eperm} ->
-        # No privileges, fall back to server
-        create_via_server(pid, params)
+      {:error, reason} when reason in [:eperm, :eacces] ->
+        # Not the owner and not privileged, ask the server
+        via_server({:attach_tun_device, to_charlist(name)})
 
-      {:error, :eacces} ->
-        # No access, fall back to server
-        create_via_server(pid, params)
+      {:error, _} = error ->
+        error
+    end
+  end
 
-      {:error, :enotsup} ->
-        # Platform not supported for direct creation, try server
-        create_via_server(pid, params)
+  @spec unpersist(reference()) :: :ok | {:error, any()}
+  def unpersist(ref), do: set_persist(ref, false)
+
+  # Names of the persistent TUN devices owned by the effective user.
+  @spec persistent_devices() :: {:ok, list(String.t())} | {:error, any()}
+  def persistent_devices do
+    with {:unix, :linux} <- :os.type(),
+         {:ok, euid} <- effective_uid(),
+         {:ok, names} <- File.ls("/sys/class/net") do
+      {:ok, Enum.filter(names, &persistent_device?(&1, euid))}
+    else
+      {:unix, _} -> {:error, :enotsup}
+      error -> error
+    end
+  end
 
-      {:error, _other} = error ->
-        # Other error, return it
-        error
+  # IFF_TUN | IFF_PERSIST
+  @tun_persist 0x0801
+
+  defp persistent_device?(name, euid) do
+    with {:ok, flags} <- File.read("/sys/class/net/#{name}/tun_flags"),
+         {:ok, owner} <- File.read("/sys/class/net/#{name}/owner"),
+         "0x" <> hex <- String.trim(flags),
+         {flags, ""} <- Integer.parse(hex, 16),
+         {^euid, ""} <- Integer.parse(String.trim(owner)) do
+      Bitwise.band(flags, @tun_persist) == @tun_persist
+    else
+      _ -> false
+    end
+  end
+
+  defp effective_uid do
+    with {:ok, status} <- File.read("/proc/self/status"),
+         [_, uids] <- Regex.run(~r/^Uid:\s+(.*)$/m, status),
+         [_real, euid | _] <- String.split(uids),
+         {euid, ""} <- Integer.parse(euid) do
+      {:ok, euid}
+    else
+      {:error, _} = error -> error
+      _ -> {:error, :einval}
+    end
+  end
+
+  # Device metadata travels in the external term format. Only a VM running as
+  # the same user can connect, so it is decoded as trusted.
+  @spec handoff_export(list({reference(), term()}), String.t(), integer()) ::
+          :ok | {:error, any()}
+  def handoff_export(pairs, path, timeout) do
+    devs = for {ref, meta} <- pairs, do: {ref, :erlang.term_to_binary(meta)}
+    export_devices(path, devs, timeout)
+  end
+
+  @spec handoff_import(String.t(), integer()) ::
+          {:ok, list({reference(), String.t(), term()})} | {:error, any()}
+  def handoff_import(path, timeout) do
+    with {:ok, devs} <- import_devices(path, timeout) do
+      {:ok, for({ref, name, meta} <- devs, do: {ref, name, :erlang.binary_to_term(meta)})}
+    end
+  end
+
+  @spec interface_stats(list(String.t())) :: {:ok, %{String.t() => map()}} | {:error, any()}
+  def interface_stats(names) when is_list(names), do: link_stats(names)
+
+  @spec open_link_monitor() :: {:ok, reference()} | {:error, any()}
+  def open_link_monitor, do: link_monitor_open()
+
+  @spec read_link_events(reference()) ::
+          {:ok, list(tuple())} | {:select, :socket.select_info()} | {:error, any()}
+  def read_link_events(ref), do: link_monitor_read(ref)
+
+  @spec configure(String.t(), map()) :: :ok | {:error, any()}
+  def configure(name, params) when is_binary(name) and is_map(params) do
+    configure_tun(to_charlist(name), params)
+  end
+
+  # Changes are {:mtu, mtu}, {:up, boolean} and {op, {address, prefix_len}}
+  # with the address as a 4 or 16-byte binary. Without the privileges to
+  # apply them directly, they are applied by the server, which is passed the
+  # device's descriptor.
+  @spec reconfigure(reference(), list()) :: :ok | {:error, any()}
+  def reconfigure(ref, changes) when is_list(changes) do
+    case reconfigure_tun(ref, changes) do
+      {:error, reason} when reason in [:eperm, :eacces] ->
+        call_server({:configure_tun_device, {ref, changes}}, 1)
+
+      result ->
+        result
     end
   end
 
@@ -81,8 +291,43 @@ defmodule Tundra.Client do
     end
   end
 
-  defp create_via_server(pid, params) do
-    with {:ok, {ref, name}} <- :gen_statem.call(pid, {:create_tun_device, params}) do
+  @spec create_loopback(non_neg_integer()) ::
+          {:ok, {{:"$tundra", reference()}, {:"$tundra", reference()}}} | {:error, any()}
+  def create_loopback(buffer) when is_integer(buffer) and buffer >= 0 do
+    with {:ok, {dev, peer}} <- create_loopback_pair(buffer) do
+      {:ok, {{:"$tundra", dev}, {:"$tundra", peer}}}
+    end
+  end
+
+  @spec new_poll_set() :: {:ok, {:"$tundra_poll", reference()}} | {:error, any()}
+  def new_poll_set do
+    with {:ok, ref} <- poll_create() do
+      {:ok, {:"$tundra_poll", ref}}
+    end
+  end
+
+  @spec poll_register(reference(), reference()) :: :ok | {:error, any()}
+  def poll_register(set, ref), do: poll_add(set, ref)
+
+  @spec poll_unregister(reference(), reference()) :: :ok | {:error, any()}
+  def poll_unregister(set, ref), do: poll_remove(set, ref)
+
+  @spec poll(reference(), pos_integer(), pos_integer(), non_neg_integer()) ::
+          {:ok, list()} | {:select, :socket.select_info()} | {:error, any()}
+  def poll(set, max, length, batch) do
+    case poll_wait(set, max, length, batch) do
+      {:ok, ready} -> {:ok, Enum.map(ready, &wrap_ready/1)}
+      other -> other
+    end
+  end
+
+  defp wrap_ready({ref, packets}), do: {{:"$tundra", ref}, packets}
+  defp wrap_ready(ref), do: {:"$tundra", ref}
+
+  defp create_via_server(params), do: via_server({:create_tun_device, params})
+
+  defp via_server(request) do
+    with {:ok, {ref, name}} <- call_server(request, 1) do
       case :os.type() do
         {:unix, :darwin} ->
           {:ok, s} = :socket.open(get_fd(ref), %{domain: 32, type: 2, protocol: 2})
@@ -98,18 +343,183 @@ defmodule Tundra.Client do
     end
   end
 
+  # Requests are spread over a small set of long-lived server connections. A
+  # request that never reached the server, because its connection was found
+  # closed (e.g. by an older server that serves one request per connection)
+  # or stopped while the request waited for it, is retried once on another.
+  # Once a request has been sent it is never retried, as it may have been
+  # applied: the server's answer, or the connection's failure, is returned.
+  defp call_server(request, retries) do
+    result =
+      with {:ok, pid} <- connection() do
+        try do
+          :gen_statem.call(pid, request)
+        catch
+          # The connection had stopped, after replying to any request it sent
+          :exit, {:noproc, _} -> {:not_sent, :closed}
+          :exit, {{:shutdown, _}, _} -> {:not_sent, :closed}
+
+          :exit, _ -> {:error, :closed}
+        end
+      end
+
+    case result do
+      {:not_sent, _} when retries > 0 -> call_server(request, retries - 1)
+      {:not_sent, reason} -> {:error, reason}
+      result -> result
+    end
+  end
+
+  # The supervisor starts at most max_connections/0 connections, deciding
+  # one start at a time, so callers racing to open the last one cannot
+  # exceed it
+  defp connection do
+    conns = Registry.lookup(Tundra.Registry, __MODULE__)
+
+    with true <- length(conns) < max_connections(),
+         {:error, :max_children} <-
+           DynamicSupervisor.start_child(Tundra.DynamicSupervisor, __MODULE__) do
+      pick(Registry.lookup(Tundra.Registry, __MODULE__))
+    else
+      false -> pick(conns)
+      result -> result
+    end
+  end
+
+  defp pick([]), do: {:not_sent, :closed}
+
+  defp pick(conns) do
+    {pid, _} = Enum.at(conns, :erlang.phash2(self(), length(conns)))
+    {:ok, pid}
+  end
+
+  @doc false
+  @spec max_connections() :: pos_integer()
+  def max_connections,
+    do: Application.get_env(:tundra, :server_connections, @default_connections)
+
   @spec recv(reference(), non_neg_integer(), list(), :nowait) ::
           {:ok, binary()} | {:error, any()} | {:select, :socket.select_info()}
-  def recv(ref, length, _flags, :nowait) do
-    recv_data(ref, length)
+  def recv(ref, length, flags, :nowait) do
+    recv_data(ref, length, Keyword.get(flags, :headroom, 0), Keyword.get(flags, :tailroom, 0))
   end
 
+  @spec recv_batch(reference(), non_neg_integer(), pos_integer(), list(), :nowait) ::
+          {:ok, [binary()]} | {:error, any()} | {:select, :socket.select_info()}
+  def recv_batch(ref, length, max, flags, :nowait) do
+    head = Keyword.get(flags, :headroom, 0)
+    recv_batch_data(ref, length, max, head, Keyword.get(flags, :tailroom, 0))
+  end
+
+  @spec fill_headroom(binary(), iodata(), iodata()) :: {:ok, binary()} | {:error, any()}
+  def fill_headroom(packet, header, trailer), do: fill_room(packet, header, trailer)
+
   @spec send(reference(), iodata(), list(), :nowait) ::
           :ok | {:ok, binary()} | {:select, :socket.select_info()} | {:error, any()}
-  def send(ref, data, _flags, :nowait) do
-    send_data(ref, :erlang.iolist_to_iovec(data))
+  def send(ref, data, flags, :nowait) do
+    send_data(ref, :erlang.iolist_to_iovec(data), Keyword.get(flags, :class, -1))
+  end
+
+  @spec stats(reference()) :: {:ok, map()} | {:error, any()}
+  def stats(ref), do: get_stats(ref)
+
+  @spec track_latency(reference(), boolean()) :: :ok | {:error, any()}
+  def track_latency(ref, enabled), do: set_latency_tracking(ref, enabled)
+
+  @spec busy_poll(reference(), non_neg_integer()) :: :ok | {:error, any()}
+  def busy_poll(ref, usec), do: set_busy_poll(ref, usec)
+
+  @spec latency(reference()) :: {:ok, %{atom() => Tundra.Histogram.t()}} | {:error, any()}
+  def latency(ref) do
+    with {:ok, hists} <- get_latency(ref) do
+      {:ok, Map.new(hists, fn {key, hist} -> {key, Tundra.Histogram.new(hist)} end)}
+    end
+  end
+
+  # Classes are {weight, packets, bytes, priority} tuples and the DSCP map a
+  # 64-byte binary giving the class of each DSCP.
+  @spec send_queue(reference(), map()) :: :ok | {:error, any()}
+  def send_queue(ref, %{packets: packets, bytes: bytes, low: low, high: high} = config) do
+    classes = Map.get(config, :classes, [{1, 0, 0, false}])
+    dscp = Map.get(config, :dscp, <<0::512>>)
+    set_send_queue(ref, packets, bytes, low, high, classes, dscp)
+  end
+
+  @spec send_queue_stats(reference()) :: {:ok, list(map())} | {:error, any()}
+  def send_queue_stats(ref) do
+    with {:ok, classes} <- get_send_queue(ref) do
+      {:ok, Enum.map(classes, &%{&1 | delay: Tundra.Histogram.new(&1.delay)})}
+    end
   end
 
+  # Filters are lists of {code, jt, jf, k} classic BPF instructions
+  @spec capture(reference(), String.t(), map()) :: :ok | {:error, any()}
+  def capture(ref, path, config) do
+    %{snaplen: snaplen, sample: sample, file_size: size, files: files, buffer: buffer} = config
+    capture_start(ref, path, snaplen, sample, size, files, buffer, config.filter)
+  end
+
+  @spec stop_capture(reference()) :: {:ok, map()} | {:error, any()}
+  def stop_capture(ref), do: capture_stop(ref)
+
+  # The NIF takes a {delay, jitter, p, r, loss_bad, loss_good, duplicate,
+  # reorder, rate, burst, limit, seed} tuple, with probabilities as fractions
+  # of 2^32
+  @spec impair(reference(), :send | :recv, map() | false) :: :ok | {:error, any()}
+  def impair(ref, direction, false), do: set_impairment(ref, direction, false)
+
+  def impair(ref, direction, config) do
+    {p, r, bad, good} = config.loss
+    probs = [p, r, bad, good, config.duplicate, config.reorder]
+    probs = Enum.map(probs, &round(&1 * 4_294_967_296))
+    rest = [config.rate, config.burst, config.limit, config.seed]
+    set_impairment(ref, direction, List.to_tuple([config.delay, config.jitter | probs] ++ rest))
+  end
+
+  @spec impair_stats(reference()) :: {:ok, map()} | {:error, any()}
+  def impair_stats(ref), do: get_impairment(ref)
+
+  @spec ring(reference(), {pos_integer(), pos_integer()} | false) :: :ok | {:error, any()}
+  def ring(ref, config), do: set_ring(ref, config)
+
+  @spec ring_fds(reference()) ::
+          {:ok, {non_neg_integer(), non_neg_integer(), non_neg_integer()}} | {:error, any()}
+  def ring_fds(ref), do: get_ring_fds(ref)
+
+  @spec ring_share(reference(), String.t()) :: :ok | {:error, any()}
+  def ring_share(ref, path), do: share_ring(ref, path)
+
+  @spec ring_stats(reference()) :: {:ok, map()} | {:error, any()}
+  def ring_stats(ref), do: get_ring_stats(ref)
+
+  @spec tunnel(reference(), {atom(), {binary(), char()}, non_neg_integer()} | false) ::
+          :ok | {:ok, char()} | {:error, any()}
+  def tunnel(ref, config), do: set_tunnel(ref, config)
+
+  @spec tunnel_peer(reference(), non_neg_integer(), tuple()) :: :ok | {:error, any()}
+  def tunnel_peer(ref, index, config), do: set_tunnel_peer(ref, index, config)
+
+  @spec remove_tunnel_peer(reference(), non_neg_integer()) :: :ok | {:error, any()}
+  def remove_tunnel_peer(ref, index), do: delete_tunnel_peer(ref, index)
+
+  @spec tunnel_send(reference(), {binary(), char()}, iodata()) :: :ok | {:error, any()}
+  def tunnel_send(ref, to, data), do: send_tunnel_control(ref, to, data)
+
+  @spec tunnel_stats(reference()) :: {:ok, map()} | {:error, any()}
+  def tunnel_stats(ref), do: get_tunnel_stats(ref)
+
+  @spec flow_accounting(reference(), tuple() | false) :: :ok | {:error, any()}
+  def flow_accounting(ref, config), do: set_flow_accounting(ref, config)
+
+  @spec flows(reference(), pos_integer()) :: {:ok, [map()]} | {:error, any()}
+  def flows(ref, max), do: get_flows(ref, max)
+
+  @spec flow_top(reference(), boolean()) :: {:ok, [map()]} | {:error, any()}
+  def flow_top(ref, reset), do: get_flow_top(ref, reset)
+
+  @spec flow_stats(reference()) :: {:ok, map()} | {:error, any()}
+  def flow_stats(ref), do: get_flow_stats(ref)
+
   @spec cancel(reference(), :socket.select_info()) :: :ok | {:error, any()}
   def cancel(ref, select_info) do
     cancel_select(ref, select_info)
@@ -120,10 +530,16 @@ defmodule Tundra.Client do
     :gen_statem.start_link(__MODULE__, opts, [])
   end
 
+  @type request() ::
+          {:create_tun_device, map()}
+          | {:attach_tun_device, charlist()}
+          | {:configure_tun_device, {reference(), list()}}
+
   typedstruct do
     field(:conn, reference() | nil)
     field(:caller, GenServer.from() | nil, default: nil)
     field(:blocked, reference() | nil, default: nil)
+    field(:request, request() | nil, default: nil)
   end
 
   @impl true
@@ -131,50 +547,49 @@ defmodule Tundra.Client do
 
   @impl true
   def init(_opts) do
-    # Try to connect to server, but allow it to fail since we might use direct creation
+    # Connections are only started once server mode is in use, so a server
+    # that cannot be reached is an error for the request that needed it
     case connect() do
       {:ok, conn} ->
+        {:ok, _} = Registry.register(Tundra.Registry, __MODULE__, nil)
         {:ok, :connected, %__MODULE__{conn: conn}}
 
       {:error, reason} ->
-        # Server not available, we'll try direct creation
-        {:ok, {:disconnected, reason}, %__MODULE__{conn: nil}}
+        {:stop, reason}
     end
   end
 
   @impl true
-  def handle_event(
-        {:call, from},
-        {:create_tun_device, _params},
-        {:disconnected, reason},
-        data
-      ) do
-    # Server not available, return the connection error
-    {:keep_state, data, {:reply, from, {:error, reason}}}
+  def handle_event({:call, _from}, _request, state, _data)
+      when state in [:sending, :receiving] do
+    # One request at a time per connection
+    {:keep_state_and_data, :postpone}
   end
 
   def handle_event(
         {:call, from},
-        {:create_tun_device, params},
+        {kind, _} = request,
         :connected,
         %__MODULE__{caller: nil} = data
-      ) do
-    event = {:next_event, :internal, {:send_request, params}}
-    {:next_state, :sending, %__MODULE__{data | caller: from}, event}
+      )
+      when kind in [:create_tun_device, :attach_tun_device, :configure_tun_device] do
+    event = {:next_event, :internal, :send_request}
+    {:next_state, :sending, %__MODULE__{data | caller: from, request: request}, event}
   end
 
-  def handle_event(:internal, {:send_request, params}, :sending, %__MODULE__{blocked: nil} = data) do
+  def handle_event(:internal, :send_request, :sending, %__MODULE__{blocked: nil} = data) do
     ref = make_ref()
 
-    case send_request(data.conn, ref, params) do
+    case send_server_request(data.conn, ref, data.request) do
       :ok ->
         {:next_state, :receiving, data, {:next_event, :internal, :recv_response}}
 
       {:error, :eagain} ->
         {:keep_state, %__MODULE__{data | blocked: ref}}
 
-      {:error, reason} = error ->
-        {:stop_and_reply, reason, %__MODULE__{data | caller: nil}, {:reply, data.caller, error}}
+      {:error, reason} ->
+        reply = {:reply, data.caller, {:not_sent, reason}}
+        {:stop_and_reply, {:shutdown, reason}, reply, %__MODULE__{data | caller: nil}}
     end
   end
 
@@ -192,15 +607,23 @@ defmodule Tundra.Client do
 
     case recv_response(data.conn, ref) do
       {:ok, {ref, _}} = reply ->
-        {pid, _} = data.caller
+        {pid, _} = caller = data.caller
         :ok = controlling_process(ref, pid)
-        {:stop_and_reply, :normal, {:reply, data.caller, reply}, %__MODULE__{data | caller: nil}}
+        data = %__MODULE__{data | caller: nil, request: nil}
+        {:next_state, :connected, data, {:reply, caller, reply}}
+
+      {answer, reply} when answer in [:configured, :refused] ->
+        # A failed request leaves the connection usable
+        caller = data.caller
+        data = %__MODULE__{data | caller: nil, request: nil}
+        {:next_state, :connected, data, {:reply, caller, reply}}
 
       {:error, :eagain} ->
         {:keep_state, %__MODULE__{data | blocked: ref}}
 
       {:error, reason} = error ->
-        {:stop_and_reply, reason, {:reply, data.caller, error}, %__MODULE__{data | caller: nil}}
+        reply = {:reply, data.caller, error}
+        {:stop_and_reply, {:shutdown, reason}, reply, %__MODULE__{data | caller: nil}}
     end
   end
 
@@ -213,6 +636,15 @@ defmodule Tundra.Client do
     {:keep_state, %__MODULE__{data | blocked: nil}, {:next_event, :internal, :recv_response}}
   end
 
+  defp send_server_request(conn, ref, {:create_tun_device, params}),
+    do: send_request(conn, ref, params)
+
+  defp send_server_request(conn, ref, {:attach_tun_device, name}),
+    do: send_attach_request(conn, ref, name)
+
+  defp send_server_request(conn, ref, {:configure_tun_device, {dev, changes}}),
+    do: send_configure_request(conn, ref, dev, changes)
+
   defp load_nif do
     path = Path.join(:code.priv_dir(:tundra), "tundra_nif")
     :erlang.load_nif(to_charlist(path), 0)
@@ -220,14 +652,83 @@ defmodule Tundra.Client do
 
   defp connect, do: :erlang.nif_error(:not_implemented)
   defp send_request(_conn, _ref, _params), do: :erlang.nif_error(:not_implemented)
+  defp send_attach_request(_conn, _ref, _name), do: :erlang.nif_error(:not_implemented)
+
+  defp send_configure_request(_conn, _ref, _dev, _changes),
+    do: :erlang.nif_error(:not_implemented)
+
   defp recv_response(_conn, _ref), do: :erlang.nif_error(:not_implemented)
   defp get_fd(_conn), do: :erlang.nif_error(:not_implemented)
+  defp get_stats(_ref), do: :erlang.nif_error(:not_implemented)
+  defp set_latency_tracking(_ref, _enabled), do: :erlang.nif_error(:not_implemented)
+  defp get_latency(_ref), do: :erlang.nif_error(:not_implemented)
+  defp set_busy_poll(_ref, _usec), do: :erlang.nif_error(:not_implemented)
+
+  defp set_send_queue(_ref, _packets, _bytes, _low, _high, _classes, _dscp),
+    do: :erlang.nif_error(:not_implemented)
+
+  defp get_send_queue(_ref), do: :erlang.nif_error(:not_implemented)
+
+  defp capture_start(_ref, _path, _snaplen, _sample, _file_size, _files, _buffer, _filter),
+    do: :erlang.nif_error(:not_implemented)
+
+  defp capture_stop(_ref), do: :erlang.nif_error(:not_implemented)
+
+  defp set_impairment(_ref, _direction, _config), do: :erlang.nif_error(:not_implemented)
+
+  defp get_impairment(_ref), do: :erlang.nif_error(:not_implemented)
+
+  defp set_ring(_ref, _config), do: :erlang.nif_error(:not_implemented)
+
+  defp get_ring_fds(_ref), do: :erlang.nif_error(:not_implemented)
+
+  defp share_ring(_ref, _path), do: :erlang.nif_error(:not_implemented)
+
+  defp get_ring_stats(_ref), do: :erlang.nif_error(:not_implemented)
+
+  defp set_tunnel(_ref, _config), do: :erlang.nif_error(:not_implemented)
+
+  defp set_tunnel_peer(_ref, _index, _config), do: :erlang.nif_error(:not_implemented)
+
+  defp delete_tunnel_peer(_ref, _index), do: :erlang.nif_error(:not_implemented)
+
+  defp send_tunnel_control(_ref, _to, _data), do: :erlang.nif_error(:not_implemented)
+
+  defp get_tunnel_stats(_ref), do: :erlang.nif_error(:not_implemented)
+
+  defp set_flow_accounting(_ref, _config), do: :erlang.nif_error(:not_implemented)
+
+  defp get_flows(_ref, _max), do: :erlang.nif_error(:not_implemented)
+
+  defp get_flow_top(_ref, _reset), do: :erlang.nif_error(:not_implemented)
+
+  defp get_flow_stats(_ref), do: :erlang.nif_error(:not_implemented)
+
+  defp recv_data(_ref, _length, _head, _tail), do: :erlang.nif_error(:not_implemented)
+
+  defp recv_batch_data(_ref, _length, _max, _head, _tail),
+    do: :erlang.nif_error(:not_implemented)
 
-  defp recv_data(_ref, _length), do: :erlang.nif_error(:not_implemented)
-  defp send_data(_ref, _data), do: :erlang.nif_error(:not_implemented)
+  defp fill_room(_packet, _header, _trailer), do: :erlang.nif_error(:not_implemented)
+  defp send_data(_ref, _data, _class), do: :erlang.nif_error(:not_implemented)
   defp cancel_select(_ref, _select_info), do: :erlang.nif_error(:not_implemented)
   defp create_tun_direct(_params), do: :erlang.nif_error(:not_implemented)
+  defp configure_tun(_name, _params), do: :erlang.nif_error(:not_implemented)
+  defp reconfigure_tun(_ref, _changes), do: :erlang.nif_error(:not_implemented)
+  defp attach_tun_direct(_name), do: :erlang.nif_error(:not_implemented)
+  defp set_persist(_ref, _persist), do: :erlang.nif_error(:not_implemented)
+  defp set_sndbuf(_ref, _bytes), do: :erlang.nif_error(:not_implemented)
+  defp export_devices(_path, _devs, _timeout), do: :erlang.nif_error(:not_implemented)
+  defp import_devices(_path, _timeout), do: :erlang.nif_error(:not_implemented)
+  defp link_stats(_names), do: :erlang.nif_error(:not_implemented)
+  defp link_monitor_open, do: :erlang.nif_error(:not_implemented)
+  defp link_monitor_read(_ref), do: :erlang.nif_error(:not_implemented)
   defp adopt_tun_fd(_fd), do: :erlang.nif_error(:not_implemented)
+  defp create_loopback_pair(_buffer), do: :erlang.nif_error(:not_implemented)
+  defp poll_create, do: :erlang.nif_error(:not_implemented)
+  defp poll_add(_set, _ref), do: :erlang.nif_error(:not_implemented)
+  defp poll_remove(_set, _ref), do: :erlang.nif_error(:not_implemented)
+  defp poll_wait(_set, _max, _length, _batch), do: :erlang.nif_error(:not_implemented)
   defp get_utun_name(_fd), do: :erlang.nif_error(:not_implemented)
   defp close_raw_fd(_fd), do: :erlang.nif_error(:not_implemented)
 
@@ -0,0 +1,139 @@
+if Code.ensure_loaded?(GenStage) do
+  defmodule Tundra.Consumer do
+    @moduledoc """
+    A `GenStage` consumer that writes the packets it receives to a TUN device.
+
+    Events are IP packets, as binaries or iodata, and are written in order. When
+    the device will not take a packet the consumer selects it and writes the
+    rest once it will, still handling other messages meanwhile. Demand is
+    manual: a producer is asked for up to its `:max_demand` of events once the
+    device is owned, and for as many again as each of its batches is written,
+    so a full device holds back the stages before it and the events held by
+    the consumer never exceed the subscriptions' `:max_demand`. A packet
+    refused for any other reason, such as a full send queue (see
+    `Tundra.send_queue/2`), is skipped; the device's counters (see
+    `Tundra.stats/1`) record it.
+
+    A device has a single owner, so a consumer writes to a device of its own
+    rather than to one a `Tundra.Producer` reads from.
+
+    Requires the optional `:gen_stage` dependency.
+
+    ## Options
+
+    - `:device` - A device owned by the caller, which is handed to the consumer
+      once it has started. The consumer must then be started by the owner,
+      rather than by a supervisor.
+    - `:create` - An `{address, opts}` tuple, to create a device with
+      `Tundra.create/2` instead.
+    - `:subscribe_to` - The producers to subscribe to, as for `GenStage`. A
+      subscription's `:max_demand` defaults to 1000.
+    - `:name` - An optional name to register the consumer under.
+
+    The consumer stops when the peer of a loopback device closes, and the
+    device is closed when the consumer exits.
+    """
+    use GenStage
+    use TypedStruct
+
+    typedstruct do
+      field(:dev, Tundra.tun_device())
+      field(:owned, boolean(), default: false)
+      field(:subscriptions, %{optional(GenStage.from()) => pos_integer()}, default: %{})
+      # {from, events asked for, events left to write} per batch
+      field(:pending, :queue.queue(), default: :queue.new())
+      field(:selecting, boolean(), default: false)
+    end
+
+    @doc """
+    Start a consumer.
+
+    See the module documentation for the supported options.
+    """
+    @spec start_link(keyword()) :: GenServer.on_start()
+    def start_link(opts) do
+      {name, opts} = Keyword.pop(opts, :name)
+      gen_opts = if name, do: [name: name], else: []
+
+      with {:ok, pid} <- GenStage.start_link(__MODULE__, opts, gen_opts) do
+        Tundra.Stage.hand_over(pid, Keyword.get(opts, :device))
+      end
+    end
+
+    @impl true
+    def init(opts) do
+      case Tundra.Stage.device(opts) do
+        {:ok, dev, owned} ->
+          state = %__MODULE__{dev: dev, owned: owned}
+          {:consumer, state, subscribe_to: Keyword.get(opts, :subscribe_to, [])}
+
+        {:error, reason} ->
+          {:stop, reason}
+
+        :error ->
+          {:stop, :einval}
+      end
+    end
+
+    # No events are asked for before the device has been handed over
+    @impl true
+    def handle_subscribe(:producer, opts, from, state) do
+      demand = Keyword.get(opts, :max_demand, 1000)
+      if state.owned, do: GenStage.ask(from, demand)
+      {:manual, %__MODULE__{state | subscriptions: Map.put(state.subscriptions, from, demand)}}
+    end
+
+    @impl true
+    def handle_cancel(_reason, from, state) do
+      {:noreply, [], %__MODULE__{state | subscriptions: Map.delete(state.subscriptions, from)}}
+    end
+
+    @impl true
+    def handle_events(events, from, state) do
+      pending = :queue.in({from, length(events), events}, state.pending)
+      write(%__MODULE__{state | pending: pending})
+    end
+
+    @impl true
+    def handle_cast(:owned, state) do
+      Enum.each(state.subscriptions, fn {from, demand} -> GenStage.ask(from, demand) end)
+      {:noreply, [], %__MODULE__{state | owned: true}}
+    end
+
+    @impl true
+    def handle_info({:"$socket", dev, :select, _}, %__MODULE__{dev: dev} = state) do
+      write(%__MODULE__{state | selecting: false})
+    end
+
+    def handle_info(_msg, state), do: {:noreply, [], state}
+
+    # Write the pending batches in order until the device would block, in which
+    # case it is selected. A batch's producer is asked for as many events again
+    # once the batch is written.
+    defp write(%__MODULE__{selecting: true} = state), do: {:noreply, [], state}
+
+    defp write(%__MODULE__{dev: dev} = state) do
+      case :queue.out(state.pending) do
+        {:empty, _} ->
+          {:noreply, [], state}
+
+        {{:value, {from, n, []}}, pending} ->
+          if Map.has_key?(state.subscriptions, from), do: GenStage.ask(from, n)
+          write(%__MODULE__{state | pending: pending})
+
+        {{:value, {from, n, [packet | rest]}}, pending} ->
+          case Tundra.send(dev, packet, :nowait) do
+            {:select, _} ->
+              {:noreply, [], %__MODULE__{state | selecting: true}}
+
+            {:error, :epipe} ->
+              # The peer of a loopback device has closed
+              {:stop, :normal, state}
+
+            _ ->
+              write(%__MODULE__{state | pending: :queue.in_r({from, n, rest}, pending)})
+          end
+      end
+    end
+  end
+end
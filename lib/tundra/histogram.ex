@@ -0,0 +1,87 @@
+defmodule Tundra.Histogram do
+  @moduledoc """
+  A latency histogram, as returned by `Tundra.latency/1`.
+
+  Values are durations in nanoseconds, counted in log-linear buckets: values
+  below 64 are exact and larger values fall in buckets whose width is at most
+  about 3% of the value. Each bucket is keyed by the highest value it counts,
+  so percentiles are reported as that upper bound (capped at the recorded
+  maximum).
+
+  Histograms from different devices, or from successive reads of the same
+  device, can be combined with `merge/2`.
+  """
+  use TypedStruct
+
+  typedstruct do
+    field(:count, non_neg_integer(), default: 0)
+    field(:sum, non_neg_integer(), default: 0)
+    field(:min, non_neg_integer(), default: 0)
+    field(:max, non_neg_integer(), default: 0)
+    field(:buckets, %{optional(non_neg_integer()) => pos_integer()}, default: %{})
+  end
+
+  @doc false
+  def new(%{count: count, sum: sum, min: min, max: max, buckets: buckets}) do
+    %__MODULE__{count: count, sum: sum, min: min, max: max, buckets: Map.new(buckets)}
+  end
+
+  @doc """
+  Combine two histograms.
+  """
+  @spec merge(t(), t()) :: t()
+  def merge(%__MODULE__{count: 0}, %__MODULE__{} = b), do: b
+  def merge(%__MODULE__{} = a, %__MODULE__{count: 0}), do: a
+
+  def merge(%__MODULE__{} = a, %__MODULE__{} = b) do
+    %__MODULE__{
+      count: a.count + b.count,
+      sum: a.sum + b.sum,
+      min: min(a.min, b.min),
+      max: max(a.max, b.max),
+      buckets: Map.merge(a.buckets, b.buckets, fn _, x, y -> x + y end)
+    }
+  end
+
+  @doc """
+  Return the mean value, or `nil` if the histogram is empty.
+  """
+  @spec mean(t()) :: float() | nil
+  def mean(%__MODULE__{count: 0}), do: nil
+  def mean(%__MODULE__{count: count, sum: sum}), do: sum / count
+
+  @doc """
+  Return the value below which `p` percent of the recorded values fall, or
+  `nil` if the histogram is empty.
+
+  ## Examples
+
+      iex> {:ok, %{recv: recv}} = Tundra.latency(dev)
+      iex> Tundra.Histogram.percentile(recv, 99.9)
+      14335
+  """
+  @spec percentile(t(), number()) :: non_neg_integer() | nil
+  def percentile(%__MODULE__{count: 0}, _p), do: nil
+
+  def percentile(%__MODULE__{} = hist, p) when p >= 0 and p <= 100 do
+    rank = max(ceil(p * hist.count / 100), 1)
+
+    hist.buckets
+    |> Enum.sort()
+    |> Enum.reduce_while(0, fn {upper, n}, seen ->
+      if seen + n >= rank, do: {:halt, {:value, upper}}, else: {:cont, seen + n}
+    end)
+    |> case do
+      {:value, upper} -> min(upper, hist.max)
+      _ -> hist.max
+    end
+  end
+
+  @doc """
+  Return a map of the given percentiles.
+  """
+  @spec percentiles(t(), list(number())) :: %{number() => non_neg_integer() | nil}
+  def percentiles(%__MODULE__{} = hist, ps \\ [50, 90, 99, 99.9]) do
+    Map.new(ps, &{&1, percentile(hist, &1)})
+  end
+end
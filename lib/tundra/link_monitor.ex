@@ -0,0 +1,196 @@
+defmodule Tundra.LinkMonitor do
+  @moduledoc """
+  Notify a process when network interfaces change.
+
+  The monitor subscribes to the kernel's interface notifications
+  (`RTNLGRP_LINK`) and sends
+
+      {:tundra_link, name, event}
+
+  to the notified process, where `event` is one of:
+
+  - `:added` - The interface appeared.
+  - `:up` - The interface became operational: it is administratively up and,
+    for a TUN device, a descriptor is attached (`IFF_UP` and `IFF_RUNNING`).
+  - `:down` - The interface stopped being operational.
+  - `{:mtu, mtu}` - The interface's MTU changed.
+  - `:removed` - The interface was removed.
+
+  The kernel only reports that an interface changed, so the monitor keeps the
+  last state of each interface and sends only what differs. Should the kernel
+  drop notifications because the monitor fell behind, the monitor reads every
+  interface afresh and reports the differences, so no change is missed,
+  although intermediate states may be.
+
+  Linux only; the monitor fails to start with `:enotsup` elsewhere.
+
+  ## Options
+
+  - `:notify` - The process to notify. Defaults to the caller. The monitor
+    stops when this process exits.
+  - `:devices` - The names of the interfaces to report. Defaults to all of
+    them.
+  - `:name` - An optional name to register the monitor under.
+
+  ## Example
+
+      {:ok, {dev, name}} = Tundra.create("fd11:b7b7:4360::2")
+      {:ok, _} = Tundra.LinkMonitor.start_link(devices: [name])
+
+      receive do
+        {:tundra_link, ^name, :down} -> :reconnect
+      end
+  """
+  use GenServer
+  use TypedStruct
+
+  # An interface's name, whether it is operational, and its MTU
+  @typep link() :: {String.t(), boolean(), non_neg_integer()}
+
+  typedstruct do
+    field(:ref, reference())
+    field(:notify, pid())
+    field(:devices, MapSet.t(String.t()) | nil)
+    field(:links, %{optional(pos_integer()) => link()}, default: %{})
+  end
+
+  @doc """
+  Start a link monitor.
+
+  See the module documentation for the supported options.
+  """
+  @spec start_link(keyword()) :: GenServer.on_start()
+  def start_link(opts \\ []) do
+    {name, opts} = Keyword.pop(opts, :name)
+    gen_opts = if name, do: [name: name], else: []
+    GenServer.start_link(__MODULE__, Keyword.put_new(opts, :notify, self()), gen_opts)
+  end
+
+  @impl true
+  def init(opts) do
+    with {:ok, notify, devices} <- validate(opts),
+         {:ok, ref} <- Tundra.Client.open_link_monitor(),
+         state = %__MODULE__{ref: ref, notify: notify, devices: devices},
+         {:ok, links} <- current(state) do
+      Process.monitor(notify)
+      read(%__MODULE__{state | links: links})
+    else
+      {:error, reason} -> {:stop, reason}
+    end
+  end
+
+  defp validate(opts) do
+    case {Keyword.get(opts, :notify), Keyword.get(opts, :devices)} do
+      {notify, nil} when is_pid(notify) ->
+        {:ok, notify, nil}
+
+      {notify, devices} when is_pid(notify) and is_list(devices) ->
+        if Enum.all?(devices, &is_binary/1),
+          do: {:ok, notify, MapSet.new(devices)},
+          else: {:error, :einval}
+
+      _ ->
+        {:error, :einval}
+    end
+  end
+
+  @impl true
+  def handle_info({:"$socket", {:"$tundra", ref}, :select, _}, %__MODULE__{ref: ref} = state) do
+    case read(state) do
+      {:ok, state} -> {:noreply, state}
+      {:stop, reason} -> {:stop, reason, state}
+    end
+  end
+
+  def handle_info({:DOWN, _, :process, pid, _}, %__MODULE__{notify: pid} = state) do
+    {:stop, :normal, state}
+  end
+
+  def handle_info(_msg, state), do: {:noreply, state}
+
+  # Handle notifications until there are none, when the subscription is
+  # selected again
+  defp read(state) do
+    case Tundra.Client.read_link_events(state.ref) do
+      {:ok, events} ->
+        read(Enum.reduce(events, state, &handle_event/2))
+
+      {:select, _} ->
+        {:ok, state}
+
+      {:error, :enobufs} ->
+        resync(state)
+
+      {:error, reason} ->
+        {:stop, reason}
+    end
+  end
+
+  defp handle_event({:del, name, index, _up, _running, _mtu}, state) do
+    case Map.pop(state.links, index) do
+      {nil, _} ->
+        state
+
+      {_, links} ->
+        notify(state, name, :removed)
+        %__MODULE__{state | links: links}
+    end
+  end
+
+  defp handle_event({:new, name, index, up, running, mtu}, state) do
+    if watched?(state, name) do
+      link = {name, up and running, mtu}
+      changed(state, name, Map.get(state.links, index), link)
+      %__MODULE__{state | links: Map.put(state.links, index, link)}
+    else
+      state
+    end
+  end
+
+  # Notifications were lost, so compare against every interface
+  defp resync(state) do
+    case current(state) do
+      {:ok, links} ->
+        for {index, {name, _, _}} <- state.links, not Map.has_key?(links, index) do
+          notify(state, name, :removed)
+        end
+
+        for {index, {name, _, _} = link} <- links do
+          changed(state, name, Map.get(state.links, index), link)
+        end
+
+        read(%__MODULE__{state | links: links})
+
+      {:error, reason} ->
+        {:stop, reason}
+    end
+  end
+
+  defp changed(state, name, nil, {_, oper, _}) do
+    notify(state, name, :added)
+    if oper, do: notify(state, name, :up)
+  end
+
+  defp changed(state, name, {_, was_oper, was_mtu}, {_, oper, mtu}) do
+    if oper != was_oper, do: notify(state, name, if(oper, do: :up, else: :down))
+    if mtu != was_mtu, do: notify(state, name, {:mtu, mtu})
+  end
+
+  # The state of the watched interfaces, by index
+  defp current(state) do
+    with {:ok, names} <- names(state),
+         {:ok, stats} <- Tundra.Client.interface_stats(names) do
+      {:ok, Map.new(stats, &to_link/1)}
+    end
+  end
+
+  defp to_link({name, s}), do: {s.ifindex, {name, s.up and s.running, s.mtu}}
+
+  defp names(%__MODULE__{devices: nil}), do: File.ls("/sys/class/net")
+  defp names(%__MODULE__{devices: devices}), do: {:ok, MapSet.to_list(devices)}
+
+  defp watched?(%__MODULE__{devices: nil}, _name), do: true
+  defp watched?(%__MODULE__{devices: devices}, name), do: MapSet.member?(devices, name)
+
+  defp notify(state, name, event), do: send(state.notify, {:tundra_link, name, event})
+end
@@ -0,0 +1,239 @@
+defmodule Tundra.Pool do
+  @moduledoc """
+  A pool of pre-created TUN devices.
+
+  Creating a device costs a process spawn, a server round trip (or a direct
+  `TUNSETIFF`) and netlink configuration. A pool moves most of that work off
+  the critical path by keeping a number of devices created and brought up in
+  advance, without an address. `checkout/3` hands one of these devices to the
+  caller and applies the final address and MTU in a single netlink batch,
+  through `Tundra.configure/2`, so a pool works in server mode too.
+
+  The pool refills itself in the background. When the number of ready devices
+  drops below `:low_watermark`, devices are created one at a time until
+  `:high_watermark` is reached; checkouts are served in between. If the pool
+  is empty, `checkout/3` falls back to `Tundra.create/2` and the checkout is
+  counted as a miss.
+
+  Pooled devices are owned by the pool process and are removed if it exits.
+
+  ## Differences from `Tundra.create/2`
+
+  A pooled device already exists when it is checked out, so `checkout/3`
+  applies its options as changes to a live device rather than at creation:
+
+  - `:netmask` is required, and gives the prefix length of the address.
+  - `:dstaddr` is optional. Rather than being set as the peer address of a
+    point-to-point link, it becomes a host route (`/128`) through the device,
+    next to the route to the address's own prefix. Where `:dstaddr` lies in
+    that prefix, as in the example below, the same traffic is routed to the
+    device either way.
+  - Options that only apply at creation, such as `:txqueuelen`, `:sndbuf` and
+    `:persist`, are ignored unless the pool is empty and the checkout falls
+    back to `Tundra.create/2`.
+  - `:netns` is ignored in favour of the pool's own.
+
+  ## Options
+
+  - `:name` - An optional name to register the pool under.
+  - `:low_watermark` - Refill when fewer devices than this are ready. Defaults to 2.
+  - `:high_watermark` - Stop refilling once this many devices are ready. Defaults to 8.
+  - `:mtu` - The MTU to create pooled devices with. The final MTU is set on checkout.
+  - `:netns` - The network namespace to create pooled devices in (see
+    `Tundra.create/2`). Devices are configured there on checkout, and the
+    fallback creation on a miss uses it too.
+
+  ## Example
+
+      children = [
+        {Tundra.Pool, name: MyApp.TunPool, low_watermark: 4, high_watermark: 16}
+      ]
+
+      {:ok, {dev, name}} =
+        Tundra.Pool.checkout(MyApp.TunPool, "fd11:b7b7:4360::2",
+          dstaddr: "fd11:b7b7:4360::1",
+          netmask: "ffff:ffff:ffff:ffff::",
+          mtu: 1500)
+  """
+  use GenServer
+  use TypedStruct
+
+  @retry_interval 1_000
+
+  @typedoc """
+  Pool statistics, as returned by `stats/1`.
+  """
+  @type stats() :: %{
+          available: non_neg_integer(),
+          hits: non_neg_integer(),
+          misses: non_neg_integer(),
+          created: non_neg_integer(),
+          failed: non_neg_integer()
+        }
+
+  typedstruct do
+    field(:devices, list({Tundra.tun_device(), String.t()}), default: [])
+    field(:available, non_neg_integer(), default: 0)
+    field(:low, non_neg_integer())
+    field(:high, non_neg_integer())
+    field(:params, map())
+    field(:refilling, boolean(), default: false)
+    field(:hits, non_neg_integer(), default: 0)
+    field(:misses, non_neg_integer(), default: 0)
+    field(:created, non_neg_integer(), default: 0)
+    field(:failed, non_neg_integer(), default: 0)
+  end
+
+  @doc """
+  Start a device pool.
+
+  See the module documentation for the supported options.
+  """
+  @spec start_link(keyword()) :: GenServer.on_start()
+  def start_link(opts) do
+    {name, opts} = Keyword.pop(opts, :name)
+    gen_opts = if name, do: [name: name], else: []
+    GenServer.start_link(__MODULE__, opts, gen_opts)
+  end
+
+  @spec checkout(GenServer.server(), Tundra.tun_address(), list(Tundra.tun_option())) ::
+          {:ok, {Tundra.tun_device(), String.t()}} | {:error, any()}
+  @doc """
+  Take a device from the pool and configure it.
+
+  Accepts the same arguments as `Tundra.create/2`, with the differences given
+  in the module documentation. On success, the calling process becomes the
+  owner of the device. If the device cannot be configured it is closed and the
+  error returned.
+  """
+  def checkout(pool, address, opts \\ []) do
+    with params when is_map(params) <- Tundra.convert_opts(Keyword.put(opts, :addr, address)),
+         changes when is_list(changes) <- changes(params) do
+      case GenServer.call(pool, {:checkout, self()}) do
+        {:ok, {dev, name}} ->
+          case Tundra.configure(dev, changes) do
+            :ok ->
+              {:ok, {dev, name}}
+
+            error ->
+              _ = Tundra.close(dev)
+              error
+          end
+
+        {:empty, pool_params} ->
+          Tundra.create_device(Map.merge(params, pool_params))
+      end
+    end
+  end
+
+  # The final address and MTU are applied through the device's descriptor, by
+  # the server when the VM lacks the privileges to do so itself. A peer address
+  # becomes a host route through the device.
+  defp changes(%{addr: addr} = params) do
+    with {:ok, addr} <- :inet.parse_ipv6_address(addr),
+         {:ok, mask} <- :inet.parse_ipv6_address(Map.get(params, :netmask, ~c"")),
+         {:ok, peer} <- :inet.parse_ipv6_address(Map.get(params, :dstaddr, ~c"::")) do
+      mtu = if Map.get(params, :mtu, 0) > 0, do: [mtu: params.mtu], else: []
+      route = if peer == {0, 0, 0, 0, 0, 0, 0, 0}, do: [], else: [add_route: {peer, 128}]
+      mtu ++ [add_address: {addr, prefix_len(mask)}] ++ route
+    else
+      _ -> {:error, :einval}
+    end
+  end
+
+  defp prefix_len(mask) do
+    bits = for x <- Tuple.to_list(mask), into: <<>>, do: <<x::16>>
+    length(Enum.take_while(for(<<bit::1 <- bits>>, do: bit), &(&1 == 1)))
+  end
+
+  @doc """
+  Return the pool's hit/miss and refill counters.
+  """
+  @spec stats(GenServer.server()) :: stats()
+  def stats(pool), do: GenServer.call(pool, :stats)
+
+  @impl true
+  def init(opts) do
+    low = Keyword.get(opts, :low_watermark, 2)
+    high = Keyword.get(opts, :high_watermark, 8)
+    mtu = Keyword.get(opts, :mtu, 0)
+    netns = Tundra.convert_opts(Keyword.take(opts, [:netns]))
+
+    valid? = is_integer(low) and is_integer(high) and is_integer(mtu) and is_map(netns)
+
+    if valid? and low >= 0 and high >= low and mtu >= 0 do
+      params = if mtu > 0, do: Map.put(netns, :mtu, mtu), else: netns
+      {:ok, refill(%__MODULE__{low: low, high: high, params: params})}
+    else
+      {:stop, :einval}
+    end
+  end
+
+  @impl true
+  def handle_call(
+        {:checkout, pid},
+        _from,
+        %__MODULE__{devices: [{dev, _} = entry | rest]} = state
+      ) do
+    state = %__MODULE__{state | devices: rest, available: state.available - 1}
+
+    case Tundra.controlling_process(dev, pid) do
+      :ok ->
+        {:reply, {:ok, entry}, refill(%__MODULE__{state | hits: state.hits + 1})}
+
+      _error ->
+        # The device is no longer usable; discard it and try the next one
+        _ = Tundra.close(dev)
+        handle_call({:checkout, pid}, nil, refill(state))
+    end
+  end
+
+  def handle_call({:checkout, _pid}, _from, %__MODULE__{devices: []} = state) do
+    {:reply, {:empty, Map.take(state.params, [:netns])},
+     refill(%__MODULE__{state | misses: state.misses + 1})}
+  end
+
+  def handle_call(:stats, _from, state) do
+    stats = %{
+      available: state.available,
+      hits: state.hits,
+      misses: state.misses,
+      created: state.created,
+      failed: state.failed
+    }
+
+    {:reply, stats, state}
+  end
+
+  @impl true
+  def handle_info(:refill, %__MODULE__{available: n, high: high} = state) when n >= high do
+    {:noreply, %__MODULE__{state | refilling: false}}
+  end
+
+  def handle_info(:refill, state) do
+    # Create one device per message so that checkouts are served in between
+    case Tundra.create_device(state.params) do
+      {:ok, entry} ->
+        send(self(), :refill)
+
+        {:noreply,
+         %__MODULE__{
+           state
+           | devices: [entry | state.devices],
+             available: state.available + 1,
+             created: state.created + 1
+         }}
+
+      {:error, _} ->
+        Process.send_after(self(), :refill, @retry_interval)
+        {:noreply, %__MODULE__{state | failed: state.failed + 1}}
+    end
+  end
+
+  defp refill(%__MODULE__{refilling: false, available: n, low: low} = state) when n < low do
+    send(self(), :refill)
+    %__MODULE__{state | refilling: true}
+  end
+
+  defp refill(state), do: state
+end
@@ -0,0 +1,186 @@
+if Code.ensure_loaded?(GenStage) do
+  defmodule Tundra.Producer do
+    @moduledoc """
+    A `GenStage` producer of the packets read from a TUN device.
+
+    The producer owns a device and reads from it only to meet downstream
+    demand, in batches of up to `:max_batch` packets (see
+    `Tundra.recv_batch/4`). While there is no demand it neither reads nor
+    selects the device, so packets wait in the kernel's queue, which drops them
+    once full. Memory is therefore bounded by the consumers' demand however far
+    they fall behind.
+
+    With `:partitions`, events are dispatched by a hash of each packet's flow
+    (addresses, protocol and, for TCP, UDP and SCTP, ports) so that the
+    packets of a flow always reach the same consumer, in order. Consumers then
+    subscribe with a `:partition` option.
+
+    Requires the optional `:gen_stage` dependency.
+
+    ## Options
+
+    - `:device` - A device owned by the caller, which is handed to the producer
+      once it has started. The producer must then be started by the owner,
+      rather than by a supervisor.
+    - `:create` - An `{address, opts}` tuple, to create a device with
+      `Tundra.create/2` instead.
+    - `:length` - The maximum number of bytes to read per packet, as for
+      `Tundra.recv/3`. Defaults to 1500.
+    - `:max_batch` - The most packets to read per call. Defaults to 64.
+    - `:partitions` - The number of partitions, or a list of their names, to
+      dispatch flows across. Defaults to none, for `GenStage.DemandDispatcher`.
+    - `:name` - An optional name to register the producer under.
+
+    The producer stops when its device is closed, normally if the device was
+    a loopback device whose peer closed. The device is closed when the producer
+    exits.
+
+    ## Example
+
+        {:ok, producer} =
+          Tundra.Producer.start_link(create: {"fd11:b7b7:4360::2", mtu: 1500}, partitions: 4)
+
+        for i <- 0..3 do
+          {:ok, _} = MyWorker.start_link(subscribe_to: [{producer, partition: i}])
+        end
+    """
+    use GenStage
+    use TypedStruct
+
+    typedstruct do
+      field(:dev, Tundra.tun_device())
+      field(:length, pos_integer())
+      field(:max_batch, pos_integer())
+      field(:demand, non_neg_integer(), default: 0)
+      field(:owned, boolean(), default: false)
+      field(:selecting, boolean(), default: false)
+    end
+
+    @doc """
+    Start a producer.
+
+    See the module documentation for the supported options.
+    """
+    @spec start_link(keyword()) :: GenServer.on_start()
+    def start_link(opts) do
+      {name, opts} = Keyword.pop(opts, :name)
+      gen_opts = if name, do: [name: name], else: []
+
+      with {:ok, pid} <- GenStage.start_link(__MODULE__, opts, gen_opts) do
+        Tundra.Stage.hand_over(pid, Keyword.get(opts, :device))
+      end
+    end
+
+    @doc """
+    Return a hash of the flow a packet belongs to.
+
+    Packets with the same source and destination addresses, protocol and, for
+    TCP, UDP and SCTP, ports have the same hash. Other packets hash to 0.
+    """
+    @spec flow_hash(binary()) :: non_neg_integer()
+    def flow_hash(packet) do
+      case flow(packet) do
+        nil -> 0
+        flow -> :erlang.phash2(flow)
+      end
+    end
+
+    defp flow(<<4::4, ihl::4, _::64, proto, _::16, addrs::binary-size(8), rest::bits>>)
+         when ihl >= 5 do
+      options = (ihl - 5) * 4
+
+      case rest do
+        <<_::binary-size(options), ports::binary-size(4), _::bits>> ->
+          {addrs, ports(proto, ports)}
+
+        _ ->
+          {addrs, proto}
+      end
+    end
+
+    defp flow(<<6::4, _::28, _::16, next, _, addrs::binary-size(32), rest::bits>>) do
+      case rest do
+        <<ports::binary-size(4), _::bits>> -> {addrs, ports(next, ports)}
+        _ -> {addrs, next}
+      end
+    end
+
+    defp flow(_), do: nil
+
+    defp ports(proto, ports) when proto in [6, 17, 132], do: {proto, ports}
+    defp ports(proto, _), do: proto
+
+    @impl true
+    def init(opts) do
+      with {:ok, dev, owned} <- Tundra.Stage.device(opts),
+           length when is_integer(length) and length > 0 <- Keyword.get(opts, :length, 1500),
+           batch when is_integer(batch) and batch > 0 <- Keyword.get(opts, :max_batch, 64),
+           {:ok, dispatcher} <- dispatcher(Keyword.get(opts, :partitions)) do
+        state = %__MODULE__{dev: dev, length: length, max_batch: batch, owned: owned}
+        {:producer, state, dispatcher: dispatcher}
+      else
+        {:error, reason} -> {:stop, reason}
+        _ -> {:stop, :einval}
+      end
+    end
+
+    defp dispatcher(nil), do: {:ok, GenStage.DemandDispatcher}
+
+    defp dispatcher(n) when is_integer(n) and n > 0 do
+      {:ok, {GenStage.PartitionDispatcher, partitions: n, hash: &{&1, rem(flow_hash(&1), n)}}}
+    end
+
+    defp dispatcher([_ | _] = names) do
+      n = length(names)
+      index = List.to_tuple(names)
+      hash = &{&1, elem(index, rem(flow_hash(&1), n))}
+      {:ok, {GenStage.PartitionDispatcher, partitions: names, hash: hash}}
+    end
+
+    defp dispatcher(_), do: :error
+
+    @impl true
+    def handle_demand(demand, %__MODULE__{} = state) do
+      read(%__MODULE__{state | demand: state.demand + demand}, [])
+    end
+
+    @impl true
+    def handle_cast(:owned, state), do: read(%__MODULE__{state | owned: true}, [])
+
+    @impl true
+    def handle_info({:"$socket", dev, :select, _}, %__MODULE__{dev: dev} = state) do
+      read(%__MODULE__{state | selecting: false}, [])
+    end
+
+    def handle_info(:read, state), do: read(state, [])
+    def handle_info(_msg, state), do: {:noreply, [], state}
+
+    # Read until the demand is met or the device would block, in which case
+    # it is selected. Nothing is read, or selected, without demand.
+    defp read(%__MODULE__{owned: true, selecting: false, demand: demand} = state, acc)
+         when demand > 0 do
+      case Tundra.recv_batch(state.dev, state.length, min(demand, state.max_batch), :nowait) do
+        {:ok, packets} ->
+          read(%__MODULE__{state | demand: demand - length(packets)}, [packets | acc])
+
+        {:select, _} ->
+          emit(%__MODULE__{state | selecting: true}, acc)
+
+        {:error, _reason} when acc != [] ->
+          # Deliver what was read first; the error recurs on the next read
+          send(self(), :read)
+          emit(state, acc)
+
+        {:error, :closed} ->
+          {:stop, :normal, state}
+
+        {:error, reason} ->
+          {:stop, reason, state}
+      end
+    end
+
+    defp read(state, acc), do: emit(state, acc)
+
+    defp emit(state, acc), do: {:noreply, acc |> Enum.reverse() |> Enum.concat(), state}
+  end
+end
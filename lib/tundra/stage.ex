@@ -0,0 +1,39 @@
+if Code.ensure_loaded?(GenStage) do
+  defmodule Tundra.Stage do
+    @moduledoc false
+
+    # Device handling shared by Tundra.Producer and Tundra.Consumer
+
+    # Return the device a stage is started with, from its :device or :create
+    # option, and whether the stage owns it already
+    def device(opts) do
+      case {Keyword.get(opts, :device), Keyword.get(opts, :create)} do
+        {nil, {address, create_opts}} ->
+          with {:ok, {dev, _name}} <- Tundra.create(address, create_opts), do: {:ok, dev, true}
+
+        {dev, nil} when is_tuple(dev) ->
+          {:ok, dev, false}
+
+        _ ->
+          :error
+      end
+    end
+
+    # A device passed in can only be handed over by its owner, once the stage
+    # is running. The stage is told with an :owned cast, or stopped if the
+    # device cannot be handed over.
+    def hand_over(pid, nil), do: {:ok, pid}
+
+    def hand_over(pid, dev) do
+      case Tundra.controlling_process(dev, pid) do
+        :ok ->
+          GenStage.cast(pid, :owned)
+          {:ok, pid}
+
+        error ->
+          GenStage.stop(pid)
+          error
+      end
+    end
+  end
+end
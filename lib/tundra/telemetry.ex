@@ -0,0 +1,116 @@
+defmodule Tundra.Telemetry do
+  @moduledoc """
+  Periodically publish device I/O counters as `:telemetry` events.
+
+  A poller reads `Tundra.stats/1` for each watched device every `:period`
+  milliseconds and emits
+
+      [:tundra, :device, :stats]
+
+  with the counters as measurements and the watch metadata, plus `:device`,
+  as metadata. Counters are cumulative; handlers that need rates should
+  difference successive events.
+
+  Reading the counters does not require ownership of the device, so a single
+  poller can watch devices owned by any number of processes. Devices are
+  dropped automatically once they are closed.
+
+  ## Options
+
+  - `:name` - An optional name to register the poller under.
+  - `:period` - The polling period in milliseconds. Defaults to 10 seconds.
+
+  ## Example
+
+      children = [
+        {Tundra.Telemetry, name: MyApp.TunTelemetry, period: 5_000}
+      ]
+
+      {:ok, {dev, name}} = Tundra.create("fd11:b7b7:4360::2", mtu: 1500)
+      :ok = Tundra.Telemetry.watch(MyApp.TunTelemetry, dev, %{name: name})
+  """
+  use GenServer
+  use TypedStruct
+
+  @event [:tundra, :device, :stats]
+  @default_period 10_000
+
+  typedstruct do
+    field(:devices, %{optional(Tundra.tun_device()) => map()}, default: %{})
+    field(:period, pos_integer())
+  end
+
+  @doc """
+  Start a telemetry poller.
+
+  See the module documentation for the supported options.
+  """
+  @spec start_link(keyword()) :: GenServer.on_start()
+  def start_link(opts \\ []) do
+    {name, opts} = Keyword.pop(opts, :name)
+    gen_opts = if name, do: [name: name], else: []
+    GenServer.start_link(__MODULE__, opts, gen_opts)
+  end
+
+  @doc """
+  Start publishing the counters of `dev`.
+
+  `metadata` is merged into the metadata of every event for the device.
+  Watching a device again replaces its metadata.
+  """
+  @spec watch(GenServer.server(), Tundra.tun_device(), map()) :: :ok
+  def watch(poller, dev, metadata \\ %{}) when is_map(metadata) do
+    GenServer.call(poller, {:watch, dev, metadata})
+  end
+
+  @doc """
+  Stop publishing the counters of `dev`.
+  """
+  @spec unwatch(GenServer.server(), Tundra.tun_device()) :: :ok
+  def unwatch(poller, dev), do: GenServer.call(poller, {:unwatch, dev})
+
+  @impl true
+  def init(opts) do
+    case Keyword.get(opts, :period, @default_period) do
+      period when is_integer(period) and period > 0 ->
+        schedule(period)
+        {:ok, %__MODULE__{period: period}}
+
+      _ ->
+        {:stop, :einval}
+    end
+  end
+
+  @impl true
+  def handle_call({:watch, dev, metadata}, _from, state) do
+    {:reply, :ok, %__MODULE__{state | devices: Map.put(state.devices, dev, metadata)}}
+  end
+
+  def handle_call({:unwatch, dev}, _from, state) do
+    {:reply, :ok, %__MODULE__{state | devices: Map.delete(state.devices, dev)}}
+  end
+
+  @impl true
+  def handle_info(:poll, state) do
+    devices =
+      for {dev, metadata} <- state.devices, publish(dev, metadata), into: %{} do
+        {dev, metadata}
+      end
+
+    schedule(state.period)
+    {:noreply, %__MODULE__{state | devices: devices}}
+  end
+
+  defp publish(dev, metadata) do
+    case Tundra.stats(dev) do
+      {:ok, stats} ->
+        :telemetry.execute(@event, stats, Map.put(metadata, :device, dev))
+        true
+
+      {:error, _} ->
+        false
+    end
+  end
+
+  defp schedule(period), do: Process.send_after(self(), :poll, period)
+end
@@ -14,14 +14,15 @@ defmodule Tundra.MixProject do
       deps: deps(),
       compilers: [:elixir_make] ++ Mix.compilers(),
       package: package(),
-      docs: docs()
+      docs: docs(),
+      aliases: aliases()
     ]
   end
 
   # Run "mix help compile.app" to learn about applications.
   def application do
     [
-      registered: [Tundra.DynamicSupervisor],
+      registered: [Tundra.Supervisor, Tundra.Registry, Tundra.DynamicSupervisor],
       extra_applications: [:logger],
       mod: {Tundra.Application, []}
     ]
@@ -32,11 +33,20 @@ defmodule Tundra.MixProject do
     [
       {:elixir_make, "~> 0.9", runtime: false},
       {:typedstruct, "~> 0.5", runtime: false},
+      {:telemetry, "~> 1.0"},
+      {:gen_stage, "~> 1.2", optional: true},
       {:ex_doc, "~> 0.40", only: :dev, runtime: false},
       {:publisho, "~> 1.0", only: :dev, runtime: false}
     ]
   end
 
+  defp aliases do
+    [
+      bench: "run bench/tundra_bench.exs",
+      "bench.churn": "run bench/churn_bench.exs"
+    ]
+  end
+
   defp docs do
     [
       main: "readme",
@@ -54,6 +64,7 @@ defmodule Tundra.MixProject do
       files: [
         "lib",
         "c_src",
+        "bpftrace",
         "mix.exs",
         "Makefile",
         "README.md",
@@ -20,4 +20,1135 @@ defmodule TundraTest do
       assert {:error, _reason} = Tundra.adopt(2)
     end
   end
+
+  describe "create/2" do
+    test "rejects a non-boolean persist option" do
+      assert {:error, :einval} = Tundra.create("fd11:b7b7:4360::2", persist: :yes)
+    end
+
+    test "rejects an invalid txqueuelen or sndbuf" do
+      assert {:error, :einval} = Tundra.create("fd11:b7b7:4360::2", txqueuelen: 0)
+      assert {:error, :einval} = Tundra.create("fd11:b7b7:4360::2", sndbuf: "big")
+    end
+  end
+
+  describe "create_loopback/1" do
+    @packet <<6::4, 0::28, 8::16, 17, 64, 0::128, 0::128, 1::16, 2::16, 8::16, 0::16>>
+
+    test "passes packets between the device and its peer" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert {:select, _} = Tundra.recv(dev, 1500, :nowait)
+      assert :ok = Tundra.send(peer, @packet, :nowait)
+      assert_receive {:"$socket", ^dev, :select, _}
+      assert {:ok, @packet} = Tundra.recv(dev, 1500, :nowait)
+
+      assert :ok = Tundra.send(dev, @packet, :nowait)
+      assert {:ok, @packet} = Tundra.recv(peer, 1500, :nowait)
+
+      assert {:ok, %{rx_packets: 1, tx_packets: 1, rx_bytes: 48}} = Tundra.stats(dev)
+      assert :ok = Tundra.close(peer)
+      assert :ok = Tundra.close(dev)
+    end
+
+    test "enforces ownership" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      task = Task.async(fn -> Tundra.send(dev, @packet, :nowait) end)
+      assert {:error, :not_owner} = Task.await(task)
+
+      assert :ok = Tundra.controlling_process(peer, self())
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+
+    test "rejects an invalid buffer size" do
+      assert {:error, :einval} = Tundra.create_loopback(buffer: -1)
+    end
+  end
+
+  describe "poll sets" do
+    @packet <<6::4, 0::28, 8::16, 17, 64, 0::128, 0::128, 1::16, 2::16, 8::16, 0::16>>
+
+    test "report readable devices" do
+      case :os.type() do
+        {:unix, :linux} ->
+          {:ok, set} = Tundra.create_poll_set()
+          {:ok, {dev, peer}} = Tundra.create_loopback()
+          assert :ok = Tundra.poll_add(set, dev)
+          assert {:error, :eexist} = Tundra.poll_add(set, dev)
+          assert {:select, _} = Tundra.poll(set, 16)
+
+          assert :ok = Tundra.send(peer, @packet, :nowait)
+          assert_receive {:"$socket", ^set, :select, _}
+          assert {:ok, [^dev]} = Tundra.poll(set, 16)
+          assert {:ok, [{^dev, [@packet]}]} = Tundra.poll(set, 16, batch: 4)
+          assert {:select, _} = Tundra.poll(set, 16)
+
+          assert :ok = Tundra.poll_remove(set, dev)
+          assert {:error, :enoent} = Tundra.poll_remove(set, dev)
+          assert :ok = Tundra.close(set)
+          assert :ok = Tundra.close(peer)
+          assert :ok = Tundra.close(dev)
+
+        _ ->
+          assert {:error, :enotsup} = Tundra.create_poll_set()
+      end
+    end
+
+    test "drop devices handed to another process" do
+      if :os.type() == {:unix, :linux} do
+        {:ok, set} = Tundra.create_poll_set()
+        {:ok, {dev, peer}} = Tundra.create_loopback()
+        assert :ok = Tundra.poll_add(set, dev)
+        assert :ok = Tundra.send(peer, @packet, :nowait)
+
+        task =
+          Task.async(fn ->
+            receive do
+              :done -> :ok
+            end
+          end)
+
+        assert :ok = Tundra.controlling_process(dev, task.pid)
+        assert {:select, _} = Tundra.poll(set, 16)
+        assert {:error, :enoent} = Tundra.poll_remove(set, dev)
+
+        send(task.pid, :done)
+        Task.await(task)
+        assert :ok = Tundra.close(set)
+        assert :ok = Tundra.close(peer)
+      end
+    end
+  end
+
+  describe "send_queue/2" do
+    @packet <<6::4, 0::28, 8::16, 17, 64, 0::128, 0::128, 1::16, 2::16, 8::16, 0::16>>
+
+    test "queues sends that would block and drains them in order" do
+      if :os.type() == {:unix, :linux} do
+        {:ok, {dev, peer}} = Tundra.create_loopback(buffer: 4096)
+        assert :ok = Tundra.send_queue(dev, high_watermark: 4096, low_watermark: 0)
+
+        packets = for i <- 1..200, do: <<@packet::binary, i::32>>
+        for packet <- packets, do: assert(:ok = Tundra.send(dev, packet, :nowait))
+        assert_receive {:tundra_send_queue, ^dev, :high}
+        assert {:ok, %{send_queue_packets: queued}} = Tundra.stats(dev)
+        assert queued > 0
+
+        assert Enum.map(packets, fn _ -> recv_wait(peer) end) == packets
+        assert_receive {:tundra_send_queue, ^dev, :low}
+
+        assert {:ok, %{tx_packets: 200, send_queue_packets: 0, send_queue_drops: 0}} =
+                 Tundra.stats(dev)
+
+        assert :ok = Tundra.close(dev)
+        assert :ok = Tundra.close(peer)
+      end
+    end
+
+    test "refuses packets when full" do
+      if :os.type() == {:unix, :linux} do
+        {:ok, {dev, peer}} = Tundra.create_loopback(buffer: 4096)
+        assert :ok = Tundra.send_queue(dev, packets: 4)
+
+        results = for _ <- 1..100, do: Tundra.send(dev, @packet, :nowait)
+        assert {:error, :queue_full} in results
+        assert {:ok, %{send_queue_packets: 4, send_queue_drops: drops}} = Tundra.stats(dev)
+        assert drops > 0
+
+        assert :ok = Tundra.send_queue(dev, false)
+        assert {:ok, %{send_queue_packets: 0}} = Tundra.stats(dev)
+        assert :ok = Tundra.close(dev)
+        assert :ok = Tundra.close(peer)
+      end
+    end
+
+    test "serves the priority class first" do
+      if :os.type() == {:unix, :linux} do
+        {:ok, {dev, peer}} = Tundra.create_loopback(buffer: 4096)
+        assert :ok = Tundra.send_queue(dev, classes: [[], [priority: true]], dscp: %{46 => 1})
+
+        bulk = for i <- 1..100, do: <<@packet::binary, i::32>>
+        for packet <- bulk, do: assert(:ok = Tundra.send(dev, packet, :nowait))
+        <<pre::4, _::6, rest::bitstring>> = @packet
+        expedited = <<pre::4, 46::6, rest::bitstring, 0::32>>
+        assert :ok = Tundra.send(dev, expedited, :nowait)
+
+        received = Enum.map(0..100, fn _ -> recv_wait(peer) end)
+        assert Enum.find_index(received, &(&1 == expedited)) < 50
+        assert Enum.reject(received, &(&1 == expedited)) == bulk
+
+        assert {:ok, [%{class: 0, sent: sent}, %{class: 1, priority: true, sent: 1} = prio]} =
+                 Tundra.send_queue_stats(dev)
+
+        assert sent > 0
+        assert prio.delay.count == 1
+        assert :ok = Tundra.close(dev)
+        assert :ok = Tundra.close(peer)
+      end
+    end
+
+    test "rejects invalid options" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert {:error, :einval} = Tundra.send_queue(dev, packets: 0)
+      classes = [[priority: true], [priority: true]]
+      assert {:error, :einval} = Tundra.send_queue(dev, classes: classes)
+      assert {:error, :einval} = Tundra.send_queue(dev, dscp: %{46 => 1})
+      assert {:error, :einval} = Tundra.send_queue(dev, bytes: 100, high_watermark: 200)
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+  end
+
+  describe "capture/3" do
+    @udp <<6::4, 0::28, 12::16, 17, 64, 0::128, 0::128, 1::16, 2::16, 12::16, 0::16, "ping">>
+    @tcp <<6::4, 0::28, 20::16, 6, 64, 0::128, 0::128, 0::160>>
+
+    # ip6 and udp, keeping at most 44 bytes, as printed by tcpdump -ddd
+    @filter """
+    7
+    48 0 0 0
+    84 0 0 240
+    21 0 3 96
+    48 0 0 6
+    21 0 1 17
+    6 0 0 44
+    6 0 0 0
+    """
+
+    setup do
+      path = Path.join(System.tmp_dir!(), "tundra-#{System.unique_integer([:positive])}.pcapng")
+      on_exit(fn -> for file <- Path.wildcard(path <> "*"), do: File.rm(file) end)
+      {:ok, path: path}
+    end
+
+    test "writes received and sent packets to a pcapng file", %{path: path} do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert :ok = Tundra.capture(dev, path)
+      assert {:error, :ebusy} = Tundra.capture(dev, path)
+
+      assert :ok = Tundra.send(peer, @udp, :nowait)
+      assert recv_wait(dev) == @udp
+      assert :ok = Tundra.send(dev, @tcp, :nowait)
+      assert recv_wait(peer) == @tcp
+
+      assert {:ok, %{packets: 2, bytes: 112, drops: 0}} = Tundra.stop_capture(dev)
+      assert {:error, :disabled} = Tundra.stop_capture(dev)
+
+      assert [{0x0A0D0D0A, _}, {1, idb}, {6, first}, {6, second}] = pcapng_blocks(path)
+      assert <<101::native-16, 0::16, 65_535::native-32, _::binary>> = idb
+      assert {1, @udp} = pcapng_packet(first)
+      assert {2, @tcp} = pcapng_packet(second)
+
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+
+    test "filters, samples and truncates packets", %{path: path} do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert :ok = Tundra.capture(dev, path, filter: @filter, sample: 2)
+
+      for _ <- 1..10 do
+        assert :ok = Tundra.send(dev, @udp, :nowait)
+        assert :ok = Tundra.send(dev, @tcp, :nowait)
+      end
+
+      assert {:ok, %{packets: 5, bytes: 220}} = Tundra.stop_capture(dev)
+      packets = for {6, epb} <- pcapng_blocks(path), do: pcapng_packet(epb)
+      assert packets == List.duplicate({2, binary_part(@udp, 0, 44)}, 5)
+
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+
+    test "rotates through a ring of files", %{path: path} do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert :ok = Tundra.capture(dev, path, file_size: 512, files: 3)
+      for _ <- 1..100, do: assert(:ok = Tundra.send(dev, @udp, :nowait))
+      assert {:ok, %{packets: 100}} = Tundra.stop_capture(dev)
+
+      assert Enum.sort(Path.wildcard(path <> "*")) == [path, path <> ".1", path <> ".2"]
+
+      for file <- [path, path <> ".1", path <> ".2"] do
+        assert File.stat!(file).size <= 512
+        assert [{0x0A0D0D0A, _}, {1, _} | _] = pcapng_blocks(file)
+      end
+
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+
+    test "rejects invalid options", %{path: path} do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert {:error, :einval} = Tundra.capture(dev, path, sample: 0)
+      assert {:error, :einval} = Tundra.capture(dev, path, buffer: 1024)
+      assert {:error, :einval} = Tundra.capture(dev, path, filter: [{6, 0, 0, 0}, {21, 5, 0, 0}])
+      assert {:error, :einval} = Tundra.capture(dev, path, filter: "2\n6 0 0 0\n")
+      assert {:error, :enoent} = Tundra.capture(dev, Path.join(path, "missing"))
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+  end
+
+  describe "impair/3" do
+    @ping <<6::4, 0::28, 12::16, 17, 64, 0::128, 0::128, 1::16, 2::16, 12::16, 0::16, "ping">>
+
+    test "loses packets" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert {:error, :disabled} = Tundra.impair_stats(dev)
+      assert :ok = Tundra.impair(dev, :send, loss: 1.0)
+      for _ <- 1..10, do: assert(:ok = Tundra.send(dev, @ping, :nowait))
+
+      assert {:select, _} = Tundra.recv(peer, 1500, :nowait)
+      assert {:ok, %{send: %{packets: 10, lost: 10}} = stats} = Tundra.impair_stats(dev)
+      refute Map.has_key?(stats, :recv)
+
+      assert :ok = Tundra.impair(dev, :send, false)
+      assert {:error, :disabled} = Tundra.impair_stats(dev)
+      assert :ok = Tundra.send(dev, @ping, :nowait)
+      assert recv_wait(peer) == @ping
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+
+    test "delays sent and received packets" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert :ok = Tundra.impair(dev, :both, delay: 50)
+
+      start = System.monotonic_time(:millisecond)
+      assert :ok = Tundra.send(dev, @ping, :nowait)
+      assert recv_wait(peer) == @ping
+      assert System.monotonic_time(:millisecond) - start >= 50
+
+      # The wheel sends the select message once the packet is due
+      start = System.monotonic_time(:millisecond)
+      assert :ok = Tundra.send(peer, @ping, :nowait)
+      assert {:select, _} = Tundra.recv(dev, 1500, :nowait)
+      assert_receive {:"$socket", ^dev, :select, _}, 1000
+      assert recv_wait(dev) == @ping
+      assert System.monotonic_time(:millisecond) - start >= 50
+
+      assert {:ok, %{send: %{delayed: 1, held: 0}, recv: %{delayed: 1, held: 0}}} =
+               Tundra.impair_stats(dev)
+
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+
+    test "duplicates packets" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert :ok = Tundra.impair(dev, :recv, duplicate: 1.0)
+      assert :ok = Tundra.send(peer, @ping, :nowait)
+      assert recv_wait(dev) == @ping
+      assert {:ok, @ping} = Tundra.recv(dev, 1500, :nowait)
+      assert {:ok, %{recv: %{packets: 1, duplicated: 1}}} = Tundra.impair_stats(dev)
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+
+    test "makes the same choices for the same seed" do
+      pattern = fn ->
+        {:ok, {dev, peer}} = Tundra.create_loopback()
+        assert :ok = Tundra.impair(dev, :send, loss: {:gilbert_elliott, 0.2, 0.4}, seed: 42)
+        for i <- 1..100, do: assert(:ok = Tundra.send(dev, @ping <> <<i>>, :nowait))
+        received = received(peer, [])
+        assert :ok = Tundra.close(dev)
+        assert :ok = Tundra.close(peer)
+        received
+      end
+
+      first = pattern.()
+      assert length(first) in 1..99
+      assert pattern.() == first
+    end
+
+    test "rejects invalid options" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert {:error, :einval} = Tundra.impair(dev, :send, loss: 2)
+      assert {:error, :einval} = Tundra.impair(dev, :send, delay: -1)
+      assert {:error, :einval} = Tundra.impair(dev, :send, loss: {:gilbert_elliott, 0.1})
+      assert {:error, :einval} = Tundra.impair(dev, :sideways, [])
+      assert {:error, :einval} = Tundra.impair(dev, :recv, limit: 0)
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+  end
+
+  describe "recv_batch/4" do
+    @packet <<6::4, 0::28, 8::16, 17, 64, 0::128, 0::128, 1::16, 2::16, 8::16, 0::16>>
+
+    test "reads up to the given number of packets" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      packets = for i <- 1..5, do: @packet <> <<i>>
+      for packet <- packets, do: assert(:ok = Tundra.send(peer, packet, :nowait))
+
+      assert {:ok, first} = Tundra.recv_batch(dev, 1500, 3, :nowait)
+      assert {:ok, rest} = Tundra.recv_batch(dev, 1500, 3, :nowait)
+      assert first ++ rest == packets
+      assert {:select, _} = Tundra.recv_batch(dev, 1500, 3, :nowait)
+
+      assert :ok = Tundra.send(peer, @packet, :nowait)
+      assert_receive {:"$socket", ^dev, :select, _}
+      assert {:ok, [@packet]} = Tundra.recv_batch(dev, 1500, 3, :nowait)
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+  end
+
+  describe "busy_poll/2" do
+    @packet <<6::4, 0::28, 8::16, 17, 64, 0::128, 0::128, 1::16, 2::16, 8::16, 0::16>>
+
+    test "spins on an empty device before selecting" do
+      {:ok, {dev, peer}} = Tundra.create_loopback(buffer: 1_048_576)
+      assert :ok = Tundra.busy_poll(dev, 200)
+
+      assert {:select, _} = Tundra.recv(dev, 1500, :nowait)
+      assert {:ok, %{busy_polls: 1, busy_poll_hits: 0, busy_poll_time: time}} = Tundra.stats(dev)
+      assert time >= 200_000
+
+      assert :ok = Tundra.send(peer, @packet, :nowait)
+      assert_receive {:"$socket", ^dev, :select, _}
+      assert {:ok, [@packet]} = Tundra.recv_batch(dev, 1500, 4, :nowait)
+
+      # Packets sent from another process while the owner reads are all
+      # delivered, whether found by a spin or a select
+      parent = self()
+
+      sender =
+        spawn_link(fn ->
+          receive do
+            :go -> for _ <- 1..500, do: :ok = Tundra.send(peer, @packet, :nowait)
+          end
+
+          send(parent, :sent)
+        end)
+
+      :ok = Tundra.controlling_process(peer, sender)
+      send(sender, :go)
+      assert 500 = busy_recv(dev, 0)
+      assert_receive :sent
+
+      assert :ok = Tundra.busy_poll(dev, 0)
+      {:ok, %{busy_polls: polls}} = Tundra.stats(dev)
+      assert {:select, _} = Tundra.recv(dev, 1500, :nowait)
+      assert {:ok, %{busy_polls: ^polls}} = Tundra.stats(dev)
+
+      assert {:error, :einval} = Tundra.busy_poll(dev, 1001)
+      assert {:error, :einval} = Tundra.busy_poll(dev, -1)
+      assert :ok = Tundra.close(dev)
+    end
+
+    test "must be set by the owner" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      task = Task.async(fn -> Tundra.busy_poll(dev, 100) end)
+      assert {:error, :not_owner} = Task.await(task)
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+  end
+
+  describe "flow_accounting/2" do
+    test "counts packets to flows and tracks the heaviest" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert {:error, :disabled} = Tundra.flow_stats(dev)
+      assert :ok = Tundra.flow_accounting(dev, top: 4, idle_timeout: 1)
+      assert {:error, :ebusy} = Tundra.flow_accounting(dev, [])
+
+      for _ <- 1..3, do: assert(:ok = Tundra.send(peer, @packet, :nowait))
+      assert_receive {:"$socket", ^dev, :select, _}
+      assert {:ok, [_, _, _]} = Tundra.recv_batch(dev, 1500, 4, :nowait)
+      reply = <<6::4, 0::28, 8::16, 17, 64, 0::128, 0::128, 2::16, 1::16, 8::16, 0::16>>
+      assert :ok = Tundra.send(dev, reply, :nowait)
+
+      assert {:ok, %{packets: 4, flows: 2, created: 2, queued: 0, memory: memory}} =
+               Tundra.flow_stats(dev)
+
+      assert memory > 0
+
+      assert {:ok, [inbound, outbound]} = Tundra.flow_top(dev, reset: true)
+
+      assert %{direction: :inbound, src: {0, 0, 0, 0, 0, 0, 0, 0}, protocol: 17} = inbound
+      assert %{sport: 1, dport: 2, packets: 3, bytes: 144, error: 0} = inbound
+      assert %{direction: :outbound, sport: 2, dport: 1, packets: 1, bytes: 48} = outbound
+      assert {:ok, []} = Tundra.flow_top(dev)
+
+      # Both flows go idle and are queued within a pass of the thread or two
+      assert [first, second] = wait_for_flows(dev, 2, 30)
+      assert Enum.all?([first, second], &(&1.reason == :idle))
+      now = System.system_time(:millisecond)
+      assert first.start <= first.end and first.end <= now and now - first.start < 10_000
+      assert {:ok, %{flows: 0, expired: 2, queued: 0}} = Tundra.flow_stats(dev)
+
+      assert :ok = Tundra.flow_accounting(dev, false)
+      assert {:error, :disabled} = Tundra.flows(dev)
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+
+    test "exports flows to an IPFIX collector" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      {:ok, sock} = :gen_udp.open(0, [:binary, active: false, ip: {127, 0, 0, 1}])
+      {:ok, port} = :inet.port(sock)
+
+      assert :ok =
+               Tundra.flow_accounting(dev, collector: {"127.0.0.1", port}, observation_domain: 9)
+
+      assert :ok = Tundra.send(dev, @packet, :nowait)
+      # Turning accounting off sends the flow still in the table
+      assert :ok = Tundra.flow_accounting(dev, false)
+
+      assert {:ok, {_, _, <<10::16, _::16, _::32, 0::32, 9::32, 2::16, _::binary>>}} =
+               :gen_udp.recv(sock, 0, 1_000)
+
+      assert {:ok, {_, _, message}} = :gen_udp.recv(sock, 0, 1_000)
+      assert <<10::16, 92::16, _::32, 0::32, 9::32, 257::16, 76::16, data::binary>> = message
+
+      # Addresses, ports, protocol, TCP flags, direction (egress), end reason
+      # (forced), bytes and packets
+      assert <<0::128, 0::128, 1::16, 2::16, 17, 0, 1, 4, 48::64, 1::64, _::binary-16>> = data
+      :gen_udp.close(sock)
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+
+    test "validates its options and must be called by the owner" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert {:error, :einval} = Tundra.flow_accounting(dev, max_flows: 0)
+      assert {:error, :einval} = Tundra.flow_accounting(dev, top: 1025)
+      assert {:error, :einval} = Tundra.flow_accounting(dev, idle_timeout: 0)
+      assert {:error, :einval} = Tundra.flow_accounting(dev, collector: {"nowhere", 4739})
+      assert {:error, :einval} = Tundra.flows(dev, 0)
+      assert {:error, :einval} = Tundra.flow_top(dev, reset: :yes)
+
+      task = Task.async(fn -> Tundra.flow_accounting(dev, []) end)
+      assert {:error, :not_owner} = Task.await(task)
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+  end
+
+  describe "fill_headroom/3" do
+    test "encapsulates a packet in its reserved room" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert :ok = Tundra.send(peer, @packet, :nowait)
+      assert_receive {:"$socket", ^dev, :select, _}
+      assert {:ok, @packet = packet} = Tundra.recv(dev, 1500, :nowait, headroom: 24, tailroom: 4)
+
+      assert {:ok, inner} = Tundra.fill_headroom(packet, <<1::64>>, ["ta", "g"])
+      assert inner == <<1::64>> <> @packet <> "tag"
+      assert packet == @packet
+
+      # Only the latest binary over the buffer can be filled
+      assert {:error, :einval} = Tundra.fill_headroom(packet, <<2::64>>)
+      assert {:error, :enospc} = Tundra.fill_headroom(inner, <<0::136>>)
+      assert {:error, :enospc} = Tundra.fill_headroom(inner, <<>>, :binary.copy("-", 1500))
+      assert {:ok, outer} = Tundra.fill_headroom(inner, <<2::128>>, "!")
+      assert outer == <<2::128, 1::64>> <> @packet <> "tag!"
+      assert inner == <<1::64>> <> @packet <> "tag"
+
+      assert {:error, :einval} = Tundra.fill_headroom(:binary.copy(outer), <<>>)
+      assert {:error, :einval} = Tundra.fill_headroom(binary_part(outer, 0, 8), <<>>)
+      assert :ok = Tundra.close(peer)
+      assert :ok = Tundra.close(dev)
+    end
+
+    test "reserves room in batches and validates options" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      for _ <- 1..2, do: assert(:ok = Tundra.send(peer, @packet, :nowait))
+      assert_receive {:"$socket", ^dev, :select, _}
+      assert {:ok, [a, b]} = Tundra.recv_batch(dev, 1500, 4, :nowait, headroom: 8)
+      assert {:ok, <<7::64>> <> @packet} = Tundra.fill_headroom(a, <<7::64>>)
+      assert {:ok, <<8::64>> <> @packet} = Tundra.fill_headroom(b, <<8::64>>)
+
+      assert {:error, :einval} = Tundra.recv(dev, 1500, :nowait, headroom: 4097)
+      assert {:error, :einval} = Tundra.recv(dev, 1500, :nowait, tailroom: -1)
+      assert {:error, :einval} = Tundra.recv_batch(dev, 1500, 4, :nowait, headroom: :big)
+      assert {:error, :einval} = Tundra.fill_headroom(@packet, <<>>)
+      assert :ok = Tundra.close(peer)
+      assert :ok = Tundra.close(dev)
+    end
+  end
+
+  describe "Tundra.Producer" do
+
+    test "reads packets only to meet demand" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      {:ok, producer} = Tundra.Producer.start_link(device: dev, max_batch: 4)
+      packets = for i <- 1..10, do: @packet <> <<i>>
+      for packet <- packets, do: assert(:ok = Tundra.send(peer, packet, :nowait))
+
+      # Nothing is read before there is a subscriber
+      assert {:ok, %{rx_packets: 0}} = Tundra.stats(dev)
+      assert [{producer, max_demand: 4}] |> GenStage.stream() |> Enum.take(10) == packets
+
+      assert :ok = GenStage.stop(producer)
+      assert :ok = Tundra.close(peer)
+    end
+
+    test "stops when the peer of a loopback device closes" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      {:ok, producer} = Tundra.Producer.start_link(device: dev)
+      Process.unlink(producer)
+      ref = Process.monitor(producer)
+      stream = Task.async(fn -> [producer] |> GenStage.stream() |> Enum.to_list() end)
+
+      assert :ok = Tundra.close(peer)
+      assert_receive {:DOWN, ^ref, :process, ^producer, :normal}, 1000
+      assert Task.await(stream) == []
+    end
+
+    test "keeps the packets of a flow in one partition" do
+      other = <<6::4, 0::28, 8::16, 17, 64, 0::128, 1::128, 1::16, 2::16, 8::16, 0::16>>
+      assert Tundra.Producer.flow_hash(@packet <> "a") == Tundra.Producer.flow_hash(@packet)
+      assert Tundra.Producer.flow_hash(@packet) != Tundra.Producer.flow_hash(other)
+      assert Tundra.Producer.flow_hash(<<1, 2, 3>>) == 0
+    end
+  end
+
+  describe "Tundra.Consumer" do
+    test "writes events to a device" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      packets = for i <- 1..10, do: @packet <> <<i>>
+      {:ok, source} = GenStage.from_enumerable(packets)
+      {:ok, _consumer} = Tundra.Consumer.start_link(device: dev, subscribe_to: [source])
+
+      assert for(_ <- packets, do: recv_wait(peer)) == packets
+      assert :ok = Tundra.close(peer)
+    end
+
+    test "asks for more events as its batches are written" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      packets = for i <- 1..10, do: @packet <> <<i>>
+      {:ok, source} = GenStage.from_enumerable(packets)
+      subscribe_to = [{source, max_demand: 2}]
+      {:ok, _consumer} = Tundra.Consumer.start_link(device: dev, subscribe_to: subscribe_to)
+
+      assert for(_ <- packets, do: recv_wait(peer)) == packets
+      assert :ok = Tundra.close(peer)
+    end
+  end
+
+  describe "export_devices/3 and import_devices/2" do
+    @tag :tmp_dir
+    test "hand over between processes", %{tmp_dir: dir} do
+      path = Path.join(dir, "handoff.sock")
+
+      case :os.type() do
+        {:unix, :linux} ->
+          assert {:error, :enoent} = Tundra.import_devices(path)
+          assert {:error, :etimedout} = Tundra.export_devices([], path, timeout: 0)
+          refute File.exists?(path)
+
+          task = Task.async(fn -> Tundra.export_devices([], path, timeout: 5_000) end)
+          assert {:ok, []} = import_when_ready(path)
+          assert :ok = Task.await(task)
+
+        _ ->
+          assert {:error, :enotsup} = Tundra.import_devices(path)
+      end
+    end
+
+    test "leave a device that cannot be handed over open" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      assert {:error, _} = Tundra.export_devices([{dev, :meta}], "/tmp/tundra-none.sock")
+      assert {:ok, _} = Tundra.stats(dev)
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+  end
+
+  describe "ring/2" do
+    test "moves a device's packets through shared memory" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+
+      case :os.type() do
+        {:unix, :linux} ->
+          assert {:error, :disabled} = Tundra.ring_stats(dev)
+          assert {:error, :einval} = Tundra.ring(dev, slots: 1000)
+          assert :ok = Tundra.ring(dev, slots: 64)
+          assert {:error, :ebusy} = Tundra.ring(dev, [])
+          assert {:ok, {memfd, rung, waited}} = Tundra.ring_fds(dev)
+          assert Enum.all?([memfd, rung, waited], &(&1 > 2))
+          assert {:error, :ebusy} = Tundra.recv(dev, 1500, :nowait)
+
+          # Nothing takes the packet out of the ring, so it waits there
+          assert :ok = Tundra.send(peer, @ping, :nowait)
+          assert ring_received(dev) == 1
+          assert :ok = Tundra.ring(dev, false)
+          assert {:error, :disabled} = Tundra.ring_fds(dev)
+          assert {:ok, %{rx_packets: 1, tx_packets: 0}} = Tundra.ring_stats(dev)
+
+          assert :ok = Tundra.send(peer, @ping, :nowait)
+          assert recv_wait(dev) == @ping
+
+        _ ->
+          assert {:error, :enotsup} = Tundra.ring(dev, [])
+      end
+
+      assert :ok = Tundra.close(dev)
+      assert :ok = Tundra.close(peer)
+    end
+  end
+
+  describe "tunnel/2" do
+    @inner <<6::4, 0::28, 12::16, 17, 64, 0xFD::8, 0::112, 1::8, 0xFD::8, 0::112, 2::8, 1::16,
+             2::16, 12::16, 0::16, "ping">>
+
+    test "carries packets both ways between two devices" do
+      case :os.type() do
+        {:unix, :linux} ->
+          for cipher <- [:chacha20_poly1305, :aes_256_gcm] do
+            t = tunnel_pair(cipher)
+            assert {:error, :ebusy} = Tundra.recv(t.a, 1500, :nowait)
+            assert {:error, :ebusy} = Tundra.ring(t.a, [])
+
+            assert :ok = Tundra.send(t.a_peer, @inner, :nowait)
+            assert recv_wait(t.b_peer) == @inner
+
+            <<head::binary-8, src::binary-16, dst::binary-16, rest::binary>> = @inner
+            reply = head <> dst <> src <> rest
+            assert :ok = Tundra.send(t.b_peer, reply, :nowait)
+            assert recv_wait(t.a_peer) == reply
+
+            assert %{tx_packets: 1, rx_packets: 1, peers: [peer]} = tunnel_counters(t.a, 1, 0)
+            assert %{index: 1, counter: 1, tx_packets: 1, rx_packets: 1} = peer
+            Enum.each([t.a, t.a_peer, t.b, t.b_peer], &Tundra.close/1)
+          end
+
+        _ ->
+          {:ok, {dev, peer}} = Tundra.create_loopback()
+          assert {:error, :enotsup} = Tundra.tunnel(dev, [])
+          Tundra.close(dev)
+          Tundra.close(peer)
+      end
+    end
+
+    test "rejects replayed and forged datagrams" do
+      if :os.type() == {:unix, :linux} do
+        t = tunnel_pair(:chacha20_poly1305)
+        {:ok, sock} = :gen_udp.open(0, [:binary, :inet6, {:ip, {0, 0, 0, 0, 0, 0, 0, 1}}])
+        {:ok, port} = :inet.port(sock)
+
+        # Point the first device at a socket that captures its datagrams
+        assert :ok =
+                 Tundra.tunnel_peer(t.a, 1,
+                   remote_index: 2,
+                   endpoint: {"::1", port},
+                   tx_key: t.k1,
+                   rx_key: t.k1,
+                   allowed_ips: [{"fd00::2", 128}]
+                 )
+
+        assert :ok = Tundra.send(t.a_peer, @inner, :nowait)
+        assert_receive {:udp, ^sock, _, _, <<4, 0, 0, 0, 2::32-little, 0::64, _::binary>> = dg}
+
+        :ok = :gen_udp.send(sock, {0, 0, 0, 0, 0, 0, 0, 1}, t.b_port, dg)
+        assert recv_wait(t.b_peer) == @inner
+        :ok = :gen_udp.send(sock, {0, 0, 0, 0, 0, 0, 0, 1}, t.b_port, dg)
+
+        <<header::binary-8, _::64, body::binary-16, byte, tail::binary>> = dg
+        forged = <<header::binary, 1::64-little, body::binary, Bitwise.bxor(byte, 1)>> <> tail
+        :ok = :gen_udp.send(sock, {0, 0, 0, 0, 0, 0, 0, 1}, t.b_port, forged)
+
+        assert %{rx_packets: 1, replays: 1, auth_failures: 1} = tunnel_counters(t.b, 1, 2)
+        :gen_udp.close(sock)
+        Enum.each([t.a, t.a_peer, t.b, t.b_peer], &Tundra.close/1)
+      end
+    end
+
+    test "passes other datagrams to the owner" do
+      if :os.type() == {:unix, :linux} do
+        t = tunnel_pair(:chacha20_poly1305)
+        {:ok, sock} = :gen_udp.open(0, [:binary, :inet6, {:ip, {0, 0, 0, 0, 0, 0, 0, 1}}])
+        {:ok, port} = :inet.port(sock)
+        a = t.a
+
+        :ok = :gen_udp.send(sock, {0, 0, 0, 0, 0, 0, 0, 1}, t.a_port, <<1, "hello">>)
+        assert_receive {:tundra_tunnel, ^a, {{0, 0, 0, 0, 0, 0, 0, 1}, ^port}, <<1, "hello">>}
+        assert :ok = Tundra.tunnel_send(a, {"::1", port}, [<<2>>, "welcome"])
+        assert_receive {:udp, ^sock, _, _, <<2, "welcome">>}
+
+        assert :ok = Tundra.remove_tunnel_peer(a, 1)
+        assert {:error, :enoent} = Tundra.remove_tunnel_peer(a, 1)
+        assert :ok = Tundra.tunnel(a, false)
+        assert {:error, :disabled} = Tundra.tunnel_send(a, {"::1", port}, "late")
+        assert {:ok, %{control: 1}} = Tundra.tunnel_stats(a)
+        :gen_udp.close(sock)
+        Enum.each([t.a, t.a_peer, t.b, t.b_peer], &Tundra.close/1)
+      end
+    end
+
+    test "rejects invalid options" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+      key = :binary.copy(<<0>>, 32)
+      assert {:error, :einval} = Tundra.tunnel(dev, cipher: :des)
+      assert {:error, :einval} = Tundra.tunnel(dev, port: 70_000)
+      assert {:error, :einval} = Tundra.tunnel(dev, ip: "not an address")
+      assert {:error, :einval} = Tundra.tunnel_peer(dev, 1, remote_index: 2, tx_key: key)
+
+      assert {:error, :einval} =
+               Tundra.tunnel_peer(dev, 1, remote_index: 2, tx_key: key, rx_key: <<0>>)
+
+      assert {:error, :einval} =
+               Tundra.tunnel_peer(dev, 1,
+                 remote_index: 2,
+                 tx_key: key,
+                 rx_key: key,
+                 allowed_ips: [{"fd00::", 129}]
+               )
+
+      assert {:error, :einval} = Tundra.tunnel_send(dev, {"::1", 0}, "x")
+      Tundra.close(dev)
+      Tundra.close(peer)
+    end
+  end
+
+  describe "configure/2" do
+    test "rejects invalid changes before applying any" do
+      {:ok, {dev, peer}} = Tundra.create_loopback()
+
+      assert {:error, :einval} = Tundra.configure(dev, mtu: 0)
+      assert {:error, :einval} = Tundra.configure(dev, up: :yes)
+      assert {:error, :einval} = Tundra.configure(dev, add_address: {"fd00::1", 129})
+      assert {:error, :einval} = Tundra.configure(dev, add_route: {"10.0.0.0", 33})
+      assert {:error, :einval} = Tundra.configure(dev, remove_address: {"not an address", 8})
+      assert {:error, :einval} = Tundra.configure(dev, rename: "tun9")
+      assert {:error, :einval} = Tundra.configure(dev, List.duplicate({:up, true}, 17))
+
+      # A loopback device has no interface to change
+      assert {:error, :enotsup} =
+               Tundra.configure(dev, mtu: 9000, up: true, add_address: {{10, 0, 0, 1}, 24})
+
+      assert :ok = Tundra.close(dev)
+      assert {:error, :closed} = Tundra.configure(dev, mtu: 9000)
+      assert :ok = Tundra.close(peer)
+    end
+  end
+
+  describe "create/2 with :netns" do
+    test "rejects a namespace that is neither a path nor a descriptor" do
+      assert {:error, :einval} = Tundra.create("fd11:b7b7:4360::2", netns: "")
+      assert {:error, :einval} = Tundra.create("fd11:b7b7:4360::2", netns: -1)
+      assert {:error, :einval} = Tundra.create("fd11:b7b7:4360::2", netns: :blue)
+
+      Process.flag(:trap_exit, true)
+      assert {:error, :einval} = Tundra.Pool.start_link(netns: :blue)
+    end
+  end
+
+  describe "Tundra.Pool" do
+    @netmask "ffff:ffff:ffff:ffff::"
+
+    test "refills from the low to the high watermark" do
+      {:ok, pool} = Tundra.Pool.start_link(low_watermark: 2, high_watermark: 4)
+
+      if can_create?() do
+        assert %{available: 4, created: 4} = pool_filled(pool, 4)
+
+        # Checkouts down to the low watermark leave the pool alone
+        devs =
+          for i <- 2..3 do
+            assert {:ok, {dev, _name}} =
+                     Tundra.Pool.checkout(pool, "fd11:b7b7:4360::#{i}", netmask: @netmask)
+
+            dev
+          end
+
+        assert %{available: 2, created: 4, hits: 2} = Tundra.Pool.stats(pool)
+
+        assert {:ok, {dev, _name}} =
+                 Tundra.Pool.checkout(pool, "fd11:b7b7:4360::4", netmask: @netmask)
+
+        assert %{available: 4, created: 7, hits: 3} = pool_filled(pool, 4)
+        for dev <- [dev | devs], do: assert(:ok = Tundra.close(dev))
+      else
+        # Without the privileges or the server, every creation fails
+        assert %{failed: failed, created: 0, available: 0} = pool_failed(pool)
+        assert failed > 0
+      end
+    end
+
+    test "counts hits and misses" do
+      {:ok, empty} = Tundra.Pool.start_link(low_watermark: 0, high_watermark: 0)
+
+      if can_create?() do
+        {:ok, full} = Tundra.Pool.start_link(low_watermark: 1, high_watermark: 1)
+        pool_filled(full, 1)
+
+        assert {:ok, {hit, _name}} =
+                 Tundra.Pool.checkout(full, "fd11:b7b7:4360::2",
+                   dstaddr: "fd11:b7b7:4360::1",
+                   netmask: @netmask,
+                   mtu: 1400
+                 )
+
+        assert %{hits: 1, misses: 0} = Tundra.Pool.stats(full)
+        assert :ok = Tundra.close(hit)
+
+        # An empty pool creates the device in the caller instead
+        assert {:ok, {miss, _name}} =
+                 Tundra.Pool.checkout(empty, "fd11:b7b7:4360::3",
+                   dstaddr: "fd11:b7b7:4360::1",
+                   netmask: @netmask
+                 )
+
+        assert :ok = Tundra.close(miss)
+      else
+        assert {:error, _} = Tundra.Pool.checkout(empty, "fd11:b7b7:4360::3", netmask: @netmask)
+      end
+
+      assert %{hits: 0, misses: 1, available: 0, created: 0} = Tundra.Pool.stats(empty)
+    end
+
+    test "validates a checkout before taking a device" do
+      {:ok, pool} = Tundra.Pool.start_link(low_watermark: 0, high_watermark: 0)
+
+      assert {:error, :einval} = Tundra.Pool.checkout(pool, "fd11::2")
+      assert {:error, :einval} = Tundra.Pool.checkout(pool, "fd11::2", netmask: "ffff::/16")
+      assert {:error, :einval} = Tundra.Pool.checkout(pool, "fd11::2", mtu: -1)
+      assert %{available: 0, hits: 0, misses: 0} = Tundra.Pool.stats(pool)
+    end
+
+    test "rejects invalid watermarks" do
+      Process.flag(:trap_exit, true)
+      assert {:error, :einval} = Tundra.Pool.start_link(low_watermark: 4, high_watermark: 2)
+      assert {:error, :einval} = Tundra.Pool.start_link(mtu: -1)
+    end
+  end
+
+  describe "link_stats/1" do
+    test "reads the kernel's counters" do
+      case :os.type() do
+        {:unix, :linux} ->
+          assert {:ok, %{"lo" => lo} = links} = Tundra.link_stats(["lo", "tundra-none0"])
+          assert map_size(links) == 1
+          assert %{ifindex: index, up: true, rx_packets: rx} = lo
+          assert index > 0 and rx >= 0
+
+        _ ->
+          assert {:error, :enotsup} = Tundra.link_stats("lo")
+      end
+    end
+  end
+
+  describe "Tundra.LinkMonitor" do
+    test "starts and stops with the notified process" do
+      if :os.type() == {:unix, :linux} do
+        Process.flag(:trap_exit, true)
+        assert {:error, :einval} = Tundra.LinkMonitor.start_link(devices: [:lo])
+
+        notify =
+          spawn(fn ->
+            receive do
+              :stop -> :ok
+            end
+          end)
+
+        {:ok, monitor} = Tundra.LinkMonitor.start_link(notify: notify, devices: ["lo"])
+        ref = Process.monitor(monitor)
+        send(notify, :stop)
+        assert_receive {:DOWN, ^ref, :process, ^monitor, :normal}
+      end
+    end
+  end
+
+  describe "reattach/1" do
+    test "returns an error for a device that does not exist" do
+      assert {:error, _reason} = Tundra.reattach("tundra-none0")
+    end
+  end
+
+  describe "Tundra.Telemetry" do
+    test "rejects an invalid period" do
+      Process.flag(:trap_exit, true)
+      assert {:error, :einval} = Tundra.Telemetry.start_link(period: 0)
+    end
+
+    test "watches and unwatches devices" do
+      {:ok, poller} = Tundra.Telemetry.start_link(period: 60_000)
+      dev = {:"$tundra", make_ref()}
+      assert :ok = Tundra.Telemetry.watch(poller, dev, %{name: "tun0"})
+      assert :ok = Tundra.Telemetry.unwatch(poller, dev)
+    end
+  end
+
+  describe "Tundra.Histogram" do
+    test "merges histograms and reports percentiles" do
+      a =
+        Tundra.Histogram.new(%{count: 2, sum: 30, min: 10, max: 20, buckets: [{10, 1}, {20, 1}]})
+      b =
+        Tundra.Histogram.new(%{count: 2, sum: 70, min: 30, max: 40, buckets: [{30, 1}, {40, 1}]})
+      hist = Tundra.Histogram.merge(a, b)
+
+      assert hist.count == 4
+      assert Tundra.Histogram.mean(hist) == 25.0
+      assert Tundra.Histogram.percentile(hist, 50) == 20
+      assert Tundra.Histogram.percentile(hist, 100) == 40
+      assert Tundra.Histogram.percentiles(%Tundra.Histogram{}, [99]) == %{99 => nil}
+    end
+  end
+
+  # The packets waiting to be read from a device
+  defp received(dev, acc) do
+    case Tundra.recv(dev, 1500, :nowait) do
+      {:ok, packet} -> received(dev, [packet | acc])
+      {:select, _} -> Enum.reverse(acc)
+    end
+  end
+
+  defp pcapng_blocks(path), do: path |> File.read!() |> pcapng_blocks([])
+
+  defp pcapng_blocks(<<>>, acc), do: Enum.reverse(acc)
+
+  defp pcapng_blocks(<<type::native-32, len::native-32, _::binary>> = data, acc) do
+    size = len - 12
+    <<_::64, body::binary-size(size), ^len::native-32, rest::binary>> = data
+    pcapng_blocks(rest, [{type, body} | acc])
+  end
+
+  # The direction flag and captured bytes of an enhanced packet block
+  defp pcapng_packet(<<0::32, _ts::64, caplen::native-32, _len::native-32, rest::binary>>) do
+    pad = rem(4 - rem(caplen, 4), 4)
+
+    <<data::binary-size(caplen), _::binary-size(pad), 2::native-16, 4::native-16,
+      flags::native-32, _::binary>> = rest
+
+    {flags, data}
+  end
+
+  defp recv_wait(dev) do
+    case Tundra.recv(dev, 1500, :nowait) do
+      {:ok, packet} ->
+        packet
+
+      {:select, _} ->
+        assert_receive {:"$socket", ^dev, :select, _}
+        recv_wait(dev)
+    end
+  end
+
+  defp import_when_ready(path, tries \\ 50) do
+    case Tundra.import_devices(path) do
+      {:error, reason} when reason in [:enoent, :econnrefused] and tries > 0 ->
+        Process.sleep(10)
+        import_when_ready(path, tries - 1)
+
+      result ->
+        result
+    end
+  end
+
+  # The packets the ring thread has read from a device, once there are some
+  defp ring_received(dev, tries \\ 50) do
+    case Tundra.ring_stats(dev) do
+      {:ok, %{rx_packets: 0}} when tries > 0 ->
+        Process.sleep(10)
+        ring_received(dev, tries - 1)
+
+      {:ok, %{rx_packets: n}} ->
+        n
+    end
+  end
+
+  defp busy_recv(_dev, 500), do: 500
+
+  defp busy_recv(dev, received) do
+    case Tundra.recv(dev, 1500, :nowait) do
+      {:ok, _} ->
+        busy_recv(dev, received + 1)
+
+      {:select, _} ->
+        receive do
+          {:"$socket", ^dev, :select, _} -> busy_recv(dev, received)
+        after
+          2_000 -> received
+        end
+    end
+  end
+
+  # Take flow records until there are n, polling every 100ms
+  defp wait_for_flows(dev, n, attempts, taken \\ []) do
+    {:ok, flows} = Tundra.flows(dev)
+    taken = taken ++ flows
+
+    if length(taken) >= n or attempts == 0 do
+      taken
+    else
+      Process.sleep(100)
+      wait_for_flows(dev, n, attempts - 1, taken)
+    end
+  end
+
+  # Two loopback devices tunnelled to each other over ::1, the second
+  # learning the first's endpoint from its first datagram
+  defp tunnel_pair(cipher) do
+    {:ok, {a, a_peer}} = Tundra.create_loopback()
+    {:ok, {b, b_peer}} = Tundra.create_loopback()
+    {:ok, a_port} = Tundra.tunnel(a, cipher: cipher, ip: "::1")
+    {:ok, b_port} = Tundra.tunnel(b, cipher: cipher, ip: "::1")
+    k1 = :crypto.strong_rand_bytes(32)
+    k2 = :crypto.strong_rand_bytes(32)
+
+    assert :ok =
+             Tundra.tunnel_peer(a, 1,
+               remote_index: 2,
+               endpoint: {"::1", b_port},
+               tx_key: k1,
+               rx_key: k2,
+               allowed_ips: [{"fd00::2", 128}]
+             )
+
+    assert :ok =
+             Tundra.tunnel_peer(b, 2,
+               remote_index: 1,
+               tx_key: k2,
+               rx_key: k1,
+               allowed_ips: [{"fd00::1", 128}]
+             )
+
+    %{a: a, a_peer: a_peer, a_port: a_port, b: b, b_peer: b_peer, b_port: b_port, k1: k1}
+  end
+
+  # A device's tunnel counters, once it has opened or rejected enough datagrams
+  defp tunnel_counters(dev, rx, rejected, tries \\ 50) do
+    {:ok, stats} = Tundra.tunnel_stats(dev)
+
+    if (stats.rx_packets < rx or stats.replays + stats.auth_failures < rejected) and tries > 0 do
+      Process.sleep(10)
+      tunnel_counters(dev, rx, rejected, tries - 1)
+    else
+      stats
+    end
+  end
+
+  # Whether this VM can create devices, directly or through the server
+  defp can_create? do
+    opts = [dstaddr: "fd11:b7b7:4360::1", netmask: "ffff:ffff:ffff:ffff::"]
+
+    case Tundra.create("fd11:b7b7:4360::2", opts) do
+      {:ok, {dev, _name}} -> Tundra.close(dev) == :ok
+      {:error, _} -> false
+    end
+  end
+
+  defp pool_filled(pool, n, tries \\ 50) do
+    stats = Tundra.Pool.stats(pool)
+
+    if stats.available < n and tries > 0 do
+      Process.sleep(10)
+      pool_filled(pool, n, tries - 1)
+    else
+      stats
+    end
+  end
+
+  defp pool_failed(pool, tries \\ 50) do
+    stats = Tundra.Pool.stats(pool)
+
+    if stats.failed == 0 and tries > 0 do
+      Process.sleep(10)
+      pool_failed(pool, tries - 1)
+    else
+      stats
+    end
+  end
 end